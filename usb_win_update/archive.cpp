@@ -0,0 +1,617 @@
+#include "stdafx.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+#include "archive.h"
+#include "inflate.h"
+#include "trace.h"
+
+#if defined(_WIN32)
+#define archive_fseek _fseeki64
+#define archive_ftell _ftelli64
+#else
+#define archive_fseek fseeko
+#define archive_ftell ftello
+
+static int fopen_s(FILE** fp, const char* fileName, const char* mode) {
+	*fp = fopen(fileName, mode);
+	return *fp ? 0 : errno;
+}
+#endif
+
+#define TAR_BLOCK_SIZE 512
+
+#define ZIP_LOCAL_HEADER_SIG		0x04034b50
+#define ZIP_CENTRAL_HEADER_SIG		0x02014b50
+#define ZIP_EOCD_SIG				0x06054b50
+#define ZIP64_EOCD_SIG				0x06064b50
+#define ZIP64_EOCD_LOCATOR_SIG		0x07064b50
+#define ZIP64_EXTRA_ID				0x0001
+
+static uint16_t get_le16(const unsigned char* p) {
+	return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t get_le32(const unsigned char* p) {
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t get_le64(const unsigned char* p) {
+	return (uint64_t)get_le32(p) | ((uint64_t)get_le32(p + 4) << 32);
+}
+
+static uint32_t crc32_update(uint32_t crc, const unsigned char* data, size_t len) {
+	static uint32_t table[256];
+	static std::once_flag table_once;
+
+	std::call_once(table_once, [] {
+		for (uint32_t i = 0; i < 256; i++) {
+			uint32_t c = i;
+			for (int k = 0; k < 8; k++)
+				c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+			table[i] = c;
+		}
+	});
+
+	crc = ~crc;
+	while (len--)
+		crc = table[(crc ^ *data++) & 0xff] ^ (crc >> 8);
+
+	return ~crc;
+}
+
+/// Parses a tar numeric field: octal, or GNU base-256 for values that do
+/// not fit (sizes of 8 GB and more).
+static int64_t tar_number(const unsigned char* field, int len) {
+	int64_t value = 0;
+
+	if (field[0] & 0x80) {
+		value = field[0] & 0x3f;
+		for (int i = 1; i < len; i++)
+			value = (value << 8) | field[i];
+		return value;
+	}
+
+	for (int i = 0; i < len; i++) {
+		if (field[i] == ' ' || field[i] == '\0') {
+			if (value != 0)
+				break;
+			continue;
+		}
+		if (field[i] < '0' || field[i] > '7')
+			return -1;
+		value = (value << 3) | (field[i] - '0');
+	}
+
+	return value;
+}
+
+static bool tar_checksum_ok(const unsigned char* header) {
+	int64_t expected = tar_number(header + 148, 8);
+	int64_t sum = 0;
+
+	for (int i = 0; i < TAR_BLOCK_SIZE; i++)
+		sum += (i >= 148 && i < 156) ? ' ' : header[i];
+
+	return expected == sum;
+}
+
+/// Applies the "path" and "size" records of a pax extended header.
+static void tar_parse_pax(const std::string& records, std::string* path, int64_t* size) {
+	size_t pos = 0;
+
+	while (pos < records.size()) {
+		size_t space = records.find(' ', pos);
+		if (space == std::string::npos)
+			break;
+
+		size_t len = strtoul(records.c_str() + pos, NULL, 10);
+		if (len == 0 || pos + len > records.size())
+			break;
+
+		std::string record = records.substr(space + 1, pos + len - space - 2);
+		size_t equal = record.find('=');
+
+		if (equal != std::string::npos) {
+			std::string key = record.substr(0, equal);
+
+			if (key == "path")
+				*path = record.substr(equal + 1);
+			else if (key == "size")
+				*size = strtoll(record.c_str() + equal + 1, NULL, 10);
+		}
+
+		pos += len;
+	}
+}
+
+int Archive::ReadTar(FILE* fp) {
+	unsigned char header[TAR_BLOCK_SIZE];
+	int64_t pos = 0;
+	std::string long_name;
+	std::string pax_path;
+	int64_t pax_size = -1;
+
+	while (fread(header, 1, TAR_BLOCK_SIZE, fp) == TAR_BLOCK_SIZE) {
+		pos += TAR_BLOCK_SIZE;
+
+		bool zero = true;
+		for (int i = 0; i < TAR_BLOCK_SIZE && zero; i++)
+			zero = header[i] == 0;
+		if (zero)
+			break;
+
+		if (!tar_checksum_ok(header)) {
+			fprintf(stderr, "Bad tar header at offset %lld in %s\n",
+				(long long)(pos - TAR_BLOCK_SIZE), file_name_.c_str());
+			return -1;
+		}
+
+		int64_t size = tar_number(header + 124, 12);
+		char type = (char)header[156];
+
+		if (size < 0)
+			return -1;
+
+		// GNU long names and pax headers describe the member that follows.
+		if (type == 'L' || type == 'x' || type == 'g') {
+			std::string data((size_t)size, '\0');
+
+			if (size && fread(&data[0], 1, (size_t)size, fp) != (size_t)size)
+				return -1;
+
+			if (type == 'L')
+				long_name.assign(data.c_str());
+			else if (type == 'x')
+				tar_parse_pax(data, &pax_path, &pax_size);
+
+			pos += (size + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE * TAR_BLOCK_SIZE;
+			archive_fseek(fp, pos, SEEK_SET);
+			continue;
+		}
+
+		archive_entry entry;
+
+		if (!pax_path.empty()) {
+			entry.name = pax_path;
+		}
+		else if (!long_name.empty()) {
+			entry.name = long_name;
+		}
+		else {
+			char name[101], prefix[156];
+
+			memcpy(name, header, 100);
+			name[100] = '\0';
+			memcpy(prefix, header + 345, 155);
+			prefix[155] = '\0';
+
+			// ustar splits long paths into prefix and name.
+			if (memcmp(header + 257, "ustar", 5) == 0 && prefix[0] != '\0')
+				entry.name = std::string(prefix) + "/" + name;
+			else
+				entry.name = name;
+		}
+
+		if (pax_size >= 0)
+			size = pax_size;
+
+		entry.size = size;
+		entry.compressed_size = size;
+		entry.offset = pos;
+		entry.method = ARCHIVE_METHOD_STORED;
+		entry.crc32 = 0;
+		entry.has_crc32 = false;
+		entry.is_dir = type == '5';
+
+		// Regular files and directories; links and devices are skipped.
+		if (type == '0' || type == '\0' || type == '7' || type == '5')
+			entries_.push_back(entry);
+
+		long_name.clear();
+		pax_path.clear();
+		pax_size = -1;
+
+		pos += (size + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE * TAR_BLOCK_SIZE;
+		if (archive_fseek(fp, pos, SEEK_SET) != 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+int Archive::ReadZip(FILE* fp) {
+	archive_fseek(fp, 0, SEEK_END);
+	int64_t file_size = archive_ftell(fp);
+
+	// The end of central directory record sits within the last 64 KB + 22 bytes.
+	int64_t tail_size = file_size < 65557 ? file_size : 65557;
+	std::vector<unsigned char> tail((size_t)tail_size);
+
+	archive_fseek(fp, file_size - tail_size, SEEK_SET);
+	if (fread(tail.data(), 1, tail.size(), fp) != tail.size())
+		return -1;
+
+	int64_t eocd = -1;
+	for (int64_t i = tail_size - 22; i >= 0; i--) {
+		if (get_le32(&tail[(size_t)i]) == ZIP_EOCD_SIG) {
+			eocd = i;
+			break;
+		}
+	}
+
+	if (eocd < 0) {
+		fprintf(stderr, "No zip central directory in %s\n", file_name_.c_str());
+		return -1;
+	}
+
+	uint64_t count = get_le16(&tail[(size_t)eocd + 10]);
+	uint64_t cd_size = get_le32(&tail[(size_t)eocd + 12]);
+	uint64_t cd_offset = get_le32(&tail[(size_t)eocd + 16]);
+
+	// zip64: the locator right before the EOCD points at the zip64 record.
+	if (eocd >= 20 && get_le32(&tail[(size_t)eocd - 20]) == ZIP64_EOCD_LOCATOR_SIG) {
+		unsigned char record[56];
+		uint64_t record_offset = get_le64(&tail[(size_t)eocd - 20 + 8]);
+
+		archive_fseek(fp, record_offset, SEEK_SET);
+		if (fread(record, 1, sizeof(record), fp) != sizeof(record) ||
+			get_le32(record) != ZIP64_EOCD_SIG)
+			return -1;
+
+		count = get_le64(record + 32);
+		cd_size = get_le64(record + 40);
+		cd_offset = get_le64(record + 48);
+	}
+
+	std::vector<unsigned char> cd((size_t)cd_size);
+
+	archive_fseek(fp, cd_offset, SEEK_SET);
+	if (cd_size && fread(cd.data(), 1, cd.size(), fp) != cd.size())
+		return -1;
+
+	size_t pos = 0;
+	for (uint64_t i = 0; i < count; i++) {
+		if (pos + 46 > cd.size() || get_le32(&cd[pos]) != ZIP_CENTRAL_HEADER_SIG)
+			return -1;
+
+		const unsigned char* hdr = &cd[pos];
+		uint16_t flags = get_le16(hdr + 8);
+		uint16_t name_len = get_le16(hdr + 28);
+		uint16_t extra_len = get_le16(hdr + 30);
+		uint16_t comment_len = get_le16(hdr + 32);
+
+		if (pos + 46 + name_len + extra_len + comment_len > cd.size())
+			return -1;
+
+		archive_entry entry;
+
+		entry.name.assign((const char*)hdr + 46, name_len);
+		entry.method = get_le16(hdr + 10);
+		entry.crc32 = get_le32(hdr + 16);
+		entry.has_crc32 = true;
+		entry.compressed_size = get_le32(hdr + 20);
+		entry.size = get_le32(hdr + 24);
+		entry.offset = get_le32(hdr + 42);
+		entry.is_dir = !entry.name.empty() && entry.name.back() == '/';
+
+		// Fields saturated at 0xFFFFFFFF live in the zip64 extra field, in order.
+		const unsigned char* extra = hdr + 46 + name_len;
+		for (size_t e = 0; e + 4 <= extra_len;) {
+			uint16_t id = get_le16(extra + e);
+			uint16_t len = get_le16(extra + e + 2);
+			const unsigned char* data = extra + e + 4;
+			const unsigned char* end = data + len;
+
+			if (e + 4 + len > extra_len)
+				break;
+
+			if (id == ZIP64_EXTRA_ID) {
+				if (entry.size == 0xFFFFFFFF && data + 8 <= end) {
+					entry.size = get_le64(data);
+					data += 8;
+				}
+				if (entry.compressed_size == 0xFFFFFFFF && data + 8 <= end) {
+					entry.compressed_size = get_le64(data);
+					data += 8;
+				}
+				if (entry.offset == 0xFFFFFFFF && data + 8 <= end)
+					entry.offset = get_le64(data);
+			}
+
+			e += 4 + len;
+		}
+
+		if (flags & 0x0001) {
+			fprintf(stderr, "Skipping encrypted zip member %s\n", entry.name.c_str());
+		}
+		else if (!entry.is_dir && entry.method != ARCHIVE_METHOD_STORED &&
+			entry.method != ARCHIVE_METHOD_DEFLATE) {
+			fprintf(stderr, "Skipping zip member %s with unsupported method %d\n",
+				entry.name.c_str(), entry.method);
+		}
+		else {
+			entries_.push_back(entry);
+		}
+
+		pos += 46 + name_len + extra_len + comment_len;
+	}
+
+	return 0;
+}
+
+Archive* Archive::Open(const char* fileName) {
+	FILE* fp;
+	unsigned char header[TAR_BLOCK_SIZE];
+
+	fopen_s(&fp, fileName, "rb");
+	if (fp == NULL)
+		return NULL;
+
+	TRACE_SCOPE("archive_index");
+
+	size_t len = fread(header, 1, sizeof(header), fp);
+	Archive* archive = NULL;
+	int ret = -1;
+
+	if (len >= 4 && (get_le32(header) == ZIP_LOCAL_HEADER_SIG || get_le32(header) == ZIP_EOCD_SIG)) {
+		archive = new Archive(fileName, "zip");
+		ret = archive->ReadZip(fp);
+	}
+	else if (len == TAR_BLOCK_SIZE && tar_checksum_ok(header)) {
+		archive = new Archive(fileName, "tar");
+		archive_fseek(fp, 0, SEEK_SET);
+		ret = archive->ReadTar(fp);
+	}
+
+	fclose(fp);
+
+	if (ret != 0) {
+		delete archive;
+		return NULL;
+	}
+
+	return archive;
+}
+
+/// Streams a stored member straight from the archive into pool blocks.
+class StoredEntryReader : public ImageReader {
+public:
+	StoredEntryReader(FILE* fp, const archive_entry& entry, BufferPool* pool)
+		: fp_(fp), entry_(entry), pool_(pool), remaining_(entry.size), crc_(0) {}
+	~StoredEntryReader() override { fclose(fp_); }
+
+	int64_t Size() const override { return entry_.size; }
+	ssize_t ReadBlock(char** block) override;
+	const char* Kind() const override { return "archive"; }
+
+private:
+	FILE* fp_;
+	archive_entry entry_;
+	BufferPool* pool_;
+	int64_t remaining_;
+	uint32_t crc_;
+};
+
+ssize_t StoredEntryReader::ReadBlock(char** block) {
+	if (remaining_ == 0) {
+		if (entry_.has_crc32 && crc_ != entry_.crc32) {
+			fprintf(stderr, "CRC mismatch in %s\n", entry_.name.c_str());
+			return -1;
+		}
+		return 0;
+	}
+
+	char* buf = (char*)pool_->Acquire();
+	if (buf == NULL)
+		return -1;
+
+	size_t want = pool_->BlockSize();
+	if ((int64_t)want > remaining_)
+		want = (size_t)remaining_;
+
+	size_t read_len = fread(buf, 1, want, fp_);
+	if (read_len == 0) {
+		pool_->Release(buf);
+		fprintf(stderr, "Archive truncated in %s\n", entry_.name.c_str());
+		return -1;
+	}
+
+	if (entry_.has_crc32)
+		crc_ = crc32_update(crc_, (const unsigned char*)buf, read_len);
+
+	remaining_ -= read_len;
+	*block = buf;
+	return read_len;
+}
+
+/// Decodes a deflate member on a worker thread. Filled pool blocks are
+/// queued for ReadBlock(); the pool itself bounds how far the worker can
+/// run ahead of the bulk writes.
+class DeflateEntryReader : public ImageReader {
+public:
+	DeflateEntryReader(FILE* fp, const archive_entry& entry, BufferPool* pool);
+	~DeflateEntryReader() override;
+
+	int64_t Size() const override { return entry_.size; }
+	ssize_t ReadBlock(char** block) override;
+	const char* Kind() const override { return "archive+inflate"; }
+
+private:
+	void Worker();
+
+	FILE* fp_;
+	archive_entry entry_;
+	BufferPool* pool_;
+
+	std::mutex lock_;
+	std::condition_variable ready_cv_;
+	std::deque<std::pair<char*, size_t>> ready_;
+	bool done_;
+	bool abort_;
+	int result_;
+
+	std::thread worker_;
+};
+
+DeflateEntryReader::DeflateEntryReader(FILE* fp, const archive_entry& entry, BufferPool* pool)
+	: fp_(fp), entry_(entry), pool_(pool), done_(false), abort_(false), result_(0) {
+	worker_ = std::thread(&DeflateEntryReader::Worker, this);
+}
+
+DeflateEntryReader::~DeflateEntryReader() {
+	{
+		std::lock_guard<std::mutex> lock(lock_);
+
+		abort_ = true;
+		// Returning the queued blocks unblocks a worker waiting on the pool.
+		for (auto& block : ready_)
+			pool_->Release(block.first);
+		ready_.clear();
+	}
+
+	worker_.join();
+
+	for (auto& block : ready_)
+		pool_->Release(block.first);
+
+	fclose(fp_);
+}
+
+void DeflateEntryReader::Worker() {
+	int64_t remaining = entry_.compressed_size;
+	uint32_t crc = 0;
+	char* current = NULL;
+
+	trace_set_thread_name("inflate worker");
+
+	Inflater inflater(
+		[&](unsigned char* buf, size_t len) -> size_t {
+		if ((int64_t)len > remaining)
+			len = (size_t)remaining;
+		size_t read_len = len ? fread(buf, 1, len, fp_) : 0;
+		remaining -= read_len;
+		return read_len;
+	},
+		[&](unsigned char* filled, size_t len, bool last, size_t* next_len) -> unsigned char* {
+		if (filled != NULL) {
+			TRACE_SCOPE("inflate_block_ready");
+
+			crc = crc32_update(crc, filled, len);
+			current = NULL;
+
+			std::lock_guard<std::mutex> lock(lock_);
+			if (abort_ || len == 0)
+				pool_->Release(filled);
+			else
+				ready_.push_back(std::make_pair((char*)filled, len));
+			ready_cv_.notify_one();
+		}
+
+		if (last)
+			return NULL;
+
+		{
+			std::lock_guard<std::mutex> lock(lock_);
+			if (abort_)
+				return NULL;
+		}
+
+		current = (char*)pool_->Acquire();
+		*next_len = pool_->BlockSize();
+		return (unsigned char*)current;
+	});
+
+	int ret;
+	{
+		TRACE_SCOPE("inflate_member");
+		ret = inflater.Run();
+	}
+
+	if (current != NULL)
+		pool_->Release(current);
+
+	if (ret == 0 && (int64_t)inflater.TotalOut() != entry_.size) {
+		fprintf(stderr, "Size mismatch in %s: %llu, expected %lld\n", entry_.name.c_str(),
+			(unsigned long long)inflater.TotalOut(), (long long)entry_.size);
+		ret = -1;
+	}
+	else if (ret == 0 && entry_.has_crc32 && crc != entry_.crc32) {
+		fprintf(stderr, "CRC mismatch in %s\n", entry_.name.c_str());
+		ret = -1;
+	}
+	else if (ret != 0 && ret != -3) {
+		fprintf(stderr, "Failed to inflate %s: %d\n", entry_.name.c_str(), ret);
+	}
+
+	std::lock_guard<std::mutex> lock(lock_);
+	result_ = ret;
+	done_ = true;
+	ready_cv_.notify_one();
+}
+
+ssize_t DeflateEntryReader::ReadBlock(char** block) {
+	std::unique_lock<std::mutex> lock(lock_);
+
+	ready_cv_.wait(lock, [this] { return !ready_.empty() || done_; });
+
+	if (ready_.empty())
+		return result_ == 0 ? 0 : -1;
+
+	// Data decoded before a failure still counts as failure: the device
+	// must not be told the member is complete.
+	if (done_ && result_ != 0)
+		return -1;
+
+	*block = ready_.front().first;
+	ssize_t len = ready_.front().second;
+	ready_.pop_front();
+
+	return len;
+}
+
+ImageReader* Archive::OpenEntry(const archive_entry& entry, BufferPool* pool) const {
+	FILE* fp;
+	int64_t data_offset = entry.offset;
+
+	if (entry.is_dir || pool == NULL || !pool->IsValid())
+		return NULL;
+
+	// Every reader gets its own FILE so members can be read concurrently.
+	fopen_s(&fp, file_name_.c_str(), "rb");
+	if (fp == NULL)
+		return NULL;
+
+	if (strcmp(format_, "zip") == 0) {
+		unsigned char local[30];
+
+		if (archive_fseek(fp, entry.offset, SEEK_SET) != 0 ||
+			fread(local, 1, sizeof(local), fp) != sizeof(local) ||
+			get_le32(local) != ZIP_LOCAL_HEADER_SIG) {
+			fprintf(stderr, "Bad zip local header for %s\n", entry.name.c_str());
+			fclose(fp);
+			return NULL;
+		}
+
+		data_offset = entry.offset + sizeof(local) + get_le16(local + 26) + get_le16(local + 28);
+	}
+
+	if (archive_fseek(fp, data_offset, SEEK_SET) != 0) {
+		fclose(fp);
+		return NULL;
+	}
+
+	if (entry.method == ARCHIVE_METHOD_DEFLATE)
+		return new DeflateEntryReader(fp, entry, pool);
+
+	return new StoredEntryReader(fp, entry, pool);
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#ifndef ARCHIVE_H_
+#define ARCHIVE_H_
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "image_reader.h"
+
+#define ARCHIVE_METHOD_STORED	0
+#define ARCHIVE_METHOD_DEFLATE	8
+
+/// One member of a release archive.
+struct archive_entry {
+	/// Path inside the archive, '/' separated
+	std::string name;
+
+	/// Uncompressed size in bytes
+	int64_t size;
+
+	/// Size of the member data as stored in the archive
+	int64_t compressed_size;
+
+	/// Offset of the tar data, or of the zip local file header
+	int64_t offset;
+
+	/// ARCHIVE_METHOD_STORED or ARCHIVE_METHOD_DEFLATE
+	int method;
+
+	/// CRC-32 of the uncompressed data (zip only)
+	uint32_t crc32;
+	bool has_crc32;
+
+	bool is_dir;
+};
+
+// Read-only view of a .tar or .zip release bundle. Members are enumerated
+// from the tar headers or the zip central directory without extracting
+// anything, and each one can be streamed straight into the send path.
+// Offsets and sizes are 64-bit (GNU base-256 and pax sizes for tar, zip64
+// records for zip), so bundles larger than 4 GB work.
+class Archive {
+public:
+	// Returns NULL if |fileName| is not a tar or zip archive we can read.
+	static Archive* Open(const char* fileName);
+
+	const char* FileName() const { return file_name_.c_str(); }
+	const char* Format() const { return format_; }
+	const std::vector<archive_entry>& Entries() const { return entries_; }
+
+	// Returns a reader producing the uncompressed bytes of |entry| in blocks
+	// of |pool|. Deflate members are decoded on a worker thread so that
+	// decompression overlaps the bulk writes. The CRC-32 of zip members is
+	// checked at the end of the stream. Returns NULL on error.
+	ImageReader* OpenEntry(const archive_entry& entry, BufferPool* pool) const;
+
+	Archive(const Archive&) = delete;
+	void operator=(const Archive&) = delete;
+
+private:
+	Archive(const char* fileName, const char* format) : file_name_(fileName), format_(format) {}
+
+	int ReadTar(FILE* fp);
+	int ReadZip(FILE* fp);
+
+	std::string file_name_;
+	const char* format_;
+	std::vector<archive_entry> entries_;
+};
+
+#endif  // ARCHIVE_H_
@@ -0,0 +1,156 @@
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <stdlib.h>
+#include <unistd.h>
+#endif
+
+#include <string.h>
+
+#include <chrono>
+
+#include "buffer_pool.h"
+
+static size_t round_up(size_t value, size_t alignment) {
+	return (value + alignment - 1) / alignment * alignment;
+}
+
+BufferPool::BufferPool(size_t block_size, int block_count, bool large_pages)
+	: block_size_(0), block_count_(0), alignment_(0), large_pages_(false), base_(NULL) {
+	memset(&stats_, 0, sizeof(stats_));
+
+	if (block_size == 0 || block_count <= 0)
+		return;
+
+#if defined(_WIN32)
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	size_t page_size = info.dwPageSize;
+
+	if (large_pages) {
+		size_t large_page_size = GetLargePageMinimum();
+
+		if (large_page_size != 0) {
+			size_t total = round_up(round_up(block_size, page_size) * block_count, large_page_size);
+
+			base_ = (char*)VirtualAlloc(NULL, total,
+				MEM_COMMIT | MEM_RESERVE | MEM_LARGE_PAGES, PAGE_READWRITE);
+			if (base_ != NULL)
+				large_pages_ = true;
+			else
+				fprintf(stderr, "Large pages unavailable (error %lu), using normal pages\n",
+					GetLastError());
+		}
+	}
+
+	if (base_ == NULL)
+		base_ = (char*)VirtualAlloc(NULL, round_up(block_size, page_size) * block_count,
+			MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+#else
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	void* mem = NULL;
+
+	(void)large_pages;
+	if (posix_memalign(&mem, page_size, round_up(block_size, page_size) * block_count) == 0)
+		base_ = (char*)mem;
+#endif
+
+	if (base_ == NULL) {
+		fprintf(stderr, "Failed to allocate %d transfer buffers of %zu bytes\n",
+			block_count, block_size);
+		return;
+	}
+
+	alignment_ = page_size;
+	block_size_ = round_up(block_size, page_size);
+	block_count_ = block_count;
+
+	// Hand out the lowest addresses first.
+	free_.reserve(block_count);
+	for (int i = block_count - 1; i >= 0; i--)
+		free_.push_back(base_ + i * block_size_);
+}
+
+BufferPool::~BufferPool() {
+	if (base_ == NULL)
+		return;
+
+	if (stats_.in_use != 0)
+		fprintf(stderr, "BufferPool destroyed with %d block(s) still in use\n", stats_.in_use);
+
+#if defined(_WIN32)
+	VirtualFree(base_, 0, MEM_RELEASE);
+#else
+	free(base_);
+#endif
+}
+
+void* BufferPool::Acquire(unsigned long timeout_ms) {
+	std::unique_lock<std::mutex> lock(lock_);
+
+	if (base_ == NULL)
+		return NULL;
+
+	if (free_.empty()) {
+		auto start = std::chrono::steady_clock::now();
+		bool ready = true;
+
+		stats_.exhausted++;
+
+		if (timeout_ms == kWaitForever)
+			available_.wait(lock, [this] { return !free_.empty(); });
+		else
+			ready = available_.wait_for(lock, std::chrono::milliseconds(timeout_ms),
+				[this] { return !free_.empty(); });
+
+		stats_.wait_us += std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::steady_clock::now() - start).count();
+
+		if (!ready) {
+			stats_.timeouts++;
+			return NULL;
+		}
+	}
+
+	void* block = free_.back();
+	free_.pop_back();
+
+	stats_.acquires++;
+	stats_.in_use++;
+	if (stats_.in_use > stats_.peak_in_use)
+		stats_.peak_in_use = stats_.in_use;
+
+	return block;
+}
+
+void BufferPool::Release(void* block) {
+	if (block == NULL)
+		return;
+
+	{
+		std::lock_guard<std::mutex> lock(lock_);
+
+		free_.push_back(block);
+		stats_.releases++;
+		stats_.in_use--;
+	}
+
+	available_.notify_one();
+}
+
+BufferPool::Stats BufferPool::GetStats() const {
+	std::lock_guard<std::mutex> lock(lock_);
+	return stats_;
+}
+
+void BufferPool::DumpJson(FILE *fp) const {
+	Stats stats = GetStats();
+
+	fprintf(fp, "{\"block_size\":%zu,\"block_count\":%d,\"alignment\":%zu,\"large_pages\":%s,"
+		"\"acquires\":%llu,\"releases\":%llu,\"exhausted\":%llu,\"wait_us\":%llu,"
+		"\"timeouts\":%llu,\"in_use\":%d,\"peak_in_use\":%d}",
+		block_size_, block_count_, alignment_, large_pages_ ? "true" : "false",
+		(unsigned long long)stats.acquires, (unsigned long long)stats.releases,
+		(unsigned long long)stats.exhausted, (unsigned long long)stats.wait_us,
+		(unsigned long long)stats.timeouts, stats.in_use, stats.peak_in_use);
+}
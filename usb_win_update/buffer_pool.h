@@ -0,0 +1,79 @@
+#pragma once
+
+#ifndef BUFFER_POOL_H_
+#define BUFFER_POOL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
+// Fixed set of page-aligned transfer buffers carved out of one allocation.
+//
+// Readers fill a block in place and the transport submits the very same
+// block to the pipe, so data never gets copied between disk and USB. When
+// every block is in flight Acquire() blocks until one is released, which
+// throttles a fast producer to the speed of the bus.
+class BufferPool {
+public:
+	static const unsigned long kWaitForever = ~0UL;
+
+	// |block_size| is rounded up to the page (or large page) size. With
+	// |large_pages| the pool tries MEM_LARGE_PAGES first, which needs
+	// SeLockMemoryPrivilege, and falls back to normal pages.
+	BufferPool(size_t block_size, int block_count, bool large_pages);
+	~BufferPool();
+
+	// Returns true if the backing allocation succeeded.
+	bool IsValid() const { return base_ != NULL; }
+
+	// Takes a free block, waiting up to |timeout_ms| for one to be released.
+	// Returns NULL on timeout.
+	void* Acquire(unsigned long timeout_ms = kWaitForever);
+
+	// Takes a free block if there is one, NULL otherwise.
+	void* TryAcquire() { return Acquire(0); }
+
+	// Gives back a block obtained from Acquire().
+	void Release(void* block);
+
+	size_t BlockSize() const { return block_size_; }
+	int BlockCount() const { return block_count_; }
+	size_t Alignment() const { return alignment_; }
+	bool UsesLargePages() const { return large_pages_; }
+
+	struct Stats {
+		uint64_t acquires;
+		uint64_t releases;
+		uint64_t exhausted;     // Acquire() calls that had to wait
+		uint64_t wait_us;       // total time spent waiting for a block
+		uint64_t timeouts;
+		int in_use;
+		int peak_in_use;
+	};
+
+	Stats GetStats() const;
+
+	// Writes the geometry and Stats as one JSON object.
+	void DumpJson(FILE *fp) const;
+
+	BufferPool(const BufferPool&) = delete;
+	void operator=(const BufferPool&) = delete;
+
+private:
+	size_t block_size_;
+	int block_count_;
+	size_t alignment_;
+	bool large_pages_;
+	char* base_;
+
+	mutable std::mutex lock_;
+	std::condition_variable available_;
+	std::vector<void*> free_;
+	Stats stats_;
+};
+
+#endif  // BUFFER_POOL_H_
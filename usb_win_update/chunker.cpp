@@ -0,0 +1,293 @@
+#include "stdafx.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "chunker.h"
+#include "protocol.h"
+#include "trace.h"
+
+#if !defined(_WIN32)
+static int fopen_s(FILE** fp, const char* fileName, const char* mode) {
+	*fp = fopen(fileName, mode);
+	return *fp ? 0 : errno;
+}
+
+static int _fseeki64(FILE* fp, int64_t offset, int origin) {
+	return fseeko(fp, offset, origin);
+}
+#endif
+
+// Random values the gear hash adds per byte. They must never change, or
+// the host stops finding the chunks the device stored from older releases.
+static const uint64_t* gear_table() {
+	static uint64_t table[256];
+	static bool ready = [] {
+		// splitmix64 from a fixed seed
+		uint64_t state = 0x504C434D47454152ULL;
+
+		for (uint64_t& value : table) {
+			uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+
+			z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+			z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+			value = z ^ (z >> 31);
+		}
+		return true;
+	}();
+
+	(void)ready;
+	return table;
+}
+
+// Mask of the top |bits| bits of the hash, those mixing the most bytes.
+static uint64_t top_mask(int bits) {
+	return bits <= 0 ? 0 : ~0ULL << (64 - bits);
+}
+
+size_t cdc_cut(const unsigned char* data, size_t len, const cdc_params& params) {
+	if (len <= params.min_size)
+		return len;
+
+	const uint64_t* gear = gear_table();
+	size_t end = std::min<size_t>(len, params.max_size);
+	size_t normal = std::min<size_t>(end, params.avg_size);
+	int bits = 0;
+
+	while ((1U << (bits + 1)) <= params.avg_size)
+		bits++;
+
+	uint64_t mask_strict = top_mask(bits + 2);
+	uint64_t mask_loose = top_mask(bits - 2);
+	uint64_t hash = 0;
+	size_t i = params.min_size;
+
+	for (; i < normal; i++) {
+		hash = (hash << 1) + gear[data[i]];
+		if (!(hash & mask_strict))
+			return i + 1;
+	}
+
+	for (; i < end; i++) {
+		hash = (hash << 1) + gear[data[i]];
+		if (!(hash & mask_loose))
+			return i + 1;
+	}
+
+	return end;
+}
+
+int cdc_chunk_file(const char* fileName, const cdc_params& params, std::vector<cdc_chunk>* chunks,
+	char md5_sum[MD5_HEX_SIZE]) {
+	// Room for a few maximum chunks, so the buffer is refilled rarely.
+	std::vector<unsigned char> buf(std::max<size_t>(4 * params.max_size, 1024 * 1024));
+	size_t start = 0;
+	size_t end = 0;
+	bool eof = false;
+	uint64_t offset = 0;
+	md5_context file_md5;
+	FILE* fp;
+
+	TraceScope trace("cdc_chunk");
+
+	fopen_s(&fp, fileName, "rb");
+	if (fp == NULL)
+		return -1;
+
+	chunks->clear();
+	md5_init(&file_md5);
+
+	for (;;) {
+		// Cuts are only final with a whole maximum chunk in view.
+		if (!eof && end - start < params.max_size) {
+			memmove(&buf[0], &buf[start], end - start);
+			end -= start;
+			start = 0;
+
+			size_t read_len = fread(&buf[end], 1, buf.size() - end, fp);
+
+			if (read_len == 0) {
+				if (ferror(fp)) {
+					fclose(fp);
+					return -1;
+				}
+				eof = true;
+			}
+
+			md5_update(&file_md5, &buf[end], read_len);
+			end += read_len;
+			continue;
+		}
+
+		if (start == end)
+			break;
+
+		size_t len = cdc_cut(&buf[start], end - start, params);
+		cdc_chunk chunk;
+		md5_context md5;
+
+		chunk.offset = offset;
+		chunk.length = (uint32_t)len;
+		md5_init(&md5);
+		md5_update(&md5, &buf[start], len);
+		md5_final(&md5, chunk.digest);
+		chunks->push_back(chunk);
+
+		start += len;
+		offset += len;
+	}
+
+	fclose(fp);
+
+	unsigned char digest[MD5_DIGEST_SIZE];
+
+	md5_final(&file_md5, digest);
+	md5_to_hex(digest, md5_sum);
+	trace.SetBytes(offset);
+
+	return 0;
+}
+
+/// Builds the chunked stream of a file on the fly, straight into pool
+/// blocks: the recipe from memory, then the chunks to send from the file.
+class ChunkedImageReader : public ImageReader {
+public:
+	ChunkedImageReader(BufferPool* pool, FILE* fp, const std::vector<cdc_chunk>& chunks,
+		const std::vector<bool>& send);
+	~ChunkedImageReader() override { fclose(fp_); }
+
+	int64_t Size() const override { return size_; }
+	ssize_t ReadBlock(char** block) override;
+	const char* Kind() const override { return "chunked"; }
+
+private:
+	/// Data of one chunk to send
+	struct range {
+		uint64_t offset;
+		uint32_t length;
+	};
+
+	BufferPool* pool_;
+	FILE* fp_;
+	int64_t size_;
+
+	std::vector<unsigned char> recipe_;
+	size_t recipe_pos_;
+
+	std::vector<range> ranges_;
+	size_t range_;
+	uint32_t range_pos_;
+	uint64_t file_pos_;
+};
+
+ChunkedImageReader::ChunkedImageReader(BufferPool* pool, FILE* fp,
+	const std::vector<cdc_chunk>& chunks, const std::vector<bool>& send)
+	: pool_(pool), fp_(fp), size_(0), recipe_pos_(0), range_(0), range_pos_(0), file_pos_(0) {
+	plcm_recipe_header header;
+	uint64_t file_length = 0;
+
+	recipe_.resize(sizeof(header) + chunks.size() * sizeof(plcm_recipe_entry));
+
+	for (size_t i = 0; i < chunks.size(); i++) {
+		plcm_recipe_entry entry;
+
+		memcpy(entry.digest, chunks[i].digest, MD5_DIGEST_SIZE);
+		entry.length = chunks[i].length;
+		entry.flags = send[i] ? PLCM_CHUNK_INLINE : 0;
+		memcpy(&recipe_[sizeof(header) + i * sizeof(entry)], &entry, sizeof(entry));
+
+		if (send[i]) {
+			range r = { chunks[i].offset, chunks[i].length };
+
+			ranges_.push_back(r);
+			size_ += r.length;
+		}
+
+		file_length += chunks[i].length;
+	}
+
+	header.magic = PLCM_RECIPE_MAGIC;
+	header.chunks = (uint32_t)chunks.size();
+	header.file_length = file_length;
+	memcpy(&recipe_[0], &header, sizeof(header));
+
+	size_ += recipe_.size();
+}
+
+ssize_t ChunkedImageReader::ReadBlock(char** block) {
+	size_t block_size = pool_->BlockSize();
+	size_t filled = 0;
+	char* buf = NULL;
+
+	while (filled < block_size) {
+		size_t take;
+
+		if (recipe_pos_ < recipe_.size()) {
+			take = std::min(block_size - filled, recipe_.size() - recipe_pos_);
+		}
+		else if (range_ < ranges_.size()) {
+			const range& r = ranges_[range_];
+
+			take = std::min<size_t>(block_size - filled, r.length - range_pos_);
+		}
+		else {
+			break;
+		}
+
+		if (buf == NULL)
+			buf = (char*)pool_->Acquire();
+
+		if (recipe_pos_ < recipe_.size()) {
+			memcpy(buf + filled, &recipe_[recipe_pos_], take);
+			recipe_pos_ += take;
+			filled += take;
+			continue;
+		}
+
+		const range& r = ranges_[range_];
+		uint64_t offset = r.offset + range_pos_;
+
+		// Chunks the device holds are skipped over.
+		if (file_pos_ != offset) {
+			if (_fseeki64(fp_, (int64_t)offset, SEEK_SET) != 0) {
+				pool_->Release(buf);
+				return -1;
+			}
+			file_pos_ = offset;
+		}
+
+		size_t read_len = fread(buf + filled, 1, take, fp_);
+
+		// The file changed since it was chunked; the recipe is wrong now.
+		if (read_len != take) {
+			pool_->Release(buf);
+			return -1;
+		}
+
+		file_pos_ += read_len;
+		range_pos_ += (uint32_t)read_len;
+		filled += read_len;
+
+		if (range_pos_ == r.length) {
+			range_++;
+			range_pos_ = 0;
+		}
+	}
+
+	*block = buf;
+	return filled;
+}
+
+ImageReader* cdc_open_reader(BufferPool* pool, const char* fileName,
+	const std::vector<cdc_chunk>& chunks, const std::vector<bool>& send) {
+	FILE* fp;
+
+	fopen_s(&fp, fileName, "rb");
+	if (fp == NULL)
+		return NULL;
+
+	return new ChunkedImageReader(pool, fp, chunks, send);
+}
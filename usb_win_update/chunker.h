@@ -0,0 +1,55 @@
+#pragma once
+
+#ifndef CHUNKER_H_
+#define CHUNKER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "image_reader.h"
+#include "md5.h"
+
+/// One content-defined chunk of a file.
+struct cdc_chunk {
+	uint64_t offset;
+	uint32_t length;
+	unsigned char digest[MD5_DIGEST_SIZE];
+};
+
+/// Chunk size bounds, in bytes. |avg_size| must be a power of two.
+struct cdc_params {
+	uint32_t min_size;
+	uint32_t avg_size;
+	uint32_t max_size;
+};
+
+// Defaults sized for USB transfers rather than for network deduplication:
+// chunks well above the cost of a control round trip per recipe entry.
+#define CDC_DEFAULT_MIN_SIZE	(16 * 1024)
+#define CDC_DEFAULT_AVG_SIZE	(64 * 1024)
+#define CDC_DEFAULT_MAX_SIZE	(256 * 1024)
+
+// Length of the first chunk of the |len| bytes at |data|, FastCDC style: a
+// gear hash rolls over the bytes past |min_size| and a cut goes where its
+// top bits are all zero. Up to |avg_size| a stricter mask is used, past it
+// a looser one, which keeps most chunks close to the average. Chunks end
+// at |max_size| at the latest. Returns |len| if the data ends first.
+// Parameters with |min_size| == |max_size| give fixed size chunks.
+size_t cdc_cut(const unsigned char* data, size_t len, const cdc_params& params);
+
+// Splits |fileName| into chunks, hashing each of them, and stores the MD5
+// sum of the whole file as hex in |md5_sum|. Returns 0, or -1 if the file
+// cannot be read.
+int cdc_chunk_file(const char* fileName, const cdc_params& params, std::vector<cdc_chunk>* chunks,
+	char md5_sum[MD5_HEX_SIZE]);
+
+// Opens the PLCM_IMG_FORMAT_CHUNKED stream of |fileName|: the recipe, one
+// entry per chunk of |chunks|, followed by the data of the chunks whose
+// |send| flag is set, in order, read from the file into blocks of |pool|.
+// Returns NULL if the file cannot be opened.
+ImageReader* cdc_open_reader(BufferPool* pool, const char* fileName,
+	const std::vector<cdc_chunk>& chunks, const std::vector<bool>& send);
+
+#endif  // CHUNKER_H_
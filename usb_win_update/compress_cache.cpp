@@ -0,0 +1,263 @@
+#include "stdafx.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#include <sys/utime.h>
+#else
+#include <dirent.h>
+#include <sys/stat.h>
+#include <utime.h>
+#endif
+
+#include <algorithm>
+#include <vector>
+
+#include "compress_cache.h"
+#include "lz4.h"
+#include "protocol.h"
+#include "trace.h"
+
+#if defined(_WIN32)
+#define CACHE_PATH_SEPARATOR "\\"
+#else
+#define CACHE_PATH_SEPARATOR "/"
+
+static int fopen_s(FILE** fp, const char* fileName, const char* mode) {
+	*fp = fopen(fileName, mode);
+	return *fp ? 0 : errno;
+}
+
+static int _utime(const char* fileName, struct utimbuf* times) {
+	return utime(fileName, times);
+}
+#endif
+
+// Suffix of the entries, naming the codec and its parameters. Streams
+// built with other parameters never match and age out.
+#define CACHE_SUFFIX	".lz4-64k"
+#define CACHE_TMP		".tmp"
+
+static bool ends_with(const std::string& s, const char* suffix) {
+	size_t len = strlen(suffix);
+
+	return s.size() >= len && s.compare(s.size() - len, len, suffix) == 0;
+}
+
+CompressCache::CompressCache(const char *dir, uint64_t max_bytes)
+	: dir_(dir), max_bytes_(max_bytes), total_bytes_(0), hits_(0), misses_(0) {
+#if defined(_WIN32)
+	WIN32_FIND_DATAA data;
+
+	CreateDirectoryA(dir, NULL);
+
+	std::string pattern = dir_ + CACHE_PATH_SEPARATOR "*";
+
+	HANDLE handle = FindFirstFileExA(pattern.c_str(), FindExInfoBasic, &data,
+		FindExSearchNameMatch, NULL, FIND_FIRST_EX_LARGE_FETCH);
+
+	if (handle == INVALID_HANDLE_VALUE)
+		return;
+
+	do {
+		if (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+			continue;
+
+		entry e;
+		// FILETIME counts 100 ns intervals since 1601-01-01.
+		uint64_t t = ((uint64_t)data.ftLastWriteTime.dwHighDateTime << 32) |
+			data.ftLastWriteTime.dwLowDateTime;
+
+		e.size = ((uint64_t)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+		e.last_use = (int64_t)(t / 10000000ULL) - 11644473600LL;
+		entries_[data.cFileName] = e;
+	} while (FindNextFileA(handle, &data));
+
+	FindClose(handle);
+#else
+	mkdir(dir, 0755);
+
+	DIR* d = opendir(dir);
+
+	if (d == NULL)
+		return;
+
+	struct dirent* ent;
+	while ((ent = readdir(d)) != NULL) {
+		struct stat st;
+
+		if (stat((dir_ + CACHE_PATH_SEPARATOR + ent->d_name).c_str(), &st) != 0 ||
+			!S_ISREG(st.st_mode))
+			continue;
+
+		entry e;
+
+		e.size = st.st_size;
+		e.last_use = st.st_mtime;
+		entries_[ent->d_name] = e;
+	}
+
+	closedir(d);
+#endif
+
+	// Leftovers of an interrupted build are dropped, entries only counted.
+	for (auto it = entries_.begin(); it != entries_.end();) {
+		if (ends_with(it->first, CACHE_TMP)) {
+			remove((dir_ + CACHE_PATH_SEPARATOR + it->first).c_str());
+			it = entries_.erase(it);
+			continue;
+		}
+		total_bytes_ += it->second.size;
+		++it;
+	}
+}
+
+std::string CompressCache::Get(const char *fileName, const char *md5_sum) {
+	std::string key = std::string(md5_sum) + CACHE_SUFFIX;
+	std::string path = dir_ + CACHE_PATH_SEPARATOR + key;
+	std::unique_lock<std::mutex> lock(lock_);
+
+	built_cv_.wait(lock, [this, &key] { return building_.count(key) == 0; });
+
+	auto it = entries_.find(key);
+
+	if (it != entries_.end()) {
+		// Touching the file records the use for later runs, and tells
+		// whether another process evicted it meanwhile.
+		if (_utime(path.c_str(), NULL) == 0) {
+			it->second.last_use = time(NULL);
+			hits_++;
+			return path;
+		}
+
+		total_bytes_ -= it->second.size;
+		entries_.erase(it);
+	}
+
+	building_.insert(key);
+	misses_++;
+	lock.unlock();
+
+	uint64_t size = 0;
+	int ret = Build(fileName, md5_sum, path, &size);
+
+	lock.lock();
+	building_.erase(key);
+	built_cv_.notify_all();
+
+	if (ret < 0)
+		return "";
+
+	entry e = { size, time(NULL) };
+
+	entries_[key] = e;
+	total_bytes_ += size;
+	Evict(key);
+
+	return path;
+}
+
+// Compresses |fileName| block by block into |path|, through a temporary
+// file so a half written stream never looks like an entry.
+int CompressCache::Build(const char *fileName, const char *md5_sum, const std::string& path,
+	uint64_t *size) {
+	std::vector<unsigned char> raw(PLCM_LZ4_BLOCK_SIZE);
+	std::vector<unsigned char> packed(lz4_compress_bound(PLCM_LZ4_BLOCK_SIZE));
+	std::string tmp = path + CACHE_TMP;
+	unsigned char digest[MD5_DIGEST_SIZE];
+	char md5_read[MD5_HEX_SIZE];
+	md5_context md5;
+	bool failed = false;
+	FILE *in;
+	FILE *out;
+	size_t len;
+
+	TraceScope trace("lz4_compress");
+
+	fopen_s(&in, fileName, "rb");
+	if (in == NULL)
+		return -1;
+
+	fopen_s(&out, tmp.c_str(), "wb");
+	if (out == NULL) {
+		fclose(in);
+		return -1;
+	}
+
+	md5_init(&md5);
+	*size = 0;
+
+	while (!failed && (len = fread(&raw[0], 1, raw.size(), in)) > 0) {
+		plcm_lz4_block block;
+
+		md5_update(&md5, &raw[0], len);
+
+		// Blocks that do not shrink are stored as they are.
+		size_t packed_len = lz4_compress_block(&raw[0], len, &packed[0], len - 1);
+		const unsigned char *data = packed_len > 0 ? &packed[0] : &raw[0];
+
+		block.raw_length = (uint32_t)len;
+		block.length = packed_len > 0 ? (uint32_t)packed_len : (uint32_t)len | PLCM_LZ4_STORED;
+		if (packed_len == 0)
+			packed_len = len;
+
+		failed = fwrite(&block, sizeof(block), 1, out) != 1 ||
+			fwrite(data, 1, packed_len, out) != packed_len;
+		*size += sizeof(block) + packed_len;
+	}
+
+	failed = failed || ferror(in) != 0;
+	fclose(in);
+	failed = fclose(out) != 0 || failed;
+
+	md5_final(&md5, digest);
+	md5_to_hex(digest, md5_read);
+
+	// The file changed since it was hashed; the stream would carry the
+	// wrong content under this sum.
+	if (!failed && memcmp(md5_read, md5_sum, MD5_HEX_SIZE) != 0)
+		failed = true;
+
+	if (!failed) {
+		remove(path.c_str());
+		failed = rename(tmp.c_str(), path.c_str()) != 0;
+	}
+
+	if (failed) {
+		remove(tmp.c_str());
+		return -1;
+	}
+
+	trace.SetBytes(*size);
+	return 0;
+}
+
+// Drops the least recently used entries but |keep| until the cache fits.
+// Entries open elsewhere may refuse to go; they are tried again next time.
+void CompressCache::Evict(const std::string& keep) {
+	if (total_bytes_ <= max_bytes_)
+		return;
+
+	std::vector<std::pair<int64_t, std::string>> order;
+
+	for (const auto& it : entries_) {
+		if (it.first != keep && building_.count(it.first) == 0)
+			order.push_back(std::make_pair(it.second.last_use, it.first));
+	}
+
+	std::sort(order.begin(), order.end());
+
+	for (size_t i = 0; i < order.size() && total_bytes_ > max_bytes_; i++) {
+		const std::string& key = order[i].second;
+
+		if (remove((dir_ + CACHE_PATH_SEPARATOR + key).c_str()) != 0 && errno != ENOENT)
+			continue;
+
+		total_bytes_ -= entries_[key].size;
+		entries_.erase(key);
+	}
+}
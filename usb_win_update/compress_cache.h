@@ -0,0 +1,66 @@
+#pragma once
+
+#ifndef COMPRESS_CACHE_H_
+#define COMPRESS_CACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+
+#include "md5.h"
+
+// Compressed image streams kept on disk across runs.
+//
+// Each entry is the PLCM_IMG_FORMAT_LZ4 stream of one file, named after
+// the MD5 sum of the file and the codec parameters, so a release flashed
+// on unit after unit is compressed once and then only read. Entries least
+// recently used go once the cache outgrows its size; the last use is the
+// file's modification time, so it carries over to the next run. One cache
+// may serve several device threads: a stream one of them is building is
+// waited for rather than built twice.
+class CompressCache {
+public:
+	// Uses the directory |dir|, created if missing, keeping at most about
+	// |max_bytes| in it.
+	CompressCache(const char *dir, uint64_t max_bytes);
+
+	// Path of the compressed stream of |fileName|, whose MD5 sum is
+	// |md5_sum|, built on a miss. Returns "" if the file cannot be read,
+	// no longer matches |md5_sum| or the cache cannot be written.
+	std::string Get(const char *fileName, const char *md5_sum);
+
+	uint64_t Hits() const { return hits_; }
+	uint64_t Misses() const { return misses_; }
+
+	CompressCache(const CompressCache&) = delete;
+	void operator=(const CompressCache&) = delete;
+
+private:
+	struct entry {
+		uint64_t size;
+		/// Seconds since the Unix epoch
+		int64_t last_use;
+	};
+
+	int Build(const char *fileName, const char *md5_sum, const std::string& path, uint64_t *size);
+	void Evict(const std::string& keep);
+
+	std::string dir_;
+	uint64_t max_bytes_;
+
+	std::mutex lock_;
+	std::condition_variable built_cv_;
+	std::map<std::string, entry> entries_;
+	// Keys whose stream a thread is building right now
+	std::set<std::string> building_;
+	uint64_t total_bytes_;
+	uint64_t hits_;
+	uint64_t misses_;
+};
+
+#endif  // COMPRESS_CACHE_H_
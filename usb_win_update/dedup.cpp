@@ -0,0 +1,79 @@
+#include "stdafx.h"
+
+#include <string.h>
+
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+#include "dedup.h"
+#include "trace.h"
+
+int64_t dedup_plan(const std::vector<manifest_entry>& manifest, int threads, DigestCache *cache,
+	std::vector<manifest_entry>* unique, std::vector<dedup_link>* links) {
+	std::unordered_map<int64_t, size_t> sizes;
+	std::vector<size_t> candidates;
+	std::vector<std::string> digests(manifest.size());
+
+	for (const manifest_entry& entry : manifest)
+		sizes[entry.size]++;
+
+	for (size_t i = 0; i < manifest.size(); i++) {
+		if (sizes[manifest[i].size] > 1)
+			candidates.push_back(i);
+	}
+
+	if (!candidates.empty()) {
+		TRACE_SCOPE("dedup_hash");
+
+		// The whole list is the window, every worker keeps going until done.
+		DigestPrefetcher prefetcher(manifest, candidates, threads > 0 ? threads : 1,
+			candidates.size(), cache);
+
+		for (size_t k = 0; k < candidates.size(); k++) {
+			char md5_sum[MD5_HEX_SIZE];
+
+			if (prefetcher.Get(k, md5_sum) == 0)
+				digests[candidates[k]] = md5_sum;
+		}
+	}
+
+	std::map<std::pair<int64_t, std::string>, size_t> sources;
+	int64_t saved = 0;
+
+	unique->clear();
+	links->clear();
+
+	for (size_t i = 0; i < manifest.size(); i++) {
+		// Unreadable files go the normal way and fail there.
+		if (digests[i].empty()) {
+			unique->push_back(manifest[i]);
+			continue;
+		}
+
+		auto key = std::make_pair(manifest[i].size, digests[i]);
+		auto it = sources.find(key);
+
+		if (it == sources.end()) {
+			sources[key] = i;
+			unique->push_back(manifest[i]);
+			unique->back().md5 = digests[i];
+			continue;
+		}
+
+		saved += manifest[i].size;
+
+		if (manifest[i].name == manifest[it->second].name)
+			continue;
+
+		dedup_link link;
+
+		link.file = i;
+		link.source = it->second;
+		memcpy(link.md5_sum, digests[i].c_str(), MD5_HEX_SIZE);
+		links->push_back(link);
+	}
+
+	return saved;
+}
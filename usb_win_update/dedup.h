@@ -0,0 +1,38 @@
+#pragma once
+
+#ifndef DEDUP_H_
+#define DEDUP_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "md5.h"
+#include "scanner.h"
+
+/// A file whose content the device gets anyway under another name.
+struct dedup_link {
+	/// Manifest index of the duplicate
+	size_t file;
+	/// Manifest index of the copy that is sent
+	size_t source;
+	/// MD5 sum of both, as hex
+	char md5_sum[MD5_HEX_SIZE];
+};
+
+// Finds the byte-identical files of |manifest|.
+//
+// Only files sharing their size with another file can be duplicates, so
+// only those are hashed, on |threads| workers, or taken from |cache| (NULL
+// for none). Files with the same size and MD5 sum are one content: the
+// first in path order stays in |unique|, with its digest filled in so it
+// is not hashed again, the others become |links| to it. Files whose name
+// is the same as their source's would land on the same device file and
+// are dropped without a link.
+//
+// Returns the bytes that don't need to be sent.
+int64_t dedup_plan(const std::vector<manifest_entry>& manifest, int threads, DigestCache *cache,
+	std::vector<manifest_entry>* unique, std::vector<dedup_link>* links);
+
+#endif  // DEDUP_H_
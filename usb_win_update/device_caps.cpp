@@ -0,0 +1,41 @@
+#include "stdafx.h"
+
+#include <string.h>
+
+#include "device_caps.h"
+
+// Fields up to and including |flags|, the least a device may send.
+#define DEVICE_CAPS_MIN_LENGTH 8
+
+int device_caps_parse(const void* data, size_t len, plcm_device_caps* caps) {
+	memset(caps, 0, sizeof(*caps));
+
+	if (len < DEVICE_CAPS_MIN_LENGTH)
+		return -1;
+
+	plcm_device_caps reported;
+
+	memset(&reported, 0, sizeof(reported));
+	memcpy(&reported, data, len < sizeof(reported) ? len : sizeof(reported));
+
+	if (reported.version == 0 || reported.length < DEVICE_CAPS_MIN_LENGTH)
+		return -1;
+
+	// Newer devices send more than we know, older ones less.
+	size_t known = reported.length < len ? reported.length : len;
+	if (known > sizeof(*caps))
+		known = sizeof(*caps);
+
+	memcpy(caps, &reported, known);
+	caps->length = (uint16_t)known;
+
+	return 0;
+}
+
+void device_caps_dump_json(FILE* fp, const plcm_device_caps& caps) {
+	fprintf(fp, "{\"version\":%u,\"length\":%u,\"flags\":%u,\"max_bulk_transfer\":%u,"
+		"\"digests\":%u,\"codecs\":%u,\"window\":%u,\"free_bytes\":%llu,\"max_stripes\":%u,"
+		"\"max_inline\":%u}",
+		caps.version, caps.length, caps.flags, caps.max_bulk_transfer, caps.digests,
+		caps.codecs, caps.window, (unsigned long long)caps.free_bytes, caps.max_stripes, caps.max_inline);
+}
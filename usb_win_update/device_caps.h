@@ -0,0 +1,76 @@
+#pragma once
+
+#ifndef DEVICE_CAPS_H_
+#define DEVICE_CAPS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Capabilities block returned by GET_INFORMATION CAPABILITIES. Fields are
+// little endian like every other value of the protocol. The block only
+// ever grows: a device fills the fields it knows and reports how many
+// bytes that is in |length|, the host treats the rest as 0.
+#define PLCM_CAPS_VERSION	1
+
+// plcm_device_caps::flags
+#define PLCM_CAP_SIZE64		0x0001	//IMG_LENGTH64 and WRITTEN_BYTES64
+#define PLCM_CAP_SPARSE		0x0002	//IMG_FORMAT sparse
+#define PLCM_CAP_TAR		0x0004	//IMG_FORMAT tar
+#define PLCM_CAP_PIPELINE	0x0008	//IMG_SEQ and SEQ_STATUS
+#define PLCM_CAP_RESUME		0x0010	//Interrupted images can be continued
+#define PLCM_CAP_CREDITS	0x0020	//CREDITS flow control
+#define PLCM_CAP_STRIPES	0x0040	//STRIPES, image data over several pipes
+#define PLCM_CAP_PULL		0x0080	//PULL_PATH and PULL_INFO, files sent to the host
+#define PLCM_CAP_LINK		0x0100	//IMG_LINK, stored images copied under another name
+#define PLCM_CAP_CHUNKS		0x0200	//CHUNK_QUERY and IMG_FORMAT chunked
+#define PLCM_CAP_DIGEST_FIRST	0x0400	//IMG_EXPECTED_MD5, images checked while stored
+#define PLCM_CAP_INLINE		0x0800	//IMG_INLINE, small images in one control transfer
+
+// plcm_device_caps::digests
+#define PLCM_DIGEST_MD5		0x0001
+#define PLCM_DIGEST_SHA256	0x0002
+
+// plcm_device_caps::codecs, for compressed image data
+#define PLCM_CODEC_LZ4		0x0001
+
+#pragma pack(push, 1)
+struct plcm_device_caps {
+	/// PLCM_CAPS_VERSION of the device, 0 if it reported nothing
+	uint16_t version;
+	/// Bytes of the block filled by the device
+	uint16_t length;
+	/// PLCM_CAP_* bits
+	uint32_t flags;
+	/// Largest bulk OUT transfer the device takes, 0 if unlimited
+	uint32_t max_bulk_transfer;
+	/// PLCM_DIGEST_* bits
+	uint32_t digests;
+	/// PLCM_CODEC_* bits
+	uint32_t codecs;
+	/// Images the device verifies while the next ones arrive
+	uint32_t window;
+	/// Free space of the image directory in bytes, 0 if unknown
+	uint64_t free_bytes;
+	/// Bulk OUT pipes an image can be striped across, default one included
+	uint32_t max_stripes;
+	/// Largest image IMG_INLINE takes, 0 if none
+	uint32_t max_inline;
+};
+#pragma pack(pop)
+
+// Fills |caps| from the |len| bytes the device returned at |data|.
+// Returns 0, or -1 if they are not a capabilities block, in which case
+// |caps| is all zero.
+int device_caps_parse(const void* data, size_t len, plcm_device_caps* caps);
+
+// True if the device reported capabilities, so a missing bit means the
+// feature is absent rather than unknown.
+inline bool device_caps_known(const plcm_device_caps& caps) {
+	return caps.version != 0;
+}
+
+// Writes |caps| as one JSON object.
+void device_caps_dump_json(FILE* fp, const plcm_device_caps& caps);
+
+#endif  // DEVICE_CAPS_H_
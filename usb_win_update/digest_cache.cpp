@@ -0,0 +1,112 @@
+#include "stdafx.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+
+#include "digest_cache.h"
+
+#if !defined(_WIN32)
+static int fopen_s(FILE** fp, const char* fileName, const char* mode) {
+	*fp = fopen(fileName, mode);
+	return *fp ? 0 : errno;
+}
+#endif
+
+DigestCache::DigestCache(const char *fileName)
+	: fileName_(fileName), dirty_(false), hits_(0) {
+	FILE *fp;
+	char line[4096];
+
+	fopen_s(&fp, fileName, "rb");
+	if (fp == NULL)
+		return;
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		const size_t hex_len = MD5_HEX_SIZE - 1;
+		record r;
+		char *end;
+
+		line[strcspn(line, "\r\n")] = '\0';
+
+		// Lines that do not parse are dropped on the next save.
+		if (strlen(line) <= hex_len || line[hex_len] != ' ')
+			continue;
+
+		memcpy(r.md5, line, hex_len);
+		r.md5[hex_len] = '\0';
+		r.size = strtoll(line + hex_len + 1, &end, 10);
+		if (*end != ' ')
+			continue;
+		r.mtime_ns = strtoll(end + 1, &end, 10);
+		if (*end != ' ' || end[1] == '\0')
+			continue;
+
+		records_[end + 1] = r;
+	}
+
+	fclose(fp);
+}
+
+bool DigestCache::Lookup(const manifest_entry& entry, char md5_sum[MD5_HEX_SIZE]) {
+	std::lock_guard<std::mutex> lock(lock_);
+	auto it = records_.find(entry.path);
+
+	if (it == records_.end() || it->second.size != entry.size || it->second.mtime_ns != entry.mtime_ns)
+		return false;
+
+	memcpy(md5_sum, it->second.md5, MD5_HEX_SIZE);
+	hits_++;
+	return true;
+}
+
+void DigestCache::Store(const manifest_entry& entry, const char *md5_sum) {
+	int64_t now_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::system_clock::now().time_since_epoch()).count();
+
+	if (now_ns - entry.mtime_ns < DIGEST_CACHE_RACY_SECONDS * 1000000000LL)
+		return;
+
+	std::lock_guard<std::mutex> lock(lock_);
+	record& r = records_[entry.path];
+
+	r.size = entry.size;
+	r.mtime_ns = entry.mtime_ns;
+	memcpy(r.md5, md5_sum, MD5_HEX_SIZE);
+	dirty_ = true;
+}
+
+int DigestCache::Save() {
+	std::lock_guard<std::mutex> lock(lock_);
+	std::string tmp = fileName_ + ".tmp";
+	FILE *fp;
+
+	if (!dirty_)
+		return 0;
+
+	// Written aside first, so an interrupted save keeps the old cache.
+	fopen_s(&fp, tmp.c_str(), "wb");
+	if (fp == NULL)
+		return -1;
+
+	for (const auto& it : records_) {
+		fprintf(fp, "%s %" PRId64 " %" PRId64 " %s\n", it.second.md5, it.second.size,
+			it.second.mtime_ns, it.first.c_str());
+	}
+
+	if (fclose(fp) != 0) {
+		remove(tmp.c_str());
+		return -1;
+	}
+
+	remove(fileName_.c_str());
+	if (rename(tmp.c_str(), fileName_.c_str()) != 0)
+		return -1;
+
+	dirty_ = false;
+	return 0;
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#ifndef DIGEST_CACHE_H_
+#define DIGEST_CACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <map>
+#include <mutex>
+#include <string>
+
+#include "md5.h"
+#include "scanner.h"
+
+// Files written this recently are not cached: on coarse file systems (FAT
+// keeps 2 s) they may still change without their write time changing.
+#define DIGEST_CACHE_RACY_SECONDS 3
+
+// MD5 sums of host files kept across runs.
+//
+// A sum is reused as long as the file keeps its size and last write time,
+// so unchanged files of the next release are not read once more just to
+// send their sum ahead of the data. The write time is compared at full
+// resolution, and sums of files written within DIGEST_CACHE_RACY_SECONDS of
+// the store are dropped, as git does for racily clean index entries: a stale
+// sum would make the device link the old content in place of the new. The
+// file holds one line per host file, "md5 size mtime_ns path"; lines left by
+// older builds, in seconds, just miss. Lookups and stores may come from hash
+// workers.
+class DigestCache {
+public:
+	// Loads |fileName| if it exists; a missing file is an empty cache.
+	explicit DigestCache(const char *fileName);
+
+	// Stores the sum of |entry| as hex in |md5_sum| if the cache holds one
+	// for the file as it is now. Returns true on a hit.
+	bool Lookup(const manifest_entry& entry, char md5_sum[MD5_HEX_SIZE]);
+	void Store(const manifest_entry& entry, const char *md5_sum);
+
+	// Writes the cache back if it changed. Returns 0, or -1 on failure.
+	int Save();
+
+	size_t Hits() const { return hits_; }
+
+	DigestCache(const DigestCache&) = delete;
+	void operator=(const DigestCache&) = delete;
+
+private:
+	struct record {
+		int64_t size;
+		int64_t mtime_ns;
+		char md5[MD5_HEX_SIZE];
+	};
+
+	std::string fileName_;
+
+	std::mutex lock_;
+	std::map<std::string, record> records_;
+	bool dirty_;
+	size_t hits_;
+};
+
+#endif  // DIGEST_CACHE_H_
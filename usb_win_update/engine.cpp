@@ -0,0 +1,151 @@
+#include <stdio.h>
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <thread>
+
+#if defined(_WIN32)
+#include <Windows.h>
+#endif
+
+#include "engine.h"
+#include "trace.h"
+#include "transport_stats.h"
+
+#if defined(_WIN32)
+
+static bool engine_signalled(void *event)
+{
+	return WaitForSingleObject((HANDLE)event, 0) == WAIT_OBJECT_0;
+}
+
+static void engine_sleep(void **events, int count, uint64_t timeout_us)
+{
+	DWORD timeout_ms = timeout_us == UINT64_MAX ? INFINITE : (DWORD)((timeout_us + 999) / 1000);
+
+	if (count > 0)
+		WaitForMultipleObjects(count, (const HANDLE *)events, FALSE, timeout_ms);
+	else
+		Sleep(timeout_ms);
+}
+
+#else
+
+//No waitable handles here; tasks with an event are polled every millisecond.
+static bool engine_signalled(void *event)
+{
+	return true;
+}
+
+static void engine_sleep(void **events, int count, uint64_t timeout_us)
+{
+	if (count > 0 && timeout_us > 1000)
+		timeout_us = 1000;
+
+	std::this_thread::sleep_for(std::chrono::microseconds(timeout_us));
+}
+
+#endif
+
+EventEngine::EventEngine() : steps_(0), waits_(0) {}
+
+int EventEngine::Add(engine_step_func step, void *task)
+{
+	if (tasks_.size() >= ENGINE_MAX_TASKS)
+		return -1;
+
+	slot s = {};
+
+	s.step = step;
+	s.task = task;
+	tasks_.push_back(s);
+
+	return 0;
+}
+
+void EventEngine::Run()
+{
+	size_t active = tasks_.size();
+
+	TRACE_SCOPE("engine");
+
+	while (active > 0) {
+		void *events[ENGINE_MAX_TASKS];
+		int count = 0;
+		uint64_t now_us = TransportStats::NowUs();
+		uint64_t next_us = UINT64_MAX;
+		bool busy = false;
+
+		for (slot &s : tasks_) {
+			if (s.done)
+				continue;
+
+			bool idle = s.wait.event == NULL && s.wait.deadline_us == 0;
+
+			if (idle || (s.wait.deadline_us != 0 && now_us >= s.wait.deadline_us) ||
+				(s.wait.event != NULL && engine_signalled(s.wait.event))) {
+				s.wait.event = NULL;
+				s.wait.deadline_us = 0;
+				steps_++;
+
+				if (!s.step(s.task, &s.wait)) {
+					s.done = true;
+					active--;
+					continue;
+				}
+			}
+
+			if (s.wait.event != NULL)
+				events[count++] = s.wait.event;
+			if (s.wait.deadline_us != 0)
+				next_us = std::min(next_us, s.wait.deadline_us);
+			if (s.wait.event == NULL && s.wait.deadline_us == 0)
+				busy = true;
+		}
+
+		if (active == 0 || busy)
+			continue;
+
+		now_us = TransportStats::NowUs();
+		if (next_us != UINT64_MAX)
+			next_us = next_us > now_us ? next_us - now_us : 0;
+
+		waits_++;
+		engine_sleep(events, count, next_us);
+	}
+}
+
+int engine_run_all(engine_step_func step, const std::vector<void *> &tasks)
+{
+	std::vector<std::unique_ptr<EventEngine>> engines;
+	std::vector<std::thread> threads;
+
+	for (size_t i = 0; i < tasks.size(); i++) {
+		if (i % ENGINE_MAX_TASKS == 0)
+			engines.push_back(std::unique_ptr<EventEngine>(new EventEngine()));
+
+		engines.back()->Add(step, tasks[i]);
+	}
+
+	for (size_t e = 1; e < engines.size(); e++) {
+		EventEngine *engine = engines[e].get();
+
+		threads.push_back(std::thread([engine]() {
+			trace_set_thread_name("event engine");
+			engine->Run();
+		}));
+	}
+
+	if (!engines.empty())
+		engines[0]->Run();
+
+	for (std::thread &thread : threads)
+		thread.join();
+
+	for (size_t e = 0; e < engines.size(); e++)
+		printf("engine %zu: %zu tasks, %llu steps, %llu waits\n", e, engines[e]->Tasks(),
+			(unsigned long long)engines[e]->Steps(), (unsigned long long)engines[e]->Waits());
+
+	return (int)engines.size();
+}
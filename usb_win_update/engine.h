@@ -0,0 +1,70 @@
+#pragma once
+
+#ifndef ENGINE_H_
+#define ENGINE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+// What a task waits for before it can make progress again. A task that
+// sets neither field is stepped again right away.
+struct engine_wait {
+	/// Waitable handle, such as Transport::WriteEvent(), NULL for none
+	void *event;
+	/// TransportStats::NowUs() time to step the task at, 0 for none
+	uint64_t deadline_us;
+};
+
+// Advances the task |task| as far as it can go without blocking, then
+// fills |wait|. Returns false once the task is over.
+typedef bool (*engine_step_func)(void *task, engine_wait *wait);
+
+// Tasks one engine can wait on, the WaitForMultipleObjects() limit.
+#define ENGINE_MAX_TASKS 64
+
+// Drives many resumable tasks from one thread.
+//
+// Each round steps every task whose event is signalled or whose deadline
+// has passed, then blocks in a single wait on all the events until the
+// next one fires or the nearest deadline comes. The thread only wakes up
+// when some task can move, however many tasks there are.
+class EventEngine {
+public:
+	EventEngine();
+
+	// Adds a task, at most ENGINE_MAX_TASKS. Returns 0 or -1.
+	int Add(engine_step_func step, void *task);
+
+	// Steps the tasks until all of them are over.
+	void Run();
+
+	size_t Tasks() const { return tasks_.size(); }
+
+	// Calls to the step functions, and times the thread went to sleep.
+	uint64_t Steps() const { return steps_; }
+	uint64_t Waits() const { return waits_; }
+
+	EventEngine(const EventEngine&) = delete;
+	void operator=(const EventEngine&) = delete;
+
+private:
+	struct slot {
+		engine_step_func step;
+		void *task;
+		engine_wait wait;
+		bool done;
+	};
+
+	std::vector<slot> tasks_;
+	uint64_t steps_;
+	uint64_t waits_;
+};
+
+// Runs the |tasks| steps of |step| on as few engines as the wait limit
+// allows, each on its own thread, the first one on the calling thread.
+// Returns the number of engine threads used.
+int engine_run_all(engine_step_func step, const std::vector<void *> &tasks);
+
+#endif  // ENGINE_H_
@@ -0,0 +1,191 @@
+#include "stdafx.h"
+
+#include <string.h>
+
+#include <chrono>
+#include <string>
+#include <thread>
+
+#include "fault_inject.h"
+#include "protocol.h"
+
+// One in this many calls a fault applies to is the one it hits, so faults
+// land anywhere in an image rather than on its first request.
+#define FAULT_HIT_ODDS	4
+
+static const char* const fault_names[FAULT_KINDS] = {
+	"timeout",
+	"short-write",
+	"stall",
+	"disconnect",
+	"bad-status",
+};
+
+const char* fault_kind_name(int kind) {
+	return kind >= 0 && kind < FAULT_KINDS ? fault_names[kind] : "unknown";
+}
+
+int fault_kinds_parse(const char* list, uint32_t* mask) {
+	std::string names = list;
+	size_t start = 0;
+
+	*mask = 0;
+
+	while (start <= names.size()) {
+		size_t end = names.find(',', start);
+		std::string name = names.substr(start, end == std::string::npos ? std::string::npos : end - start);
+		int kind = 0;
+
+		if (name == "all") {
+			*mask |= FAULT_ALL_KINDS;
+		}
+		else {
+			while (kind < FAULT_KINDS && name != fault_names[kind])
+				kind++;
+			if (kind == FAULT_KINDS)
+				return -1;
+			*mask |= 1U << kind;
+		}
+
+		if (end == std::string::npos)
+			break;
+		start = end + 1;
+	}
+
+	return 0;
+}
+
+FaultInjectingTransport::FaultInjectingTransport(Transport* inner, const fault_options& options)
+	: inner_(inner), options_(options), random_(options.seed), armed_(false), kind_(FAULT_TIMEOUT),
+	hit_(false), hit_kind_(FAULT_TIMEOUT), hit_us_(0), down_until_us_(0) {}
+
+void FaultInjectingTransport::Arm(fault_kind kind) {
+	armed_ = true;
+	kind_ = kind;
+}
+
+bool FaultInjectingTransport::TakeHit(fault_kind* kind, uint64_t* hit_us) {
+	if (!hit_)
+		return false;
+
+	hit_ = false;
+	*kind = hit_kind_;
+	*hit_us = hit_us_;
+	return true;
+}
+
+bool FaultInjectingTransport::Disconnected() const {
+	return TransportStats::NowUs() < down_until_us_;
+}
+
+// Decides whether the armed fault, which applies to the call at hand, hits
+// it. A wrong STATUS has a single request to go with and always does.
+bool FaultInjectingTransport::Strike(fault_kind kind) {
+	if (kind != FAULT_BAD_STATUS && random_() % FAULT_HIT_ODDS != 0)
+		return false;
+
+	armed_ = false;
+	hit_ = true;
+	hit_kind_ = kind;
+	hit_us_ = TransportStats::NowUs();
+
+	if (kind == FAULT_TIMEOUT)
+		std::this_thread::sleep_for(std::chrono::milliseconds(options_.timeout_ms));
+	else if (kind == FAULT_DISCONNECT)
+		down_until_us_ = hit_us_ + options_.reconnect_ms * 1000ULL;
+
+	return true;
+}
+
+ssize_t FaultInjectingTransport::Fail() {
+	stats_.RecordError(-1);
+	return -1;
+}
+
+ssize_t FaultInjectingTransport::Read(void* data, size_t len) {
+	if (Disconnected())
+		return Fail();
+
+	if (armed_ && (kind_ == FAULT_TIMEOUT || kind_ == FAULT_DISCONNECT) && Strike(kind_))
+		return Fail();
+
+	return inner_->Read(data, len);
+}
+
+ssize_t FaultInjectingTransport::Write(const void* data, size_t len) {
+	if (Disconnected())
+		return Fail();
+
+	if (armed_ && (kind_ == FAULT_TIMEOUT || kind_ == FAULT_DISCONNECT) && Strike(kind_))
+		return Fail();
+
+	//The device takes the first half, then the transfer ends
+	if (armed_ && kind_ == FAULT_SHORT_WRITE && len > 1 && Strike(kind_))
+		return inner_->Write(data, len / 2);
+
+	return inner_->Write(data, len);
+}
+
+ssize_t FaultInjectingTransport::ControlIO(bool is_in, void* setup, void* data, size_t len) {
+	const setup_packet* packet = (const setup_packet*)setup;
+
+	if (Disconnected())
+		return Fail();
+
+	if (armed_ && (kind_ == FAULT_TIMEOUT || kind_ == FAULT_DISCONNECT || kind_ == FAULT_STALL) &&
+		Strike(kind_))
+		return Fail();
+
+	ssize_t ret = inner_->ControlIO(is_in, setup, data, len);
+
+	if (armed_ && kind_ == FAULT_BAD_STATUS && is_in && ret >= (ssize_t)sizeof(int32_t) &&
+		packet->wValue == PLCM_USB_REQUEST_VALUE_STATUS && Strike(kind_)) {
+		int32_t status = 1;
+
+		memcpy(data, &status, sizeof(status));
+	}
+
+	return ret;
+}
+
+FaultReport::FaultReport() : recover_total_us_(0) {
+	memset(hits_, 0, sizeof(hits_));
+	memset(undetected_, 0, sizeof(undetected_));
+	memset(unrecovered_, 0, sizeof(unrecovered_));
+}
+
+uint64_t FaultReport::Undetected() const {
+	uint64_t total = 0;
+
+	for (int i = 0; i < FAULT_KINDS; i++)
+		total += undetected_[i];
+	return total;
+}
+
+uint64_t FaultReport::Unrecovered() const {
+	uint64_t total = 0;
+
+	for (int i = 0; i < FAULT_KINDS; i++)
+		total += unrecovered_[i];
+	return total;
+}
+
+void FaultReport::Print(FILE* fp) const {
+	fprintf(fp, "%-12s %6s %10s %11s %27s %27s\n", "fault", "hits", "undetected", "unrecovered",
+		"detect ms p50/p99/max", "recover ms p50/p99/max");
+
+	for (int i = 0; i < FAULT_KINDS; i++) {
+		const LatencyHistogram& detect = detect_us_[i];
+		const LatencyHistogram& recover = recover_us_[i];
+
+		if (hits_[i] == 0)
+			continue;
+
+		fprintf(fp, "%-12s %6llu %10llu %11llu %9.1f/%7.1f/%9.1f %9.1f/%7.1f/%9.1f\n",
+			fault_kind_name(i), (unsigned long long)hits_[i],
+			(unsigned long long)undetected_[i], (unsigned long long)unrecovered_[i],
+			detect.Percentile(50.0) / 1000.0, detect.Percentile(99.0) / 1000.0, detect.Max() / 1000.0,
+			recover.Percentile(50.0) / 1000.0, recover.Percentile(99.0) / 1000.0,
+			recover.Max() / 1000.0);
+	}
+}
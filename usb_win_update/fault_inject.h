@@ -0,0 +1,136 @@
+#pragma once
+
+#ifndef FAULT_INJECT_H_
+#define FAULT_INJECT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <memory>
+#include <random>
+#include <vector>
+
+#include "transport.h"
+
+// Faults FaultInjectingTransport can put in the way of a transfer.
+enum fault_kind {
+	// The call blocks for the pipe timeout, then fails.
+	FAULT_TIMEOUT,
+	// A Write() that takes only the first half of the data.
+	FAULT_SHORT_WRITE,
+	// A control transfer the device stalls.
+	FAULT_STALL,
+	// The device drops off the bus: calls fail until it is back.
+	FAULT_DISCONNECT,
+	// STATUS reports a failed check of an image that was fine.
+	FAULT_BAD_STATUS,
+	FAULT_KINDS,
+};
+
+#define FAULT_ALL_KINDS	((1U << FAULT_KINDS) - 1)
+
+// As AdbWriteEndpointSync() and AdbReadEndpointSync() are given by
+// WindowsUsbTransport, and WinUSB's default for control transfers.
+#define FAULT_DEFAULT_TIMEOUT_MS	5000
+// Time a device typically takes to come back after dropping off the bus.
+#define FAULT_DEFAULT_RECONNECT_MS	1500
+
+const char* fault_kind_name(int kind);
+
+// Parses a comma separated list of fault names ("timeout,stall") or "all"
+// into a mask of (1 << fault_kind) bits. Returns -1 for an unknown name.
+int fault_kinds_parse(const char* list, uint32_t* mask);
+
+struct fault_options {
+	/// How long FAULT_TIMEOUT blocks the call
+	uint32_t timeout_ms;
+	/// How long FAULT_DISCONNECT keeps the device away
+	uint32_t reconnect_ms;
+	/// Seed of the choice of the call a fault hits
+	uint32_t seed;
+};
+
+// Transport passing every call on to |inner|, except that a fault armed by
+// Arm() hits one of the next calls it applies to, picked at random. The
+// time the fault hit is kept for measuring how long the host takes to
+// notice and to get going again.
+class FaultInjectingTransport : public Transport {
+public:
+	// Takes ownership of |inner|.
+	FaultInjectingTransport(Transport* inner, const fault_options& options);
+
+	// Has |kind| hit one of the next calls. Replaces a fault armed before
+	// that has not hit yet.
+	void Arm(fault_kind kind);
+
+	// Hands out the fault that hit since the last call: stores its kind and
+	// when it hit and returns true, or returns false if none did.
+	bool TakeHit(fault_kind* kind, uint64_t* hit_us);
+
+	// True while a FAULT_DISCONNECT keeps the device away.
+	bool Disconnected() const;
+
+	ssize_t Read(void* data, size_t len) override;
+	ssize_t Write(const void* data, size_t len) override;
+	ssize_t ControlIO(bool is_in, void* setup, void* data, size_t len) override;
+	int Close() override { return inner_->Close(); }
+	const char* Name() const override { return inner_->Name(); }
+	const char* Serial() const override { return inner_->Serial(); }
+	const char* Location() const override { return inner_->Location(); }
+
+	FaultInjectingTransport(const FaultInjectingTransport&) = delete;
+	void operator=(const FaultInjectingTransport&) = delete;
+
+private:
+	bool Strike(fault_kind kind);
+	ssize_t Fail();
+
+	std::unique_ptr<Transport> inner_;
+	fault_options options_;
+	std::mt19937 random_;
+
+	bool armed_;
+	fault_kind kind_;
+
+	bool hit_;
+	fault_kind hit_kind_;
+	uint64_t hit_us_;
+
+	uint64_t down_until_us_;
+};
+
+// Outcome of the faults of a soak run: how many hit, how long the host took
+// to fail the image each hit (time-to-detect) and to store an image again
+// (time-to-recover), and faults it never noticed or never got over.
+class FaultReport {
+public:
+	FaultReport();
+
+	void Hit(fault_kind kind) { hits_[kind]++; }
+	void Detected(fault_kind kind, uint64_t us) { detect_us_[kind].Record(us); }
+	void Recovered(fault_kind kind, uint64_t us) { recover_us_[kind].Record(us); recover_total_us_ += us; }
+	void Undetected(fault_kind kind) { undetected_[kind]++; }
+	void Unrecovered(fault_kind kind) { unrecovered_[kind]++; }
+
+	// Total time from faults hitting to images being stored again.
+	uint64_t LostUs() const { return recover_total_us_; }
+	uint64_t Undetected() const;
+	uint64_t Unrecovered() const;
+
+	// Writes one line per fault kind that hit, latencies in ms.
+	void Print(FILE* fp) const;
+
+	FaultReport(const FaultReport&) = delete;
+	void operator=(const FaultReport&) = delete;
+
+private:
+	uint64_t hits_[FAULT_KINDS];
+	uint64_t undetected_[FAULT_KINDS];
+	uint64_t unrecovered_[FAULT_KINDS];
+	LatencyHistogram detect_us_[FAULT_KINDS];
+	LatencyHistogram recover_us_[FAULT_KINDS];
+	uint64_t recover_total_us_;
+};
+
+#endif  // FAULT_INJECT_H_
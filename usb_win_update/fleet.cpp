@@ -0,0 +1,331 @@
+#include "stdafx.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
+
+#include "fleet.h"
+#include "trace.h"
+#include "transport_stats.h"
+
+// How often the controller looks at the groups when no job ends.
+#define FLEET_TICK_MS 100
+
+int fleet_grouping_parse(const char *name, fleet_grouping *grouping)
+{
+	if (strcmp(name, "none") == 0)
+		*grouping = FLEET_GROUP_NONE;
+	else if (strcmp(name, "hub") == 0)
+		*grouping = FLEET_GROUP_HUB;
+	else if (strcmp(name, "controller") == 0)
+		*grouping = FLEET_GROUP_CONTROLLER;
+	else
+		return -1;
+
+	return 0;
+}
+
+std::string fleet_group_key(const char *location, fleet_grouping grouping,
+	const std::string &fallback)
+{
+	if (grouping == FLEET_GROUP_NONE || location == NULL || location[0] == '\0')
+		return fallback;
+
+	std::string path = location;
+
+	//The interface of a composite device, the device itself is one up
+	size_t pos = path.rfind("#USBMI(");
+	if (pos != std::string::npos)
+		path.erase(pos);
+
+	if (grouping == FLEET_GROUP_CONTROLLER) {
+		pos = path.find("#USBROOT(");
+		if (pos != std::string::npos)
+			pos = path.find(')', pos);
+
+		return pos != std::string::npos ? path.substr(0, pos + 1) : path;
+	}
+
+	//The hub is the path minus the port of the device
+	pos = path.rfind("#USB(");
+
+	return pos != std::string::npos ? path.substr(0, pos) : path;
+}
+
+namespace {
+
+struct fleet_device {
+	size_t group;
+	std::thread thread;
+	bool started;
+	// Set by the job thread under the scheduler lock.
+	bool done;
+	bool reaped;
+	uint64_t start_us;
+	uint64_t start_bytes;
+};
+
+struct fleet_group {
+	std::deque<size_t> pending;
+	std::vector<size_t> devices;
+	int running;
+	int cap;
+	int peak;
+	bool saturated;
+	uint64_t last_start_us;
+	uint64_t first_us;
+	uint64_t last_us;
+
+	// Throughput of the running devices is measured from |base_us| on.
+	// Restarted whenever a device starts or ends, and for as long as one
+	// that started has not sent anything yet.
+	uint64_t base_us;
+	uint64_t base_bytes;
+
+	// Device started to see whether the group takes one more, -1 if
+	// none, and the throughput of the group before it started.
+	long probe;
+	double probe_before;
+	int probe_running;
+};
+
+}  // namespace
+
+static uint64_t fleet_device_bytes(const fleet_result &result)
+{
+	return result.transport->Stats().BulkBytes(TransportStats::kOut);
+}
+
+FleetScheduler::FleetScheduler(const fleet_options &options)
+	: options_(options) {}
+
+void FleetScheduler::AddDevice(Transport *transport)
+{
+	fleet_result result;
+
+	result.transport = transport;
+	result.group = fleet_group_key(transport->Location(), options_.grouping,
+		"device " + std::to_string(results_.size() + 1));
+	result.status = 0;
+	result.bytes = 0;
+	result.seconds = 0;
+
+	results_.push_back(result);
+}
+
+int FleetScheduler::Run(fleet_job_func job, void *arg)
+{
+	std::vector<fleet_device> devices(results_.size());
+	std::vector<fleet_group> groups;
+	std::map<std::string, size_t> group_index;
+	std::mutex lock;
+	std::condition_variable done_cv;
+	bool adaptive = options_.group_limit <= 0;
+	uint64_t settle_us = (uint64_t)options_.settle_ms * 1000;
+	uint64_t stagger_us = (uint64_t)options_.stagger_ms * 1000;
+	size_t remaining = results_.size();
+	int failed = 0;
+
+	TRACE_SCOPE("fleet");
+
+	groups_.clear();
+
+	for (size_t i = 0; i < results_.size(); i++) {
+		auto it = group_index.find(results_[i].group);
+
+		if (it == group_index.end()) {
+			fleet_group group = {};
+			group_report report = {};
+
+			group.cap = adaptive ? 1 : options_.group_limit;
+			group.probe = -1;
+			report.key = results_[i].group;
+
+			it = group_index.insert(std::make_pair(results_[i].group, groups.size())).first;
+			groups.push_back(group);
+			groups_.push_back(report);
+		}
+
+		devices[i].group = it->second;
+		devices[i].started = false;
+		devices[i].done = false;
+		devices[i].reaped = false;
+		groups[it->second].pending.push_back(i);
+		groups[it->second].devices.push_back(i);
+	}
+
+	printf("%zu devices in %zu groups\n", results_.size(), groups.size());
+	for (size_t g = 0; g < groups.size(); g++)
+		printf("\tgroup %zu: %zu devices, %s\n", g, groups[g].devices.size(),
+			groups_[g].key.c_str());
+
+	std::unique_lock<std::mutex> guard(lock);
+
+	while (remaining > 0) {
+		uint64_t now_us = TransportStats::NowUs();
+
+		for (size_t g = 0; g < groups.size(); g++) {
+			fleet_group &group = groups[g];
+			uint64_t bytes = 0;
+			bool warming = false;
+			bool changed = false;
+
+			for (size_t i : group.devices) {
+				fleet_device &device = devices[i];
+
+				if (!device.started)
+					continue;
+
+				bytes += fleet_device_bytes(results_[i]);
+
+				if (device.reaped)
+					continue;
+
+				if (device.done) {
+					device.thread.join();
+					device.reaped = true;
+
+					results_[i].bytes = fleet_device_bytes(results_[i]) - device.start_bytes;
+					results_[i].seconds = (now_us - device.start_us) / 1e6;
+					if (results_[i].status < 0)
+						failed++;
+
+					group.running--;
+					group.last_us = now_us;
+					remaining--;
+					changed = true;
+				}
+				else if (fleet_device_bytes(results_[i]) == device.start_bytes) {
+					//Still scanning and hashing, not on the bus yet
+					warming = true;
+				}
+			}
+
+			//A device that ended spoils the measurement, try again later
+			if (changed && group.probe >= 0) {
+				group.cap = std::max(1, group.running);
+				group.probe = -1;
+			}
+
+			if (changed || warming) {
+				group.base_us = now_us;
+				group.base_bytes = bytes;
+			}
+
+			double rate = now_us > group.base_us ?
+				(bytes - group.base_bytes) * 1e6 / (now_us - group.base_us) : 0;
+			bool settled = group.running > 0 && now_us - group.base_us >= settle_us;
+
+			//Judge the last device added once the group has run long enough with it
+			if (group.probe >= 0 && settled) {
+				double share = group.probe_before / group.probe_running;
+
+				if (rate - group.probe_before < options_.min_gain * share) {
+					group.saturated = true;
+					group.cap = group.probe_running;
+					printf("Group %zu saturated: %d devices %.1f MB/s, %d devices %.1f MB/s\n",
+						g, group.probe_running, group.probe_before / (1024 * 1024),
+						group.running, rate / (1024 * 1024));
+				}
+
+				group.probe = -1;
+			}
+
+			if (group.pending.empty() ||
+				(group.last_start_us != 0 && now_us - group.last_start_us < stagger_us))
+				continue;
+
+			//One more than the group has shown to take, to see if it pays
+			if (group.running >= group.cap) {
+				if (!adaptive || group.saturated || group.probe >= 0 || !settled)
+					continue;
+
+				group.probe = (long)group.pending.front();
+				group.probe_before = rate;
+				group.probe_running = group.running;
+				group.cap++;
+			}
+
+			size_t i = group.pending.front();
+			fleet_device &device = devices[i];
+
+			group.pending.pop_front();
+
+			device.started = true;
+			device.start_us = now_us;
+			device.start_bytes = fleet_device_bytes(results_[i]);
+			device.thread = std::thread([&, i]() {
+				int status = job(results_[i].transport, (int)i + 1, arg);
+
+				std::lock_guard<std::mutex> done_guard(lock);
+				results_[i].status = status;
+				devices[i].done = true;
+				done_cv.notify_one();
+			});
+
+			group.running++;
+			group.peak = std::max(group.peak, group.running);
+			group.last_start_us = now_us;
+			if (group.first_us == 0)
+				group.first_us = now_us;
+
+			group.base_us = now_us;
+			group.base_bytes = bytes + device.start_bytes;
+		}
+
+		if (remaining > 0)
+			done_cv.wait_for(guard, std::chrono::milliseconds(FLEET_TICK_MS));
+	}
+
+	for (size_t g = 0; g < groups.size(); g++) {
+		groups_[g].devices = (int)groups[g].devices.size();
+		groups_[g].peak = groups[g].peak;
+		groups_[g].saturated = groups[g].saturated;
+		groups_[g].seconds = (groups[g].last_us - groups[g].first_us) / 1e6;
+		for (size_t i : groups[g].devices)
+			groups_[g].bytes += results_[i].bytes;
+	}
+
+	return failed;
+}
+
+void FleetScheduler::PrintReport(FILE *fp) const
+{
+	uint64_t total_bytes = 0;
+	double total_seconds = 0;
+
+	fprintf(fp, "\n%-6s %-8s %-6s %-10s %10s %10s  %s\n",
+		"group", "devices", "peak", "saturated", "MB", "MB/s", "location");
+
+	for (size_t g = 0; g < groups_.size(); g++) {
+		const group_report &group = groups_[g];
+
+		fprintf(fp, "%-6zu %-8d %-6d %-10s %10.1f %10.1f  %s\n", g, group.devices, group.peak,
+			group.saturated ? "yes" : "no", group.bytes / (1024.0 * 1024),
+			group.seconds > 0 ? group.bytes / (1024.0 * 1024) / group.seconds : 0,
+			group.key.c_str());
+
+		total_bytes += group.bytes;
+		total_seconds = std::max(total_seconds, group.seconds);
+	}
+
+	fprintf(fp, "\n%-6s %-20s %-8s %10s %10s %10s\n",
+		"device", "serial", "status", "MB", "seconds", "MB/s");
+
+	for (size_t i = 0; i < results_.size(); i++) {
+		const fleet_result &result = results_[i];
+
+		fprintf(fp, "%-6zu %-20s %-8d %10.1f %10.1f %10.1f\n", i + 1, result.transport->Serial(),
+			result.status, result.bytes / (1024.0 * 1024), result.seconds,
+			result.seconds > 0 ? result.bytes / (1024.0 * 1024) / result.seconds : 0);
+	}
+
+	fprintf(fp, "\nfleet: %.1f MB in %.1f s, %.1f MB/s\n", total_bytes / (1024.0 * 1024),
+		total_seconds, total_seconds > 0 ? total_bytes / (1024.0 * 1024) / total_seconds : 0);
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#ifndef FLEET_H_
+#define FLEET_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <string>
+#include <vector>
+
+#include "transport.h"
+
+// What devices are assumed to share bandwidth.
+enum fleet_grouping {
+	// Every device is on its own.
+	FLEET_GROUP_NONE = 0,
+	// Devices behind the same hub share its upstream port.
+	FLEET_GROUP_HUB = 1,
+	// Devices on the same host controller share its root hub.
+	FLEET_GROUP_CONTROLLER = 2,
+};
+
+// Parses "none", "hub" or "controller". Returns 0 or -1.
+int fleet_grouping_parse(const char *name, fleet_grouping *grouping);
+
+// Group a device at Transport::Location() |location| falls in. Devices
+// with an unknown location are never grouped with anything; |fallback|,
+// unique per device, names their group.
+std::string fleet_group_key(const char *location, fleet_grouping grouping,
+	const std::string &fallback);
+
+#define FLEET_DEFAULT_SETTLE_MS 3000
+#define FLEET_DEFAULT_MIN_GAIN 0.5
+#define FLEET_DEFAULT_STAGGER_MS 500
+
+struct fleet_options {
+	fleet_grouping grouping;
+	// Devices of a group transferring at once, 0 to find the limit by
+	// measuring the group throughput.
+	int group_limit;
+	// How long the throughput of a group is measured after a device
+	// starts sending.
+	int settle_ms;
+	// Fraction of the average per device throughput an extra device must
+	// add to its group for the group not to count as saturated.
+	double min_gain;
+	// Least time between two devices of one group starting.
+	int stagger_ms;
+};
+
+// Updates the device |transport|, the |device_id|th of the fleet, from 1.
+// Runs on a thread of its own. Returns the number of images transferred,
+// or < 0 on error.
+typedef int (*fleet_job_func)(Transport *transport, int device_id, void *arg);
+
+struct fleet_result {
+	Transport *transport;
+	std::string group;
+	int status;
+	// Bulk OUT bytes and wall time of the job.
+	uint64_t bytes;
+	double seconds;
+};
+
+// Runs one job per device, as many at once as the bus takes.
+//
+// Devices are grouped by where they hang in the USB topology. In each
+// group devices start one at a time, |stagger_ms| apart. With a fixed
+// |group_limit| that is all; otherwise a group starts with one device and
+// takes one more each time the last one raised the group throughput by
+// at least |min_gain| of a device's share. Once an extra device stops
+// paying off, the group is saturated and keeps the number of devices it
+// had before. Groups run independently, so idle root ports fill up while
+// a shared hub is held back.
+class FleetScheduler {
+public:
+	explicit FleetScheduler(const fleet_options &options);
+
+	void AddDevice(Transport *transport);
+
+	// Runs |job| on every device and waits for all of them. Returns the
+	// number of devices whose job failed.
+	int Run(fleet_job_func job, void *arg);
+
+	const std::vector<fleet_result> &Results() const { return results_; }
+
+	// Prints the throughput of every group and device.
+	void PrintReport(FILE *fp) const;
+
+	FleetScheduler(const FleetScheduler&) = delete;
+	void operator=(const FleetScheduler&) = delete;
+
+private:
+	struct group_report {
+		std::string key;
+		int devices;
+		// Most devices that ran at once.
+		int peak;
+		bool saturated;
+		uint64_t bytes;
+		double seconds;
+	};
+
+	fleet_options options_;
+	std::vector<fleet_result> results_;
+	std::vector<group_report> groups_;
+};
+
+#endif  // FLEET_H_
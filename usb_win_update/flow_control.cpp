@@ -0,0 +1,147 @@
+#include "stdafx.h"
+
+#include <stdio.h>
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+#include "flow_control.h"
+#include "trace.h"
+
+// Without new credits for this long the device is considered gone, like a
+// timed out bulk write.
+#define CREDIT_TIMEOUT_MS 5000
+#define CREDIT_POLL_MAX_DELAY_MS 4
+
+// Pieces of a split block are cut on packet boundaries when possible.
+#define CREDIT_ALIGNMENT 512
+
+CreditSender::CreditSender(Transport* transport, credit_query_func query)
+	: transport_(transport), pool_(transport->Buffers()), query_(query), sent_(0), limit_(0),
+	blocks_in_flight_(0), failed_(false), stalls_(0), stall_us_(0) {
+	max_blocks_ = std::max(1, pool_->BlockCount() / 2);
+}
+
+CreditSender::~CreditSender() {
+	Flush();
+}
+
+bool CreditSender::FinishOne(bool wait) {
+	const void* data;
+	ssize_t ret = transport_->FinishWrite(&data, wait);
+
+	// Pieces are never empty, so 0 means still in progress.
+	if (ret == 0)
+		return false;
+
+	piece p = pieces_.front();
+	pieces_.pop_front();
+
+	if (ret < 0)
+		failed_ = true;
+
+	if (p.last) {
+		pool_->Release(p.block);
+		blocks_in_flight_--;
+	}
+
+	return true;
+}
+
+int CreditSender::WaitForCredits() {
+	uint64_t start_us = TransportStats::NowUs();
+	int delay_ms = 0;
+
+	// The first grant of an image is not a stall.
+	bool stalled = sent_ > 0;
+
+	TraceScope trace("credit_wait");
+
+	for (;;) {
+		uint64_t limit = 0;
+
+		if (query_(transport_, &limit) < 0) {
+			fprintf(stderr, "Failed to read the credits\n");
+			return -1;
+		}
+
+		// Grants only move forward; an older answer must not shrink them.
+		if (limit > limit_)
+			limit_ = limit;
+		if (limit_ > sent_)
+			break;
+
+		// Completed writes give their blocks back meanwhile.
+		while (!pieces_.empty() && FinishOne(false))
+			;
+
+		if (TransportStats::NowUs() - start_us > CREDIT_TIMEOUT_MS * 1000ULL) {
+			fprintf(stderr, "No credits from the device in %d ms, %llu bytes sent\n",
+				CREDIT_TIMEOUT_MS, (unsigned long long)sent_);
+			return -1;
+		}
+
+		std::this_thread::sleep_for(std::chrono::milliseconds(delay_ms));
+		delay_ms = std::min(delay_ms * 2 + 1, CREDIT_POLL_MAX_DELAY_MS);
+	}
+
+	if (stalled) {
+		stalls_++;
+		stall_us_ += TransportStats::NowUs() - start_us;
+	}
+
+	return 0;
+}
+
+int CreditSender::Send(char* block, size_t len) {
+	size_t offset = 0;
+
+	while (offset < len && !failed_) {
+		if (sent_ >= limit_ && WaitForCredits() < 0) {
+			failed_ = true;
+			break;
+		}
+
+		size_t chunk = (size_t)std::min<uint64_t>(len - offset, limit_ - sent_);
+
+		if (offset + chunk < len && chunk >= CREDIT_ALIGNMENT)
+			chunk -= chunk % CREDIT_ALIGNMENT;
+
+		piece p;
+
+		p.block = block;
+		p.last = offset + chunk == len;
+
+		if (offset == 0)
+			blocks_in_flight_++;
+
+		if (transport_->WriteAsync(block + offset, chunk) < 0)
+			failed_ = true;
+
+		pieces_.push_back(p);
+		sent_ += chunk;
+		offset += chunk;
+	}
+
+	if (offset < len) {
+		// The rest of the block will never be queued; release it with the
+		// last piece that was, or now if there was none.
+		if (offset > 0)
+			pieces_.back().last = true;
+		else
+			pool_->Release(block);
+	}
+
+	while (blocks_in_flight_ >= max_blocks_ && !pieces_.empty())
+		FinishOne(true);
+
+	return failed_ ? -1 : 0;
+}
+
+int CreditSender::Flush() {
+	while (!pieces_.empty())
+		FinishOne(true);
+
+	return failed_ ? -1 : 0;
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#ifndef FLOW_CONTROL_H_
+#define FLOW_CONTROL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <deque>
+
+#include "transport.h"
+
+// Asks the device how far into the current image it can take data, as a
+// cumulative byte count. Returns 0, or -1 on error.
+typedef int (*credit_query_func)(Transport* transport, uint64_t* limit);
+
+// Credit-based flow control for the bulk data of one image.
+//
+// The device grants credits as a byte offset into the image: everything
+// below it fits in its receive buffers. The sender keeps writes queued on
+// the pipe right up to that offset instead of waiting for each one, and
+// only asks for fresh credits once it gets there. A slow flash then shows
+// up as a later grant rather than a stalled or NAKed bulk transfer, and
+// a fast one never leaves the bus idle between blocks.
+//
+// At most half of the pool is kept in flight, fewer than that between
+// Send() calls, so a reader waiting for a block while none of its own are
+// in flight always gets one. Readers only read ahead into free blocks.
+class CreditSender {
+public:
+	CreditSender(Transport* transport, credit_query_func query);
+	~CreditSender();
+
+	// Queues |len| bytes of the pool block |block|, waiting for credits as
+	// needed. The block goes back to the pool once written, also on error.
+	// Returns 0 or -1.
+	int Send(char* block, size_t len);
+
+	// Waits for every queued write. Returns 0, or -1 if any failed.
+	int Flush();
+
+	uint64_t Sent() const { return sent_; }
+
+	// Times the sender ran out of credits, and how long it waited for more.
+	int Stalls() const { return stalls_; }
+	uint64_t StallUs() const { return stall_us_; }
+
+	CreditSender(const CreditSender&) = delete;
+	void operator=(const CreditSender&) = delete;
+
+private:
+	// One WriteAsync() call; a block is split when credits run out in it.
+	struct piece {
+		char* block;
+		bool last;
+	};
+
+	int WaitForCredits();
+	// Collects the oldest piece, waiting for it if |wait|. Returns false
+	// if it has not completed yet.
+	bool FinishOne(bool wait);
+
+	Transport* transport_;
+	BufferPool* pool_;
+	credit_query_func query_;
+
+	uint64_t sent_;
+	uint64_t limit_;
+
+	std::deque<piece> pieces_;
+	int blocks_in_flight_;
+	int max_blocks_;
+	bool failed_;
+
+	int stalls_;
+	uint64_t stall_us_;
+};
+
+#endif  // FLOW_CONTROL_H_
@@ -0,0 +1,303 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include <deque>
+#include <vector>
+
+#include "image_reader.h"
+
+#if !defined(_WIN32)
+static int fopen_s(FILE** fp, const char* fileName, const char* mode) {
+	*fp = fopen(fileName, mode);
+	return *fp ? 0 : errno;
+}
+#endif
+
+/// Buffered reader for small files.
+class StdioImageReader : public ImageReader {
+public:
+	StdioImageReader(FILE* fp, int64_t size, BufferPool* pool) : fp_(fp), size_(size), pool_(pool) {}
+	~StdioImageReader() override { fclose(fp_); }
+
+	int64_t Size() const override { return size_; }
+	ssize_t ReadBlock(char** block) override;
+	const char* Kind() const override { return "stdio"; }
+
+private:
+	FILE* fp_;
+	int64_t size_;
+	BufferPool* pool_;
+};
+
+ssize_t StdioImageReader::ReadBlock(char** block) {
+	char* buf = (char*)pool_->Acquire();
+
+	if (buf == NULL)
+		return -1;
+
+	size_t read_len = fread(buf, sizeof(char), pool_->BlockSize(), fp_);
+	if (read_len == 0) {
+		pool_->Release(buf);
+		return ferror(fp_) ? -1 : 0;
+	}
+
+	*block = buf;
+	return read_len;
+}
+
+#if defined(_WIN32)
+
+/// Unbuffered reader keeping several overlapped reads in flight. Pool
+/// blocks are page aligned and a multiple of the page size, which satisfies
+/// the sector alignment FILE_FLAG_NO_BUFFERING requires on every disk we
+/// care about. The tail of the file is read with a full-block request and
+/// comes back short. Reads ahead only go into blocks that are free: the
+/// caller's writes may hold the rest of the pool, and only the caller can
+/// give them back.
+class DirectImageReader : public ImageReader {
+public:
+	DirectImageReader(HANDLE file, int64_t size, BufferPool* pool, int depth);
+	~DirectImageReader() override;
+
+	int64_t Size() const override { return size_; }
+	ssize_t ReadBlock(char** block) override;
+	const char* Kind() const override { return "direct"; }
+
+private:
+	struct read_request {
+		OVERLAPPED ovl;
+		char* block;
+	};
+
+	bool Issue(bool wait);
+
+	HANDLE file_;
+	int64_t size_;
+	int64_t next_offset_;
+	BufferPool* pool_;
+	bool failed_;
+
+	std::vector<read_request> requests_;
+	std::deque<read_request*> idle_;
+	std::deque<read_request*> in_flight_;
+};
+
+DirectImageReader::DirectImageReader(HANDLE file, int64_t size, BufferPool* pool, int depth)
+	: file_(file), size_(size), next_offset_(0), pool_(pool), failed_(false), requests_(depth) {
+	for (auto& request : requests_) {
+		memset(&request.ovl, 0, sizeof(request.ovl));
+		request.ovl.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+		request.block = NULL;
+		idle_.push_back(&request);
+	}
+
+	while (!idle_.empty() && next_offset_ < size_ && Issue(false))
+		;
+}
+
+DirectImageReader::~DirectImageReader() {
+	if (!in_flight_.empty()) {
+		CancelIo(file_);
+		for (read_request* request : in_flight_) {
+			unsigned long read_len;
+
+			GetOverlappedResult(file_, &request->ovl, &read_len, TRUE);
+			pool_->Release(request->block);
+		}
+	}
+
+	for (auto& request : requests_) {
+		if (request.ovl.hEvent != NULL)
+			CloseHandle(request.ovl.hEvent);
+	}
+
+	CloseHandle(file_);
+}
+
+// Starts the read of the next block. Without |wait| it gives up when the
+// pool has no free block.
+bool DirectImageReader::Issue(bool wait) {
+	read_request* request = idle_.front();
+
+	request->block = (char*)(wait ? pool_->Acquire() : pool_->TryAcquire());
+	if (request->block == NULL) {
+		failed_ = failed_ || wait;
+		return false;
+	}
+
+	ResetEvent(request->ovl.hEvent);
+	request->ovl.Offset = (unsigned long)(next_offset_ & 0xFFFFFFFF);
+	request->ovl.OffsetHigh = (unsigned long)(next_offset_ >> 32);
+
+	if (!ReadFile(file_, request->block, (unsigned long)pool_->BlockSize(), NULL, &request->ovl)) {
+		unsigned long error = GetLastError();
+
+		if (error != ERROR_IO_PENDING) {
+			fprintf(stderr, "ReadFile at %lld failed, error: %lu\n", next_offset_, error);
+			pool_->Release(request->block);
+			request->block = NULL;
+			failed_ = true;
+			return false;
+		}
+	}
+
+	idle_.pop_front();
+	in_flight_.push_back(request);
+	next_offset_ += pool_->BlockSize();
+
+	return true;
+}
+
+ssize_t DirectImageReader::ReadBlock(char** block) {
+	// Nothing read ahead, the pool was empty; whatever the caller holds
+	// leaves a block for this one.
+	if (in_flight_.empty() && !failed_ && next_offset_ < size_)
+		Issue(true);
+
+	if (in_flight_.empty())
+		return failed_ ? -1 : 0;
+
+	read_request* request = in_flight_.front();
+	unsigned long read_len = 0;
+
+	in_flight_.pop_front();
+
+	bool ok = GetOverlappedResult(file_, &request->ovl, &read_len, TRUE) != FALSE;
+	if (!ok && GetLastError() != ERROR_HANDLE_EOF) {
+		fprintf(stderr, "Overlapped read failed, error: %lu\n", GetLastError());
+		failed_ = true;
+	}
+
+	char* buf = request->block;
+	request->block = NULL;
+	idle_.push_back(request);
+
+	if (failed_ || read_len == 0) {
+		pool_->Release(buf);
+		return failed_ ? -1 : 0;
+	}
+
+	// Keep the queue as full as the free blocks allow before handing the
+	// block out.
+	while (!idle_.empty() && next_offset_ < size_ && Issue(false))
+		;
+
+	*block = buf;
+	return read_len;
+}
+
+static ImageReader* direct_image_reader_open(const char* fileName, int64_t size, BufferPool* pool) {
+	// The caller holds one block while the reader refills the others.
+	int depth = pool->BlockCount() - 1;
+	if (depth > IMAGE_READER_DIRECT_DEPTH)
+		depth = IMAGE_READER_DIRECT_DEPTH;
+	if (depth < 1)
+		return NULL;
+
+	HANDLE file = CreateFileA(fileName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+		FILE_FLAG_NO_BUFFERING | FILE_FLAG_OVERLAPPED | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+
+	if (file == INVALID_HANDLE_VALUE) {
+		fprintf(stderr, "Unbuffered open of %s failed, error: %lu\n", fileName, GetLastError());
+		return NULL;
+	}
+
+	return new DirectImageReader(file, size, pool, depth);
+}
+
+#else
+
+/// O_DIRECT reader. Reads are issued one at a time; the transport still
+/// overlaps them with the bulk writes of the previous block.
+class DirectImageReader : public ImageReader {
+public:
+	DirectImageReader(int fd, int64_t size, BufferPool* pool)
+		: fd_(fd), size_(size), offset_(0), pool_(pool) {}
+	~DirectImageReader() override { close(fd_); }
+
+	int64_t Size() const override { return size_; }
+	ssize_t ReadBlock(char** block) override;
+	const char* Kind() const override { return "direct"; }
+
+private:
+	int fd_;
+	int64_t size_;
+	int64_t offset_;
+	BufferPool* pool_;
+};
+
+ssize_t DirectImageReader::ReadBlock(char** block) {
+	if (offset_ >= size_)
+		return 0;
+
+	char* buf = (char*)pool_->Acquire();
+	if (buf == NULL)
+		return -1;
+
+	ssize_t read_len = pread(fd_, buf, pool_->BlockSize(), offset_);
+	if (read_len <= 0) {
+		pool_->Release(buf);
+		return read_len < 0 ? -1 : 0;
+	}
+
+	offset_ += read_len;
+	*block = buf;
+	return read_len;
+}
+
+static ImageReader* direct_image_reader_open(const char* fileName, int64_t size, BufferPool* pool) {
+	int fd = open(fileName, O_RDONLY | O_DIRECT);
+
+	if (fd < 0) {
+		fprintf(stderr, "Unbuffered open of %s failed, errno: %d\n", fileName, errno);
+		return NULL;
+	}
+
+	return new DirectImageReader(fd, size, pool);
+}
+
+#endif
+
+ImageReader* image_reader_open(const char* fileName, BufferPool* pool, int64_t direct_threshold) {
+	int64_t size;
+
+#if defined(_WIN32)
+	struct _stat64 st;
+	if (_stat64(fileName, &st) != 0)
+		return NULL;
+#else
+	struct stat st;
+	if (stat(fileName, &st) != 0)
+		return NULL;
+#endif
+	size = st.st_size;
+
+	if (pool == NULL || !pool->IsValid())
+		return NULL;
+
+	if (direct_threshold >= 0 && size >= direct_threshold) {
+		ImageReader* reader = direct_image_reader_open(fileName, size, pool);
+		if (reader != NULL)
+			return reader;
+		// Fall back to the buffered path, e.g. on file systems without
+		// unbuffered I/O support.
+	}
+
+	FILE* fp;
+
+	fopen_s(&fp, fileName, "rb");
+	if (fp == NULL)
+		return NULL;
+
+	return new StdioImageReader(fp, size, pool);
+}
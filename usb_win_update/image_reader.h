@@ -0,0 +1,48 @@
+#pragma once
+
+#ifndef IMAGE_READER_H_
+#define IMAGE_READER_H_
+
+#include <stdint.h>
+
+#include "transport.h"
+
+// Source of the bytes of one image for polySendImageFile().
+//
+// Readers fill blocks of the transport's BufferPool in place, so the block
+// handed back by ReadBlock() can be written to the pipe as is. The caller
+// owns the returned block and gives it back with BufferPool::Release().
+class ImageReader {
+public:
+	ImageReader() = default;
+	virtual ~ImageReader() = default;
+
+	// Size of the whole image in bytes.
+	virtual int64_t Size() const = 0;
+
+	// Stores the next block of the image in |block| and returns its length,
+	// 0 at the end of the image or -1 on error.
+	virtual ssize_t ReadBlock(char** block) = 0;
+
+	// Short description of the reader for logs.
+	virtual const char* Kind() const = 0;
+
+	ImageReader(const ImageReader&) = delete;
+	void operator=(const ImageReader&) = delete;
+};
+
+// Default size from which image_reader_open() bypasses the page cache.
+#define IMAGE_READER_DIRECT_THRESHOLD (64LL * 1024 * 1024)
+
+// Number of reads an unbuffered reader keeps in flight.
+#define IMAGE_READER_DIRECT_DEPTH 4
+
+// Opens |fileName| for reading into blocks of |pool|. Files of at least
+// |direct_threshold| bytes are read unbuffered (FILE_FLAG_NO_BUFFERING with
+// overlapped reads on Windows, O_DIRECT elsewhere) so multi-GB images do
+// not evict everything else from the page cache; smaller files, or all
+// files when |direct_threshold| is negative, go through stdio. Returns
+// NULL if the file cannot be opened.
+ImageReader* image_reader_open(const char* fileName, BufferPool* pool, int64_t direct_threshold);
+
+#endif  // IMAGE_READER_H_
@@ -0,0 +1,189 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#endif
+
+#include <deque>
+#include <vector>
+
+#include "image_writer.h"
+
+#if defined(_WIN32)
+
+/// Writer keeping several overlapped writes in flight. Writes complete in
+/// any order on the disk but are collected oldest first, which is enough
+/// to hand the blocks back in time.
+class OverlappedImageWriter : public ImageWriter {
+public:
+	OverlappedImageWriter(HANDLE file, BufferPool* pool, int depth);
+	~OverlappedImageWriter() override;
+
+	int WriteBlock(char* block, size_t len) override;
+	int Finish() override;
+	const char* Kind() const override { return "overlapped"; }
+
+private:
+	struct write_request {
+		OVERLAPPED ovl;
+		char* block;
+		unsigned long len;
+	};
+
+	bool Complete();
+
+	HANDLE file_;
+	BufferPool* pool_;
+	int64_t next_offset_;
+	bool failed_;
+
+	std::vector<write_request> requests_;
+	std::deque<write_request*> idle_;
+	std::deque<write_request*> in_flight_;
+};
+
+OverlappedImageWriter::OverlappedImageWriter(HANDLE file, BufferPool* pool, int depth)
+	: file_(file), pool_(pool), next_offset_(0), failed_(false), requests_(depth) {
+	for (auto& request : requests_) {
+		memset(&request.ovl, 0, sizeof(request.ovl));
+		request.ovl.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+		request.block = NULL;
+		idle_.push_back(&request);
+	}
+}
+
+OverlappedImageWriter::~OverlappedImageWriter() {
+	Finish();
+
+	for (auto& request : requests_) {
+		if (request.ovl.hEvent != NULL)
+			CloseHandle(request.ovl.hEvent);
+	}
+
+	CloseHandle(file_);
+}
+
+bool OverlappedImageWriter::Complete() {
+	write_request* request = in_flight_.front();
+	unsigned long written = 0;
+
+	in_flight_.pop_front();
+
+	if (!GetOverlappedResult(file_, &request->ovl, &written, TRUE) || written != request->len) {
+		fprintf(stderr, "Overlapped write failed, error: %lu\n", GetLastError());
+		failed_ = true;
+	}
+
+	pool_->Release(request->block);
+	request->block = NULL;
+	idle_.push_back(request);
+
+	return !failed_;
+}
+
+int OverlappedImageWriter::WriteBlock(char* block, size_t len) {
+	if (idle_.empty())
+		Complete();
+
+	if (failed_) {
+		pool_->Release(block);
+		return -1;
+	}
+
+	write_request* request = idle_.front();
+
+	ResetEvent(request->ovl.hEvent);
+	request->ovl.Offset = (unsigned long)(next_offset_ & 0xFFFFFFFF);
+	request->ovl.OffsetHigh = (unsigned long)(next_offset_ >> 32);
+	request->block = block;
+	request->len = (unsigned long)len;
+
+	if (!WriteFile(file_, block, (unsigned long)len, NULL, &request->ovl)) {
+		unsigned long error = GetLastError();
+
+		if (error != ERROR_IO_PENDING) {
+			fprintf(stderr, "WriteFile at %lld failed, error: %lu\n", next_offset_, error);
+			pool_->Release(block);
+			request->block = NULL;
+			failed_ = true;
+			return -1;
+		}
+	}
+
+	idle_.pop_front();
+	in_flight_.push_back(request);
+	next_offset_ += len;
+
+	return 0;
+}
+
+int OverlappedImageWriter::Finish() {
+	while (!in_flight_.empty())
+		Complete();
+
+	return failed_ ? -1 : 0;
+}
+
+ImageWriter* image_writer_open(const char* fileName, BufferPool* pool, int depth) {
+	if (depth < 1)
+		depth = 1;
+
+	HANDLE file = CreateFileA(fileName, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+		FILE_FLAG_OVERLAPPED | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return NULL;
+
+	return new OverlappedImageWriter(file, pool, depth);
+}
+
+#else
+
+static int fopen_s(FILE** fp, const char* fileName, const char* mode) {
+	*fp = fopen(fileName, mode);
+	return *fp ? 0 : errno;
+}
+
+/// Buffered writer, one fwrite() per block.
+class StdioImageWriter : public ImageWriter {
+public:
+	StdioImageWriter(FILE* fp, BufferPool* pool) : fp_(fp), pool_(pool), failed_(false) {}
+	~StdioImageWriter() override { fclose(fp_); }
+
+	int WriteBlock(char* block, size_t len) override;
+	int Finish() override;
+	const char* Kind() const override { return "stdio"; }
+
+private:
+	FILE* fp_;
+	BufferPool* pool_;
+	bool failed_;
+};
+
+int StdioImageWriter::WriteBlock(char* block, size_t len) {
+	if (!failed_ && fwrite(block, 1, len, fp_) != len)
+		failed_ = true;
+
+	pool_->Release(block);
+	return failed_ ? -1 : 0;
+}
+
+int StdioImageWriter::Finish() {
+	if (fflush(fp_) != 0)
+		failed_ = true;
+
+	return failed_ ? -1 : 0;
+}
+
+ImageWriter* image_writer_open(const char* fileName, BufferPool* pool, int depth) {
+	FILE* fp;
+
+	fopen_s(&fp, fileName, "wb");
+	if (fp == NULL)
+		return NULL;
+
+	return new StdioImageWriter(fp, pool);
+}
+
+#endif
@@ -0,0 +1,45 @@
+#pragma once
+
+#ifndef IMAGE_WRITER_H_
+#define IMAGE_WRITER_H_
+
+#include <stdint.h>
+
+#include "transport.h"
+
+// Host side sink of data pulled from the device, the counterpart of
+// ImageReader.
+//
+// Blocks of the transport's BufferPool are handed over as they come off
+// the pipe and go back to the pool once they are on disk, so the data is
+// never copied on the host.
+class ImageWriter {
+public:
+	ImageWriter() = default;
+	virtual ~ImageWriter() = default;
+
+	// Appends |len| bytes of the pool block |block|. The writer releases
+	// the block, also on error. Returns 0 or -1.
+	virtual int WriteBlock(char* block, size_t len) = 0;
+
+	// Waits until everything is written. Returns 0, or -1 if any write
+	// failed.
+	virtual int Finish() = 0;
+
+	// Short description of the writer for logs.
+	virtual const char* Kind() const = 0;
+
+	ImageWriter(const ImageWriter&) = delete;
+	void operator=(const ImageWriter&) = delete;
+};
+
+// Default number of writes an overlapped writer keeps in flight.
+#define IMAGE_WRITER_DEPTH 4
+
+// Creates or truncates |fileName| for writing blocks of |pool|. On Windows
+// up to |depth| overlapped writes are in flight, so the disk works while
+// the next blocks arrive; elsewhere writes go through stdio. Returns NULL
+// if the file cannot be created.
+ImageWriter* image_writer_open(const char* fileName, BufferPool* pool, int depth);
+
+#endif  // IMAGE_WRITER_H_
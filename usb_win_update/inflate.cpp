@@ -0,0 +1,366 @@
+#include <string.h>
+
+#include "inflate.h"
+
+#define INFLATE_INPUT_SIZE (64 * 1024)
+#define INFLATE_WINDOW_SIZE 32768
+#define INFLATE_MAX_BITS 15
+
+static const uint16_t length_base[29] = {
+	3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+	35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const uint8_t length_extra[29] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+	3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const uint16_t dist_base[30] = {
+	1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+	257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+	8193, 12289, 16385, 24577 };
+static const uint8_t dist_extra[30] = {
+	0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+	7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+
+Inflater::Inflater(InputFunc input, OutputFunc output)
+	: input_(input), output_(output), in_buf_(INFLATE_INPUT_SIZE), in_pos_(0), in_len_(0),
+	in_eof_(false), bit_buf_(0), bit_cnt_(0), window_(INFLATE_WINDOW_SIZE), window_pos_(0),
+	out_(NULL), out_len_(0), out_pos_(0), total_out_(0), aborted_(false) {
+	unsigned char lengths[288];
+	int sym;
+
+	for (sym = 0; sym < 144; sym++)
+		lengths[sym] = 8;
+	for (; sym < 256; sym++)
+		lengths[sym] = 9;
+	for (; sym < 280; sym++)
+		lengths[sym] = 7;
+	for (; sym < 288; sym++)
+		lengths[sym] = 8;
+	BuildHuffman(&fixed_len_, lengths, 288);
+
+	for (sym = 0; sym < 30; sym++)
+		lengths[sym] = 5;
+	BuildHuffman(&fixed_dist_, lengths, 30);
+}
+
+bool Inflater::Need(int bits) {
+	while (bit_cnt_ < bits) {
+		if (in_pos_ == in_len_) {
+			if (in_eof_)
+				return false;
+
+			in_len_ = input_(&in_buf_[0], in_buf_.size());
+			in_pos_ = 0;
+			if (in_len_ == 0) {
+				in_eof_ = true;
+				return false;
+			}
+		}
+
+		bit_buf_ |= (uint64_t)in_buf_[in_pos_++] << bit_cnt_;
+		bit_cnt_ += 8;
+	}
+
+	return true;
+}
+
+uint32_t Inflater::Bits(int bits) {
+	if (!Need(bits))
+		return (uint32_t)-1;
+
+	uint32_t value = (uint32_t)(bit_buf_ & ((1u << bits) - 1));
+
+	bit_buf_ >>= bits;
+	bit_cnt_ -= bits;
+
+	return value;
+}
+
+bool Inflater::PutByte(unsigned char c) {
+	window_[window_pos_++ & (INFLATE_WINDOW_SIZE - 1)] = c;
+	out_[out_pos_++] = c;
+	total_out_++;
+
+	if (out_pos_ == out_len_) {
+		out_ = output_(out_, out_pos_, false, &out_len_);
+		out_pos_ = 0;
+		if (out_ == NULL || out_len_ == 0) {
+			aborted_ = true;
+			return false;
+		}
+	}
+
+	return true;
+}
+
+int Inflater::BuildHuffman(huffman* h, const unsigned char* lengths, int count) {
+	int bl_count[INFLATE_MAX_BITS + 1] = { 0 };
+	int next_code[INFLATE_MAX_BITS + 1];
+	int max_bits = 1;
+
+	for (int sym = 0; sym < count; sym++) {
+		bl_count[lengths[sym]]++;
+		if (lengths[sym] > max_bits)
+			max_bits = lengths[sym];
+	}
+	bl_count[0] = 0;
+
+	// Reject over-subscribed codes; incomplete ones are legal (a single
+	// distance code, for instance) and simply leave table holes.
+	int left = 1;
+	for (int len = 1; len <= INFLATE_MAX_BITS; len++) {
+		left <<= 1;
+		left -= bl_count[len];
+		if (left < 0)
+			return -1;
+	}
+
+	int code = 0;
+	for (int len = 1; len <= INFLATE_MAX_BITS; len++) {
+		code = (code + bl_count[len - 1]) << 1;
+		next_code[len] = code;
+	}
+
+	h->bits = max_bits;
+	h->table.assign((size_t)1 << max_bits, 0);
+
+	for (int sym = 0; sym < count; sym++) {
+		int len = lengths[sym];
+
+		if (len == 0)
+			continue;
+
+		// Codes are sent MSB first but read LSB first; index by the reversed code.
+		int c = next_code[len]++;
+		int reversed = 0;
+		for (int i = 0; i < len; i++) {
+			reversed = (reversed << 1) | (c & 1);
+			c >>= 1;
+		}
+
+		for (size_t i = reversed; i < h->table.size(); i += (size_t)1 << len)
+			h->table[i] = (uint16_t)((sym << 4) | len);
+	}
+
+	return 0;
+}
+
+int Inflater::Decode(const huffman* h) {
+	// Near the end of the stream fewer bits than the table width may be
+	// left; missing bits read as zero and the code length is checked below.
+	Need(h->bits);
+
+	uint16_t entry = h->table[(size_t)(bit_buf_ & ((1u << h->bits) - 1))];
+	int len = entry & 15;
+
+	if (len == 0)
+		return -1;
+	if (len > bit_cnt_)
+		return -2;
+
+	bit_buf_ >>= len;
+	bit_cnt_ -= len;
+
+	return entry >> 4;
+}
+
+int Inflater::Stored() {
+	// Skip to the byte boundary.
+	bit_buf_ >>= bit_cnt_ & 7;
+	bit_cnt_ -= bit_cnt_ & 7;
+
+	uint32_t len = Bits(16);
+	uint32_t nlen = Bits(16);
+
+	if (len == (uint32_t)-1 || nlen == (uint32_t)-1)
+		return -2;
+	if (len != (~nlen & 0xffff))
+		return -1;
+
+	while (len > 0) {
+		uint32_t c = Bits(8);
+
+		if (c == (uint32_t)-1)
+			return -2;
+		if (!PutByte((unsigned char)c))
+			return -3;
+		len--;
+	}
+
+	return 0;
+}
+
+int Inflater::Codes(const huffman* lencode, const huffman* distcode) {
+	for (;;) {
+		int sym = Decode(lencode);
+
+		if (sym < 0)
+			return sym;
+
+		if (sym < 256) {
+			if (!PutByte((unsigned char)sym))
+				return -3;
+			continue;
+		}
+
+		if (sym == 256)
+			return 0;
+
+		sym -= 257;
+		if (sym >= 29)
+			return -1;
+
+		uint32_t extra = Bits(length_extra[sym]);
+		if (extra == (uint32_t)-1)
+			return -2;
+		uint32_t len = length_base[sym] + extra;
+
+		int dsym = Decode(distcode);
+		if (dsym < 0)
+			return dsym;
+		if (dsym >= 30)
+			return -1;
+
+		extra = Bits(dist_extra[dsym]);
+		if (extra == (uint32_t)-1)
+			return -2;
+		uint32_t dist = dist_base[dsym] + extra;
+
+		if (dist > total_out_)
+			return -1;
+
+		while (len--) {
+			if (!PutByte(window_[(window_pos_ - dist) & (INFLATE_WINDOW_SIZE - 1)]))
+				return -3;
+		}
+	}
+}
+
+int Inflater::Fixed() {
+	return Codes(&fixed_len_, &fixed_dist_);
+}
+
+int Inflater::Dynamic() {
+	static const uint8_t order[19] = {
+		16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+	unsigned char lengths[320];
+
+	uint32_t nlen = Bits(5);
+	uint32_t ndist = Bits(5);
+	uint32_t ncode = Bits(4);
+
+	if (nlen == (uint32_t)-1 || ndist == (uint32_t)-1 || ncode == (uint32_t)-1)
+		return -2;
+
+	nlen += 257;
+	ndist += 1;
+	ncode += 4;
+	if (nlen > 286 || ndist > 30)
+		return -1;
+
+	memset(lengths, 0, sizeof(lengths));
+	for (uint32_t i = 0; i < ncode; i++) {
+		uint32_t len = Bits(3);
+
+		if (len == (uint32_t)-1)
+			return -2;
+		lengths[order[i]] = (unsigned char)len;
+	}
+
+	huffman lencode;
+	if (BuildHuffman(&lencode, lengths, 19) != 0)
+		return -1;
+
+	uint32_t index = 0;
+	while (index < nlen + ndist) {
+		int sym = Decode(&lencode);
+		uint32_t repeat;
+		unsigned char len = 0;
+
+		if (sym < 0)
+			return sym;
+
+		if (sym < 16) {
+			lengths[index++] = (unsigned char)sym;
+			continue;
+		}
+
+		if (sym == 16) {
+			if (index == 0)
+				return -1;
+			len = lengths[index - 1];
+			repeat = Bits(2);
+			if (repeat == (uint32_t)-1)
+				return -2;
+			repeat += 3;
+		}
+		else if (sym == 17) {
+			repeat = Bits(3);
+			if (repeat == (uint32_t)-1)
+				return -2;
+			repeat += 3;
+		}
+		else {
+			repeat = Bits(7);
+			if (repeat == (uint32_t)-1)
+				return -2;
+			repeat += 11;
+		}
+
+		if (index + repeat > nlen + ndist)
+			return -1;
+		while (repeat--)
+			lengths[index++] = len;
+	}
+
+	// A block without an end-of-block code could never terminate.
+	if (lengths[256] == 0)
+		return -1;
+
+	if (BuildHuffman(&len_, lengths, nlen) != 0 ||
+		BuildHuffman(&dist_, lengths + nlen, ndist) != 0)
+		return -1;
+
+	return Codes(&len_, &dist_);
+}
+
+int Inflater::Run() {
+	size_t unused;
+	int last;
+	int ret;
+
+	out_ = output_(NULL, 0, false, &out_len_);
+	out_pos_ = 0;
+	if (out_ == NULL || out_len_ == 0)
+		return -3;
+
+	do {
+		uint32_t header = Bits(3);
+
+		if (header == (uint32_t)-1)
+			return -2;
+
+		last = header & 1;
+		switch (header >> 1) {
+		case 0:
+			ret = Stored();
+			break;
+		case 1:
+			ret = Fixed();
+			break;
+		case 2:
+			ret = Dynamic();
+			break;
+		default:
+			ret = -1;
+			break;
+		}
+
+		if (ret != 0)
+			return aborted_ ? -3 : ret;
+	} while (!last);
+
+	output_(out_, out_pos_, true, &unused);
+	out_ = NULL;
+
+	return 0;
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#ifndef INFLATE_H_
+#define INFLATE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <functional>
+#include <vector>
+
+// Streaming decoder for raw deflate data (RFC 1951), as stored in zip
+// members. Input is pulled through |InputFunc| and output is produced
+// directly into caller supplied buffers, so a member of any size can be
+// decoded with constant memory.
+class Inflater {
+public:
+	// Fills |buf| with up to |len| compressed bytes. Returns the number of
+	// bytes stored, 0 at the end of the input.
+	typedef std::function<size_t(unsigned char* buf, size_t len)> InputFunc;
+
+	// Takes |len| decoded bytes in |filled| (NULL on the first call) and
+	// returns the next buffer to decode into, with its size in |next_len|.
+	// |last| is set on the final call, whose return value is ignored.
+	// Returning NULL otherwise aborts decoding.
+	typedef std::function<unsigned char*(unsigned char* filled, size_t len, bool last,
+		size_t* next_len)> OutputFunc;
+
+	Inflater(InputFunc input, OutputFunc output);
+
+	// Decodes the whole stream. Returns 0 on success, -1 on corrupt input,
+	// -2 when the input ends early and -3 when the output side aborted.
+	int Run();
+
+	// Number of decoded bytes so far.
+	uint64_t TotalOut() const { return total_out_; }
+
+	Inflater(const Inflater&) = delete;
+	void operator=(const Inflater&) = delete;
+
+private:
+	struct huffman {
+		// Lookup table indexed by the next |bits| input bits: symbol << 4 | length.
+		std::vector<uint16_t> table;
+		int bits;
+	};
+
+	bool Need(int bits);
+	uint32_t Bits(int bits);
+	bool PutByte(unsigned char c);
+	int BuildHuffman(huffman* h, const unsigned char* lengths, int count);
+	int Decode(const huffman* h);
+	int Stored();
+	int Codes(const huffman* lencode, const huffman* distcode);
+	int Fixed();
+	int Dynamic();
+
+	InputFunc input_;
+	OutputFunc output_;
+
+	std::vector<unsigned char> in_buf_;
+	size_t in_pos_;
+	size_t in_len_;
+	bool in_eof_;
+	uint64_t bit_buf_;
+	int bit_cnt_;
+
+	// 32 KB history for back references.
+	std::vector<unsigned char> window_;
+	uint32_t window_pos_;
+
+	unsigned char* out_;
+	size_t out_len_;
+	size_t out_pos_;
+	uint64_t total_out_;
+	bool aborted_;
+
+	huffman fixed_len_;
+	huffman fixed_dist_;
+	huffman len_;
+	huffman dist_;
+};
+
+#endif  // INFLATE_H_
@@ -0,0 +1,18 @@
+#include <stdio.h>
+
+#include "json.h"
+
+void json_write_string(FILE *fp, const char *str) {
+	fputc('"', fp);
+	for (; *str != '\0'; str++) {
+		unsigned char c = (unsigned char)*str;
+
+		if (c == '"' || c == '\\')
+			fprintf(fp, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(fp, "\\u%04x", c);
+		else
+			fputc(c, fp);
+	}
+	fputc('"', fp);
+}
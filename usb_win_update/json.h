@@ -0,0 +1,12 @@
+#pragma once
+
+#ifndef JSON_H_
+#define JSON_H_
+
+#include <stdio.h>
+
+// Writes |str| to |fp| as a quoted JSON string, escaping quotes,
+// backslashes and control characters.
+void json_write_string(FILE *fp, const char *str);
+
+#endif  // JSON_H_
@@ -0,0 +1,131 @@
+#include <string.h>
+
+#include "lz4.h"
+
+// Bits of the match finder's hash; 4K entries stay in the L1 cache.
+#define LZ4_HASH_BITS	12
+
+// Format limits: a match is at least 4 bytes, the last 5 bytes are always
+// literals and the last match starts 12 bytes before the end at the latest.
+#define LZ4_MIN_MATCH		4
+#define LZ4_LAST_LITERALS	5
+#define LZ4_MF_LIMIT		12
+#define LZ4_MAX_OFFSET		65535
+
+static uint32_t read32(const unsigned char* p) {
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint32_t hash32(uint32_t v) {
+	return (v * 2654435761U) >> (32 - LZ4_HASH_BITS);
+}
+
+// Appends |value| as the 255-run extension of a length field.
+static bool put_length(unsigned char* dst, size_t capacity, size_t* op, size_t value) {
+	for (; value >= 255; value -= 255) {
+		if (*op >= capacity)
+			return false;
+		dst[(*op)++] = 255;
+	}
+
+	if (*op >= capacity)
+		return false;
+	dst[(*op)++] = (unsigned char)value;
+	return true;
+}
+
+// Writes one sequence: |literals| bytes from |src|, then a match of
+// |match_len| bytes |offset| back, or none for the last sequence.
+static bool put_sequence(unsigned char* dst, size_t capacity, size_t* op,
+	const unsigned char* src, size_t literals, size_t offset, size_t match_len) {
+	if (*op >= capacity)
+		return false;
+
+	size_t match_code = match_len > 0 ? match_len - LZ4_MIN_MATCH : 0;
+
+	dst[(*op)++] = (unsigned char)(((literals < 15 ? literals : 15) << 4) |
+		(match_code < 15 ? match_code : 15));
+
+	if (literals >= 15 && !put_length(dst, capacity, op, literals - 15))
+		return false;
+
+	if (capacity - *op < literals)
+		return false;
+	memcpy(dst + *op, src, literals);
+	*op += literals;
+
+	if (match_len == 0)
+		return true;
+
+	if (capacity - *op < 2)
+		return false;
+	dst[(*op)++] = (unsigned char)offset;
+	dst[(*op)++] = (unsigned char)(offset >> 8);
+
+	return match_code < 15 || put_length(dst, capacity, op, match_code - 15);
+}
+
+size_t lz4_compress_bound(size_t len) {
+	return len + len / 255 + 16;
+}
+
+size_t lz4_compress_block(const unsigned char* src, size_t len, unsigned char* dst,
+	size_t capacity) {
+	// Positions plus one, so 0 means empty.
+	uint32_t table[1 << LZ4_HASH_BITS];
+	size_t anchor = 0;
+	size_t op = 0;
+
+	memset(table, 0, sizeof(table));
+
+	if (len > LZ4_MF_LIMIT) {
+		size_t limit = len - LZ4_MF_LIMIT;
+		size_t match_end = len - LZ4_LAST_LITERALS;
+		size_t ip = 0;
+
+		while (ip < limit) {
+			uint32_t seq = read32(src + ip);
+			uint32_t h = hash32(seq);
+			size_t ref = table[h];
+
+			table[h] = (uint32_t)(ip + 1);
+
+			if (ref == 0 || ip - (ref - 1) > LZ4_MAX_OFFSET || read32(src + ref - 1) != seq) {
+				// The longer nothing matches, the faster incompressible data is skipped.
+				ip += 1 + ((ip - anchor) >> 6);
+				continue;
+			}
+
+			ref--;
+
+			while (ip > anchor && ref > 0 && src[ip - 1] == src[ref - 1]) {
+				ip--;
+				ref--;
+			}
+
+			size_t end = ip + LZ4_MIN_MATCH;
+
+			while (end < match_end && src[end] == src[ref + end - ip])
+				end++;
+
+			if (!put_sequence(dst, capacity, &op, src + anchor, ip - anchor, ip - ref, end - ip))
+				return 0;
+
+			anchor = end;
+			ip = end;
+
+			// Positions inside the match are not hashed, but the one just
+			// before its end often starts the next match.
+			if (ip < limit)
+				table[hash32(read32(src + ip - 2))] = (uint32_t)(ip - 2 + 1);
+		}
+	}
+
+	if (!put_sequence(dst, capacity, &op, src + anchor, len - anchor, 0, 0))
+		return 0;
+
+	return op;
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#ifndef LZ4_H_
+#define LZ4_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Encoder for the LZ4 block format, the one codec devices decode on the
+// fly (PLCM_CODEC_LZ4). Greedy matching over a small hash table, like the
+// reference fast mode: well below a full deflate in ratio, but cheap
+// enough to keep up with the bulk pipe, and trivial to decode on the
+// device. Blocks are independent; matches reach back at most 64 KB.
+
+// Largest block lz4_compress_block() may produce for |len| input bytes.
+size_t lz4_compress_bound(size_t len);
+
+// Compresses the |len| bytes at |src| into |dst|, which holds |capacity|
+// bytes. Returns the compressed size, or 0 if it does not fit, in which
+// case the block is better stored as is.
+size_t lz4_compress_block(const unsigned char* src, size_t len, unsigned char* dst,
+	size_t capacity);
+
+#endif  // LZ4_H_
@@ -0,0 +1,29 @@
+#pragma once
+
+#ifndef MD5_H_
+#define MD5_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// RFC 1321 MD5, used to hash images while they stream to the device.
+
+#define MD5_DIGEST_SIZE 16
+
+// Hex digest plus terminating NUL.
+#define MD5_HEX_SIZE (MD5_DIGEST_SIZE * 2 + 1)
+
+struct md5_context {
+	uint32_t state[4];
+	uint64_t length;
+	unsigned char block[64];
+};
+
+void md5_init(md5_context *ctx);
+void md5_update(md5_context *ctx, const void *data, size_t len);
+void md5_final(md5_context *ctx, unsigned char digest[MD5_DIGEST_SIZE]);
+
+// Formats |digest| as 32 lowercase hex characters, as md5sum prints it.
+void md5_to_hex(const unsigned char digest[MD5_DIGEST_SIZE], char hex[MD5_HEX_SIZE]);
+
+#endif  // MD5_H_
@@ -0,0 +1,45 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "protocol_bench.h"
+#include "transport_log.h"
+
+//The protocol core and the simulated device on their own, without the
+//Windows front end or a device, so the host side of the protocol can be
+//profiled at memory speed on any platform. With --replay the blocking
+//driver runs against a recording of a real device instead.
+int main(int argc, char *argv[])
+{
+	unsigned long long images = 100000;
+	long long size = 4096;
+	const char *replay_path = NULL;
+
+	for (int i = 1; i < argc; i++) {
+		if (strncmp(argv[i], "--protocol-bench=", 17) == 0 &&
+			sscanf(argv[i] + 17, "%llu,%lld", &images, &size) >= 1)
+			continue;
+
+		if (strncmp(argv[i], "--replay=", 9) == 0) {
+			replay_path = argv[i] + 9;
+			continue;
+		}
+
+		fprintf(stderr, "Usage: plcm_bench [--protocol-bench=IMAGES[,BYTES]] [--replay=FILE.tlog]\n");
+		return -1;
+	}
+
+	if (replay_path == NULL)
+		return plcm_protocol_bench(images, size) < 0 ? -1 : 0;
+
+	ReplayTransport replay(replay_path);
+
+	if (!replay.IsValid()) {
+		fprintf(stderr, "Failed to read the recording %s\n", replay_path);
+		return -1;
+	}
+
+	int ret = plcm_replay_bench(&replay, images, size);
+
+	replay.Close();
+	return ret < 0 ? -1 : 0;
+}
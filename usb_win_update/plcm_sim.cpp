@@ -0,0 +1,233 @@
+#include <string.h>
+
+#include "plcm_sim.h"
+#include "transport_stats.h"
+
+PlcmSimDevice::PlcmSimDevice(const plcm_sim_options &options)
+	: options_(options), now_ms_(0), length_(0), received_(0), stored_ms_(0), status_(-1),
+	images_(0), failed_(0) {
+	md5_init(&md5_);
+	name_[0] = '\0';
+	expected_md5_[0] = '\0';
+}
+
+int64_t PlcmSimDevice::Written() const {
+	//Data still being stored shows up as half written
+	if (received_ >= length_ && now_ms_ < stored_ms_)
+		return received_ / 2;
+
+	return received_;
+}
+
+int64_t PlcmSimDevice::Data(const void *data, int64_t len) {
+	if (options_.check_digest && data != NULL)
+		md5_update(&md5_, data, (size_t)len);
+
+	received_ += len;
+	if (received_ >= length_)
+		stored_ms_ = now_ms_ + options_.store_delay_ms;
+
+	return len;
+}
+
+//STATUS of the image just stored, checked against |md5_sum|
+int32_t PlcmSimDevice::Check(const char *md5_sum) {
+	bool ok = true;
+
+	if (options_.check_digest) {
+		unsigned char digest[MD5_DIGEST_SIZE];
+		char received[MD5_HEX_SIZE];
+
+		md5_final(&md5_, digest);
+		md5_to_hex(digest, received);
+		ok = memcmp(received, md5_sum, MD5_HEX_SIZE) == 0;
+	}
+
+	return ok && Written() == length_ ? PLCM_STATUS_OK : 1;
+}
+
+//A whole image in one request, stalled unless stored and matching
+int PlcmSimDevice::Inline(const void *data, unsigned int len) {
+	plcm_img_inline header;
+
+	if (len < sizeof(header))
+		return -1;
+	memcpy(&header, data, sizeof(header));
+	if (header.length > options_.max_inline || len != sizeof(header) + header.length ||
+		header.md5_sum[MD5_HEX_SIZE - 1] != '\0')
+		return -1;
+
+	//Data arrives and is stored within the request
+	length_ = header.length;
+	received_ = 0;
+	stored_ms_ = 0;
+	md5_init(&md5_);
+	Data((const char *)data + sizeof(header), header.length);
+	stored_ms_ = now_ms_;
+
+	images_++;
+	if (Check(header.md5_sum) != PLCM_STATUS_OK) {
+		failed_++;
+		return -1;
+	}
+
+	return len;
+}
+
+int PlcmSimDevice::Control(bool is_in, unsigned char request, unsigned short value, void *data,
+	unsigned int len) {
+	if (!is_in && request == PLCM_USB_REQUEST_SET_INFORMATION) {
+		switch (value) {
+		case PLCM_USB_REQUEST_VALUE_IMG_LENGTH64:
+			if (!options_.size64 || len != sizeof(int64_t))
+				return -1;
+			memcpy(&length_, data, sizeof(int64_t));
+			break;
+
+		case PLCM_USB_REQUEST_VALUE_IMG_LENGTH: {
+			int32_t length;
+
+			if (len != sizeof(length))
+				return -1;
+			memcpy(&length, data, sizeof(length));
+			length_ = length;
+			break;
+		}
+
+		case PLCM_USB_REQUEST_VALUE_IMG_NAME:
+			if (len == 0 || len > sizeof(name_))
+				return -1;
+			memcpy(name_, data, len);
+			name_[len - 1] = '\0';
+			return len;
+
+		case PLCM_USB_REQUEST_VALUE_IMG_MD5_SUM:
+			if (len != MD5_HEX_SIZE || ((const char *)data)[MD5_HEX_SIZE - 1] != '\0')
+				status_ = 1;
+			else
+				status_ = Check((const char *)data);
+			return len;
+
+		case PLCM_USB_REQUEST_VALUE_IMG_EXPECTED_MD5:
+			if (!options_.digest_first || len != MD5_HEX_SIZE ||
+				((const char *)data)[MD5_HEX_SIZE - 1] != '\0')
+				return -1;
+			memcpy(expected_md5_, data, MD5_HEX_SIZE);
+			return len;
+
+		case PLCM_USB_REQUEST_VALUE_IMG_INLINE:
+			return Inline(data, len);
+
+		default:
+			return -1;
+		}
+
+		//A new image starts with its length
+		received_ = 0;
+		stored_ms_ = 0;
+		status_ = -1;
+		expected_md5_[0] = '\0';
+		md5_init(&md5_);
+		return len;
+	}
+
+	if (is_in && request == PLCM_USB_REQUEST_GET_INFORMATION) {
+		switch (value) {
+		case PLCM_USB_REQUEST_VALUE_WRITTEN_BYTES64: {
+			int64_t written = Written();
+
+			if (!options_.size64 || len < sizeof(written))
+				return -1;
+			memcpy(data, &written, sizeof(written));
+			return sizeof(written);
+		}
+
+		case PLCM_USB_REQUEST_VALUE_WRITTEN_BYTES: {
+			int32_t written = (int32_t)Written();
+
+			if (len < sizeof(written))
+				return -1;
+			memcpy(data, &written, sizeof(written));
+			return sizeof(written);
+		}
+
+		case PLCM_USB_REQUEST_VALUE_STATUS:
+			if (len < sizeof(status_))
+				return -1;
+
+			//Checked while storing, known as soon as the last byte is down
+			if (expected_md5_[0] != '\0' && status_ < 0) {
+				int32_t pending = PLCM_STATUS_PENDING;
+
+				if (Written() < length_) {
+					memcpy(data, &pending, sizeof(pending));
+					return sizeof(pending);
+				}
+				status_ = Check(expected_md5_);
+			}
+
+			memcpy(data, &status_, sizeof(status_));
+			images_++;
+			if (status_ != 0)
+				failed_++;
+			return sizeof(status_);
+
+		default:
+			return -1;
+		}
+	}
+
+	return -1;
+}
+
+SimulatedTransport::SimulatedTransport(const plcm_sim_options &options)
+	: device_(options), last_us_(TransportStats::NowUs()) {}
+
+void SimulatedTransport::Tick() {
+	uint64_t now_us = TransportStats::NowUs();
+	uint64_t elapsed_ms = (now_us - last_us_) / 1000;
+
+	if (elapsed_ms > 0) {
+		device_.Advance((uint32_t)elapsed_ms);
+		last_us_ += elapsed_ms * 1000;
+	}
+}
+
+ssize_t SimulatedTransport::Write(const void* data, size_t len) {
+	Tick();
+	device_.Data(data, len);
+	stats_.RecordBulk(TransportStats::kOut, len);
+
+	return len;
+}
+
+ssize_t SimulatedTransport::ControlIO(bool is_in, void *setup, void* data, size_t len) {
+	const setup_packet *packet = (const setup_packet *)setup;
+
+	Tick();
+
+	int ret = device_.Control(is_in, packet->bRequest, packet->wValue, data, (unsigned int)len);
+	if (ret < 0) {
+		stats_.RecordError(-1);
+		return -1;
+	}
+
+	stats_.RecordControl(is_in ? TransportStats::kIn : TransportStats::kOut, ret);
+	return ret;
+}
+
+ssize_t PatternImageReader::ReadBlock(char** block) {
+	int64_t left = size_ - offset_;
+
+	if (left <= 0)
+		return 0;
+
+	size_t len = left < (int64_t)pool_->BlockSize() ? (size_t)left : pool_->BlockSize();
+
+	*block = (char *)pool_->Acquire();
+	for (size_t i = 0; i < len; i++)
+		(*block)[i] = (char)((offset_ + i) * 31);
+
+	offset_ += len;
+	return len;
+}
@@ -0,0 +1,114 @@
+#pragma once
+
+#ifndef PLCM_SIM_H_
+#define PLCM_SIM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "image_reader.h"
+#include "md5.h"
+#include "protocol.h"
+#include "transport.h"
+
+struct plcm_sim_options {
+	/// Takes IMG_LENGTH64 and WRITTEN_BYTES64
+	bool size64;
+	/// Device time between the last byte of an image arriving and
+	/// WRITTEN_BYTES reporting all of it
+	uint32_t store_delay_ms;
+	/// Hash the data received and compare it with IMG_MD5_SUM; otherwise
+	/// any well formed sum passes, so drivers can skip the data itself
+	bool check_digest;
+	/// Takes IMG_EXPECTED_MD5 and checks images while storing them
+	bool digest_first;
+	/// Largest image IMG_INLINE takes, 0 to stall it
+	uint32_t max_inline;
+};
+
+// In-memory model of the device side of the PLCM image protocol: the
+// requests of an old device that knows no capabilities, pipelining or
+// formats besides raw, optionally with digest-first checking. Requests it
+// does not know are stalled (-1).
+class PlcmSimDevice {
+public:
+	explicit PlcmSimDevice(const plcm_sim_options &options);
+
+	// A control request as the firmware sees it. Returns the bytes
+	// transferred, or -1 for a STALL.
+	int Control(bool is_in, unsigned char request, unsigned short value, void *data,
+		unsigned int len);
+
+	// |len| bytes of bulk OUT data; |data| may be NULL when the digest is
+	// not checked. Returns |len|.
+	int64_t Data(const void *data, int64_t len);
+
+	// Moves the device clock forward.
+	void Advance(uint32_t ms) { now_ms_ += ms; }
+
+	// Images whose STATUS was read, and how many of them failed.
+	uint64_t Images() const { return images_; }
+	uint64_t Failed() const { return failed_; }
+
+	PlcmSimDevice(const PlcmSimDevice&) = delete;
+	void operator=(const PlcmSimDevice&) = delete;
+
+private:
+	int64_t Written() const;
+	int32_t Check(const char *md5_sum);
+	int Inline(const void *data, unsigned int len);
+
+	plcm_sim_options options_;
+	uint64_t now_ms_;
+
+	int64_t length_;
+	int64_t received_;
+	uint64_t stored_ms_;
+	md5_context md5_;
+	char name_[PLCM_IMG_NAME_SIZE];
+	/// IMG_EXPECTED_MD5 of the current image, "" if none
+	char expected_md5_[MD5_HEX_SIZE];
+	int32_t status_;
+
+	uint64_t images_;
+	uint64_t failed_;
+};
+
+// Transport in front of a PlcmSimDevice, for running the real drivers and
+// data paths without hardware. The device clock follows the wall clock.
+class SimulatedTransport : public Transport {
+public:
+	explicit SimulatedTransport(const plcm_sim_options &options);
+
+	ssize_t Read(void* data, size_t len) override { return -1; }
+	ssize_t Write(const void* data, size_t len) override;
+	ssize_t ControlIO(bool is_in, void *setup, void* data, size_t len) override;
+	int Close() override { return 0; }
+	const char* Name() const override { return "simulated"; }
+
+	PlcmSimDevice& Device() { return device_; }
+
+private:
+	void Tick();
+
+	PlcmSimDevice device_;
+	uint64_t last_us_;
+};
+
+// Image of |size| bytes of a fixed pattern, made up in the blocks of
+// |pool| rather than read from disk.
+class PatternImageReader : public ImageReader {
+public:
+	PatternImageReader(BufferPool* pool, int64_t size) : pool_(pool), size_(size), offset_(0) {}
+
+	int64_t Size() const override { return size_; }
+	ssize_t ReadBlock(char** block) override;
+	const char* Kind() const override { return "pattern"; }
+
+private:
+	BufferPool* pool_;
+	int64_t size_;
+	int64_t offset_;
+};
+
+#endif  // PLCM_SIM_H_
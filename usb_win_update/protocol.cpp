@@ -0,0 +1,227 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "protocol.h"
+
+PlcmSession::PlcmSession(int size64, int digest_first)
+	: state_(kIdle), size64_(size64), digest_first_(digest_first), checked_inline_(false),
+	length_(0), value64_(0), value32_(0), waited_ms_(0), delay_ms_(1), polls_(0), error_("") {
+	name_[0] = '\0';
+	md5_[0] = '\0';
+}
+
+plcm_action PlcmSession::Start(const char *name, int64_t length, const char *md5_hex) {
+	snprintf(name_, sizeof(name_), "%s", name);
+	snprintf(md5_, sizeof(md5_), "%s", md5_hex != NULL ? md5_hex : "");
+	length_ = length;
+	waited_ms_ = 0;
+	delay_ms_ = 1;
+	polls_ = 0;
+	error_ = "";
+	checked_inline_ = false;
+
+	//Cut short, it could land on another image
+	if (strlen(name) >= sizeof(name_))
+		return Fail("image name too long");
+
+	//Empty images are not transferred
+	if (length_ == 0)
+		return Fail("empty image");
+
+	//A stalled WRITTEN_BYTES64 tells a device without 64-bit sizes
+	if (size64_ < 0) {
+		value64_ = 0;
+		return Control(kProbeSize64, true, PLCM_USB_REQUEST_VALUE_WRITTEN_BYTES64, &value64_,
+			sizeof(value64_));
+	}
+
+	return SendLength();
+}
+
+void PlcmSession::SetDigest(const char *md5_hex) {
+	snprintf(md5_, sizeof(md5_), "%s", md5_hex);
+}
+
+plcm_action PlcmSession::Control(state next, bool is_in, unsigned short value, void *data,
+	unsigned int len) {
+	plcm_action action = {};
+
+	state_ = next;
+	action.type = PLCM_ACTION_CONTROL;
+	action.is_in = is_in;
+	action.request = is_in ? PLCM_USB_REQUEST_GET_INFORMATION : PLCM_USB_REQUEST_SET_INFORMATION;
+	action.value = value;
+	action.data = data;
+	action.len = len;
+
+	return action;
+}
+
+plcm_action PlcmSession::SendLength() {
+	if (size64_ == 1) {
+		value64_ = length_;
+		return Control(kSetLength, false, PLCM_USB_REQUEST_VALUE_IMG_LENGTH64, &value64_,
+			sizeof(value64_));
+	}
+
+	if (length_ > PLCM_MAX_IMG_LENGTH32)
+		return Fail("image too large for the device");
+
+	value32_ = (int32_t)length_;
+	return Control(kSetLength, false, PLCM_USB_REQUEST_VALUE_IMG_LENGTH, &value32_,
+		sizeof(value32_));
+}
+
+plcm_action PlcmSession::SendData() {
+	plcm_action action = {};
+
+	state_ = kSendData;
+	action.type = PLCM_ACTION_SEND_DATA;
+	action.length = length_;
+
+	return action;
+}
+
+plcm_action PlcmSession::Poll() {
+	polls_++;
+
+	if (size64_ == 1) {
+		value64_ = 0;
+		return Control(kPoll, true, PLCM_USB_REQUEST_VALUE_WRITTEN_BYTES64, &value64_,
+			sizeof(value64_));
+	}
+
+	value32_ = 0;
+	return Control(kPoll, true, PLCM_USB_REQUEST_VALUE_WRITTEN_BYTES, &value32_,
+		sizeof(value32_));
+}
+
+plcm_action PlcmSession::GetStatus() {
+	value32_ = -1;
+	return Control(kGetStatus, true, PLCM_USB_REQUEST_VALUE_STATUS, &value32_, sizeof(value32_));
+}
+
+//Backs off before asking again, or gives up past PLCM_POLL_TIMEOUT_MS
+plcm_action PlcmSession::Wait(state next) {
+	plcm_action action = {};
+
+	state_ = next;
+	action.type = PLCM_ACTION_WAIT;
+	action.delay_ms = delay_ms_;
+
+	waited_ms_ += delay_ms_;
+	delay_ms_ = (delay_ms_ * 2 > PLCM_POLL_MAX_DELAY_MS) ? PLCM_POLL_MAX_DELAY_MS : delay_ms_ * 2;
+	return action;
+}
+
+plcm_action PlcmSession::Fail(const char *error) {
+	plcm_action action = {};
+
+	state_ = kIdle;
+	error_ = error;
+	action.type = PLCM_ACTION_DONE;
+	action.status = -1;
+
+	return action;
+}
+
+plcm_action PlcmSession::Step(const plcm_event &event) {
+	plcm_action action = {};
+
+	switch (state_) {
+	case kProbeSize64:
+		size64_ = event.result == sizeof(value64_) ? 1 : 0;
+		return SendLength();
+
+	case kSetLength:
+		if (event.result < 0)
+			return Fail("IMG_LENGTH failed");
+
+		return Control(kSetName, false, PLCM_USB_REQUEST_VALUE_IMG_NAME, name_,
+			(unsigned int)strlen(name_) + 1);
+
+	case kSetName:
+		if (event.result < 0)
+			return Fail("IMG_NAME failed");
+
+		//A known sum goes first, so the device checks while storing
+		if (digest_first_ != 0 && !NeedsDigest())
+			return Control(kSetExpectedMd5, false, PLCM_USB_REQUEST_VALUE_IMG_EXPECTED_MD5, md5_,
+				(unsigned int)strlen(md5_) + 1);
+
+		return SendData();
+
+	case kSetExpectedMd5:
+		//Older devices stall it and check after the fact as before
+		if (event.result < 0 && digest_first_ == 1)
+			return Fail("IMG_EXPECTED_MD5 failed");
+
+		digest_first_ = event.result < 0 ? 0 : 1;
+		checked_inline_ = digest_first_ == 1;
+		return SendData();
+
+	case kSendData:
+		if (event.result != length_)
+			return Fail("image data not written");
+		if (NeedsDigest())
+			return Fail("no MD5 sum for the image");
+
+		if (checked_inline_)
+			return GetStatus();
+
+		//Small images are usually stored by the time the data is out
+		return Poll();
+
+	case kPoll: {
+		if (event.result < 0)
+			return Fail("WRITTEN_BYTES failed");
+
+		int64_t written = size64_ == 1 ? value64_ : value32_;
+
+		if (written < length_ && waited_ms_ < PLCM_POLL_TIMEOUT_MS)
+			return Wait(kPollWait);
+
+		if (written != length_)
+			return Fail("device did not store all the data");
+
+		return Control(kSetMd5, false, PLCM_USB_REQUEST_VALUE_IMG_MD5_SUM, md5_,
+			(unsigned int)strlen(md5_) + 1);
+	}
+
+	case kPollWait:
+		return Poll();
+
+	case kStatusWait:
+		return GetStatus();
+
+	case kSetMd5:
+		if (event.result < 0)
+			return Fail("IMG_MD5_SUM failed");
+
+		return GetStatus();
+
+	case kGetStatus:
+		if (event.result < 0)
+			return Fail("STATUS failed");
+
+		if (checked_inline_ && value32_ == PLCM_STATUS_PENDING) {
+			polls_++;
+			if (waited_ms_ < PLCM_POLL_TIMEOUT_MS)
+				return Wait(kStatusWait);
+			return Fail("device did not store all the data");
+		}
+
+		if (value32_ != PLCM_STATUS_OK)
+			return Fail("MD5 checking failed");
+
+		state_ = kIdle;
+		action.type = PLCM_ACTION_DONE;
+		action.status = 0;
+		return action;
+
+	case kIdle:
+		break;
+	}
+
+	return Fail("no image in progress");
+}
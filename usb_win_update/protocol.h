@@ -0,0 +1,300 @@
+#pragma once
+
+#ifndef PROTOCOL_H_
+#define PROTOCOL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "md5.h"
+
+struct setup_packet {
+	unsigned char bRequestType;
+	unsigned char bRequest;
+	unsigned short wValue;
+	unsigned short wIndex;
+	unsigned short wLength;
+};
+
+#define PLCM_USB_REQUEST_SET_INFORMATION	0x01
+#define PLCM_USB_REQUEST_GET_INFORMATION	0x81
+
+#define PLCM_USB_REQUEST_VALUE_IMG_LENGTH		0x0001
+#define PLCM_USB_REQUEST_VALUE_IMG_NAME			0x0002
+#define PLCM_USB_REQUEST_VALUE_IMG_MD5_SUM		0x0003
+#define PLCM_USB_REQUEST_VALUE_STATUS			0x0004
+#define PLCM_USB_REQUEST_VALUE_WRITTEN_BYTES	0x0005
+#define PLCM_USB_REQUEST_VALUE_IMG_FORMAT		0x0006
+#define PLCM_USB_REQUEST_VALUE_IMG_LENGTH64		0x0007
+#define PLCM_USB_REQUEST_VALUE_WRITTEN_BYTES64	0x0008
+#define PLCM_USB_REQUEST_VALUE_IMG_SEQ			0x0009
+#define PLCM_USB_REQUEST_VALUE_SEQ_STATUS		0x000A
+#define PLCM_USB_REQUEST_VALUE_CAPABILITIES		0x000B
+#define PLCM_USB_REQUEST_VALUE_CREDITS			0x000C
+#define PLCM_USB_REQUEST_VALUE_STRIPES			0x000D
+#define PLCM_USB_REQUEST_VALUE_PULL_PATH		0x000E
+#define PLCM_USB_REQUEST_VALUE_PULL_INFO		0x000F
+#define PLCM_USB_REQUEST_VALUE_IMG_LINK			0x0010
+#define PLCM_USB_REQUEST_VALUE_CHUNK_QUERY		0x0011
+#define PLCM_USB_REQUEST_VALUE_IMG_EXPECTED_MD5	0x0012
+#define PLCM_USB_REQUEST_VALUE_IMG_INLINE		0x0013
+
+//Payload of PLCM_USB_REQUEST_VALUE_IMG_FORMAT. The device falls back to
+//PLCM_IMG_FORMAT_RAW after reporting the status of each image.
+#define PLCM_IMG_FORMAT_RAW		0
+#define PLCM_IMG_FORMAT_SPARSE	1	//Android sparse stream, expanded by the device
+#define PLCM_IMG_FORMAT_TAR		2	//ustar stream, unpacked into the image directory
+#define PLCM_IMG_FORMAT_CHUNKED	3	//Chunk recipe, rebuilt from the device's chunk store
+#define PLCM_IMG_FORMAT_LZ4		4	//LZ4 blocks, decoded by the device
+
+//A PLCM_IMG_FORMAT_LZ4 image is a series of blocks, each a header and
+//|length| bytes: an LZ4 block decoding to |raw_length| bytes or, with
+//PLCM_LZ4_STORED set, those bytes as they are. Blocks decode to at most
+//PLCM_LZ4_BLOCK_SIZE bytes and never refer to each other. IMG_LENGTH and
+//WRITTEN_BYTES count stream bytes, IMG_MD5_SUM is the decoded file's.
+#define PLCM_LZ4_BLOCK_SIZE	(64 * 1024)
+#define PLCM_LZ4_STORED		0x80000000
+
+#pragma pack(push, 1)
+struct plcm_lz4_block {
+	uint32_t raw_length;
+	/// Bytes that follow, PLCM_LZ4_STORED bit aside
+	uint32_t length;
+};
+#pragma pack(pop)
+
+//Answer to GET_INFORMATION PULL_INFO for the file or directory named by
+//SET_INFORMATION PULL_PATH. The device then sends |length| bytes on bulk
+//IN, a directory as a ustar stream.
+#pragma pack(push, 1)
+struct plcm_pull_info {
+	/// Bytes that follow on bulk IN
+	uint64_t length;
+	/// PLCM_IMG_FORMAT_RAW for a file, PLCM_IMG_FORMAT_TAR for a directory
+	uint32_t format;
+	/// MD5 sum of those bytes, as hex
+	char md5_sum[MD5_HEX_SIZE];
+};
+#pragma pack(pop)
+
+//SET_INFORMATION CHUNK_QUERY carries up to PLCM_CHUNK_QUERY_MAX chunk
+//digests back to back; GET_INFORMATION CHUNK_QUERY then returns one bit
+//per digest, LSB first, set if the device's chunk store holds the chunk.
+#define PLCM_CHUNK_QUERY_MAX	256
+
+//A PLCM_IMG_FORMAT_CHUNKED image is the recipe header, |chunks| entries,
+//then the data of the entries flagged PLCM_CHUNK_INLINE back to back. The
+//device rebuilds the file in entry order from the stream and its chunk
+//store, keeps the new chunks, and checks IMG_MD5_SUM against the rebuilt
+//file. IMG_LENGTH and WRITTEN_BYTES count stream bytes, as for tar.
+#define PLCM_RECIPE_MAGIC	0x52434C50	//"PLCR"
+#define PLCM_CHUNK_INLINE	0x0001
+
+#pragma pack(push, 1)
+struct plcm_recipe_header {
+	uint32_t magic;
+	/// Entries that follow
+	uint32_t chunks;
+	/// Length of the rebuilt file
+	uint64_t file_length;
+};
+
+struct plcm_recipe_entry {
+	/// MD5 digest of the chunk
+	unsigned char digest[MD5_DIGEST_SIZE];
+	uint32_t length;
+	/// PLCM_CHUNK_* bits
+	uint32_t flags;
+};
+#pragma pack(pop)
+
+//IMG_EXPECTED_MD5 takes the MD5 sum of an image with its metadata, before
+//the data. The device hashes the image as it stores it, and STATUS tells
+//the outcome once the stream is stored, without reading the file back;
+//until then it answers PLCM_STATUS_PENDING. No IMG_MD5_SUM follows.
+#define PLCM_STATUS_OK			0
+#define PLCM_STATUS_PENDING		2
+
+//Budget for WRITTEN_BYTES to reach the image length once the data is out
+#define PLCM_POLL_TIMEOUT_MS	1100
+#define PLCM_POLL_MAX_DELAY_MS	100
+
+//Largest image the 32-bit IMG_LENGTH/WRITTEN_BYTES pair can describe; the
+//device side keeps WRITTEN_BYTES in a signed int.
+#define PLCM_MAX_IMG_LENGTH32	0x7FFFFFFFLL
+
+//Longest IMG_NAME, terminator included
+#define PLCM_IMG_NAME_SIZE		64
+
+//Payload of SET_INFORMATION IMG_LINK: store the image |source|, received
+//and verified earlier, once more as |name|, by hard link or copy. The
+//device stalls the request if |source| is missing or does not match
+//|md5_sum|, the host then sends |name| in full.
+#pragma pack(push, 1)
+struct plcm_img_link {
+	/// MD5 sum of the content, as hex
+	char md5_sum[MD5_HEX_SIZE];
+	/// Image name the content was sent under
+	char source[PLCM_IMG_NAME_SIZE];
+	/// Image name to store it under as well
+	char name[PLCM_IMG_NAME_SIZE];
+};
+#pragma pack(pop)
+
+//SET_INFORMATION IMG_INLINE stores a whole small image in one control
+//transfer: this header, then |length| bytes of data. The device stores the
+//image and checks |md5_sum| before the status stage and stalls the request
+//if either fails, so the handshake is the STATUS. Images of up to
+//plcm_device_caps::max_inline bytes qualify, and the whole transfer stays
+//within PLCM_INLINE_MAX_TRANSFER, the data stage WinUSB takes at once.
+#define PLCM_INLINE_MAX_TRANSFER	4096
+
+#pragma pack(push, 1)
+struct plcm_img_inline {
+	/// MD5 sum of the data, as hex
+	char md5_sum[MD5_HEX_SIZE];
+	char name[PLCM_IMG_NAME_SIZE];
+	/// Data bytes that follow
+	uint32_t length;
+};
+#pragma pack(pop)
+
+// What the driver of a PlcmSession has to do next.
+enum plcm_action_type {
+	// Control transfer described by the action; answer PLCM_EVENT_CONTROL.
+	PLCM_ACTION_CONTROL,
+	// Write the |length| bytes of the image on the bulk pipe; answer
+	// PLCM_EVENT_DATA once all of them are out.
+	PLCM_ACTION_SEND_DATA,
+	// Answer PLCM_EVENT_TIMER after |delay_ms|.
+	PLCM_ACTION_WAIT,
+	// The image is over, |status| says how it went.
+	PLCM_ACTION_DONE,
+};
+
+struct plcm_action {
+	plcm_action_type type;
+	/// PLCM_ACTION_CONTROL: direction, request, value and payload. The
+	/// payload buffer belongs to the session and stays valid until the
+	/// next call.
+	bool is_in;
+	unsigned char request;
+	unsigned short value;
+	void *data;
+	unsigned int len;
+	/// PLCM_ACTION_SEND_DATA
+	int64_t length;
+	/// PLCM_ACTION_WAIT
+	uint32_t delay_ms;
+	/// PLCM_ACTION_DONE: 0 once the device checked the image, -1 otherwise
+	int status;
+};
+
+enum plcm_event_type {
+	PLCM_EVENT_CONTROL,
+	PLCM_EVENT_DATA,
+	PLCM_EVENT_TIMER,
+};
+
+struct plcm_event {
+	plcm_event_type type;
+	/// Bytes transferred, < 0 if the transfer failed
+	int64_t result;
+};
+
+// The PLCM image protocol as a pure state machine.
+//
+// It neither reads files nor touches a Transport nor sleeps: Start() and
+// Step() return the next action, the driver carries it out any way it
+// likes and feeds the outcome back as an event. One image goes
+// IMG_LENGTH(64), IMG_NAME, data, WRITTEN_BYTES polls with back-off,
+// IMG_MD5_SUM and STATUS, or IMG_EXPECTED_MD5 before the data and STATUS
+// right after it when the sum is known up front and the device checks
+// images while storing them; 64-bit sizes and digest-first are probed on
+// the first image when the caller does not know. The same core thus runs
+// behind the blocking send paths, the event engine, or a simulated device
+// at memory speed.
+class PlcmSession {
+public:
+	// |size64| is 1 or 0 if the device is known to take 64-bit sizes or
+	// not, -1 to probe. |digest_first| likewise for IMG_EXPECTED_MD5,
+	// which is only used for images whose sum is known up front.
+	PlcmSession(int size64, int digest_first);
+
+	// Begins an image of |length| bytes, stored as |name| and checked
+	// against the MD5 sum |md5_hex|. Returns the first action. With a
+	// NULL |md5_hex| the driver hashes the data as it sends it and hands
+	// the sum to SetDigest() before reporting PLCM_EVENT_DATA. Names of
+	// PLCM_IMG_NAME_SIZE bytes or more fail the image rather than being
+	// cut short.
+	plcm_action Start(const char *name, int64_t length, const char *md5_hex);
+
+	// True if the current image waits for SetDigest().
+	bool NeedsDigest() const { return md5_[0] == '\0'; }
+	void SetDigest(const char *md5_hex);
+	const char *Digest() const { return md5_; }
+
+	// True once the device took IMG_EXPECTED_MD5 for the current image and
+	// checks it while storing it; no IMG_MD5_SUM follows the data.
+	bool CheckedInline() const { return checked_inline_; }
+
+	// Takes the outcome of the last action and returns the next one.
+	plcm_action Step(const plcm_event &event);
+
+	// What the probes found, -1 before they ran.
+	int Size64() const { return size64_; }
+	int DigestFirst() const { return digest_first_; }
+
+	// Why the last image failed, "" if it did not.
+	const char *Error() const { return error_; }
+
+	// WRITTEN_BYTES or pending STATUS requests of the last image.
+	int Polls() const { return polls_; }
+
+	PlcmSession(const PlcmSession&) = delete;
+	void operator=(const PlcmSession&) = delete;
+
+private:
+	enum state {
+		kIdle,
+		kProbeSize64,
+		kSetLength,
+		kSetName,
+		kSetExpectedMd5,
+		kSendData,
+		kPoll,
+		kPollWait,
+		kSetMd5,
+		kGetStatus,
+		kStatusWait,
+	};
+
+	plcm_action Control(state next, bool is_in, unsigned short value, void *data, unsigned int len);
+	plcm_action SendLength();
+	plcm_action SendData();
+	plcm_action Poll();
+	plcm_action GetStatus();
+	plcm_action Wait(state next);
+	plcm_action Fail(const char *error);
+
+	state state_;
+	int size64_;
+	int digest_first_;
+	// The device got the sum ahead and checks the image itself
+	bool checked_inline_;
+
+	char name_[PLCM_IMG_NAME_SIZE];
+	int64_t length_;
+	char md5_[MD5_HEX_SIZE];
+
+	// Payloads of the requests in flight
+	int64_t value64_;
+	int32_t value32_;
+
+	int waited_ms_;
+	int delay_ms_;
+	int polls_;
+	const char *error_;
+};
+
+#endif  // PROTOCOL_H_
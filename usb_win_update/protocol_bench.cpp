@@ -0,0 +1,87 @@
+#include <stdio.h>
+
+#include "plcm_sim.h"
+#include "protocol.h"
+#include "protocol_bench.h"
+#include "protocol_driver.h"
+#include "transport_stats.h"
+
+int plcm_protocol_bench(uint64_t images, int64_t size)
+{
+	char name[PLCM_IMG_NAME_SIZE];
+	uint64_t failed = 0;
+
+	//The device takes a few ms to store each image, to go through the polls
+	plcm_sim_options options = { true, 5, false, false, 0 };
+	PlcmSimDevice device(options);
+	PlcmSession session(-1, 0);
+	uint64_t polls = 0;
+	uint64_t start_us = TransportStats::NowUs();
+
+	for (uint64_t i = 0; i < images; i++) {
+		snprintf(name, sizeof(name), "image-%llu", (unsigned long long)i);
+
+		if (plcm_run_simulated(&device, &session, session.Start(name, size, NULL)) != 0)
+			failed++;
+		polls += session.Polls();
+	}
+
+	double seconds = (TransportStats::NowUs() - start_us) / 1e6;
+
+	printf("simulated driver: %llu images of %lld bytes in %.2f s, %.0f images/s, "
+		"%.1f polls per image, %llu failed\n", (unsigned long long)images, (long long)size,
+		seconds, seconds > 0 ? images / seconds : 0, images > 0 ? (double)polls / images : 0,
+		(unsigned long long)failed);
+
+	//32-bit sizes this time, and the device checks the data
+	plcm_sim_options checked = { false, 0, true, false, 0 };
+	SimulatedTransport transport(checked);
+	PlcmSession blocking(-1, 0);
+	uint64_t sample = images < PROTOCOL_BENCH_BLOCKING_IMAGES ? images : PROTOCOL_BENCH_BLOCKING_IMAGES;
+
+	start_us = TransportStats::NowUs();
+
+	for (uint64_t i = 0; i < sample; i++) {
+		PatternImageReader reader(transport.Buffers(), size);
+
+		snprintf(name, sizeof(name), "image-%llu", (unsigned long long)i);
+
+		if (plcm_run_blocking(&transport, &blocking, blocking.Start(name, size, NULL), &reader) != 0)
+			failed++;
+	}
+
+	seconds = (TransportStats::NowUs() - start_us) / 1e6;
+
+	printf("blocking driver: %llu images in %.2f s, %.0f images/s, %.1f MB/s, %llu failed on the device\n",
+		(unsigned long long)sample, seconds, seconds > 0 ? sample / seconds : 0,
+		seconds > 0 ? sample * size / (1024 * 1024) / seconds : 0,
+		(unsigned long long)transport.Device().Failed());
+
+	return failed > 0 ? -1 : 0;
+}
+
+int plcm_replay_bench(Transport *transport, uint64_t images, int64_t size)
+{
+	char name[PLCM_IMG_NAME_SIZE];
+	uint64_t failed = 0;
+	PlcmSession session(-1, 0);
+	uint64_t start_us = TransportStats::NowUs();
+
+	for (uint64_t i = 0; i < images; i++) {
+		PatternImageReader reader(transport->Buffers(), size);
+
+		snprintf(name, sizeof(name), "image-%llu", (unsigned long long)i);
+
+		if (plcm_run_blocking(transport, &session, session.Start(name, size, NULL), &reader) != 0)
+			failed++;
+	}
+
+	double seconds = (TransportStats::NowUs() - start_us) / 1e6;
+
+	printf("%s: %llu images of %lld bytes in %.2f s, %.0f images/s, %.1f MB/s, %llu failed\n",
+		transport->Name(), (unsigned long long)images, (long long)size, seconds,
+		seconds > 0 ? images / seconds : 0, seconds > 0 ? images * size / (1024 * 1024) / seconds : 0,
+		(unsigned long long)failed);
+
+	return failed > 0 ? -1 : 0;
+}
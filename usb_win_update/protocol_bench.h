@@ -0,0 +1,26 @@
+#pragma once
+
+#ifndef PROTOCOL_BENCH_H_
+#define PROTOCOL_BENCH_H_
+
+#include <stdint.h>
+
+#include "transport.h"
+
+// Images of --protocol-bench that go through the blocking driver with real
+// data, a fraction of what the simulated driver alone gets through.
+#define PROTOCOL_BENCH_BLOCKING_IMAGES	10000
+
+// Runs |images| images of |size| bytes through the protocol core against a
+// simulated device, first with the simulated driver alone, then with the
+// blocking driver, real data and digests. No device is used, so it runs
+// wherever the core builds. Returns 0, or -1 if any image failed.
+int plcm_protocol_bench(uint64_t images, int64_t size);
+
+// Runs |images| images of |size| bytes through the blocking driver against
+// |transport|, typically a ReplayTransport standing in for a recorded
+// device, and reports how fast they went. Returns 0, or -1 if any image
+// failed.
+int plcm_replay_bench(Transport *transport, uint64_t images, int64_t size);
+
+#endif  // PROTOCOL_BENCH_H_
@@ -0,0 +1,329 @@
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+#include "protocol_driver.h"
+#include "trace.h"
+#include "transport_stats.h"
+
+ssize_t plcm_control(Transport *transport, const plcm_action &action)
+{
+	struct setup_packet setup;
+
+	memset(&setup, 0x00, sizeof(struct setup_packet));
+
+	setup.bRequest = action.request;
+	setup.wValue = action.value;
+	setup.wLength = action.len;
+
+	return transport->ControlIO(action.is_in, &setup, action.data, action.len);
+}
+
+//Sends the image data from |reader| with blocking writes, hashing it when
+//the session has no digest yet
+static int64_t plcm_send_blocking(Transport *transport, PlcmSession *session, ImageReader *reader)
+{
+	BufferPool *pool = transport->Buffers();
+	bool hash = session->NeedsDigest();
+	md5_context md5;
+	int64_t sent = 0;
+	char *block;
+	ssize_t len;
+
+	TRACE_SCOPE("bulk_data");
+
+	md5_init(&md5);
+
+	while ((len = reader->ReadBlock(&block)) > 0) {
+		if (hash)
+			md5_update(&md5, block, len);
+
+		if (transport->Limiter() != NULL)
+			transport->Limiter()->Acquire(len);
+
+		ssize_t written = transport->Write(block, len);
+		pool->Release(block);
+
+		if (written != len)
+			return -1;
+
+		sent += len;
+	}
+
+	if (len < 0)
+		return -1;
+
+	if (hash) {
+		unsigned char digest[MD5_DIGEST_SIZE];
+		char md5_sum[MD5_HEX_SIZE];
+
+		md5_final(&md5, digest);
+		md5_to_hex(digest, md5_sum);
+		session->SetDigest(md5_sum);
+	}
+
+	return sent;
+}
+
+plcm_action plcm_run_controls(Transport *transport, PlcmSession *session, plcm_action action)
+{
+	plcm_event event;
+
+	for (;;) {
+		switch (action.type) {
+		case PLCM_ACTION_CONTROL:
+			event.type = PLCM_EVENT_CONTROL;
+			event.result = plcm_control(transport, action);
+			break;
+
+		case PLCM_ACTION_WAIT: {
+			TRACE_SCOPE("poll_sleep");
+
+			transport->Stats().RecordRetry();
+			std::this_thread::sleep_for(std::chrono::milliseconds(action.delay_ms));
+			event.type = PLCM_EVENT_TIMER;
+			event.result = 0;
+			break;
+		}
+
+		case PLCM_ACTION_SEND_DATA:
+		case PLCM_ACTION_DONE:
+			return action;
+		}
+
+		action = session->Step(event);
+	}
+}
+
+int plcm_run_blocking(Transport *transport, PlcmSession *session, plcm_action action,
+	ImageReader *reader)
+{
+	plcm_event event;
+
+	for (;;) {
+		action = plcm_run_controls(transport, session, action);
+
+		if (action.type == PLCM_ACTION_DONE)
+			return action.status;
+
+		event.type = PLCM_EVENT_DATA;
+		event.result = plcm_send_blocking(transport, session, reader);
+		action = session->Step(event);
+	}
+}
+
+int plcm_run_simulated(PlcmSimDevice *device, PlcmSession *session, plcm_action action)
+{
+	plcm_event event;
+
+	for (;;) {
+		switch (action.type) {
+		case PLCM_ACTION_CONTROL:
+			event.type = PLCM_EVENT_CONTROL;
+			event.result = device->Control(action.is_in, action.request, action.value, action.data,
+				action.len);
+			break;
+
+		case PLCM_ACTION_SEND_DATA:
+			//Nothing to hash, any well formed sum will do
+			if (session->NeedsDigest())
+				session->SetDigest("00000000000000000000000000000000");
+
+			event.type = PLCM_EVENT_DATA;
+			event.result = device->Data(NULL, action.length);
+			break;
+
+		case PLCM_ACTION_WAIT:
+			device->Advance(action.delay_ms);
+			event.type = PLCM_EVENT_TIMER;
+			event.result = 0;
+			break;
+
+		case PLCM_ACTION_DONE:
+			return action.status;
+		}
+
+		action = session->Step(event);
+	}
+}
+
+PlcmAsyncDriver::PlcmAsyncDriver()
+	: transport_(NULL), session_(NULL), reader_(NULL), status_(-1), deadline_us_(0), sent_(0),
+	read_done_(false), failed_(false), depth_(1), held_(NULL), held_len_(0), held_until_us_(0) {
+	action_.type = PLCM_ACTION_DONE;
+	action_.status = -1;
+}
+
+PlcmAsyncDriver::~PlcmAsyncDriver() {
+	Drop();
+}
+
+void PlcmAsyncDriver::Start(Transport *transport, PlcmSession *session, plcm_action action,
+	ImageReader *reader) {
+	transport_ = transport;
+	session_ = session;
+	reader_ = reader;
+	action_ = action;
+	status_ = -1;
+	deadline_us_ = 0;
+
+	md5_init(&md5_);
+	sent_ = 0;
+	read_done_ = false;
+	failed_ = false;
+	depth_ = std::max(1, transport->Buffers()->BlockCount() / 2);
+	held_ = NULL;
+	held_until_us_ = 0;
+}
+
+//Gives back the blocks of an image that ended early
+void PlcmAsyncDriver::Drop() {
+	if (transport_ == NULL)
+		return;
+
+	BufferPool *pool = transport_->Buffers();
+
+	while (transport_->WritesInFlight() > 0) {
+		const void *data;
+
+		transport_->FinishWrite(&data, true);
+		pool->Release((char *)data);
+	}
+
+	if (held_ != NULL) {
+		pool->Release(held_);
+		held_ = NULL;
+	}
+}
+
+//Collects the writes that are done and queues new ones, up to |depth_|.
+//Returns true once the whole image is out or the writes failed.
+bool PlcmAsyncDriver::Pump(engine_wait *wait) {
+	BufferPool *pool = transport_->Buffers();
+	bool hash = session_->NeedsDigest();
+
+	for (;;) {
+		while (transport_->WritesInFlight() > 0) {
+			const void *data;
+			ssize_t ret = transport_->FinishWrite(&data, false);
+
+			if (ret == 0)
+				break;
+
+			pool->Release((char *)data);
+			if (ret < 0)
+				failed_ = true;
+		}
+
+		//Reading with |depth_| writes in flight could leave the reader
+		//waiting for a block only FinishWrite() above gives back
+		if (read_done_ || failed_ || transport_->WritesInFlight() >= depth_)
+			break;
+
+		if (held_ == NULL) {
+			ssize_t read_len = reader_->ReadBlock(&held_);
+
+			if (read_len <= 0) {
+				failed_ = read_len < 0;
+				read_done_ = true;
+				held_ = NULL;
+				break;
+			}
+
+			if (hash)
+				md5_update(&md5_, held_, read_len);
+
+			held_len_ = read_len;
+			held_until_us_ = 0;
+
+			if (transport_->Limiter() != NULL) {
+				uint64_t delay_us = transport_->Limiter()->Reserve(read_len);
+
+				if (delay_us > 0)
+					held_until_us_ = TransportStats::NowUs() + delay_us;
+			}
+		}
+
+		if (held_until_us_ > TransportStats::NowUs()) {
+			wait->deadline_us = held_until_us_;
+			break;
+		}
+
+		//Queued even when it fails; FinishWrite() reports it
+		transport_->WriteAsync(held_, held_len_);
+		sent_ += held_len_;
+		held_ = NULL;
+	}
+
+	if (transport_->WritesInFlight() > 0) {
+		wait->event = transport_->WriteEvent();
+		return false;
+	}
+
+	if (held_ != NULL && !failed_)
+		return false;
+
+	if (held_ != NULL) {
+		pool->Release(held_);
+		held_ = NULL;
+	}
+
+	if (hash && !failed_) {
+		unsigned char digest[MD5_DIGEST_SIZE];
+		char md5_sum[MD5_HEX_SIZE];
+
+		md5_final(&md5_, digest);
+		md5_to_hex(digest, md5_sum);
+		session_->SetDigest(md5_sum);
+	}
+
+	return true;
+}
+
+bool PlcmAsyncDriver::Step(engine_wait *wait) {
+	plcm_event event;
+
+	for (;;) {
+		switch (action_.type) {
+		case PLCM_ACTION_CONTROL:
+			event.type = PLCM_EVENT_CONTROL;
+			event.result = plcm_control(transport_, action_);
+			break;
+
+		case PLCM_ACTION_SEND_DATA:
+			if (!Pump(wait))
+				return true;
+
+			event.type = PLCM_EVENT_DATA;
+			event.result = failed_ ? -1 : sent_;
+			break;
+
+		case PLCM_ACTION_WAIT: {
+			uint64_t now_us = TransportStats::NowUs();
+
+			if (deadline_us_ == 0) {
+				transport_->Stats().RecordRetry();
+				deadline_us_ = now_us + action_.delay_ms * 1000ULL;
+			}
+
+			if (now_us < deadline_us_) {
+				wait->deadline_us = deadline_us_;
+				return true;
+			}
+
+			deadline_us_ = 0;
+			event.type = PLCM_EVENT_TIMER;
+			event.result = 0;
+			break;
+		}
+
+		case PLCM_ACTION_DONE:
+			status_ = action_.status;
+			return false;
+		}
+
+		action_ = session_->Step(event);
+	}
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#ifndef PROTOCOL_DRIVER_H_
+#define PROTOCOL_DRIVER_H_
+
+#include <stdint.h>
+
+#include "engine.h"
+#include "image_reader.h"
+#include "md5.h"
+#include "plcm_sim.h"
+#include "protocol.h"
+#include "transport.h"
+
+// Drivers carrying out the actions of a PlcmSession. Each takes the action
+// returned by PlcmSession::Start() and runs the image to its end.
+
+// Issues the control transfer of |action| on |transport|. Returns the
+// bytes transferred or -1.
+ssize_t plcm_control(Transport *transport, const plcm_action &action);
+
+// Carries out the control transfers and waits from |action| on, from the
+// calling thread, and returns the first action that is neither: the data
+// to send, or the end of the image. Lets a caller send the data its own
+// way and go on with PlcmSession::Step().
+plcm_action plcm_run_controls(Transport *transport, PlcmSession *session, plcm_action action);
+
+// Runs the image on |transport| from the calling thread: control
+// transfers and data block by block from |reader|, sleeping through the
+// waits. Returns the status of the image.
+int plcm_run_blocking(Transport *transport, PlcmSession *session, plcm_action action,
+	ImageReader *reader);
+
+// Runs the image against |device| with no transport, data or sleeping:
+// the data is only counted and the waits move the device clock. Measures
+// the protocol itself. Returns the status of the image.
+int plcm_run_simulated(PlcmSimDevice *device, PlcmSession *session, plcm_action action);
+
+// Runs images from an EventEngine task without ever blocking on the bulk
+// pipe: data goes out through WriteAsync(), at most half the transfer
+// pool at a time, and the waits become engine deadlines. Blocks are read
+// only with fewer writes than that in flight, so the reader finds one
+// without waiting for writes that only this thread collects.
+class PlcmAsyncDriver {
+public:
+	PlcmAsyncDriver();
+	~PlcmAsyncDriver();
+
+	// Begins the image |session| was started with. |reader| stays with the
+	// caller and must outlive the image.
+	void Start(Transport *transport, PlcmSession *session, plcm_action action, ImageReader *reader);
+
+	// Carries out actions until one has to be waited for. Returns true
+	// while the image is in progress, with |wait| filled in; false once it
+	// is over, see Status().
+	bool Step(engine_wait *wait);
+
+	int Status() const { return status_; }
+
+	PlcmAsyncDriver(const PlcmAsyncDriver&) = delete;
+	void operator=(const PlcmAsyncDriver&) = delete;
+
+private:
+	bool Pump(engine_wait *wait);
+	void Drop();
+
+	Transport *transport_;
+	PlcmSession *session_;
+	ImageReader *reader_;
+	plcm_action action_;
+	int status_;
+
+	uint64_t deadline_us_;
+
+	md5_context md5_;
+	int64_t sent_;
+	bool read_done_;
+	bool failed_;
+	size_t depth_;
+	// Block read but held back by the rate limit until |held_until_us_|
+	char *held_;
+	size_t held_len_;
+	uint64_t held_until_us_;
+};
+
+#endif  // PROTOCOL_DRIVER_H_
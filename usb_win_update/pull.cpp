@@ -0,0 +1,94 @@
+#include "stdafx.h"
+
+#include <algorithm>
+#include <deque>
+
+#include "pull.h"
+#include "trace.h"
+
+int64_t pull_stream(Transport* transport, ImageWriter* writer, uint64_t length,
+	char md5_sum[MD5_HEX_SIZE])
+{
+	BufferPool* pool = transport->Buffers();
+	size_t depth = (size_t)std::max(1, pool->BlockCount() / 2);
+	std::deque<size_t> lengths;
+	uint64_t requested = 0;
+	uint64_t received = 0;
+	bool failed = false;
+	md5_context md5;
+
+	TRACE_SCOPE("bulk_pull");
+
+	md5_init(&md5);
+
+	while (!failed && received < length) {
+		while (transport->ReadsInFlight() < depth && requested < length) {
+			char* block = (char*)pool->TryAcquire();
+
+			//Blocks still being written come back once the writer is done
+			if (block == NULL) {
+				if (transport->ReadsInFlight() > 0)
+					break;
+				if (writer->Finish() < 0) {
+					failed = true;
+					break;
+				}
+				block = (char*)pool->Acquire();
+			}
+
+			size_t len = (size_t)std::min<uint64_t>(pool->BlockSize(), length - requested);
+
+			//Queued even when it fails; FinishRead() reports it
+			transport->ReadAsync(block, len);
+			lengths.push_back(len);
+			requested += len;
+		}
+
+		if (transport->ReadsInFlight() == 0)
+			break;
+
+		void* data;
+		ssize_t got = transport->FinishRead(&data, true);
+		size_t len = lengths.front();
+
+		lengths.pop_front();
+
+		if (got < 0 || (size_t)got > len) {
+			pool->Release((char*)data);
+			failed = true;
+			break;
+		}
+
+		//The rest of this read comes with the ones behind it
+		requested -= len - got;
+
+		if (got == 0) {
+			pool->Release((char*)data);
+			continue;
+		}
+
+		md5_update(&md5, data, got);
+		received += got;
+
+		if (writer->WriteBlock((char*)data, got) < 0)
+			failed = true;
+	}
+
+	//The buffers must not go back to the pool under reads still queued
+	while (transport->ReadsInFlight() > 0) {
+		void* data;
+
+		transport->FinishRead(&data, true);
+		pool->Release((char*)data);
+	}
+
+	if (writer->Finish() < 0)
+		failed = true;
+
+	unsigned char digest[MD5_DIGEST_SIZE];
+
+	md5_final(&md5, digest);
+	md5_to_hex(digest, md5_sum);
+
+	return failed ? -1 : (int64_t)received;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#ifndef PULL_H_
+#define PULL_H_
+
+#include <stdint.h>
+
+#include "image_writer.h"
+#include "md5.h"
+#include "transport.h"
+
+// Receives |length| bytes of bulk IN data from |transport| into |writer|.
+//
+// Up to half of the transport's pool is kept in flight as reads straight
+// into pool blocks; each block is hashed as it completes and handed to
+// the writer, which gives it back once on disk, so the pipe, the digest
+// and the disk all work at once. Reads never ask for more than is left,
+// so a short packet only shifts the rest of the stream onto the reads
+// behind it and nothing of a later transfer is swallowed.
+//
+// Stores the hex MD5 sum of what arrived in |md5_sum| and returns the
+// number of bytes received, or -1 on a read or write error.
+int64_t pull_stream(Transport* transport, ImageWriter* writer, uint64_t length,
+	char md5_sum[MD5_HEX_SIZE]);
+
+#endif  // PULL_H_
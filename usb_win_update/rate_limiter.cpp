@@ -0,0 +1,42 @@
+#include <chrono>
+#include <thread>
+
+#include "rate_limiter.h"
+#include "trace.h"
+#include "transport_stats.h"
+
+RateLimiter::RateLimiter(double bytes_per_s, double burst)
+	: rate_(bytes_per_s), burst_(burst), tokens_(burst), last_us_(TransportStats::NowUs()),
+	wait_us_(0) {}
+
+uint64_t RateLimiter::Reserve(size_t bytes) {
+	std::lock_guard<std::mutex> lock(lock_);
+	uint64_t now_us = TransportStats::NowUs();
+
+	tokens_ += (now_us - last_us_) * rate_ / 1e6;
+	if (tokens_ > burst_)
+		tokens_ = burst_;
+	last_us_ = now_us;
+
+	// Writes bigger than the burst just run the bucket into debt, which
+	// the following ones pay back.
+	tokens_ -= bytes;
+	if (tokens_ >= 0)
+		return 0;
+
+	uint64_t wait_us = (uint64_t)(-tokens_ * 1e6 / rate_);
+
+	wait_us_ += wait_us;
+	return wait_us;
+}
+
+void RateLimiter::Acquire(size_t bytes) {
+	uint64_t sleep_us = Reserve(bytes);
+
+	if (sleep_us == 0)
+		return;
+
+	TRACE_SCOPE("rate_limit");
+
+	std::this_thread::sleep_for(std::chrono::microseconds(sleep_us));
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#ifndef RATE_LIMITER_H_
+#define RATE_LIMITER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <mutex>
+
+// Token bucket capping the bulk throughput of one device.
+//
+// Tokens are bytes, refilled at |bytes_per_s| up to |burst| bytes. Acquire()
+// takes the tokens for a write and sleeps when there are not enough, so a
+// device never holds the bus above its share for longer than one burst.
+class RateLimiter {
+public:
+	RateLimiter(double bytes_per_s, double burst);
+
+	// Waits until |bytes| may be written.
+	void Acquire(size_t bytes);
+
+	// Takes the tokens for |bytes| without waiting. Returns how many
+	// microseconds the caller must hold the write back, 0 for none.
+	uint64_t Reserve(size_t bytes);
+
+	double BytesPerSecond() const { return rate_; }
+
+	// Total time spent waiting in Acquire().
+	uint64_t WaitUs() const { return wait_us_; }
+
+	RateLimiter(const RateLimiter&) = delete;
+	void operator=(const RateLimiter&) = delete;
+
+private:
+	double rate_;
+	double burst_;
+
+	std::mutex lock_;
+	double tokens_;
+	uint64_t last_us_;
+	uint64_t wait_us_;
+};
+
+#endif  // RATE_LIMITER_H_
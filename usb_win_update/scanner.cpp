@@ -0,0 +1,355 @@
+#include "stdafx.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <sys/stat.h>
+#endif
+
+#include <algorithm>
+
+#include "digest_cache.h"
+#include "scanner.h"
+#include "trace.h"
+
+#if defined(_WIN32)
+#define SCANNER_PATH_SEPARATOR "\\"
+#else
+#define SCANNER_PATH_SEPARATOR "/"
+
+static int fopen_s(FILE** fp, const char* fileName, const char* mode) {
+	*fp = fopen(fileName, mode);
+	return *fp ? 0 : errno;
+}
+#endif
+
+// Subdirectories are only shared while fewer than this many are waiting.
+#define SCANNER_QUEUE_LIMIT 256
+
+#define PREFETCH_READ_SIZE (1024 * 1024)
+
+DirectoryScanner::DirectoryScanner(int threads)
+	: threads_(threads < 1 ? 1 : threads), pending_(0), total_bytes_(0), directories_(0), errors_(0) {}
+
+#if defined(_WIN32)
+// FILETIME counts 100 ns intervals since 1601-01-01.
+static int64_t filetime_to_unix(const FILETIME& ft) {
+	uint64_t t = ((uint64_t)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+
+	return (int64_t)(t / 10000000ULL) - 11644473600LL;
+}
+
+static int64_t filetime_to_unix_ns(const FILETIME& ft) {
+	uint64_t t = ((uint64_t)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+
+	return ((int64_t)t - 116444736000000000LL) * 100;
+}
+#endif
+
+int DirectoryScanner::ReadDirectory(const std::string& dir, std::vector<std::string>* subdirs,
+	std::vector<manifest_entry>* files) {
+#if defined(_WIN32)
+	WIN32_FIND_DATAA data;
+	std::string pattern = dir + "\\*";
+
+	HANDLE handle = FindFirstFileExA(pattern.c_str(), FindExInfoBasic, &data,
+		FindExSearchNameMatch, NULL, FIND_FIRST_EX_LARGE_FETCH);
+
+	if (handle == INVALID_HANDLE_VALUE) {
+		fprintf(stderr, "Failed to read the directory %s: %lu\n", dir.c_str(), GetLastError());
+		return -1;
+	}
+
+	do {
+		if (strcmp(data.cFileName, ".") == 0 || strcmp(data.cFileName, "..") == 0)
+			continue;
+
+		std::string path = dir + SCANNER_PATH_SEPARATOR + data.cFileName;
+
+		if (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+			if (!(data.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT))
+				subdirs->push_back(path);
+			continue;
+		}
+
+		manifest_entry entry;
+
+		entry.path = path;
+		entry.name = data.cFileName;
+		entry.size = ((int64_t)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+		entry.mtime = filetime_to_unix(data.ftLastWriteTime);
+		entry.mtime_ns = filetime_to_unix_ns(data.ftLastWriteTime);
+		files->push_back(entry);
+	} while (FindNextFileA(handle, &data));
+
+	FindClose(handle);
+#else
+	DIR* d = opendir(dir.c_str());
+
+	if (d == NULL) {
+		fprintf(stderr, "Failed to read the directory %s: %d\n", dir.c_str(), errno);
+		return -1;
+	}
+
+	struct dirent* ent;
+	while ((ent = readdir(d)) != NULL) {
+		if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+			continue;
+
+		std::string path = dir + SCANNER_PATH_SEPARATOR + ent->d_name;
+		struct stat st;
+
+		if (lstat(path.c_str(), &st) != 0)
+			continue;
+
+		if (S_ISDIR(st.st_mode)) {
+			subdirs->push_back(path);
+			continue;
+		}
+
+		if (!S_ISREG(st.st_mode))
+			continue;
+
+		manifest_entry entry;
+
+		entry.path = path;
+		entry.name = ent->d_name;
+		entry.size = st.st_size;
+		entry.mtime = st.st_mtime;
+		entry.mtime_ns = (int64_t)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+		files->push_back(entry);
+	}
+
+	closedir(d);
+#endif
+
+	return 0;
+}
+
+void DirectoryScanner::Worker() {
+	std::vector<std::string> stack;
+	std::vector<std::string> subdirs;
+	std::vector<manifest_entry> files;
+	int64_t bytes = 0;
+	int dirs = 0;
+	int errors = 0;
+
+	trace_set_thread_name("scan worker");
+
+	for (;;) {
+		std::string dir;
+
+		if (!stack.empty()) {
+			dir = std::move(stack.back());
+			stack.pop_back();
+		}
+		else {
+			std::unique_lock<std::mutex> lock(lock_);
+
+			queue_cv_.wait(lock, [this] { return !queue_.empty() || pending_ == 0; });
+			if (queue_.empty())
+				break;
+
+			dir = std::move(queue_.back());
+			queue_.pop_back();
+		}
+
+		subdirs.clear();
+		size_t first_file = files.size();
+
+		{
+			TRACE_SCOPE("scan_directory");
+			if (ReadDirectory(dir, &subdirs, &files) < 0)
+				errors++;
+		}
+
+		dirs++;
+		for (size_t i = first_file; i < files.size(); i++)
+			bytes += files[i].size;
+
+		std::lock_guard<std::mutex> lock(lock_);
+
+		// Keep the shared queue fed for idle workers, the rest stays local.
+		for (std::string& subdir : subdirs) {
+			if (queue_.size() < SCANNER_QUEUE_LIMIT)
+				queue_.push_back(std::move(subdir));
+			else
+				stack.push_back(std::move(subdir));
+		}
+
+		pending_ += (int)subdirs.size() - 1;
+		if (!queue_.empty() || pending_ == 0)
+			queue_cv_.notify_all();
+	}
+
+	std::lock_guard<std::mutex> lock(lock_);
+
+	manifest_.insert(manifest_.end(), std::make_move_iterator(files.begin()),
+		std::make_move_iterator(files.end()));
+	total_bytes_ += bytes;
+	directories_ += dirs;
+	errors_ += errors;
+}
+
+int DirectoryScanner::Scan(const char *base_dir) {
+	TRACE_SCOPE("scan");
+
+	manifest_.clear();
+	total_bytes_ = 0;
+	directories_ = 0;
+	errors_ = 0;
+
+	queue_.push_back(base_dir);
+	pending_ = 1;
+
+	std::vector<std::thread> workers;
+	for (int i = 0; i < threads_; i++)
+		workers.push_back(std::thread(&DirectoryScanner::Worker, this));
+	for (std::thread& worker : workers)
+		worker.join();
+
+	// The base directory is always read first, by whichever worker got it.
+	if (directories_ == 1 && errors_ == 1)
+		return -1;
+
+	std::sort(manifest_.begin(), manifest_.end(),
+		[](const manifest_entry& a, const manifest_entry& b) { return a.path < b.path; });
+
+	return (int)manifest_.size();
+}
+
+DigestPrefetcher::DigestPrefetcher(const std::vector<manifest_entry>& manifest,
+	const std::vector<size_t>& order, int threads, size_t window, DigestCache *cache)
+	: manifest_(manifest), order_(order), window_(window < 1 ? 1 : window), cache_(cache),
+	digests_(order.size()),
+	next_(0), consumer_(0), stop_(false) {
+	for (digest& d : digests_) {
+		d.ready = false;
+		d.failed = false;
+	}
+
+	for (int i = 0; i < threads; i++)
+		workers_.push_back(std::thread(&DigestPrefetcher::Worker, this));
+}
+
+DigestPrefetcher::~DigestPrefetcher() {
+	{
+		std::lock_guard<std::mutex> lock(lock_);
+		stop_ = true;
+	}
+	work_cv_.notify_all();
+
+	for (std::thread& worker : workers_)
+		worker.join();
+}
+
+void DigestPrefetcher::Worker() {
+	std::vector<unsigned char> buf(PREFETCH_READ_SIZE);
+
+	trace_set_thread_name("hash worker");
+
+	for (;;) {
+		size_t index;
+
+		{
+			std::unique_lock<std::mutex> lock(lock_);
+
+			work_cv_.wait(lock, [this] {
+				return stop_ || (next_ < digests_.size() && next_ < consumer_ + window_);
+			});
+			if (stop_)
+				return;
+
+			index = next_++;
+		}
+
+		const manifest_entry& entry = manifest_[order_[index]];
+		unsigned char md5_digest[MD5_DIGEST_SIZE];
+		char cached[MD5_HEX_SIZE];
+		md5_context md5;
+		bool failed = false;
+		FILE *fp;
+
+		if (cache_ != NULL && cache_->Lookup(entry, cached)) {
+			std::lock_guard<std::mutex> lock(lock_);
+			digest& d = digests_[index];
+
+			memcpy(d.hex, cached, MD5_HEX_SIZE);
+			d.failed = false;
+			d.ready = true;
+			ready_cv_.notify_all();
+			continue;
+		}
+
+		TraceScope trace("prehash");
+
+		fopen_s(&fp, entry.path.c_str(), "rb");
+		if (fp != NULL) {
+			size_t len;
+			uint64_t total = 0;
+
+			md5_init(&md5);
+			while ((len = fread(&buf[0], 1, buf.size(), fp)) > 0) {
+				md5_update(&md5, &buf[0], len);
+				total += len;
+			}
+
+			failed = ferror(fp) != 0;
+			fclose(fp);
+			trace.SetBytes(total);
+		}
+		else {
+			failed = true;
+		}
+
+		trace.End();
+
+		std::lock_guard<std::mutex> lock(lock_);
+		digest& d = digests_[index];
+
+		if (!failed) {
+			md5_final(&md5, md5_digest);
+			md5_to_hex(md5_digest, d.hex);
+			if (cache_ != NULL)
+				cache_->Store(entry, d.hex);
+		}
+		d.failed = failed;
+		d.ready = true;
+		ready_cv_.notify_all();
+	}
+}
+
+int DigestPrefetcher::Get(size_t position, char md5_sum[MD5_HEX_SIZE]) {
+	std::unique_lock<std::mutex> lock(lock_);
+
+	if (position >= digests_.size())
+		return -1;
+
+	if (consumer_ < position) {
+		consumer_ = position;
+		work_cv_.notify_all();
+	}
+
+	TRACE_SCOPE("prehash_wait");
+
+	// Without workers nothing would ever fill the slot.
+	if (workers_.empty())
+		return -1;
+
+	ready_cv_.wait(lock, [this, position] { return digests_[position].ready; });
+
+	// The entry is about to be sent, let the workers move past it.
+	consumer_ = position + 1;
+	work_cv_.notify_all();
+
+	if (digests_[position].failed)
+		return -1;
+
+	memcpy(md5_sum, digests_[position].hex, MD5_HEX_SIZE);
+	return 0;
+}
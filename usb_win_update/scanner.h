@@ -0,0 +1,131 @@
+#pragma once
+
+#ifndef SCANNER_H_
+#define SCANNER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "md5.h"
+
+class DigestCache;
+
+/// One regular file found under the scanned directory.
+struct manifest_entry {
+	/// Host path, base directory included
+	std::string path;
+
+	/// File name without the directory
+	std::string name;
+
+	int64_t size;
+
+	/// Last write time, seconds since the Unix epoch
+	int64_t mtime;
+
+	/// Last write time at full resolution, nanoseconds since the Unix epoch
+	int64_t mtime_ns;
+
+	/// MD5 sum as hex when it was computed ahead, "" otherwise
+	std::string md5;
+};
+
+// Iterative, multi-threaded directory walker.
+//
+// Directories are enumerated by a small pool of threads. Each thread walks
+// depth first from its own explicit stack and only hands subdirectories to
+// the shared queue while that queue is short, so the queue and its lock
+// stay small and there is no recursion however deep the tree is. A stack
+// holds the paths of the subdirectories not walked yet at every level of
+// the current branch, so a wide tree keeps all their siblings around.
+// Directory junctions and symbolic links are not followed.
+class DirectoryScanner {
+public:
+	explicit DirectoryScanner(int threads);
+
+	// Walks |base_dir| and fills the manifest, sorted by path so transfers
+	// happen in a stable order. Returns the number of files, or -1 if
+	// |base_dir| cannot be read.
+	int Scan(const char *base_dir);
+
+	const std::vector<manifest_entry>& Manifest() const { return manifest_; }
+	int64_t TotalBytes() const { return total_bytes_; }
+	int Directories() const { return directories_; }
+	int Errors() const { return errors_; }
+
+	DirectoryScanner(const DirectoryScanner&) = delete;
+	void operator=(const DirectoryScanner&) = delete;
+
+private:
+	void Worker();
+	int ReadDirectory(const std::string& dir, std::vector<std::string>* subdirs,
+		std::vector<manifest_entry>* files);
+
+	int threads_;
+
+	std::mutex lock_;
+	std::condition_variable queue_cv_;
+	std::vector<std::string> queue_;
+	// Directories queued or being read; the walk is over when it drops to 0.
+	int pending_;
+
+	std::vector<manifest_entry> manifest_;
+	int64_t total_bytes_;
+	int directories_;
+	int errors_;
+};
+
+// Hashes files of a manifest on worker threads ahead of the transfer.
+//
+// |order| lists the manifest indexes in the order they will be sent.
+// Workers take files in that order, at most |window| entries past the one
+// being transferred, so digests are ready when a file's turn comes
+// without reading the whole tree up front. Files |cache| knows unchanged
+// are not read at all, the others are added to it; |cache| may be NULL.
+class DigestPrefetcher {
+public:
+	DigestPrefetcher(const std::vector<manifest_entry>& manifest, const std::vector<size_t>& order,
+		int threads, size_t window, DigestCache *cache);
+	~DigestPrefetcher();
+
+	// Waits for the MD5 sum of the file at |position| in the send order and
+	// stores it as hex in |md5_sum|. Also moves the window forward. Returns
+	// 0, or -1 if the file could not be read.
+	int Get(size_t position, char md5_sum[MD5_HEX_SIZE]);
+
+	DigestPrefetcher(const DigestPrefetcher&) = delete;
+	void operator=(const DigestPrefetcher&) = delete;
+
+private:
+	struct digest {
+		bool ready;
+		bool failed;
+		char hex[MD5_HEX_SIZE];
+	};
+
+	void Worker();
+
+	const std::vector<manifest_entry>& manifest_;
+	std::vector<size_t> order_;
+	size_t window_;
+	DigestCache *cache_;
+
+	std::mutex lock_;
+	std::condition_variable work_cv_;
+	std::condition_variable ready_cv_;
+	std::vector<digest> digests_;
+	size_t next_;
+	size_t consumer_;
+	bool stop_;
+
+	std::vector<std::thread> workers_;
+};
+
+#endif  // SCANNER_H_
@@ -0,0 +1,336 @@
+#include "stdafx.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+
+#include "scheduler.h"
+#include "trace.h"
+
+#if !defined(_WIN32)
+static int fopen_s(FILE** fp, const char* fileName, const char* mode) {
+	*fp = fopen(fileName, mode);
+	return *fp ? 0 : errno;
+}
+#endif
+
+#define TAR_BLOCK_SIZE 512
+#define TAR_NAME_SIZE 100
+
+const char* const schedule_policy_names[] = { "path", "largest", "shortest", NULL };
+
+/// Manifest order, which is sorted by path.
+class PathPolicy : public SchedulePolicy {
+public:
+	const char* Name() const override { return "path"; }
+	void Order(std::vector<transfer_item>*) const override {}
+};
+
+/// Biggest transfers first, so they never end up last on a busy device.
+class LargestFirstPolicy : public SchedulePolicy {
+public:
+	const char* Name() const override { return "largest"; }
+	void Order(std::vector<transfer_item>* items) const override {
+		std::stable_sort(items->begin(), items->end(),
+			[](const transfer_item& a, const transfer_item& b) { return a.bytes > b.bytes; });
+	}
+};
+
+/// Smallest transfers first, so most files are verified early.
+class ShortestFirstPolicy : public SchedulePolicy {
+public:
+	const char* Name() const override { return "shortest"; }
+	void Order(std::vector<transfer_item>* items) const override {
+		std::stable_sort(items->begin(), items->end(),
+			[](const transfer_item& a, const transfer_item& b) { return a.bytes < b.bytes; });
+	}
+};
+
+SchedulePolicy* schedule_policy_create(const char* name) {
+	if (strcmp(name, "path") == 0)
+		return new PathPolicy();
+	if (strcmp(name, "largest") == 0)
+		return new LargestFirstPolicy();
+	if (strcmp(name, "shortest") == 0)
+		return new ShortestFirstPolicy();
+
+	return NULL;
+}
+
+static int64_t tar_padded(int64_t size) {
+	return (size + TAR_BLOCK_SIZE - 1) / TAR_BLOCK_SIZE * TAR_BLOCK_SIZE;
+}
+
+// Header blocks of one member: a GNU long name record when the name does
+// not fit the ustar name field, then the ustar header.
+static int64_t tar_header_size(const std::string& name) {
+	if (name.size() < TAR_NAME_SIZE)
+		return TAR_BLOCK_SIZE;
+
+	return 2 * TAR_BLOCK_SIZE + tar_padded(name.size() + 1);
+}
+
+static void tar_octal(char* field, int len, int64_t value) {
+	snprintf(field, len, "%0*llo", len - 1, (unsigned long long)value);
+}
+
+static void tar_fill_header(unsigned char* header, const char* name, int64_t size, int64_t mtime,
+	char type) {
+	memset(header, 0, TAR_BLOCK_SIZE);
+
+	strncpy_s((char*)header, TAR_NAME_SIZE, name, _TRUNCATE);
+	tar_octal((char*)header + 100, 8, 0644);
+	tar_octal((char*)header + 108, 8, 0);
+	tar_octal((char*)header + 116, 8, 0);
+	tar_octal((char*)header + 124, 12, size);
+	tar_octal((char*)header + 136, 12, mtime > 0 ? mtime : 0);
+	header[156] = type;
+	memcpy(header + 257, "ustar", 6);
+	memcpy(header + 263, "00", 2);
+
+	unsigned int sum = 0;
+	memset(header + 148, ' ', 8);
+	for (int i = 0; i < TAR_BLOCK_SIZE; i++)
+		sum += header[i];
+	snprintf((char*)header + 148, 8, "%06o", sum);
+}
+
+std::vector<transfer_item> schedule_plan(const std::vector<manifest_entry>& manifest,
+	const SchedulePolicy& policy, const schedule_options& options) {
+	std::vector<transfer_item> items;
+	transfer_item batch;
+
+	TRACE_SCOPE("schedule_plan");
+
+	batch.bytes = 0;
+	batch.batch = true;
+
+	for (size_t i = 0; i < manifest.size(); i++) {
+		const manifest_entry& entry = manifest[i];
+
+		if (entry.size == 0)
+			continue;
+
+		if (entry.size > options.batch_threshold) {
+			transfer_item item;
+
+			item.files.push_back(i);
+			item.bytes = entry.size;
+			item.batch = false;
+			items.push_back(item);
+			continue;
+		}
+
+		batch.files.push_back(i);
+		batch.bytes += tar_header_size(entry.name) + tar_padded(entry.size);
+
+		if (batch.bytes >= options.batch_size) {
+			batch.bytes += 2 * TAR_BLOCK_SIZE;
+			items.push_back(batch);
+			batch.files.clear();
+			batch.bytes = 0;
+		}
+	}
+
+	if (!batch.files.empty()) {
+		batch.bytes += 2 * TAR_BLOCK_SIZE;
+		items.push_back(batch);
+	}
+
+	// A batch of one is just a file with extra framing.
+	for (transfer_item& item : items) {
+		if (item.batch && item.files.size() == 1) {
+			item.batch = false;
+			item.bytes = manifest[item.files[0]].size;
+		}
+	}
+
+	policy.Order(&items);
+
+	return items;
+}
+
+/// Builds the ustar stream of a batch on the fly, straight into pool blocks.
+class TarBatchReader : public ImageReader {
+public:
+	TarBatchReader(const std::vector<manifest_entry>& manifest, const transfer_item& item,
+		BufferPool* pool)
+		: manifest_(manifest), item_(item), pool_(pool), member_(0), fp_(NULL),
+		header_pos_(0), data_left_(0), pad_left_(0), trailer_left_(2 * TAR_BLOCK_SIZE),
+		failed_(false) {}
+	~TarBatchReader() override {
+		if (fp_ != NULL)
+			fclose(fp_);
+	}
+
+	int64_t Size() const override { return item_.bytes; }
+	ssize_t ReadBlock(char** block) override;
+	const char* Kind() const override { return "batch"; }
+
+private:
+	bool StartMember();
+	size_t Fill(char* buf, size_t len);
+
+	const std::vector<manifest_entry>& manifest_;
+	transfer_item item_;
+	BufferPool* pool_;
+
+	size_t member_;
+	FILE* fp_;
+	std::vector<unsigned char> header_;
+	size_t header_pos_;
+	int64_t data_left_;
+	int64_t pad_left_;
+	int64_t trailer_left_;
+	bool failed_;
+};
+
+bool TarBatchReader::StartMember() {
+	const manifest_entry& entry = manifest_[item_.files[member_]];
+	const std::string& name = entry.name;
+
+	header_.assign((size_t)tar_header_size(name), 0);
+
+	unsigned char* ustar = &header_[0];
+	if (name.size() >= TAR_NAME_SIZE) {
+		tar_fill_header(ustar, "././@LongLink", name.size() + 1, 0, 'L');
+		memcpy(ustar + TAR_BLOCK_SIZE, name.c_str(), name.size());
+		ustar = &header_[header_.size() - TAR_BLOCK_SIZE];
+	}
+	tar_fill_header(ustar, name.c_str(), entry.size, entry.mtime, '0');
+
+	header_pos_ = 0;
+	data_left_ = entry.size;
+	pad_left_ = tar_padded(entry.size) - entry.size;
+
+	fopen_s(&fp_, entry.path.c_str(), "rb");
+	if (fp_ == NULL) {
+		fprintf(stderr, "Failed to open %s\n", entry.path.c_str());
+		return false;
+	}
+
+	return true;
+}
+
+size_t TarBatchReader::Fill(char* buf, size_t len) {
+	size_t filled = 0;
+
+	while (filled < len && !failed_) {
+		if (header_pos_ < header_.size()) {
+			size_t take = std::min(len - filled, header_.size() - header_pos_);
+
+			memcpy(buf + filled, &header_[header_pos_], take);
+			header_pos_ += take;
+			filled += take;
+		}
+		else if (data_left_ > 0) {
+			size_t take = (size_t)std::min<int64_t>(len - filled, data_left_);
+			size_t read_len = fread(buf + filled, 1, take, fp_);
+
+			// The file shrank since the scan; the batch can't be sent right.
+			if (read_len == 0) {
+				fprintf(stderr, "%s changed while being sent\n",
+					manifest_[item_.files[member_]].path.c_str());
+				failed_ = true;
+				break;
+			}
+
+			data_left_ -= read_len;
+			filled += read_len;
+		}
+		else if (pad_left_ > 0) {
+			size_t take = (size_t)std::min<int64_t>(len - filled, pad_left_);
+
+			memset(buf + filled, 0, take);
+			pad_left_ -= take;
+			filled += take;
+		}
+		else if (fp_ != NULL || (member_ == 0 && header_.empty())) {
+			// Current member done (or none started yet), move to the next one.
+			if (fp_ != NULL) {
+				fclose(fp_);
+				fp_ = NULL;
+				member_++;
+			}
+
+			if (member_ < item_.files.size()) {
+				if (!StartMember())
+					failed_ = true;
+			}
+			else {
+				header_.clear();
+				header_pos_ = 0;
+				member_ = item_.files.size();
+			}
+		}
+		else if (trailer_left_ > 0) {
+			size_t take = (size_t)std::min<int64_t>(len - filled, trailer_left_);
+
+			memset(buf + filled, 0, take);
+			trailer_left_ -= take;
+			filled += take;
+		}
+		else {
+			break;
+		}
+	}
+
+	return filled;
+}
+
+ssize_t TarBatchReader::ReadBlock(char** block) {
+	if (failed_)
+		return -1;
+
+	char* buf = (char*)pool_->Acquire();
+	if (buf == NULL)
+		return -1;
+
+	size_t len = Fill(buf, pool_->BlockSize());
+
+	if (failed_ || len == 0) {
+		pool_->Release(buf);
+		return failed_ ? -1 : 0;
+	}
+
+	*block = buf;
+	return len;
+}
+
+ImageReader* schedule_open_batch(const std::vector<manifest_entry>& manifest,
+	const transfer_item& item, BufferPool* pool) {
+	if (!item.batch || item.files.empty() || pool == NULL || !pool->IsValid())
+		return NULL;
+
+	return new TarBatchReader(manifest, item, pool);
+}
+
+schedule_estimate schedule_estimate_run(const std::vector<transfer_item>& items,
+	const schedule_cost_model& model) {
+	schedule_estimate estimate;
+	double now = 0;
+	double file_sum = 0;
+	size_t files = 0;
+
+	estimate.first_verified_ms = 0;
+	estimate.transfers = (int)items.size();
+
+	for (const transfer_item& item : items) {
+		now += model.handshake_ms + item.bytes / model.bytes_per_ms;
+
+		if (files == 0)
+			estimate.first_verified_ms = now;
+
+		// Every file of a batch is verified when the batch is.
+		file_sum += now * item.files.size();
+		files += item.files.size();
+	}
+
+	estimate.makespan_ms = now;
+	estimate.mean_file_ms = files ? file_sum / files : 0;
+
+	return estimate;
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+#ifndef SCHEDULER_H_
+#define SCHEDULER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "image_reader.h"
+#include "scanner.h"
+
+/// One transfer handed to the device: a single file, or a batch of small
+/// files sent as one ustar stream.
+struct transfer_item {
+	/// Manifest indexes of the files carried by this transfer
+	std::vector<size_t> files;
+
+	/// Bytes put on the wire, tar framing included for batches
+	int64_t bytes;
+
+	bool batch;
+};
+
+// Decides the order in which transfers go out. Implementations only sort;
+// grouping small files is done by schedule_plan().
+class SchedulePolicy {
+public:
+	SchedulePolicy() = default;
+	virtual ~SchedulePolicy() = default;
+
+	// Name used on the command line and in reports.
+	virtual const char* Name() const = 0;
+
+	// Sorts |items| into sending order. |items| comes in manifest (path)
+	// order; the sort must be stable so ties keep that order.
+	virtual void Order(std::vector<transfer_item>* items) const = 0;
+
+	SchedulePolicy(const SchedulePolicy&) = delete;
+	void operator=(const SchedulePolicy&) = delete;
+};
+
+// Returns the policy called |name| ("path", "largest", "shortest"), or
+// NULL if there is none.
+SchedulePolicy* schedule_policy_create(const char* name);
+
+// NULL terminated list of the policy names.
+extern const char* const schedule_policy_names[];
+
+struct schedule_options {
+	/// Files up to this size are batched, 0 disables batching
+	int64_t batch_threshold;
+
+	/// Target payload of one batch
+	int64_t batch_size;
+};
+
+#define SCHEDULE_DEFAULT_BATCH_THRESHOLD	(64 * 1024)
+#define SCHEDULE_DEFAULT_BATCH_SIZE			(4 * 1024 * 1024)
+
+// Groups the small files of |manifest| into batches and orders the
+// resulting transfers with |policy|. Empty files are left out, as the
+// device does not take them.
+std::vector<transfer_item> schedule_plan(const std::vector<manifest_entry>& manifest,
+	const SchedulePolicy& policy, const schedule_options& options);
+
+// Returns a reader producing the ustar stream of the files of |item|, in
+// blocks of |pool|. Member names are the file names without directory.
+// Reading fails if a file no longer has its manifest size.
+ImageReader* schedule_open_batch(const std::vector<manifest_entry>& manifest,
+	const transfer_item& item, BufferPool* pool);
+
+// Simple model of one device link, for comparing policies without one.
+struct schedule_cost_model {
+	/// Fixed cost of a transfer: metadata, polling, MD5 and status exchange
+	double handshake_ms;
+
+	/// Bulk throughput
+	double bytes_per_ms;
+};
+
+struct schedule_estimate {
+	/// Time until the last transfer is verified
+	double makespan_ms;
+
+	/// Mean time until a file is verified
+	double mean_file_ms;
+
+	/// Time until the first transfer is verified
+	double first_verified_ms;
+
+	int transfers;
+};
+
+// Replays |items| against |model|, one transfer after the other.
+schedule_estimate schedule_estimate_run(const std::vector<transfer_item>& items,
+	const schedule_cost_model& model);
+
+#endif  // SCHEDULER_H_
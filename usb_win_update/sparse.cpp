@@ -0,0 +1,381 @@
+#include "stdafx.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#include <emmintrin.h>
+#define SPARSE_USE_SSE2 1
+#endif
+
+#include "sparse.h"
+#include "trace.h"
+
+#if !defined(_WIN32)
+static int fopen_s(FILE** fp, const char* fileName, const char* mode) {
+	*fp = fopen(fileName, mode);
+	return *fp ? 0 : errno;
+}
+#endif
+
+#define SPARSE_FILE_HEADER_SIZE		28
+#define SPARSE_CHUNK_HEADER_SIZE	12
+
+bool sparse_block_fill_value(const void* data, size_t len, uint32_t* value) {
+	const unsigned char* p = (const unsigned char*)data;
+	uint32_t word;
+	size_t i = 0;
+
+	if (len < 4)
+		return false;
+
+	memcpy(&word, p, 4);
+
+#if defined(SPARSE_USE_SSE2)
+	const __m128i pattern = _mm_set1_epi32((int)word);
+
+	for (; i + 64 <= len; i += 64) {
+		__m128i d0 = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(p + i)), pattern);
+		__m128i d1 = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(p + i + 16)), pattern);
+		__m128i d2 = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(p + i + 32)), pattern);
+		__m128i d3 = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(p + i + 48)), pattern);
+		__m128i diff = _mm_or_si128(_mm_or_si128(d0, d1), _mm_or_si128(d2, d3));
+
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(diff, _mm_setzero_si128())) != 0xffff)
+			return false;
+	}
+#endif
+
+	for (; i + 4 <= len; i += 4) {
+		uint32_t w;
+
+		memcpy(&w, p + i, 4);
+		if (w != word)
+			return false;
+	}
+
+	*value = word;
+	return true;
+}
+
+void sparse_digest_fill(md5_context* md5, uint32_t value, uint64_t bytes) {
+	uint32_t buf[SPARSE_BLOCK_SIZE / 4];
+
+	for (size_t i = 0; i < SPARSE_BLOCK_SIZE / 4; i++)
+		buf[i] = value;
+
+	while (bytes > 0) {
+		size_t len = bytes < sizeof(buf) ? (size_t)bytes : sizeof(buf);
+
+		md5_update(md5, buf, len);
+		bytes -= len;
+	}
+}
+
+static bool sparse_header_ok(const sparse_header* header) {
+	return header->magic == SPARSE_HEADER_MAGIC &&
+		header->major_version == SPARSE_MAJOR_VERSION &&
+		header->file_hdr_sz >= SPARSE_FILE_HEADER_SIZE && header->file_hdr_sz <= 64 &&
+		header->chunk_hdr_sz >= SPARSE_CHUNK_HEADER_SIZE && header->chunk_hdr_sz <= 64 &&
+		header->blk_sz != 0 && header->blk_sz % 4 == 0;
+}
+
+int sparse_read_header(const char* fileName, sparse_header* header) {
+	FILE* fp;
+
+	fopen_s(&fp, fileName, "rb");
+	if (fp == NULL)
+		return -1;
+
+	size_t len = fread(header, 1, sizeof(*header), fp);
+	fclose(fp);
+
+	if (len != sizeof(*header) || !sparse_header_ok(header))
+		return -1;
+
+	return 0;
+}
+
+SparseEncoder::SparseEncoder(Transport* transport, int64_t image_size, md5_context* md5)
+	: transport_(transport), md5_(md5), header_sent_(false), pending_type_(0),
+	pending_fill_(0), pending_blocks_(0), wire_bytes_(0) {
+	header_.magic = SPARSE_HEADER_MAGIC;
+	header_.major_version = SPARSE_MAJOR_VERSION;
+	header_.minor_version = 0;
+	header_.file_hdr_sz = SPARSE_FILE_HEADER_SIZE;
+	header_.chunk_hdr_sz = SPARSE_CHUNK_HEADER_SIZE;
+	header_.blk_sz = SPARSE_BLOCK_SIZE;
+	header_.total_blks = (uint32_t)(image_size / SPARSE_BLOCK_SIZE);
+	header_.total_chunks = 0;
+	header_.image_checksum = 0;
+}
+
+void SparseEncoder::AddRecord(uint16_t type, uint32_t blocks, uint32_t fill, const char* raw) {
+	record rec;
+
+	rec.header.chunk_type = type;
+	rec.header.reserved1 = 0;
+	rec.header.chunk_sz = blocks;
+	rec.header.total_sz = SPARSE_CHUNK_HEADER_SIZE;
+	rec.fill = fill;
+
+	if (type == SPARSE_CHUNK_FILL)
+		rec.header.total_sz += sizeof(uint32_t);
+	else if (type == SPARSE_CHUNK_RAW)
+		rec.header.total_sz += blocks * SPARSE_BLOCK_SIZE;
+
+	// Callers reserve records_ up front, so the address stays valid.
+	records_.push_back(rec);
+
+	transport_iovec seg;
+	seg.base = &records_.back();
+	seg.len = type == SPARSE_CHUNK_FILL ? sizeof(record) : SPARSE_CHUNK_HEADER_SIZE;
+	iov_.push_back(seg);
+
+	if (type == SPARSE_CHUNK_RAW) {
+		seg.base = raw;
+		seg.len = (size_t)blocks * SPARSE_BLOCK_SIZE;
+		iov_.push_back(seg);
+	}
+}
+
+void SparseEncoder::FlushPending() {
+	if (pending_blocks_ == 0)
+		return;
+
+	AddRecord(pending_type_, pending_blocks_, pending_fill_, NULL);
+	pending_blocks_ = 0;
+}
+
+int SparseEncoder::Send() {
+	std::vector<transport_iovec> iov;
+	size_t total = 0;
+
+	iov.reserve(iov_.size() + 1);
+
+	if (!header_sent_) {
+		transport_iovec seg = { &header_, SPARSE_FILE_HEADER_SIZE };
+
+		iov.push_back(seg);
+		header_sent_ = true;
+	}
+
+	iov.insert(iov.end(), iov_.begin(), iov_.end());
+
+	for (const transport_iovec& seg : iov)
+		total += seg.len;
+
+	ssize_t ret = total ? transport_->WriteV(iov.data(), (int)iov.size()) : 0;
+
+	records_.clear();
+	iov_.clear();
+
+	if (ret < 0 || (size_t)ret != total) {
+		fprintf(stderr, "Failed to write the sparse chunks. Written length : %lld, all data : %zu\n",
+			(long long)ret, total);
+		return -1;
+	}
+
+	wire_bytes_ += total;
+	return 0;
+}
+
+int SparseEncoder::Encode(const char* data, size_t len) {
+	const char* raw_start = NULL;
+	uint32_t raw_blocks = 0;
+
+	if (len % SPARSE_BLOCK_SIZE != 0)
+		return -1;
+
+	// At most one record per block plus the run carried over.
+	records_.reserve(len / SPARSE_BLOCK_SIZE + 1);
+
+	if (md5_ != NULL) {
+		TRACE_SCOPE("md5_update");
+		md5_update(md5_, data, len);
+	}
+
+	TRACE_SCOPE("sparse_scan");
+
+	for (size_t off = 0; off < len; off += SPARSE_BLOCK_SIZE) {
+		const char* block = data + off;
+		uint32_t value;
+
+		if (!sparse_block_fill_value(block, SPARSE_BLOCK_SIZE, &value)) {
+			FlushPending();
+			if (raw_blocks == 0)
+				raw_start = block;
+			raw_blocks++;
+			continue;
+		}
+
+		if (raw_blocks) {
+			AddRecord(SPARSE_CHUNK_RAW, raw_blocks, 0, raw_start);
+			raw_blocks = 0;
+		}
+
+		uint16_t type = value == 0 ? SPARSE_CHUNK_DONT_CARE : SPARSE_CHUNK_FILL;
+
+		if (pending_blocks_ && (pending_type_ != type || pending_fill_ != value))
+			FlushPending();
+
+		pending_type_ = type;
+		pending_fill_ = value;
+		pending_blocks_++;
+	}
+
+	// RAW chunks point into |data|, which the caller recycles after this
+	// call, so they never span blocks. FILL/DONT_CARE runs may.
+	if (raw_blocks)
+		AddRecord(SPARSE_CHUNK_RAW, raw_blocks, 0, raw_start);
+
+	if (records_.empty() && header_sent_)
+		return 0;
+
+	return Send();
+}
+
+int SparseEncoder::Finish() {
+	records_.reserve(1);
+	FlushPending();
+
+	if (records_.empty() && header_sent_)
+		return 0;
+
+	return Send();
+}
+
+SparseDigest::SparseDigest(md5_context* md5)
+	: md5_(md5), state_(kFileHeader), pending_len_(0), pending_want_(SPARSE_FILE_HEADER_SIZE),
+	data_left_(0), blocks_left_(0) {}
+
+void SparseDigest::StartChunk() {
+	pending_len_ = 0;
+
+	if (blocks_left_ == 0) {
+		// A trailing CRC32 chunk, if any, is ignored.
+		state_ = kDone;
+		return;
+	}
+
+	state_ = kChunkHeader;
+	pending_want_ = header_.chunk_hdr_sz;
+}
+
+int SparseDigest::Update(const char* data, size_t len) {
+	while (len > 0) {
+		if (state_ == kDone)
+			return 0;
+		if (state_ == kError)
+			return -1;
+
+		if (state_ == kChunkData && chunk_.chunk_type == SPARSE_CHUNK_RAW) {
+			size_t take = data_left_ < len ? (size_t)data_left_ : len;
+
+			md5_update(md5_, data, take);
+			data += take;
+			len -= take;
+			data_left_ -= take;
+
+			if (data_left_ == 0)
+				StartChunk();
+			continue;
+		}
+
+		// Headers and FILL/CRC32 words may straddle two blocks.
+		size_t take = pending_want_ - pending_len_;
+		if (take > len)
+			take = len;
+
+		memcpy(pending_ + pending_len_, data, take);
+		pending_len_ += take;
+		data += take;
+		len -= take;
+
+		if (pending_len_ < pending_want_)
+			continue;
+
+		if (state_ == kFileHeader) {
+			memcpy(&header_, pending_, sizeof(header_));
+
+			if (!sparse_header_ok(&header_)) {
+				state_ = kError;
+				continue;
+			}
+
+			if (pending_want_ < header_.file_hdr_sz) {
+				pending_want_ = header_.file_hdr_sz;
+				continue;
+			}
+
+			blocks_left_ = header_.total_blks;
+			StartChunk();
+		}
+		else if (state_ == kChunkHeader) {
+			memcpy(&chunk_, pending_, sizeof(chunk_));
+
+			if (chunk_.total_sz < header_.chunk_hdr_sz) {
+				state_ = kError;
+				continue;
+			}
+
+			uint64_t expanded = (uint64_t)chunk_.chunk_sz * header_.blk_sz;
+			data_left_ = chunk_.total_sz - header_.chunk_hdr_sz;
+
+			bool ok;
+			switch (chunk_.chunk_type) {
+			case SPARSE_CHUNK_RAW:
+				ok = data_left_ == expanded;
+				break;
+			case SPARSE_CHUNK_FILL:
+			case SPARSE_CHUNK_CRC32:
+				ok = data_left_ == sizeof(uint32_t);
+				break;
+			case SPARSE_CHUNK_DONT_CARE:
+				ok = data_left_ == 0;
+				break;
+			default:
+				ok = false;
+				break;
+			}
+
+			if (chunk_.chunk_type != SPARSE_CHUNK_CRC32) {
+				if (chunk_.chunk_sz > blocks_left_)
+					ok = false;
+				else
+					blocks_left_ -= chunk_.chunk_sz;
+			}
+
+			if (!ok) {
+				state_ = kError;
+				continue;
+			}
+
+			// The receiver expands DONT_CARE to zeros.
+			if (chunk_.chunk_type == SPARSE_CHUNK_DONT_CARE)
+				sparse_digest_fill(md5_, 0, expanded);
+
+			pending_len_ = 0;
+			pending_want_ = (size_t)data_left_;
+
+			if (data_left_ == 0)
+				StartChunk();
+			else
+				state_ = kChunkData;
+		}
+		else {
+			if (chunk_.chunk_type == SPARSE_CHUNK_FILL) {
+				uint32_t value;
+
+				memcpy(&value, pending_, sizeof(value));
+				sparse_digest_fill(md5_, value, (uint64_t)chunk_.chunk_sz * header_.blk_sz);
+			}
+
+			data_left_ = 0;
+			StartChunk();
+		}
+	}
+
+	return state_ == kError ? -1 : 0;
+}
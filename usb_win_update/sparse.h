@@ -0,0 +1,156 @@
+#pragma once
+
+#ifndef SPARSE_H_
+#define SPARSE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "md5.h"
+#include "transport.h"
+
+// Android sparse image format, as produced by img2simg and understood by
+// simg2img/fastboot. It is used both as an input format and as the wire
+// format of the sparse transfer mode.
+#define SPARSE_HEADER_MAGIC		0xed26ff3a
+#define SPARSE_MAJOR_VERSION	1
+
+#define SPARSE_CHUNK_RAW		0xCAC1
+#define SPARSE_CHUNK_FILL		0xCAC2
+#define SPARSE_CHUNK_DONT_CARE	0xCAC3
+#define SPARSE_CHUNK_CRC32		0xCAC4
+
+// Block size of the sparse streams we generate.
+#define SPARSE_BLOCK_SIZE 4096
+
+struct sparse_header {
+	uint32_t magic;
+	uint16_t major_version;
+	uint16_t minor_version;
+	/// 28 bytes for version 1.0
+	uint16_t file_hdr_sz;
+	/// 12 bytes for version 1.0
+	uint16_t chunk_hdr_sz;
+	/// Block size in bytes, a multiple of 4
+	uint32_t blk_sz;
+	/// Number of blocks in the expanded image
+	uint32_t total_blks;
+	/// Number of chunks, 0 in the streams we generate (see SparseEncoder)
+	uint32_t total_chunks;
+	/// CRC-32 of the expanded image, 0 if not computed
+	uint32_t image_checksum;
+};
+
+struct sparse_chunk_header {
+	uint16_t chunk_type;
+	uint16_t reserved1;
+	/// Size of the chunk in blocks of the expanded image
+	uint32_t chunk_sz;
+	/// Size of the chunk in bytes, header and data included
+	uint32_t total_sz;
+};
+
+// Returns true if |len| bytes at |data| all repeat the 32-bit word at
+// |data|, which is stored in |value|. |len| must be a multiple of 4. The
+// scan is SSE2 on x86/x64 and stops at the first mismatching 64 bytes.
+bool sparse_block_fill_value(const void* data, size_t len, uint32_t* value);
+
+// Feeds |bytes| bytes of the repeated word |value| to |md5|, for the
+// FILL and DONT_CARE parts of a logical image.
+void sparse_digest_fill(md5_context* md5, uint32_t value, uint64_t bytes);
+
+// Reads the header of |fileName| into |header|. Returns 0 if the file is
+// a supported Android sparse image, -1 otherwise.
+int sparse_read_header(const char* fileName, sparse_header* header);
+
+// Turns a plain image into a sparse stream on the fly. Every block handed
+// to Encode() is split in SPARSE_BLOCK_SIZE blocks: all-zero runs become
+// DONT_CARE chunks, runs of one repeated word become FILL chunks and the
+// rest is sent as RAW chunks pointing into the block itself, so data is
+// still never copied. The chunk count is unknown while streaming, hence
+// the header carries total_chunks = 0: the receiver expands chunks until
+// total_blks blocks have been written.
+//
+// The MD5 sum of the logical image is updated as blocks are encoded,
+// unless |md5| is NULL.
+class SparseEncoder {
+public:
+	SparseEncoder(Transport* transport, int64_t image_size, md5_context* md5);
+
+	// Sends the chunks describing |len| bytes at |data|. |len| must be a
+	// multiple of SPARSE_BLOCK_SIZE. Returns 0 or -1 on a transport error.
+	int Encode(const char* data, size_t len);
+
+	// Sends the pending FILL/DONT_CARE chunk. Returns 0 or -1.
+	int Finish();
+
+	// Bytes put on the wire so far.
+	int64_t WireBytes() const { return wire_bytes_; }
+
+	SparseEncoder(const SparseEncoder&) = delete;
+	void operator=(const SparseEncoder&) = delete;
+
+private:
+	// A chunk header followed by the word of a FILL chunk.
+	struct record {
+		sparse_chunk_header header;
+		uint32_t fill;
+	};
+
+	void AddRecord(uint16_t type, uint32_t blocks, uint32_t fill, const char* raw);
+	void FlushPending();
+	int Send();
+
+	Transport* transport_;
+	md5_context* md5_;
+	sparse_header header_;
+	bool header_sent_;
+
+	// FILL/DONT_CARE run carried over from one block to the next.
+	uint16_t pending_type_;
+	uint32_t pending_fill_;
+	uint32_t pending_blocks_;
+
+	std::vector<record> records_;
+	std::vector<transport_iovec> iov_;
+	int64_t wire_bytes_;
+};
+
+// Follows an Android sparse stream byte by byte and computes the MD5 sum
+// of the image it expands to, so sparse input can go over the wire as is.
+class SparseDigest {
+public:
+	explicit SparseDigest(md5_context* md5);
+
+	// Consumes the next |len| bytes of the stream. Returns -1 if the stream
+	// is malformed.
+	int Update(const char* data, size_t len);
+
+	// Returns true once every block of the image has been described.
+	bool Complete() const { return state_ == kDone; }
+
+	SparseDigest(const SparseDigest&) = delete;
+	void operator=(const SparseDigest&) = delete;
+
+private:
+	enum State { kFileHeader, kChunkHeader, kChunkData, kDone, kError };
+
+	void StartChunk();
+
+	md5_context* md5_;
+	State state_;
+	sparse_header header_;
+	sparse_chunk_header chunk_;
+
+	// Partially received header or FILL word.
+	unsigned char pending_[64];
+	size_t pending_len_;
+	size_t pending_want_;
+
+	uint64_t data_left_;
+	uint32_t blocks_left_;
+};
+
+#endif  // SPARSE_H_
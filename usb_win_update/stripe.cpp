@@ -0,0 +1,118 @@
+#include "stdafx.h"
+
+#include <stdio.h>
+
+#include <algorithm>
+
+#include "stripe.h"
+#include "trace.h"
+
+StripedSender::StripedSender(Transport* transport, int stripes)
+	: transport_(transport), pool_(transport->Buffers()), busy_(0), next_seq_(0), sent_(0),
+	failed_(false), stop_(false), stripe_bytes_(stripes, 0) {
+	max_blocks_ = std::max(1, pool_->BlockCount() / 2);
+
+	for (int i = 0; i < stripes; i++)
+		workers_.push_back(std::thread(&StripedSender::Worker, this, i));
+}
+
+StripedSender::~StripedSender() {
+	Flush();
+
+	{
+		std::lock_guard<std::mutex> lock(lock_);
+		stop_ = true;
+	}
+	work_cv_.notify_all();
+
+	for (std::thread& worker : workers_)
+		worker.join();
+}
+
+void StripedSender::Worker(int stripe) {
+	trace_set_thread_name("stripe worker");
+
+	for (;;) {
+		chunk c;
+		bool ok;
+
+		{
+			std::unique_lock<std::mutex> lock(lock_);
+
+			work_cv_.wait(lock, [this] { return stop_ || !queue_.empty(); });
+			if (queue_.empty())
+				return;
+
+			c = queue_.front();
+			queue_.pop_front();
+			busy_++;
+
+			// After a failure the image is lost, only give the blocks back.
+			ok = !failed_;
+		}
+
+		if (ok) {
+			TraceScope trace("stripe_write");
+			plcm_stripe_header header;
+
+			trace.SetBytes(c.len);
+
+			header.magic = PLCM_STRIPE_MAGIC;
+			header.seq = c.seq;
+			header.offset = c.offset;
+			header.length = (uint32_t)c.len;
+
+			ok = transport_->WriteStripe(stripe, &header, sizeof(header)) == sizeof(header) &&
+				transport_->WriteStripe(stripe, c.block, c.len) == (ssize_t)c.len;
+
+			if (!ok)
+				fprintf(stderr, "Failed to write chunk %u on pipe %d\n", c.seq, stripe);
+		}
+
+		pool_->Release(c.block);
+
+		std::lock_guard<std::mutex> lock(lock_);
+
+		if (ok)
+			stripe_bytes_[stripe] += c.len;
+		else
+			failed_ = true;
+
+		busy_--;
+		done_cv_.notify_all();
+	}
+}
+
+int StripedSender::Send(char* block, size_t len) {
+	std::unique_lock<std::mutex> lock(lock_);
+
+	done_cv_.wait(lock, [this] { return failed_ || (int)queue_.size() + busy_ < max_blocks_; });
+
+	if (failed_) {
+		pool_->Release(block);
+		return -1;
+	}
+
+	chunk c;
+
+	c.block = block;
+	c.len = len;
+	c.seq = next_seq_++;
+	c.offset = sent_;
+	queue_.push_back(c);
+	sent_ += len;
+
+	work_cv_.notify_one();
+
+	return 0;
+}
+
+int StripedSender::Flush() {
+	std::unique_lock<std::mutex> lock(lock_);
+
+	TRACE_SCOPE("stripe_flush");
+
+	done_cv_.wait(lock, [this] { return queue_.empty() && busy_ == 0; });
+
+	return failed_ ? -1 : 0;
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#ifndef STRIPE_H_
+#define STRIPE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "transport.h"
+
+#define PLCM_STRIPE_MAGIC 0x53434C50	//"PLCS"
+
+// Sent in its own transfer in front of every chunk of a striped image,
+// on the pipe that carries the chunk. Little endian.
+#pragma pack(push, 1)
+struct plcm_stripe_header {
+	uint32_t magic;
+	/// Chunk number within the image, from 0
+	uint32_t seq;
+	/// Offset of the chunk in the image data
+	uint64_t offset;
+	/// Bytes of data in the transfers that follow
+	uint32_t length;
+};
+#pragma pack(pop)
+
+// Spreads the data of one image over every bulk OUT pipe of a transport.
+//
+// Each pipe has a worker thread. Chunks, one pool block each, go to
+// whichever worker is free, so a pipe the device drains faster carries
+// more of them; the sequence number and offset in the header let the
+// device put the image back together whatever order chunks arrive in.
+// As with CreditSender, at most half of the pool is kept in flight.
+class StripedSender {
+public:
+	StripedSender(Transport* transport, int stripes);
+	~StripedSender();
+
+	// Queues |len| bytes of the pool block |block|. The block goes back to
+	// the pool once written, also on error. Returns 0 or -1.
+	int Send(char* block, size_t len);
+
+	// Waits until every queued chunk is written. Returns 0, or -1 if any
+	// write failed.
+	int Flush();
+
+	uint64_t Sent() const { return sent_; }
+
+	// Data bytes written on pipe |stripe|.
+	uint64_t StripeBytes(int stripe) const { return stripe_bytes_[stripe]; }
+
+	StripedSender(const StripedSender&) = delete;
+	void operator=(const StripedSender&) = delete;
+
+private:
+	struct chunk {
+		char* block;
+		size_t len;
+		uint32_t seq;
+		uint64_t offset;
+	};
+
+	void Worker(int stripe);
+
+	Transport* transport_;
+	BufferPool* pool_;
+	int max_blocks_;
+
+	std::mutex lock_;
+	std::condition_variable work_cv_;
+	std::condition_variable done_cv_;
+	std::deque<chunk> queue_;
+	// Chunks taken by a worker and not written yet.
+	int busy_;
+	uint32_t next_seq_;
+	uint64_t sent_;
+	bool failed_;
+	bool stop_;
+	std::vector<uint64_t> stripe_bytes_;
+
+	std::vector<std::thread> workers_;
+};
+
+#endif  // STRIPE_H_
@@ -0,0 +1,260 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "json.h"
+#include "trace.h"
+
+#if !defined(_WIN32)
+static int fopen_s(FILE** fp, const char* fileName, const char* mode) {
+	*fp = fopen(fileName, mode);
+	return *fp ? 0 : errno;
+}
+#endif
+
+struct trace_event {
+	const char *phase;
+	uint64_t start_us;
+	uint64_t dur_us;
+	uint64_t bytes;
+	int device_id;
+};
+
+/// Events of one thread. Owned by the registry so they survive the thread.
+struct trace_thread {
+	int tid;
+	int device_id;
+	std::string name;
+	std::vector<trace_event> events;
+};
+
+static std::atomic<bool> trace_on(false);
+static std::string trace_path;
+static std::chrono::steady_clock::time_point trace_epoch = std::chrono::steady_clock::now();
+
+static std::mutex trace_lock;
+static std::vector<std::shared_ptr<trace_thread>> trace_threads;
+static std::map<int, std::string> trace_devices;
+
+static trace_thread *trace_current_thread() {
+	static thread_local std::shared_ptr<trace_thread> current;
+
+	if (!current) {
+		current = std::make_shared<trace_thread>();
+		current->device_id = 0;
+
+		std::lock_guard<std::mutex> lock(trace_lock);
+		current->tid = (int)trace_threads.size() + 1;
+		trace_threads.push_back(current);
+	}
+
+	return current.get();
+}
+
+uint64_t trace_now_us() {
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now() - trace_epoch).count();
+}
+
+void trace_init(const char *trace_file) {
+	trace_path = trace_file ? trace_file : "";
+	trace_on = true;
+
+	std::lock_guard<std::mutex> lock(trace_lock);
+	if (trace_devices.find(0) == trace_devices.end())
+		trace_devices[0] = "host";
+}
+
+bool trace_enabled() {
+	return trace_on;
+}
+
+void trace_set_device(int device_id, const char *name) {
+	if (!trace_on)
+		return;
+
+	trace_current_thread()->device_id = device_id;
+
+	std::lock_guard<std::mutex> lock(trace_lock);
+	if (name != NULL && name[0] != '\0')
+		trace_devices[device_id] = name;
+	else if (trace_devices.find(device_id) == trace_devices.end())
+		trace_devices[device_id] = "device " + std::to_string(device_id);
+}
+
+void trace_set_thread_name(const char *name) {
+	if (!trace_on)
+		return;
+
+	trace_thread *thread = trace_current_thread();
+	std::lock_guard<std::mutex> lock(trace_lock);
+	thread->name = name;
+}
+
+TraceScope::TraceScope(const char *phase) : phase_(phase), start_us_(0), bytes_(0) {
+	if (trace_on)
+		start_us_ = trace_now_us();
+	else
+		phase_ = NULL;
+}
+
+TraceScope::~TraceScope() {
+	End();
+}
+
+void TraceScope::End() {
+	if (phase_ == NULL || !trace_on)
+		return;
+
+	trace_thread *thread = trace_current_thread();
+	trace_event event;
+
+	event.phase = phase_;
+	event.start_us = start_us_;
+	event.dur_us = trace_now_us() - start_us_;
+	event.bytes = bytes_;
+	event.device_id = thread->device_id;
+
+	// Only the shutdown path reads other threads' events, under the lock.
+	std::lock_guard<std::mutex> lock(trace_lock);
+	thread->events.push_back(event);
+	phase_ = NULL;
+}
+
+static int trace_write_chrome_json(const char *path) {
+	FILE *fp;
+
+	fopen_s(&fp, path, "w");
+	if (fp == NULL) {
+		fprintf(stderr, "Failed to open the trace file %s\n", path);
+		return -1;
+	}
+
+	bool first = true;
+
+	fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+
+	for (auto& device : trace_devices) {
+		fprintf(fp, "%s{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":",
+			first ? "" : ",\n", device.first);
+		json_write_string(fp, device.second.c_str());
+		fprintf(fp, "}}");
+		first = false;
+	}
+
+	for (auto& thread : trace_threads) {
+		std::string name = thread->name.empty() ?
+			"thread " + std::to_string(thread->tid) : thread->name;
+
+		// A thread may have worked for several devices; name it on each track.
+		std::vector<int> devices;
+		for (auto& event : thread->events) {
+			if (std::find(devices.begin(), devices.end(), event.device_id) == devices.end())
+				devices.push_back(event.device_id);
+		}
+
+		for (int device_id : devices) {
+			fprintf(fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":",
+				first ? "" : ",\n", device_id, thread->tid);
+			json_write_string(fp, name.c_str());
+			fprintf(fp, "}}");
+			first = false;
+		}
+
+		for (auto& event : thread->events) {
+			fprintf(fp, "%s{\"name\":", first ? "" : ",\n");
+			json_write_string(fp, event.phase);
+			fprintf(fp, ",\"cat\":\"usb\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%llu,\"pid\":%d,\"tid\":%d",
+				(unsigned long long)event.start_us, (unsigned long long)event.dur_us,
+				event.device_id, thread->tid);
+			if (event.bytes)
+				fprintf(fp, ",\"args\":{\"bytes\":%llu}", (unsigned long long)event.bytes);
+			fprintf(fp, "}");
+			first = false;
+		}
+	}
+
+	fprintf(fp, "\n]}\n");
+	fclose(fp);
+
+	return 0;
+}
+
+struct trace_phase_summary {
+	const char *phase;
+	uint64_t count;
+	uint64_t total_us;
+	uint64_t max_us;
+	uint64_t bytes;
+};
+
+static void trace_print_summary(uint64_t wall_us) {
+	std::map<std::string, trace_phase_summary> phases;
+
+	for (auto& thread : trace_threads) {
+		for (auto& event : thread->events) {
+			trace_phase_summary& summary = phases[event.phase];
+
+			summary.phase = event.phase;
+			summary.count++;
+			summary.total_us += event.dur_us;
+			summary.max_us = std::max(summary.max_us, event.dur_us);
+			summary.bytes += event.bytes;
+		}
+	}
+
+	std::vector<trace_phase_summary> sorted;
+	for (auto& phase : phases)
+		sorted.push_back(phase.second);
+
+	std::sort(sorted.begin(), sorted.end(),
+		[](const trace_phase_summary& a, const trace_phase_summary& b) {
+		return a.total_us > b.total_us;
+	});
+
+	printf("\nPhase summary (inclusive times, wall %.3f s, %d thread(s)):\n",
+		wall_us / 1e6, (int)trace_threads.size());
+	printf("%-24s %8s %12s %10s %10s %7s %10s\n",
+		"phase", "count", "total(ms)", "avg(ms)", "max(ms)", "wall%", "MB/s");
+
+	for (auto& summary : sorted) {
+		double total_ms = summary.total_us / 1000.0;
+		double avg_ms = total_ms / summary.count;
+		double wall_pct = wall_us ? 100.0 * summary.total_us / wall_us : 0.0;
+
+		printf("%-24s %8llu %12.3f %10.3f %10.3f %7.1f ",
+			summary.phase, (unsigned long long)summary.count,
+			total_ms, avg_ms, summary.max_us / 1000.0, wall_pct);
+
+		if (summary.bytes && summary.total_us)
+			printf("%10.2f\n", (double)summary.bytes / summary.total_us);
+		else
+			printf("%10s\n", "-");
+	}
+}
+
+void trace_shutdown() {
+	if (!trace_on)
+		return;
+
+	uint64_t wall_us = trace_now_us();
+
+	// Stop recording before walking the per-thread buffers.
+	trace_on = false;
+
+	std::lock_guard<std::mutex> lock(trace_lock);
+
+	if (!trace_path.empty() && trace_write_chrome_json(trace_path.c_str()) == 0)
+		printf("Trace written to %s\n", trace_path.c_str());
+
+	trace_print_summary(wall_us);
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stdint.h>
+
+// Per-phase timeline profiler.
+//
+// Code under test opens a TraceScope (or the TRACE_SCOPE() shortcut) around
+// each phase it wants to account for. Every finished span is recorded on the
+// calling thread with the device that thread is currently working for, so
+// the Chrome trace shows one process track per device and one thread track
+// per worker thread. Spans nest; the summary table reports inclusive times.
+//
+// Nothing is recorded until trace_init() has been called, so the scopes can
+// stay in the hot paths at the cost of one flag test.
+
+// Enables the profiler. |trace_file| receives the Chrome trace-event JSON
+// (chrome://tracing, Perfetto) at trace_shutdown(); pass NULL to collect the
+// per-phase summary only.
+void trace_init(const char *trace_file);
+
+// Returns true once trace_init() has been called.
+bool trace_enabled();
+
+// Attributes the spans of the calling thread to device |device_id| from now
+// on. |name| (serial number, interface path...) labels the device track.
+// Device id 0 is the host track used before any device is known.
+void trace_set_device(int device_id, const char *name);
+
+// Names the calling thread's track.
+void trace_set_thread_name(const char *name);
+
+// Writes the trace file and prints the per-phase summary table to stdout.
+// Safe to call when the profiler is disabled.
+void trace_shutdown();
+
+// Microseconds since the profiler epoch.
+uint64_t trace_now_us();
+
+class TraceScope {
+public:
+	// |phase| must be a string literal (or otherwise outlive the profiler).
+	explicit TraceScope(const char *phase);
+	~TraceScope();
+
+	// Attaches a byte count to the span, reported as throughput.
+	void SetBytes(uint64_t bytes) { bytes_ = bytes; }
+
+	// Records the span now instead of at the end of the enclosing block.
+	void End();
+
+	TraceScope(const TraceScope&) = delete;
+	void operator=(const TraceScope&) = delete;
+
+private:
+	const char *phase_;
+	uint64_t start_us_;
+	uint64_t bytes_;
+};
+
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+#define TRACE_SCOPE(phase) TraceScope TRACE_CONCAT(trace_scope_, __LINE__)(phase)
+
+#endif  // TRACE_H_
@@ -37,6 +37,20 @@
 typedef SSIZE_T ssize_t;
 #endif
 
+#include <deque>
+#include <memory>
+
+#include "buffer_pool.h"
+#include "device_caps.h"
+#include "rate_limiter.h"
+#include "transport_stats.h"
+
+// One segment of a vectored write.
+struct transport_iovec {
+	const void* base;
+	size_t len;
+};
+
 // General interface to allow the fastboot protocol to be used over different
 // types of transports.
 class Transport {
@@ -44,14 +58,124 @@ public:
 	Transport() = default;
 	virtual ~Transport() = default;
 
-	// Reads |len| bytes into |data|. Returns the number of bytes actually
-	// read or -1 on error.
+	// Reads |len| bytes into |data|, fewer if the device ends the transfer
+	// with a short packet. Returns the number of bytes actually read or -1
+	// on error.
 	virtual ssize_t Read(void* data, size_t len) = 0;
 
 	// Writes |len| bytes from |data|. Returns the number of bytes actually
 	// written or -1 on error.
 	virtual ssize_t Write(const void* data, size_t len) = 0;
 
+	// Writes the |iovcnt| segments of |iov| back to back, as one logical
+	// write of their total length, without gathering them into one buffer
+	// first. Returns the number of bytes actually written or -1 on error.
+	// The default implementation issues one Write() per non-empty segment.
+	virtual ssize_t WriteV(const transport_iovec* iov, int iovcnt) {
+		ssize_t total = 0;
+
+		for (int i = 0; i < iovcnt; i++) {
+			if (iov[i].len == 0)
+				continue;
+
+			ssize_t ret = Write(iov[i].base, iov[i].len);
+			if (ret < 0)
+				return -1;
+
+			total += ret;
+			if ((size_t)ret < iov[i].len)
+				break;
+		}
+
+		return total;
+	}
+
+	// Queues a write of |len| bytes from |data|, |len| > 0, and returns
+	// without waiting for it. |data| must stay untouched until FinishWrite()
+	// hands it back. Returns 0, or -1 if the write failed to start; it is
+	// queued either way. The default implementation writes synchronously
+	// and queues the result.
+	virtual int WriteAsync(const void* data, size_t len) {
+		async_write write;
+
+		write.data = data;
+		write.result = Write(data, len);
+		async_writes_.push_back(write);
+
+		return write.result < 0 ? -1 : 0;
+	}
+
+	// Finishes the oldest write queued by WriteAsync(): waits for it, or
+	// only checks on it when |wait| is false. Stores its buffer in |*data|
+	// and returns the number of bytes written, 0 if it is still in progress
+	// or -1 on error. Must only be called with writes in flight.
+	virtual ssize_t FinishWrite(const void** data, bool wait) {
+		async_write write = async_writes_.front();
+
+		async_writes_.pop_front();
+		*data = write.data;
+
+		return write.result;
+	}
+
+	// Writes queued by WriteAsync() and not finished yet.
+	virtual size_t WritesInFlight() const { return async_writes_.size(); }
+
+	// Waitable handle (a Windows event) signalled once the oldest write
+	// queued by WriteAsync() is done, so that FinishWrite() won't block.
+	// NULL when no write is in flight or when writes finish synchronously,
+	// as with the default implementation.
+	virtual void* WriteEvent() const { return nullptr; }
+
+	// Queues a bulk read of up to |len| bytes into |data|, |len| > 0, and
+	// returns without waiting for it. Reads complete in the order they were
+	// queued and each ends early on a short packet, so a stream of known
+	// length can be pulled with several reads in flight. Returns 0, or -1 if
+	// the read failed to start; it is queued either way. The default
+	// implementation reads synchronously and queues the result.
+	virtual int ReadAsync(void* data, size_t len) {
+		async_read read;
+
+		read.data = data;
+		read.result = Read(data, len);
+		async_reads_.push_back(read);
+
+		return read.result < 0 ? -1 : 0;
+	}
+
+	// Finishes the oldest read queued by ReadAsync(): waits for it, or only
+	// checks on it when |wait| is false. Stores its buffer in |*data| and
+	// returns the number of bytes read, 0 for a zero length packet, or -1 on
+	// error. A read still in progress returns 0 with |*data| NULL. Must only
+	// be called with reads in flight.
+	virtual ssize_t FinishRead(void** data, bool wait) {
+		async_read read = async_reads_.front();
+
+		async_reads_.pop_front();
+		*data = read.data;
+
+		return read.result;
+	}
+
+	// Reads queued by ReadAsync() and not finished yet.
+	virtual size_t ReadsInFlight() const { return async_reads_.size(); }
+
+	// Opens up to |count| bulk OUT pipes besides the default one, to stripe
+	// image data across. Returns how many are open. Transports with a
+	// single pipe open none.
+	virtual int OpenStripes(int count) { return 0; }
+
+	// Bulk OUT pipes WriteStripe() can use, the default one included.
+	virtual int Stripes() const { return 1; }
+
+	// Writes like Write() on pipe |stripe|, 0 being the default pipe.
+	// Different pipes may be written from different threads at once, so a
+	// failed write only fails; any teardown waits for the next call that is
+	// not a WriteStripe().
+	virtual ssize_t WriteStripe(int stripe, const void* data, size_t len) {
+		return stripe == 0 ? Write(data, len) : -1;
+	}
+
 	// Reads or Writes |len| bytes from/to data. Returns the number of bytes actually
 	// read or written or -1 on error
 	virtual ssize_t ControlIO(bool is_in, void *setup, void* data, size_t len) = 0;
@@ -62,6 +186,99 @@ public:
 	// Blocks until the transport disconnects. Transports that don't support
 	// this will return immediately. Returns 0 on success.
 	virtual int WaitForDisconnect() { return 0; }
+
+	// Performance counters of this transport. Safe to read while transfers
+	// are in progress on another thread.
+	TransportStats& Stats() { return stats_; }
+	const TransportStats& Stats() const { return stats_; }
+
+	// Human readable name used when reporting statistics.
+	virtual const char* Name() const { return "transport"; }
+
+	// Serial number of the device, "" if unknown.
+	virtual const char* Serial() const { return ""; }
+
+	// Where the device hangs in the bus topology, as a Windows location
+	// path ("PCIROOT(0)#PCI(1400)#USBROOT(0)#USB(2)#USB(1)"), "" if unknown.
+	virtual const char* Location() const { return ""; }
+
+	// Default geometry of the transfer buffer pool: one block per maximum
+	// bulk submission, enough blocks to keep reads and writes overlapped.
+	static const size_t kDefaultBufferSize = 1024 * 1024;
+	static const int kDefaultBufferCount = 8;
+
+	// Sets up the transfer buffer pool. Must be called before the first
+	// Buffers() call, otherwise the default geometry is used. Returns 0 on
+	// success.
+	int ConfigureBuffers(size_t block_size, int block_count, bool large_pages) {
+		if (buffers_)
+			return -1;
+
+		buffers_.reset(new BufferPool(block_size, block_count, large_pages));
+		return buffers_->IsValid() ? 0 : -1;
+	}
+
+	// Page-aligned transfer buffers owned by this transport. Blocks taken
+	// from the pool can be filled in place and passed straight to Write()
+	// or WriteV().
+	BufferPool* Buffers() {
+		if (!buffers_)
+			ConfigureBuffers(kDefaultBufferSize, kDefaultBufferCount, false);
+		return buffers_.get();
+	}
+
+	// What the device said it supports, all zero until SetCapabilities()
+	// or if it reported nothing (see device_caps_known()).
+	const plcm_device_caps& Capabilities() const { return caps_; }
+	void SetCapabilities(const plcm_device_caps& caps) { caps_ = caps; }
+
+	// Outcome of trying the PLCM_CAP_* feature |cap| on a device without a
+	// capabilities block: -1 until SetProbed(), then 0 or 1.
+	int Probed(uint32_t cap) const {
+		if (!(probed_mask_ & cap))
+			return -1;
+		return (probed_flags_ & cap) ? 1 : 0;
+	}
+	void SetProbed(uint32_t cap, bool supported) {
+		probed_mask_ |= cap;
+		if (supported)
+			probed_flags_ |= cap;
+		else
+			probed_flags_ &= ~cap;
+	}
+
+	// Caps the bulk throughput of this device, 0 removes the cap. Data paths
+	// take their bytes from Limiter() before writing them.
+	void SetRateLimit(double bytes_per_s) {
+		if (bytes_per_s > 0)
+			limiter_.reset(new RateLimiter(bytes_per_s, kDefaultBufferSize));
+		else
+			limiter_.reset();
+	}
+	RateLimiter* Limiter() { return limiter_.get(); }
+
+protected:
+	TransportStats stats_;
+	std::unique_ptr<BufferPool> buffers_;
+	plcm_device_caps caps_ = {};
+	uint32_t probed_mask_ = 0;
+	uint32_t probed_flags_ = 0;
+	std::unique_ptr<RateLimiter> limiter_;
+
+private:
+	struct async_write {
+		const void* data;
+		ssize_t result;
+	};
+
+	std::deque<async_write> async_writes_;
+
+	struct async_read {
+		void* data;
+		ssize_t result;
+	};
+
+	std::deque<async_read> async_reads_;
 };
 
 #endif  // TRANSPORT_H_
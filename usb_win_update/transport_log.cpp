@@ -0,0 +1,532 @@
+#include <errno.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+#include "transport_log.h"
+
+#if !defined(_WIN32)
+static int fopen_s(FILE** fp, const char* fileName, const char* mode) {
+	*fp = fopen(fileName, mode);
+	return *fp ? 0 : errno;
+}
+#endif
+
+#define TLOG_SETUP_SIZE	8
+
+// 64-bit FNV-1a over the segments of |iov|: cheap enough not to skew the
+// timings being recorded, and enough to tell whether payloads changed.
+static uint64_t tlog_hash(const transport_iovec* iov, int iovcnt) {
+	uint64_t hash = 0xCBF29CE484222325ULL;
+
+	for (int i = 0; i < iovcnt; i++) {
+		const unsigned char* p = (const unsigned char*)iov[i].base;
+
+		for (size_t j = 0; j < iov[i].len; j++)
+			hash = (hash ^ p[j]) * 0x100000001B3ULL;
+	}
+
+	return hash;
+}
+
+static uint32_t clamp32(uint64_t value) {
+	return value > 0xFFFFFFFFULL ? 0xFFFFFFFFU : (uint32_t)value;
+}
+
+RecordingTransport::RecordingTransport(Transport* inner, const char* fileName,
+	tlog_payloads payloads)
+	: inner_(inner), payloads_(payloads), base_us_(TransportStats::NowUs()), fp_(NULL),
+	last_write_us_(0), last_read_us_(0) {
+	tlog_header header;
+
+	fopen_s(&fp_, fileName, "wb");
+	if (fp_ == NULL)
+		return;
+
+	setvbuf(fp_, NULL, _IOFBF, 1024 * 1024);
+
+	memset(&header, 0, sizeof(header));
+	header.magic = TLOG_MAGIC;
+	header.version = TLOG_VERSION;
+	header.payloads = (uint16_t)payloads;
+	snprintf(header.name, sizeof(header.name), "%s", inner->Name());
+	snprintf(header.serial, sizeof(header.serial), "%s", inner->Serial());
+	snprintf(header.location, sizeof(header.location), "%s", inner->Location());
+
+	fwrite(&header, sizeof(header), 1, fp_);
+}
+
+RecordingTransport::~RecordingTransport() {
+	if (fp_ != NULL)
+		fclose(fp_);
+}
+
+void RecordingTransport::Log(tlog_record* record, uint64_t start_us, uint64_t duration_us,
+	const transport_iovec* iov, int iovcnt, bool control) {
+	bool keep_data = control || payloads_ == TLOG_BULK_DATA;
+	uint64_t hash = 0;
+	size_t len = 0;
+
+	for (int i = 0; i < iovcnt; i++)
+		len += iov[i].len;
+
+	if (!control && payloads_ == TLOG_BULK_HASH) {
+		hash = tlog_hash(iov, iovcnt);
+		record->flags |= TLOG_PAYLOAD_HASH;
+		record->payload = sizeof(hash);
+	}
+	else if (keep_data && len > 0) {
+		record->flags |= TLOG_PAYLOAD_DATA;
+		record->payload = clamp32(len);
+	}
+
+	record->start_us = start_us - base_us_;
+	record->duration_us = clamp32(duration_us);
+
+	std::lock_guard<std::mutex> lock(lock_);
+
+	if (fp_ == NULL)
+		return;
+
+	fwrite(record, sizeof(*record), 1, fp_);
+
+	if (record->flags & TLOG_PAYLOAD_HASH) {
+		fwrite(&hash, sizeof(hash), 1, fp_);
+	}
+	else if (record->flags & TLOG_PAYLOAD_DATA) {
+		for (int i = 0; i < iovcnt; i++)
+			fwrite(iov[i].base, 1, iov[i].len, fp_);
+	}
+}
+
+ssize_t RecordingTransport::Read(void* data, size_t len) {
+	uint64_t start_us = TransportStats::NowUs();
+	ssize_t ret = inner_->Read(data, len);
+	uint64_t end_us = TransportStats::NowUs();
+	transport_iovec iov = { data, ret > 0 ? (size_t)ret : 0 };
+	tlog_record record = {};
+
+	record.op = TLOG_READ;
+	record.flags = TLOG_IN;
+	record.length = clamp32(len);
+	record.result = (int32_t)ret;
+	Log(&record, start_us, end_us - start_us, &iov, 1, false);
+
+	stats_.read_latency.Record(end_us - start_us);
+	if (ret >= 0)
+		stats_.RecordBulk(TransportStats::kIn, ret);
+	else
+		stats_.RecordError(-1);
+
+	return ret;
+}
+
+ssize_t RecordingTransport::Write(const void* data, size_t len) {
+	return WriteStripe(0, data, len);
+}
+
+ssize_t RecordingTransport::WriteV(const transport_iovec* iov, int iovcnt) {
+	uint64_t start_us = TransportStats::NowUs();
+	ssize_t ret = inner_->WriteV(iov, iovcnt);
+	uint64_t end_us = TransportStats::NowUs();
+	tlog_record record = {};
+	size_t len = 0;
+
+	for (int i = 0; i < iovcnt; i++)
+		len += iov[i].len;
+
+	record.op = TLOG_WRITE;
+	record.length = clamp32(len);
+	record.result = (int32_t)ret;
+	Log(&record, start_us, end_us - start_us, iov, iovcnt, false);
+
+	stats_.write_latency.Record(end_us - start_us);
+	if (ret >= 0)
+		stats_.RecordBulk(TransportStats::kOut, ret);
+	else
+		stats_.RecordError(-1);
+
+	return ret;
+}
+
+ssize_t RecordingTransport::WriteStripe(int stripe, const void* data, size_t len) {
+	uint64_t start_us = TransportStats::NowUs();
+	ssize_t ret = stripe == 0 ? inner_->Write(data, len) : inner_->WriteStripe(stripe, data, len);
+	uint64_t end_us = TransportStats::NowUs();
+	transport_iovec iov = { data, len };
+	tlog_record record = {};
+
+	record.op = TLOG_WRITE;
+	record.stripe = (uint16_t)stripe;
+	record.length = clamp32(len);
+	record.result = (int32_t)ret;
+	Log(&record, start_us, end_us - start_us, &iov, 1, false);
+
+	stats_.write_latency.Record(end_us - start_us);
+	if (ret >= 0)
+		stats_.RecordBulk(TransportStats::kOut, ret);
+	else
+		stats_.RecordError(-1);
+
+	return ret;
+}
+
+int RecordingTransport::WriteAsync(const void* data, size_t len) {
+	queued q = { TransportStats::NowUs(), clamp32(len) };
+
+	{
+		std::lock_guard<std::mutex> lock(lock_);
+		writes_.push_back(q);
+	}
+
+	return inner_->WriteAsync(data, len);
+}
+
+// Logs the oldest transfer of |queue| once the inner transport reports it
+// done with |ret|. The device time starts when the transfer reached the
+// head of the queue: at its submission, or when the one before finished.
+ssize_t RecordingTransport::Finish(std::deque<queued>* queue, uint64_t* last_end_us, uint8_t op,
+	uint8_t flags, const void* data, ssize_t ret) {
+	uint64_t end_us = TransportStats::NowUs();
+	queued q;
+
+	{
+		std::lock_guard<std::mutex> lock(lock_);
+
+		q = queue->front();
+		queue->pop_front();
+	}
+
+	uint64_t service_start_us = std::max(q.start_us, *last_end_us);
+	size_t len = (flags & TLOG_IN) ? (ret > 0 ? (size_t)ret : 0) : q.length;
+	transport_iovec iov = { data, len };
+	tlog_record record = {};
+
+	*last_end_us = end_us;
+
+	record.op = op;
+	record.flags = flags | TLOG_ASYNC;
+	record.length = q.length;
+	record.result = (int32_t)ret;
+	Log(&record, q.start_us, end_us - service_start_us, &iov, data != NULL ? 1 : 0, false);
+
+	TransportStats::Direction dir = (flags & TLOG_IN) ? TransportStats::kIn : TransportStats::kOut;
+
+	if (ret >= 0)
+		stats_.RecordBulk(dir, ret);
+	else
+		stats_.RecordError(-1);
+
+	return ret;
+}
+
+ssize_t RecordingTransport::FinishWrite(const void** data, bool wait) {
+	ssize_t ret = inner_->FinishWrite(data, wait);
+
+	// Writes are never empty, so 0 means still in progress.
+	if (ret == 0)
+		return 0;
+
+	return Finish(&writes_, &last_write_us_, TLOG_WRITE, 0, *data, ret);
+}
+
+int RecordingTransport::ReadAsync(void* data, size_t len) {
+	queued q = { TransportStats::NowUs(), clamp32(len) };
+
+	{
+		std::lock_guard<std::mutex> lock(lock_);
+		reads_.push_back(q);
+	}
+
+	return inner_->ReadAsync(data, len);
+}
+
+ssize_t RecordingTransport::FinishRead(void** data, bool wait) {
+	ssize_t ret = inner_->FinishRead(data, wait);
+
+	// A zero length packet comes with its buffer, a read in progress without.
+	if (ret == 0 && *data == NULL)
+		return 0;
+
+	return Finish(&reads_, &last_read_us_, TLOG_READ, TLOG_IN, *data, ret);
+}
+
+int RecordingTransport::OpenStripes(int count) {
+	uint64_t start_us = TransportStats::NowUs();
+	int ret = inner_->OpenStripes(count);
+	tlog_record record = {};
+
+	record.op = TLOG_OPEN_STRIPES;
+	record.length = (uint32_t)count;
+	record.result = ret;
+	Log(&record, start_us, TransportStats::NowUs() - start_us, NULL, 0, false);
+
+	return ret;
+}
+
+ssize_t RecordingTransport::ControlIO(bool is_in, void* setup, void* data, size_t len) {
+	uint64_t start_us = TransportStats::NowUs();
+	ssize_t ret = inner_->ControlIO(is_in, setup, data, len);
+	uint64_t end_us = TransportStats::NowUs();
+	transport_iovec iov = { data, is_in ? (ret > 0 ? (size_t)ret : 0) : len };
+	tlog_record record = {};
+
+	record.op = TLOG_CONTROL;
+	record.flags = is_in ? TLOG_IN : 0;
+	memcpy(record.setup, setup, TLOG_SETUP_SIZE);
+	record.length = clamp32(len);
+	record.result = (int32_t)ret;
+	Log(&record, start_us, end_us - start_us, &iov, data != NULL ? 1 : 0, true);
+
+	stats_.control_latency.Record(end_us - start_us);
+	if (ret >= 0)
+		stats_.RecordControl(is_in ? TransportStats::kIn : TransportStats::kOut, ret);
+	else
+		stats_.RecordError(-1);
+
+	return ret;
+}
+
+int RecordingTransport::Close() {
+	{
+		std::lock_guard<std::mutex> lock(lock_);
+
+		if (fp_ != NULL) {
+			fclose(fp_);
+			fp_ = NULL;
+		}
+	}
+
+	return inner_->Close();
+}
+
+ReplayTransport::ReplayTransport(const char* fileName)
+	: valid_(false), stripes_(1), cursor_(0), matched_(0), skipped_(0), unmatched_(0) {
+	FILE* fp;
+
+	memset(&header_, 0, sizeof(header_));
+
+	fopen_s(&fp, fileName, "rb");
+	if (fp == NULL)
+		return;
+
+	if (fread(&header_, sizeof(header_), 1, fp) != 1 || header_.magic != TLOG_MAGIC ||
+		header_.version != TLOG_VERSION) {
+		fclose(fp);
+		return;
+	}
+
+	header_.serial[sizeof(header_.serial) - 1] = '\0';
+	header_.location[sizeof(header_.location) - 1] = '\0';
+
+	entry e;
+
+	while (fread(&e.record, sizeof(e.record), 1, fp) == 1) {
+		e.payload = payloads_.size();
+		payloads_.resize(payloads_.size() + e.record.payload);
+
+		// A recording cut short keeps the records before the cut.
+		if (e.record.payload > 0 &&
+			fread(&payloads_[e.payload], 1, e.record.payload, fp) != e.record.payload) {
+			payloads_.resize(e.payload);
+			break;
+		}
+
+		entries_.push_back(e);
+	}
+
+	fclose(fp);
+	valid_ = true;
+}
+
+// Takes the next record for an |op| call, with matching direction and, for
+// control transfers, request and value. Returns NULL if none is close.
+const ReplayTransport::entry* ReplayTransport::Next(uint8_t op, bool is_in,
+	const unsigned char* setup) {
+	size_t end = std::min(entries_.size(), cursor_ + TLOG_RESYNC_WINDOW);
+
+	for (size_t i = cursor_; i < end; i++) {
+		const tlog_record& r = entries_[i].record;
+
+		if (r.op != op || ((r.flags & TLOG_IN) != 0) != is_in)
+			continue;
+
+		// bRequest and wValue; wIndex and wLength may differ
+		if (setup != NULL && memcmp(r.setup + 1, setup + 1, 3) != 0)
+			continue;
+
+		skipped_ += i - cursor_;
+		matched_++;
+		cursor_ = i + 1;
+		return &entries_[i];
+	}
+
+	unmatched_++;
+	return NULL;
+}
+
+// Blocks until |duration_us| after |start_us|, as long as the device took.
+void ReplayTransport::Hold(uint64_t start_us, uint32_t duration_us) {
+	uint64_t now_us = TransportStats::NowUs();
+
+	if (now_us < start_us + duration_us)
+		std::this_thread::sleep_for(std::chrono::microseconds(start_us + duration_us - now_us));
+}
+
+ssize_t ReplayTransport::Read(void* data, size_t len) {
+	uint64_t start_us = TransportStats::NowUs();
+	tlog_record record;
+	const unsigned char* payload = NULL;
+
+	{
+		std::lock_guard<std::mutex> lock(lock_);
+		const entry* e = Next(TLOG_READ, true, NULL);
+
+		if (e == NULL) {
+			stats_.RecordError(-1);
+			return -1;
+		}
+
+		record = e->record;
+		if (record.flags & TLOG_PAYLOAD_DATA)
+			payload = &payloads_[e->payload];
+	}
+
+	ssize_t ret = record.result < 0 ? -1 : (ssize_t)std::min<size_t>(record.result, len);
+
+	// Without the recorded data, the host gets zeros of the right length.
+	if (ret > 0) {
+		size_t copied = payload != NULL ? std::min<size_t>(ret, record.payload) : 0;
+
+		if (copied > 0)
+			memcpy(data, payload, copied);
+		memset((char*)data + copied, 0, ret - copied);
+	}
+
+	Hold(start_us, record.duration_us);
+
+	stats_.read_latency.Record(TransportStats::NowUs() - start_us);
+	if (ret >= 0)
+		stats_.RecordBulk(TransportStats::kIn, ret);
+	else
+		stats_.RecordError(-1);
+
+	return ret;
+}
+
+ssize_t ReplayTransport::Write(const void* data, size_t len) {
+	return WriteStripe(0, data, len);
+}
+
+ssize_t ReplayTransport::WriteV(const transport_iovec* iov, int iovcnt) {
+	size_t len = 0;
+
+	for (int i = 0; i < iovcnt; i++)
+		len += iov[i].len;
+
+	return WriteStripe(0, NULL, len);
+}
+
+ssize_t ReplayTransport::WriteStripe(int stripe, const void* data, size_t len) {
+	uint64_t start_us = TransportStats::NowUs();
+	tlog_record record;
+
+	if (stripe >= stripes_)
+		return -1;
+
+	{
+		std::lock_guard<std::mutex> lock(lock_);
+		const entry* e = Next(TLOG_WRITE, false, NULL);
+
+		if (e == NULL) {
+			stats_.RecordError(-1);
+			return -1;
+		}
+
+		record = e->record;
+	}
+
+	// Another length than recorded takes proportionally as long, and a
+	// short write takes the same share of it.
+	uint64_t duration_us = record.duration_us;
+	ssize_t ret = record.result < 0 ? -1 : (ssize_t)len;
+
+	if (record.length > 0 && record.length != len)
+		duration_us = duration_us * len / record.length;
+	if (record.length > 0 && record.result >= 0 && (uint32_t)record.result < record.length)
+		ret = (ssize_t)((uint64_t)record.result * len / record.length);
+
+	Hold(start_us, clamp32(duration_us));
+
+	stats_.write_latency.Record(TransportStats::NowUs() - start_us);
+	if (ret >= 0)
+		stats_.RecordBulk(TransportStats::kOut, ret);
+	else
+		stats_.RecordError(-1);
+
+	return ret;
+}
+
+int ReplayTransport::OpenStripes(int count) {
+	std::lock_guard<std::mutex> lock(lock_);
+	const entry* e = Next(TLOG_OPEN_STRIPES, false, NULL);
+
+	if (e == NULL || e->record.result <= 0)
+		return 0;
+
+	stripes_ = 1 + std::min(count, (int)e->record.result);
+	return stripes_ - 1;
+}
+
+ssize_t ReplayTransport::ControlIO(bool is_in, void* setup, void* data, size_t len) {
+	uint64_t start_us = TransportStats::NowUs();
+	tlog_record record;
+	const unsigned char* payload = NULL;
+
+	{
+		std::lock_guard<std::mutex> lock(lock_);
+		const entry* e = Next(TLOG_CONTROL, is_in, (const unsigned char*)setup);
+
+		if (e == NULL) {
+			stats_.RecordError(-1);
+			return -1;
+		}
+
+		record = e->record;
+		if (record.flags & TLOG_PAYLOAD_DATA)
+			payload = &payloads_[e->payload];
+	}
+
+	ssize_t ret = record.result;
+
+	if (ret > 0 && is_in) {
+		ret = std::min<size_t>(ret, len);
+		if (payload != NULL)
+			memcpy(data, payload, std::min<size_t>(ret, record.payload));
+	}
+	else if (ret > 0) {
+		ret = len;
+	}
+
+	Hold(start_us, record.duration_us);
+
+	stats_.control_latency.Record(TransportStats::NowUs() - start_us);
+	if (ret >= 0)
+		stats_.RecordControl(is_in ? TransportStats::kIn : TransportStats::kOut, ret);
+	else
+		stats_.RecordError(-1);
+
+	return ret;
+}
+
+int ReplayTransport::Close() {
+	std::lock_guard<std::mutex> lock(lock_);
+
+	printf("Replay: %llu of %zu records played back, %llu skipped, %llu calls unmatched\n",
+		(unsigned long long)matched_, entries_.size(), (unsigned long long)skipped_,
+		(unsigned long long)unmatched_);
+
+	return 0;
+}
@@ -0,0 +1,202 @@
+#pragma once
+
+#ifndef TRANSPORT_LOG_H_
+#define TRANSPORT_LOG_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <deque>
+#include <mutex>
+#include <vector>
+
+#include "transport.h"
+
+// Binary log of the transfers of one device, written by RecordingTransport
+// and played back by ReplayTransport. A tlog_header, then one tlog_record
+// per finished call, each followed by |payload| bytes. Little endian, like
+// the protocol itself.
+#define TLOG_MAGIC		0x474C5450	//"PTLG"
+#define TLOG_VERSION	1
+
+// tlog_record::op
+#define TLOG_READ			1
+#define TLOG_WRITE			2
+#define TLOG_CONTROL		3
+#define TLOG_OPEN_STRIPES	4
+
+// tlog_record::flags
+#define TLOG_IN				0x01	//Device to host
+#define TLOG_ASYNC			0x02	//Queued through WriteAsync() or ReadAsync()
+#define TLOG_PAYLOAD_HASH	0x04	//The payload is the 64-bit FNV-1a hash of the data
+#define TLOG_PAYLOAD_DATA	0x08	//The payload is the data itself
+
+// Records a replay may skip to find the one matching a call.
+#define TLOG_RESYNC_WINDOW	64
+
+// What RecordingTransport keeps of bulk data. Control data is always kept
+// whole: it is small, and replay needs what the device answered.
+enum tlog_payloads {
+	TLOG_BULK_NONE,
+	TLOG_BULK_HASH,
+	TLOG_BULK_DATA,
+};
+
+#pragma pack(push, 1)
+struct tlog_header {
+	uint32_t magic;
+	uint16_t version;
+	/// tlog_payloads of the recording
+	uint16_t payloads;
+	/// Transport::Name(), Serial() and Location() of the recorded device
+	char name[32];
+	char serial[64];
+	char location[160];
+};
+
+struct tlog_record {
+	uint8_t op;
+	/// TLOG_* flags
+	uint8_t flags;
+	/// Bulk OUT pipe of a WriteStripe(), 0 otherwise
+	uint16_t stripe;
+	/// Setup packet of a control transfer, zero otherwise
+	unsigned char setup[8];
+	/// Bytes asked for
+	uint32_t length;
+	/// What the call returned
+	int32_t result;
+	/// When the call started, since the log began
+	uint64_t start_us;
+	/// Time the device took: the whole call, or for queued transfers the
+	/// time since the later of its submission and the previous completion
+	uint32_t duration_us;
+	/// Bytes that follow
+	uint32_t payload;
+};
+#pragma pack(pop)
+
+// Transport passing every call on to |inner| and logging it to |fileName|:
+// setup packets, sizes, results and timings, and bulk payloads as chosen
+// by |payloads|. Queued writes and reads are logged once they finish.
+// Calls from several threads are logged in the order they finish.
+class RecordingTransport : public Transport {
+public:
+	// Takes ownership of |inner|. Check IsValid() before use.
+	RecordingTransport(Transport* inner, const char* fileName, tlog_payloads payloads);
+	~RecordingTransport() override;
+
+	bool IsValid() const { return fp_ != NULL; }
+
+	ssize_t Read(void* data, size_t len) override;
+	ssize_t Write(const void* data, size_t len) override;
+	ssize_t WriteV(const transport_iovec* iov, int iovcnt) override;
+	int WriteAsync(const void* data, size_t len) override;
+	ssize_t FinishWrite(const void** data, bool wait) override;
+	size_t WritesInFlight() const override { return inner_->WritesInFlight(); }
+	void* WriteEvent() const override { return inner_->WriteEvent(); }
+	int ReadAsync(void* data, size_t len) override;
+	ssize_t FinishRead(void** data, bool wait) override;
+	size_t ReadsInFlight() const override { return inner_->ReadsInFlight(); }
+	int OpenStripes(int count) override;
+	int Stripes() const override { return inner_->Stripes(); }
+	ssize_t WriteStripe(int stripe, const void* data, size_t len) override;
+	ssize_t ControlIO(bool is_in, void* setup, void* data, size_t len) override;
+	int Close() override;
+	int WaitForDisconnect() override { return inner_->WaitForDisconnect(); }
+	const char* Name() const override { return inner_->Name(); }
+	const char* Serial() const override { return inner_->Serial(); }
+	const char* Location() const override { return inner_->Location(); }
+
+	RecordingTransport(const RecordingTransport&) = delete;
+	void operator=(const RecordingTransport&) = delete;
+
+private:
+	/// A queued transfer, until it finishes
+	struct queued {
+		uint64_t start_us;
+		uint32_t length;
+	};
+
+	void Log(tlog_record* record, uint64_t start_us, uint64_t duration_us,
+		const transport_iovec* iov, int iovcnt, bool control);
+	ssize_t Finish(std::deque<queued>* queue, uint64_t* last_end_us, uint8_t op, uint8_t flags,
+		const void* data, ssize_t ret);
+
+	std::unique_ptr<Transport> inner_;
+	tlog_payloads payloads_;
+	uint64_t base_us_;
+
+	std::mutex lock_;
+	FILE* fp_;
+
+	std::deque<queued> writes_;
+	std::deque<queued> reads_;
+	uint64_t last_write_us_;
+	uint64_t last_read_us_;
+};
+
+// Transport playing back the device side of a recording.
+//
+// Each call takes the next record of the same kind, a control transfer
+// the next one with the same direction, request and value, skipping at
+// most TLOG_RESYNC_WINDOW records the host no longer issues. It returns
+// what the device returned then, with the data of control and, when
+// recorded, bulk IN transfers, and takes as long as the device took, so
+// host side changes can be profiled against real device behaviour without
+// the device. Transfers of another length than recorded are scaled, their
+// time and any short write alike.
+// Calls nothing matches fail, control transfers like a STALL.
+class ReplayTransport : public Transport {
+public:
+	// Check IsValid() before use.
+	explicit ReplayTransport(const char* fileName);
+
+	bool IsValid() const { return valid_; }
+
+	ssize_t Read(void* data, size_t len) override;
+	ssize_t Write(const void* data, size_t len) override;
+	// One record for the whole vector, as RecordingTransport logs it.
+	ssize_t WriteV(const transport_iovec* iov, int iovcnt) override;
+	int OpenStripes(int count) override;
+	int Stripes() const override { return stripes_; }
+	ssize_t WriteStripe(int stripe, const void* data, size_t len) override;
+	ssize_t ControlIO(bool is_in, void* setup, void* data, size_t len) override;
+	int Close() override;
+	const char* Name() const override { return "replay"; }
+	const char* Serial() const override { return header_.serial; }
+	const char* Location() const override { return header_.location; }
+
+	// Records played back, skipped over, and calls nothing matched.
+	uint64_t Matched() const { return matched_; }
+	uint64_t Skipped() const { return skipped_; }
+	uint64_t Unmatched() const { return unmatched_; }
+
+	ReplayTransport(const ReplayTransport&) = delete;
+	void operator=(const ReplayTransport&) = delete;
+
+private:
+	/// One record and where its payload is in |payloads_|
+	struct entry {
+		tlog_record record;
+		size_t payload;
+	};
+
+	const entry* Next(uint8_t op, bool is_in, const unsigned char* setup);
+	void Hold(uint64_t start_us, uint32_t duration_us);
+
+	bool valid_;
+	tlog_header header_;
+	std::vector<entry> entries_;
+	std::vector<unsigned char> payloads_;
+	int stripes_;
+
+	std::mutex lock_;
+	size_t cursor_;
+	uint64_t matched_;
+	uint64_t skipped_;
+	uint64_t unmatched_;
+};
+
+#endif  // TRANSPORT_LOG_H_
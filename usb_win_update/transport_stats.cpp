@@ -0,0 +1,201 @@
+#include <chrono>
+
+#include "json.h"
+#include "transport_stats.h"
+
+int LatencyHistogram::BucketIndex(uint64_t value) {
+	if (value < kSubBucketCount)
+		return (int)value;
+
+	int msb = 0;
+	for (uint64_t v = value; v >>= 1;)
+		msb++;
+
+	// value >> shift lands in [kSubBucketHalf, kSubBucketCount).
+	int shift = msb - (kSubBucketBits - 1);
+	int sub = (int)(value >> shift);
+
+	return kSubBucketCount + (shift - 1) * kSubBucketHalf + (sub - kSubBucketHalf);
+}
+
+uint64_t LatencyHistogram::BucketLowerBound(int index) {
+	if (index < kSubBucketCount)
+		return index;
+
+	int k = index - kSubBucketCount;
+	int shift = k / kSubBucketHalf + 1;
+	uint64_t sub = k % kSubBucketHalf + kSubBucketHalf;
+
+	return sub << shift;
+}
+
+void LatencyHistogram::Record(uint64_t value) {
+	counts_[BucketIndex(value)].fetch_add(1, std::memory_order_relaxed);
+	count_.fetch_add(1, std::memory_order_relaxed);
+	sum_.fetch_add(value, std::memory_order_relaxed);
+
+	uint64_t cur = min_.load(std::memory_order_relaxed);
+	while (value < cur && !min_.compare_exchange_weak(cur, value, std::memory_order_relaxed))
+		;
+
+	cur = max_.load(std::memory_order_relaxed);
+	while (value > cur && !max_.compare_exchange_weak(cur, value, std::memory_order_relaxed))
+		;
+}
+
+void LatencyHistogram::Reset() {
+	for (int i = 0; i < kBucketCount; i++)
+		counts_[i].store(0, std::memory_order_relaxed);
+	count_.store(0, std::memory_order_relaxed);
+	sum_.store(0, std::memory_order_relaxed);
+	min_.store(UINT64_MAX, std::memory_order_relaxed);
+	max_.store(0, std::memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::Min() const {
+	return Count() ? min_.load(std::memory_order_relaxed) : 0;
+}
+
+double LatencyHistogram::Mean() const {
+	uint64_t count = Count();
+
+	return count ? (double)sum_.load(std::memory_order_relaxed) / count : 0.0;
+}
+
+uint64_t LatencyHistogram::Percentile(double percentile) const {
+	uint64_t count = Count();
+
+	if (count == 0)
+		return 0;
+
+	uint64_t rank = (uint64_t)(percentile / 100.0 * count + 0.5);
+	if (rank < 1)
+		rank = 1;
+
+	uint64_t seen = 0;
+	for (int i = 0; i < kBucketCount; i++) {
+		seen += counts_[i].load(std::memory_order_relaxed);
+		if (seen >= rank)
+			return BucketLowerBound(i);
+	}
+
+	return Max();
+}
+
+void LatencyHistogram::DumpJson(FILE *fp) const {
+	fprintf(fp, "{\"count\":%llu,\"min\":%llu,\"mean\":%.1f,\"p50\":%llu,\"p90\":%llu,"
+		"\"p99\":%llu,\"p999\":%llu,\"max\":%llu,\"buckets\":[",
+		(unsigned long long)Count(), (unsigned long long)Min(), Mean(),
+		(unsigned long long)Percentile(50.0), (unsigned long long)Percentile(90.0),
+		(unsigned long long)Percentile(99.0), (unsigned long long)Percentile(99.9),
+		(unsigned long long)Max());
+
+	// Only non-empty buckets, as [lower_bound, count] pairs.
+	bool first = true;
+	for (int i = 0; i < kBucketCount; i++) {
+		uint64_t n = counts_[i].load(std::memory_order_relaxed);
+		if (n == 0)
+			continue;
+
+		fprintf(fp, "%s[%llu,%llu]", first ? "" : ",",
+			(unsigned long long)BucketLowerBound(i), (unsigned long long)n);
+		first = false;
+	}
+
+	fprintf(fp, "]}");
+}
+
+uint64_t TransportStats::NowUs() {
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void TransportStats::RecordBulk(Direction dir, uint64_t bytes) {
+	bulk_bytes_[dir].fetch_add(bytes, std::memory_order_relaxed);
+	bulk_transfers_[dir].fetch_add(1, std::memory_order_relaxed);
+}
+
+void TransportStats::RecordControl(Direction dir, uint64_t bytes) {
+	control_bytes_[dir].fetch_add(bytes, std::memory_order_relaxed);
+	control_transfers_[dir].fetch_add(1, std::memory_order_relaxed);
+}
+
+void TransportStats::RecordZlp() {
+	zlps_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void TransportStats::RecordRetry() {
+	retries_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void TransportStats::RecordError(int code) {
+	std::lock_guard<std::mutex> lock(errors_lock_);
+	errors_[code]++;
+}
+
+void TransportStats::Reset() {
+	for (int dir = kOut; dir <= kIn; dir++) {
+		bulk_bytes_[dir].store(0, std::memory_order_relaxed);
+		bulk_transfers_[dir].store(0, std::memory_order_relaxed);
+		control_bytes_[dir].store(0, std::memory_order_relaxed);
+		control_transfers_[dir].store(0, std::memory_order_relaxed);
+	}
+	zlps_.store(0, std::memory_order_relaxed);
+	retries_.store(0, std::memory_order_relaxed);
+
+	write_latency.Reset();
+	read_latency.Reset();
+	control_latency.Reset();
+
+	std::lock_guard<std::mutex> lock(errors_lock_);
+	errors_.clear();
+}
+
+uint64_t TransportStats::Errors() const {
+	std::lock_guard<std::mutex> lock(errors_lock_);
+	uint64_t total = 0;
+
+	for (auto& error : errors_)
+		total += error.second;
+
+	return total;
+}
+
+std::map<int, uint64_t> TransportStats::ErrorsByCode() const {
+	std::lock_guard<std::mutex> lock(errors_lock_);
+	return errors_;
+}
+
+void TransportStats::DumpJson(FILE *fp, const char *label) const {
+	fprintf(fp, "{\"transport\":");
+	json_write_string(fp, label ? label : "");
+	fprintf(fp, ",\n");
+
+	fprintf(fp, " \"bulk_out\":{\"bytes\":%llu,\"transfers\":%llu},\n",
+		(unsigned long long)BulkBytes(kOut), (unsigned long long)BulkTransfers(kOut));
+	fprintf(fp, " \"bulk_in\":{\"bytes\":%llu,\"transfers\":%llu},\n",
+		(unsigned long long)BulkBytes(kIn), (unsigned long long)BulkTransfers(kIn));
+	fprintf(fp, " \"control_out\":{\"bytes\":%llu,\"transfers\":%llu},\n",
+		(unsigned long long)ControlBytes(kOut), (unsigned long long)ControlTransfers(kOut));
+	fprintf(fp, " \"control_in\":{\"bytes\":%llu,\"transfers\":%llu},\n",
+		(unsigned long long)ControlBytes(kIn), (unsigned long long)ControlTransfers(kIn));
+	fprintf(fp, " \"zlps\":%llu,\n \"retries\":%llu,\n",
+		(unsigned long long)Zlps(), (unsigned long long)Retries());
+
+	fprintf(fp, " \"errors\":{");
+	bool first = true;
+	for (auto& error : ErrorsByCode()) {
+		fprintf(fp, "%s\"%d\":%llu", first ? "" : ",", error.first,
+			(unsigned long long)error.second);
+		first = false;
+	}
+	fprintf(fp, "},\n");
+
+	fprintf(fp, " \"write_latency_us\":");
+	write_latency.DumpJson(fp);
+	fprintf(fp, ",\n \"read_latency_us\":");
+	read_latency.DumpJson(fp);
+	fprintf(fp, ",\n \"control_latency_us\":");
+	control_latency.DumpJson(fp);
+	fprintf(fp, "}");
+}
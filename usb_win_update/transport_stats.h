@@ -0,0 +1,126 @@
+#pragma once
+
+#ifndef TRANSPORT_STATS_H_
+#define TRANSPORT_STATS_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <atomic>
+#include <map>
+#include <mutex>
+
+// Log-linear latency histogram in the style of HdrHistogram: values below
+// 32 get their own bucket, above that every power of two is split into 16
+// linear sub-buckets, which keeps the relative error under ~6% over the
+// whole 64-bit range. Recording is lock-free so it can be read at runtime
+// while a transfer is in progress.
+class LatencyHistogram {
+public:
+	static const int kSubBucketBits = 5;
+	static const int kSubBucketCount = 1 << kSubBucketBits;
+	static const int kSubBucketHalf = kSubBucketCount / 2;
+	static const int kBucketCount = kSubBucketCount + (64 - kSubBucketBits) * kSubBucketHalf;
+
+	LatencyHistogram() { Reset(); }
+
+	void Record(uint64_t value);
+	void Reset();
+
+	uint64_t Count() const { return count_.load(std::memory_order_relaxed); }
+	uint64_t Min() const;
+	uint64_t Max() const { return max_.load(std::memory_order_relaxed); }
+	double Mean() const;
+
+	// Returns the lower bound of the bucket holding the |percentile|th value.
+	uint64_t Percentile(double percentile) const;
+
+	// Writes {"count":..,"min":..,"p50":..,...} to |fp|.
+	void DumpJson(FILE *fp) const;
+
+	LatencyHistogram(const LatencyHistogram&) = delete;
+	void operator=(const LatencyHistogram&) = delete;
+
+private:
+	static int BucketIndex(uint64_t value);
+	static uint64_t BucketLowerBound(int index);
+
+	std::atomic<uint64_t> counts_[kBucketCount];
+	std::atomic<uint64_t> count_;
+	std::atomic<uint64_t> sum_;
+	std::atomic<uint64_t> min_;
+	std::atomic<uint64_t> max_;
+};
+
+// Performance counters kept by every Transport. Bulk transfers are counted
+// per submission to the host controller, so a Write() larger than the
+// maximum bulk size shows up as several transfers. Latencies are per
+// Read()/Write()/ControlIO() call, in microseconds.
+class TransportStats {
+public:
+	enum Direction {
+		kOut = 0,
+		kIn = 1,
+	};
+
+	TransportStats() { Reset(); }
+
+	// Monotonic microsecond clock used for the latency histograms.
+	static uint64_t NowUs();
+
+	void RecordBulk(Direction dir, uint64_t bytes);
+	void RecordControl(Direction dir, uint64_t bytes);
+	void RecordZlp();
+	void RecordRetry();
+	void RecordError(int code);
+
+	void Reset();
+
+	uint64_t BulkBytes(Direction dir) const { return bulk_bytes_[dir].load(std::memory_order_relaxed); }
+	uint64_t BulkTransfers(Direction dir) const { return bulk_transfers_[dir].load(std::memory_order_relaxed); }
+	uint64_t ControlBytes(Direction dir) const { return control_bytes_[dir].load(std::memory_order_relaxed); }
+	uint64_t ControlTransfers(Direction dir) const { return control_transfers_[dir].load(std::memory_order_relaxed); }
+	uint64_t Zlps() const { return zlps_.load(std::memory_order_relaxed); }
+	uint64_t Retries() const { return retries_.load(std::memory_order_relaxed); }
+	uint64_t Errors() const;
+	std::map<int, uint64_t> ErrorsByCode() const;
+
+	// Writes the counters and histograms as one JSON object. |label| names
+	// the transport (interface name, serial...) and may be NULL.
+	void DumpJson(FILE *fp, const char *label) const;
+
+	LatencyHistogram write_latency;
+	LatencyHistogram read_latency;
+	LatencyHistogram control_latency;
+
+	TransportStats(const TransportStats&) = delete;
+	void operator=(const TransportStats&) = delete;
+
+private:
+	std::atomic<uint64_t> bulk_bytes_[2];
+	std::atomic<uint64_t> bulk_transfers_[2];
+	std::atomic<uint64_t> control_bytes_[2];
+	std::atomic<uint64_t> control_transfers_[2];
+	std::atomic<uint64_t> zlps_;
+	std::atomic<uint64_t> retries_;
+
+	mutable std::mutex errors_lock_;
+	std::map<int, uint64_t> errors_;
+};
+
+// Times one Transport call into |histogram| when it goes out of scope.
+class LatencyTimer {
+public:
+	explicit LatencyTimer(LatencyHistogram& histogram)
+		: histogram_(histogram), start_us_(TransportStats::NowUs()) {}
+	~LatencyTimer() { histogram_.Record(TransportStats::NowUs() - start_us_); }
+
+	LatencyTimer(const LatencyTimer&) = delete;
+	void operator=(const LatencyTimer&) = delete;
+
+private:
+	LatencyHistogram& histogram_;
+	uint64_t start_us_;
+};
+
+#endif  // TRANSPORT_STATS_H_
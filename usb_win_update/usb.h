@@ -31,6 +31,8 @@
 #ifndef _USB_H_
 #define _USB_H_
 
+#include <vector>
+
 #include "transport.h"
 
 struct usb_ifc_info {
@@ -59,4 +61,7 @@ typedef int(*ifc_match_func)(usb_ifc_info *ifc);
 
 Transport* usb_open(ifc_match_func callback);
 
+// Opens every device accepted by |callback|.
+std::vector<Transport*> usb_open_all(ifc_match_func callback);
+
 #endif
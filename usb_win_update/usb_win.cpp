@@ -31,17 +31,32 @@
 #include <winerror.h>
 #include <errno.h>
 #include <usb100.h>
+#include <setupapi.h>
 #include <adb_api.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include <atomic>
+#include <deque>
 #include <memory>
 #include <string>
+#include <vector>
 
 #include "usb.h"
+#include "trace.h"
 
 #define MAX_USBFS_BULK_SIZE (1024 * 1024)
 
+/// WriteV() segments shorter than this are gathered into a staging buffer
+#define WRITEV_COALESCE_THRESHOLD (4 * 1024)
+
+/// Size of the WriteV() staging buffer for coalesced segments
+#define WRITEV_COALESCE_BUFFER_SIZE (64 * 1024)
+
+/// Maximum number of WriteV() submissions outstanding on the write pipe
+#define WRITEV_MAX_IN_FLIGHT 8
+
 /** Structure usb_handle describes our connection to the usb device via
 AdbWinApi.dll. This structure is returned from usb_open() routine and
 is expected in each subsequent call that is accessing the device.
@@ -56,25 +71,92 @@ struct usb_handle {
 	/// Handle to USB write pipe (endpoint)
 	ADBAPIHANDLE  adb_write_pipe;
 
+	/// Extra bulk OUT pipes opened for striping
+	std::vector<ADBAPIHANDLE> stripe_pipes;
+
 	/// Interface name
 	std::string interface_name;
 
+	/// Serial number of the device
+	std::string serial;
+
+	/// Location path of the device, see Transport::Location()
+	std::string location;
+
 	/// Mask for determining when to use zero length packets
 	unsigned zero_mask;
 };
 
 class WindowsUsbTransport : public Transport {
 public:
-	WindowsUsbTransport(std::unique_ptr<usb_handle> handle) : handle_(std::move(handle)) {}
+	WindowsUsbTransport(std::unique_ptr<usb_handle> handle) : handle_(std::move(handle)), lost_(false) {}
 	~WindowsUsbTransport() override = default;
 
 	ssize_t Read(void* data, size_t len) override;
 	ssize_t Write(const void* data, size_t len) override;
+	ssize_t WriteV(const transport_iovec* iov, int iovcnt) override;
+	int OpenStripes(int count) override;
+	int Stripes() const override;
+	ssize_t WriteStripe(int stripe, const void* data, size_t len) override;
+	int WriteAsync(const void* data, size_t len) override;
+	ssize_t FinishWrite(const void** data, bool wait) override;
+	size_t WritesInFlight() const override { return async_queue_.size(); }
+	void* WriteEvent() const override;
+	int ReadAsync(void* data, size_t len) override;
+	ssize_t FinishRead(void** data, bool wait) override;
+	size_t ReadsInFlight() const override { return read_queue_.size(); }
 	ssize_t ControlIO(bool is_in, void *setup, void* data, size_t len) override;
 	int Close() override;
+	const char* Name() const override;
+	const char* Serial() const override;
+	const char* Location() const override;
 
 private:
+	/// One asynchronous bulk OUT submission issued by WriteV()
+	struct write_submission {
+		ADBAPIHANDLE io;
+		unsigned long len;
+	};
+
+	/// One WriteAsync() call, split in bulk transfers
+	struct async_submission {
+		const void* data;
+		std::deque<write_submission> ios;
+		/// Signalled with the last transfer, see WriteEvent()
+		HANDLE event;
+		bool failed;
+	};
+
+	/// One ReadAsync() call, a single bulk IN transfer
+	struct read_submission {
+		void* data;
+		ADBAPIHANDLE io;
+		bool failed;
+	};
+
+	ssize_t WritePipe(ADBAPIHANDLE pipe, const void* data, size_t len, bool striped);
+	void Kick(bool striped);
+	void KickLost();
+	bool SubmitWrite(std::deque<write_submission>& pending, const void* data, unsigned long len);
+	bool CompleteWrite(std::deque<write_submission>& pending);
+	bool SubmitAsync(async_submission& submission, const void* data, unsigned long len,
+		HANDLE event);
+
 	std::unique_ptr<usb_handle> handle_;
+
+	/// Writes queued by WriteAsync(), oldest first
+	std::deque<async_submission> async_queue_;
+
+	/// Reads queued by ReadAsync(), oldest first
+	std::deque<read_submission> read_queue_;
+
+	/// Staging buffer for small WriteV() segments
+	std::vector<char> coalesce_buf_;
+
+	/// A WriteStripe() found the device gone. Other stripes may still be
+	/// writing, so the handle is only kicked by the next call outside
+	/// WriteStripe(), once the striped image is over.
+	std::atomic<bool> lost_;
 };
 
 #if 0
@@ -98,6 +180,8 @@ void usb_kick(usb_handle* handle);
 
 
 std::unique_ptr<usb_handle> do_usb_open(const wchar_t* interface_name) {
+	TRACE_SCOPE("usb_open_interface");
+
 	// Allocate our handle
 	std::unique_ptr<usb_handle> ret(new usb_handle);
 
@@ -151,60 +235,88 @@ std::unique_ptr<usb_handle> do_usb_open(const wchar_t* interface_name) {
 	return nullptr;
 }
 
-ssize_t WindowsUsbTransport::Write(const void* data, size_t len) {
+// Kicks the handle, or for a stripe write leaves that to KickLost().
+void WindowsUsbTransport::Kick(bool striped) {
+	if (striped)
+		lost_ = true;
+	else
+		usb_kick(handle_.get());
+}
+
+// Kicks the handle a stripe write found disconnected. Called on entry of
+// every call but WriteStripe(); those are never made while stripes are
+// being written.
+void WindowsUsbTransport::KickLost() {
+	if (lost_.exchange(false) && nullptr != handle_)
+		usb_kick(handle_.get());
+}
+
+ssize_t WindowsUsbTransport::WritePipe(ADBAPIHANDLE pipe, const void* data, size_t len,
+	bool striped) {
 	unsigned long time_out = 5000;
 	unsigned long written = 0, written_zlp = 0;
-	unsigned count = 0;
+	size_t count = 0;
 	int ret;
 
+	TraceScope trace("usb_bulk_write");
+	trace.SetBytes(len);
+	LatencyTimer timer(stats_.write_latency);
+
 	//fprintf(stderr, "usb_write %d\n", len);
 	if (nullptr != handle_) {
 		// Perform write
 #if 1
 		if (len == 0) {
 			fprintf(stderr, "usb_write: write the short packet. ZLP\n");
-			ret = AdbWriteEndpointSync(handle_->adb_write_pipe, const_cast<void*>(data), 0,
+			ret = AdbWriteEndpointSync(pipe, const_cast<void*>(data), 0,
 				&written_zlp, time_out);
 			if (ret == 0) {
 				errno = GetLastError();
+				stats_.RecordError(errno);
 				fprintf(stderr, "AdbWriteEndpointSync ZLP returned %d, errno: %d\n", ret, errno);
 				// assume ERROR_INVALID_HANDLE indicates we are disconnected
 				if (errno == ERROR_INVALID_HANDLE)
-					usb_kick(handle_.get());
+					Kick(striped);
 				return -1;
 			}
+			stats_.RecordZlp();
 			return 0;
 		}
 #endif
 
 		while (len > 0) {
-			int xfer = (len > MAX_USBFS_BULK_SIZE) ? MAX_USBFS_BULK_SIZE : len;
-			ret = AdbWriteEndpointSync(handle_->adb_write_pipe, const_cast<void*>(data), xfer,
+			unsigned long xfer = (len > MAX_USBFS_BULK_SIZE) ? MAX_USBFS_BULK_SIZE : (unsigned long)len;
+			ret = AdbWriteEndpointSync(pipe, const_cast<void*>(data), xfer,
 				&written, time_out);
 
 			if (ret == 0) {
 				errno = GetLastError();
+				stats_.RecordError(errno);
 				fprintf(stderr, "AdbWriteEndpointSync returned %d, errno: %d\n", ret, errno);
 				// assume ERROR_INVALID_HANDLE indicates we are disconnected
 				if (errno == ERROR_INVALID_HANDLE)
-					usb_kick(handle_.get());
+					Kick(striped);
 				return -1;
 			}
 
+			stats_.RecordBulk(TransportStats::kOut, written);
+
 #if 1
 			if (handle_->zero_mask && ((xfer & handle_->zero_mask) == 0)) {
 				//Send the ZLP
 				//fprintf(stdout, "Send the ZLP\n");
-				ret = AdbWriteEndpointSync(handle_->adb_write_pipe, const_cast<void*>(data), 0,
+				ret = AdbWriteEndpointSync(pipe, const_cast<void*>(data), 0,
 					&written_zlp, time_out);
 				if (ret == 0) {
 					errno = GetLastError();
+					stats_.RecordError(errno);
 					fprintf(stderr, "AdbWriteEndpointSync ZLP returned %d, errno: %d\n", ret, errno);
 					// assume ERROR_INVALID_HANDLE indicates we are disconnected
 					if (errno == ERROR_INVALID_HANDLE)
-						usb_kick(handle_.get());
+						Kick(striped);
 					return -1;
 				}
+				stats_.RecordZlp();
 			}
 #endif
 
@@ -226,10 +338,338 @@ ssize_t WindowsUsbTransport::Write(const void* data, size_t len) {
 	return -1;
 }
 
+ssize_t WindowsUsbTransport::Write(const void* data, size_t len) {
+	KickLost();
+	return WritePipe(nullptr != handle_ ? handle_->adb_write_pipe : nullptr, data, len, false);
+}
+
+// Extra pipes are the bulk OUT endpoints of the interface other than the
+// default one, in endpoint index order.
+int WindowsUsbTransport::OpenStripes(int count) {
+	USB_INTERFACE_DESCRIPTOR interf_desc;
+	AdbEndpointInformation default_info;
+
+	KickLost();
+
+	if (nullptr == handle_)
+		return 0;
+
+	if (!AdbGetUsbInterfaceDescriptor(handle_->adb_interface, &interf_desc) ||
+		!AdbGetDefaultBulkWriteEndpointInformation(handle_->adb_interface, &default_info)) {
+		fprintf(stderr, "Failed to get the endpoint information\n");
+		return 0;
+	}
+
+	for (unsigned char index = 0; index < interf_desc.bNumEndpoints &&
+		(int)handle_->stripe_pipes.size() < count; index++) {
+		AdbEndpointInformation info;
+
+		if (!AdbGetEndpointInformation(handle_->adb_interface, index, &info))
+			continue;
+
+		if (info.endpoint_type != AdbEndpointTypeBulk || (info.endpoint_address & 0x80) ||
+			info.endpoint_address == default_info.endpoint_address)
+			continue;
+
+		ADBAPIHANDLE pipe = AdbOpenEndpoint(handle_->adb_interface, index,
+			AdbOpenAccessTypeReadWrite, AdbOpenSharingModeReadWrite);
+		if (nullptr == pipe) {
+			fprintf(stderr, "AdbOpenEndpoint 0x%02x failed, errno: %lu\n", info.endpoint_address,
+				GetLastError());
+			continue;
+		}
+
+		handle_->stripe_pipes.push_back(pipe);
+	}
+
+	return (int)handle_->stripe_pipes.size();
+}
+
+int WindowsUsbTransport::Stripes() const {
+	if (nullptr == handle_)
+		return 1;
+
+	return 1 + (int)handle_->stripe_pipes.size();
+}
+
+ssize_t WindowsUsbTransport::WriteStripe(int stripe, const void* data, size_t len) {
+	//Every pipe is gone with the device, fail the rest of the image fast
+	if (nullptr == handle_ || lost_ || stripe < 0 || stripe > (int)handle_->stripe_pipes.size()) {
+		SetLastError(ERROR_INVALID_HANDLE);
+		return -1;
+	}
+
+	if (stripe == 0)
+		return WritePipe(handle_->adb_write_pipe, data, len, true);
+
+	return WritePipe(handle_->stripe_pipes[stripe - 1], data, len, true);
+}
+
+bool WindowsUsbTransport::SubmitWrite(std::deque<write_submission>& pending,
+	const void* data, unsigned long len) {
+	const unsigned long time_out = 5000;
+
+	while (pending.size() >= WRITEV_MAX_IN_FLIGHT) {
+		if (!CompleteWrite(pending))
+			return false;
+	}
+
+	write_submission submission;
+
+	submission.len = len;
+	submission.io = AdbWriteEndpointAsync(handle_->adb_write_pipe, const_cast<void*>(data), len,
+		NULL, time_out, NULL);
+	if (nullptr == submission.io) {
+		errno = GetLastError();
+		stats_.RecordError(errno);
+		fprintf(stderr, "AdbWriteEndpointAsync failed, errno: %d\n", errno);
+		return false;
+	}
+
+	pending.push_back(submission);
+	return true;
+}
+
+bool WindowsUsbTransport::CompleteWrite(std::deque<write_submission>& pending) {
+	write_submission submission = pending.front();
+	unsigned long written = 0;
+
+	pending.pop_front();
+
+	bool ret = AdbGetOvelappedIoResult(submission.io, NULL, &written, true);
+	if (!ret)
+		errno = GetLastError();
+	AdbCloseHandle(submission.io);
+
+	if (!ret) {
+		stats_.RecordError(errno);
+		fprintf(stderr, "usb_writev completion failed, errno: %d\n", errno);
+		return false;
+	}
+
+	if (written != submission.len) {
+		fprintf(stderr, "usb_writev short write. Written: %lu, expected: %lu\n",
+			written, submission.len);
+		return false;
+	}
+
+	if (submission.len != 0)
+		stats_.RecordBulk(TransportStats::kOut, written);
+	else
+		stats_.RecordZlp();
+
+	return true;
+}
+
+// Large segments are submitted in place, back to back, with up to
+// WRITEV_MAX_IN_FLIGHT transfers queued on the pipe so the host controller
+// never idles between them. Runs of small segments (framing headers) are
+// gathered into coalesce_buf_ and go out as one transfer. The vector is one
+// logical write: a ZLP follows only when its total length is a multiple of
+// the max packet size.
+ssize_t WindowsUsbTransport::WriteV(const transport_iovec* iov, int iovcnt) {
+	std::deque<write_submission> pending;
+	size_t total = 0;
+	size_t staged_start = 0, staged_end = 0;
+	bool ok = true;
+
+	KickLost();
+
+	TraceScope trace("usb_bulk_writev");
+	LatencyTimer timer(stats_.write_latency);
+
+	if (nullptr == handle_) {
+		fprintf(stderr, "usb_writev NULL handle\n");
+		SetLastError(ERROR_INVALID_HANDLE);
+		return -1;
+	}
+
+	if (coalesce_buf_.empty())
+		coalesce_buf_.resize(WRITEV_COALESCE_BUFFER_SIZE);
+
+	for (int i = 0; ok && i < iovcnt; i++) {
+		const char* data = (const char*)iov[i].base;
+		size_t len = iov[i].len;
+
+		if (len == 0)
+			continue;
+
+		if (len < WRITEV_COALESCE_THRESHOLD) {
+			if (staged_end + len > coalesce_buf_.size()) {
+				// Flush the run, then wait until the staging buffer is idle.
+				if (staged_end > staged_start)
+					ok = SubmitWrite(pending, &coalesce_buf_[staged_start], staged_end - staged_start);
+				while (ok && !pending.empty())
+					ok = CompleteWrite(pending);
+				staged_start = staged_end = 0;
+				if (!ok)
+					break;
+			}
+
+			memcpy(&coalesce_buf_[staged_end], data, len);
+			staged_end += len;
+			total += len;
+			continue;
+		}
+
+		if (staged_end > staged_start) {
+			ok = SubmitWrite(pending, &coalesce_buf_[staged_start], staged_end - staged_start);
+			staged_start = staged_end;
+		}
+
+		while (ok && len > 0) {
+			unsigned long xfer = (len > MAX_USBFS_BULK_SIZE) ? MAX_USBFS_BULK_SIZE : (unsigned long)len;
+
+			ok = SubmitWrite(pending, data, xfer);
+			data += xfer;
+			len -= xfer;
+			total += xfer;
+		}
+	}
+
+	if (ok && staged_end > staged_start)
+		ok = SubmitWrite(pending, &coalesce_buf_[staged_start], staged_end - staged_start);
+
+	if (ok && total != 0 && handle_->zero_mask && ((total & handle_->zero_mask) == 0))
+		ok = SubmitWrite(pending, &coalesce_buf_[0], 0);
+
+	// The caller's buffers must not be released while the pipe still
+	// references them, so drain everything even after a failure.
+	while (!pending.empty()) {
+		if (!CompleteWrite(pending))
+			ok = false;
+	}
+
+	if (!ok) {
+		// assume ERROR_INVALID_HANDLE indicates we are disconnected
+		if (errno == ERROR_INVALID_HANDLE)
+			usb_kick(handle_.get());
+		fprintf(stderr, "usb_writev failed: %d\n", errno);
+		return -1;
+	}
+
+	trace.SetBytes(total);
+	return total;
+}
+
+bool WindowsUsbTransport::SubmitAsync(async_submission& submission, const void* data,
+	unsigned long len, HANDLE event) {
+	const unsigned long time_out = 5000;
+	write_submission io;
+
+	io.len = len;
+	io.io = AdbWriteEndpointAsync(handle_->adb_write_pipe, const_cast<void*>(data), len,
+		NULL, time_out, event);
+	if (nullptr == io.io) {
+		errno = GetLastError();
+		stats_.RecordError(errno);
+		fprintf(stderr, "AdbWriteEndpointAsync failed, errno: %d\n", errno);
+		return false;
+	}
+
+	submission.ios.push_back(io);
+	return true;
+}
+
+// Same framing as Write(): the data goes out in transfers of at most
+// MAX_USBFS_BULK_SIZE, each followed by a ZLP when it fills whole packets.
+// The transfers are only queued on the pipe; FinishWrite() collects them.
+// Transfers on one pipe complete in order, so only the last one carries
+// the event of the submission.
+int WindowsUsbTransport::WriteAsync(const void* data, size_t len) {
+	async_submission submission;
+	const char* p = (const char*)data;
+	bool ok = true;
+
+	KickLost();
+
+	TraceScope trace("usb_bulk_write_async");
+	trace.SetBytes(len);
+
+	submission.data = data;
+	submission.event = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+	if (nullptr == handle_ || NULL == submission.event) {
+		fprintf(stderr, "usb_write_async NULL handle\n");
+		SetLastError(ERROR_INVALID_HANDLE);
+		ok = false;
+	}
+
+	while (ok && len > 0) {
+		unsigned long xfer = (len > MAX_USBFS_BULK_SIZE) ? MAX_USBFS_BULK_SIZE : (unsigned long)len;
+		bool last = xfer == len;
+		bool zlp = handle_->zero_mask && ((xfer & handle_->zero_mask) == 0);
+
+		ok = SubmitAsync(submission, p, xfer, last && !zlp ? submission.event : NULL);
+		if (ok && zlp)
+			ok = SubmitAsync(submission, p, 0, last ? submission.event : NULL);
+
+		p += xfer;
+		len -= xfer;
+	}
+
+	// Whatever was submitted must be drained before |data| is reused.
+	// A failed submission never completes its last transfer, so wake up
+	// whoever waits for it now.
+	submission.failed = !ok;
+	if (!ok && NULL != submission.event)
+		SetEvent(submission.event);
+	async_queue_.push_back(submission);
+
+	return ok ? 0 : -1;
+}
+
+ssize_t WindowsUsbTransport::FinishWrite(const void** data, bool wait) {
+	async_submission& submission = async_queue_.front();
+	size_t total = 0;
+	bool ok = !submission.failed;
+
+	if (!wait) {
+		for (const write_submission& io : submission.ios) {
+			if (!AdbHasOvelappedIoComplated(io.io))
+				return 0;
+		}
+	}
+
+	TraceScope trace("usb_write_wait");
+
+	for (const write_submission& io : submission.ios)
+		total += io.len;
+
+	while (!submission.ios.empty()) {
+		if (!CompleteWrite(submission.ios))
+			ok = false;
+	}
+
+	*data = submission.data;
+	if (NULL != submission.event)
+		CloseHandle(submission.event);
+	async_queue_.pop_front();
+
+	if (!ok) {
+		// assume ERROR_INVALID_HANDLE indicates we are disconnected
+		if (errno == ERROR_INVALID_HANDLE && nullptr != handle_)
+			usb_kick(handle_.get());
+		fprintf(stderr, "usb_write_async failed: %d\n", errno);
+		return -1;
+	}
+
+	return total;
+}
+
+void* WindowsUsbTransport::WriteEvent() const {
+	return async_queue_.empty() ? nullptr : async_queue_.front().event;
+}
+
 ssize_t WindowsUsbTransport::ControlIO(bool is_in,
 	void *setup, void* data, size_t len) {
 	unsigned long transferred = 0;
 
+	KickLost();
+
+	TRACE_SCOPE("usb_control");
+	LatencyTimer timer(stats_.control_latency);
+
 #if 0
 	fprintf(stderr, "usb_control_transfer %d\n", len);
 #endif
@@ -243,10 +683,12 @@ ssize_t WindowsUsbTransport::ControlIO(bool is_in,
 			len,
 			&transferred)) {
 			errno = GetLastError();
+			stats_.RecordError(errno);
 			fprintf(stderr, "usb_control_transfer failed. errno: %d\n", errno);
 			return -1;
 		}
 		else {
+			stats_.RecordControl(is_in ? TransportStats::kIn : TransportStats::kOut, transferred);
 			return transferred;
 		}
 	}
@@ -258,43 +700,128 @@ ssize_t WindowsUsbTransport::ControlIO(bool is_in,
 	return -1;
 }
 
+// Reads in transfers of at most MAX_USBFS_BULK_SIZE until |len| bytes are
+// in or a short transfer ends the data early. Each transfer times out, so
+// a device that stops sending fails the read instead of hanging it.
 ssize_t WindowsUsbTransport::Read(void* data, size_t len) {
-	unsigned long time_out = 0;
-	unsigned long read = 0;
-	int ret;
+	const unsigned long time_out = 5000;
+	char* p = (char*)data;
+	size_t total = 0;
 
-	fprintf(stderr, "usb_read %d\n", len);
-	if (nullptr != handle_) {
-		while (1) {
-			int xfer = (len > MAX_USBFS_BULK_SIZE) ? MAX_USBFS_BULK_SIZE : len;
+	KickLost();
+
+	TraceScope trace("usb_bulk_read");
+	LatencyTimer timer(stats_.read_latency);
+
+	if (nullptr == handle_) {
+		fprintf(stderr, "usb_read NULL handle\n");
+		SetLastError(ERROR_INVALID_HANDLE);
+		return -1;
+	}
+
+	while (total < len) {
+		unsigned long xfer = (len - total > MAX_USBFS_BULK_SIZE) ? MAX_USBFS_BULK_SIZE :
+			(unsigned long)(len - total);
+		unsigned long read = 0;
 
-			ret = AdbReadEndpointSync(handle_->adb_read_pipe, data, xfer, &read, time_out);
+		if (!AdbReadEndpointSync(handle_->adb_read_pipe, p, xfer, &read, time_out)) {
 			errno = GetLastError();
-			fprintf(stderr, "usb_read got: %ld, expected: %d, errno: %d\n", read, xfer, errno);
-			if (ret) {
-				return read;
-			}
-			else {
-				// assume ERROR_INVALID_HANDLE indicates we are disconnected
-				if (errno == ERROR_INVALID_HANDLE)
-					usb_kick(handle_.get());
-				break;
-			}
-			// else we timed out - try again
+			stats_.RecordError(errno);
+			// assume ERROR_INVALID_HANDLE indicates we are disconnected
+			if (errno == ERROR_INVALID_HANDLE)
+				usb_kick(handle_.get());
+			fprintf(stderr, "usb_read failed after %zu bytes: %d\n", total, errno);
+			return -1;
 		}
+
+		stats_.RecordBulk(TransportStats::kIn, read);
+		p += read;
+		total += read;
+
+		if (read < xfer)
+			break;
 	}
-	else {
-		fprintf(stderr, "usb_read NULL handle\n");
+
+	trace.SetBytes(total);
+	return total;
+}
+
+// A single transfer per call, so that a short packet ends exactly one read
+// and the reads queued behind it go on with the rest of the stream.
+int WindowsUsbTransport::ReadAsync(void* data, size_t len) {
+	const unsigned long time_out = 5000;
+	unsigned long xfer = (len > MAX_USBFS_BULK_SIZE) ? MAX_USBFS_BULK_SIZE : (unsigned long)len;
+	read_submission submission;
+
+	KickLost();
+
+	TRACE_SCOPE("usb_bulk_read_async");
+
+	submission.data = data;
+	submission.io = nullptr;
+
+	if (nullptr == handle_) {
+		fprintf(stderr, "usb_read_async NULL handle\n");
 		SetLastError(ERROR_INVALID_HANDLE);
 	}
+	else {
+		submission.io = AdbReadEndpointAsync(handle_->adb_read_pipe, data, xfer, NULL, time_out,
+			NULL);
+		if (nullptr == submission.io) {
+			errno = GetLastError();
+			stats_.RecordError(errno);
+			fprintf(stderr, "AdbReadEndpointAsync failed, errno: %d\n", errno);
+		}
+	}
 
-	fprintf(stderr, "usb_read failed: %d\n", errno);
+	submission.failed = nullptr == submission.io;
+	read_queue_.push_back(submission);
 
-	return -1;
+	return submission.failed ? -1 : 0;
+}
+
+ssize_t WindowsUsbTransport::FinishRead(void** data, bool wait) {
+	read_submission submission = read_queue_.front();
+	unsigned long read = 0;
+
+	if (!wait && !submission.failed && !AdbHasOvelappedIoComplated(submission.io)) {
+		*data = NULL;
+		return 0;
+	}
+
+	TraceScope trace("usb_read_wait");
+
+	read_queue_.pop_front();
+	*data = submission.data;
+
+	if (submission.failed)
+		return -1;
+
+	bool ok = AdbGetOvelappedIoResult(submission.io, NULL, &read, true);
+	if (!ok)
+		errno = GetLastError();
+	AdbCloseHandle(submission.io);
+
+	if (!ok) {
+		stats_.RecordError(errno);
+		// assume ERROR_INVALID_HANDLE indicates we are disconnected
+		if (errno == ERROR_INVALID_HANDLE && nullptr != handle_)
+			usb_kick(handle_.get());
+		fprintf(stderr, "usb_read_async failed: %d\n", errno);
+		return -1;
+	}
+
+	stats_.RecordBulk(TransportStats::kIn, read);
+	trace.SetBytes(read);
+	return read;
 }
 
 void usb_cleanup_handle(usb_handle* handle) {
 	if (NULL != handle) {
+		for (ADBAPIHANDLE pipe : handle->stripe_pipes)
+			AdbCloseHandle(pipe);
+		handle->stripe_pipes.clear();
+
 		if (NULL != handle->adb_write_pipe)
 			AdbCloseHandle(handle->adb_write_pipe);
 		if (NULL != handle->adb_read_pipe)
@@ -319,9 +846,37 @@ void usb_kick(usb_handle* handle) {
 	}
 }
 
+const char* WindowsUsbTransport::Name() const {
+	if (nullptr == handle_ || handle_->interface_name.empty())
+		return "usb";
+
+	return handle_->interface_name.c_str();
+}
+
+const char* WindowsUsbTransport::Serial() const {
+	return nullptr != handle_ ? handle_->serial.c_str() : "";
+}
+
+const char* WindowsUsbTransport::Location() const {
+	return nullptr != handle_ ? handle_->location.c_str() : "";
+}
+
 int WindowsUsbTransport::Close() {
 	fprintf(stderr, "usb_close\n");
 
+	KickLost();
+
+	// The pipe must not go away under queued writes.
+	while (!async_queue_.empty()) {
+		const void* data;
+		FinishWrite(&data, true);
+	}
+
+	while (!read_queue_.empty()) {
+		void* data;
+		FinishRead(&data, true);
+	}
+
 	if (nullptr != handle_) {
 		// Cleanup handle
 		usb_cleanup_handle(handle_.get());
@@ -331,6 +886,39 @@ int WindowsUsbTransport::Close() {
 	return 0;
 }
 
+// Location path of the device behind |interface_name|: which host
+// controller, hubs and ports it hangs off. Returns false if SetupAPI does
+// not know it.
+static bool usb_location_path(const char* interface_name, char* path, size_t len) {
+	SP_DEVICE_INTERFACE_DATA ifc_data;
+	SP_DEVINFO_DATA dev_data;
+	char paths[1024];
+	bool ok = false;
+
+	HDEVINFO devs = SetupDiCreateDeviceInfoList(NULL, NULL);
+	if (INVALID_HANDLE_VALUE == devs)
+		return false;
+
+	ifc_data.cbSize = sizeof(ifc_data);
+	dev_data.cbSize = sizeof(dev_data);
+
+	// Without a detail buffer the call fails, but still names the device.
+	if (SetupDiOpenDeviceInterfaceA(devs, interface_name, 0, &ifc_data) &&
+		(SetupDiGetDeviceInterfaceDetailA(devs, &ifc_data, NULL, 0, NULL, &dev_data) ||
+			GetLastError() == ERROR_INSUFFICIENT_BUFFER)) {
+		// A REG_MULTI_SZ, the first string is the PCI based path.
+		if (SetupDiGetDeviceRegistryPropertyA(devs, &dev_data, SPDRP_LOCATION_PATHS, NULL,
+			(PBYTE)paths, sizeof(paths) - 1, NULL)) {
+			paths[sizeof(paths) - 1] = '\0';
+			strncpy_s(path, len, paths, _TRUNCATE);
+			ok = true;
+		}
+	}
+
+	SetupDiDestroyDeviceInfoList(devs);
+	return ok;
+}
+
 int recognized_device(usb_handle* handle, ifc_match_func callback) {
 	struct usb_ifc_info info;
 	USB_DEVICE_DESCRIPTOR device_desc;
@@ -385,31 +973,39 @@ int recognized_device(usb_handle* handle, ifc_match_func callback) {
 		info.serial_number[0] = 0;
 	}
 
-	info.device_path[0] = 0;
+	if (!usb_location_path(handle->interface_name.c_str(), info.device_path,
+		sizeof(info.device_path)))
+		info.device_path[0] = 0;
 
 	if (callback(&info) == 0) {
+		handle->serial = info.serial_number;
+		handle->location = info.device_path;
 		return 1;
 	}
 
 	return 0;
 }
 
-static std::unique_ptr<usb_handle> find_usb_device(ifc_match_func callback) {
-	std::unique_ptr<usb_handle> handle;
+// Opens the interfaces accepted by |callback|, at most |max_count| of them.
+static void find_usb_devices(ifc_match_func callback, size_t max_count,
+	std::vector<std::unique_ptr<usb_handle>>* found) {
 	char entry_buffer[2048];
 	char interf_name[2048];
 	AdbInterfaceInfo* next_interface = (AdbInterfaceInfo*)(&entry_buffer[0]);
 	unsigned long entry_buffer_size = sizeof(entry_buffer);
 	char* copy_name;
 
+	TRACE_SCOPE("usb_enumerate");
+
 	// Enumerate all present and active interfaces.
 	ADBAPIHANDLE enum_handle =
 		AdbEnumInterfaces(usb_class_id, true, true, true);
 
 	if (NULL == enum_handle)
-		return NULL;
+		return;
 
-	while (AdbNextInterface(enum_handle, next_interface, &entry_buffer_size)) {
+	while (found->size() < max_count &&
+		AdbNextInterface(enum_handle, next_interface, &entry_buffer_size)) {
 		// TODO(vchtchetkine): FIXME - temp hack converting wchar_t into char.
 		// It would be better to change AdbNextInterface so it will return
 		// interface name as single char string.
@@ -421,30 +1017,39 @@ static std::unique_ptr<usb_handle> find_usb_device(ifc_match_func callback) {
 		}
 		*copy_name = '\0';
 
-		handle = do_usb_open(next_interface->device_name);
+		std::unique_ptr<usb_handle> handle = do_usb_open(next_interface->device_name);
 		if (NULL != handle) {
 			// Lets see if this interface (device) belongs to us
-			if (recognized_device(handle.get(), callback)) {
-				// found it!
-				break;
-			}
-			else {
+			if (recognized_device(handle.get(), callback))
+				found->push_back(std::move(handle));
+			else
 				usb_cleanup_handle(handle.get());
-				handle.reset();
-			}
 		}
 
 		entry_buffer_size = sizeof(entry_buffer);
 	}
 
 	AdbCloseHandle(enum_handle);
-	return handle;
 }
 
 Transport* usb_open(ifc_match_func callback)
 {
-	std::unique_ptr<usb_handle> handle = find_usb_device(callback);
-	return handle ? new WindowsUsbTransport(std::move(handle)) : nullptr;
+	std::vector<std::unique_ptr<usb_handle>> found;
+
+	find_usb_devices(callback, 1, &found);
+	return found.empty() ? nullptr : new WindowsUsbTransport(std::move(found[0]));
+}
+
+std::vector<Transport*> usb_open_all(ifc_match_func callback)
+{
+	std::vector<std::unique_ptr<usb_handle>> found;
+	std::vector<Transport*> transports;
+
+	find_usb_devices(callback, (size_t)-1, &found);
+	for (std::unique_ptr<usb_handle>& handle : found)
+		transports.push_back(new WindowsUsbTransport(std::move(handle)));
+
+	return transports;
 }
 
 // called from fastboot.c
@@ -10,302 +10,2457 @@
 #include <sys/stat.h>
 #include <string.h>
 #include <io.h>
+#include <math.h>
+
+#include <algorithm>
+#include <deque>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
 
 #include <Windows.h>
 
+#include "archive.h"
+#include "chunker.h"
+#include "compress_cache.h"
+#include "dedup.h"
+#include "digest_cache.h"
+#include "device_caps.h"
+#include "engine.h"
+#include "fault_inject.h"
+#include "fleet.h"
+#include "flow_control.h"
+#include "image_reader.h"
+#include "image_writer.h"
+#include "json.h"
+#include "md5.h"
+#include "plcm_sim.h"
+#include "protocol.h"
+#include "protocol_bench.h"
+#include "protocol_driver.h"
+#include "pull.h"
+#include "scanner.h"
+#include "scheduler.h"
+#include "sparse.h"
+#include "stripe.h"
+#include "transport_log.h"
 #include "usb.h"
+#include "trace.h"
+
+#define DEVICE_IMAGE_STORE_DIRECTORY	"/data"
+
+char device_serial[256];
+
+int on_adb_device_found(usb_ifc_info *info)
+{
+	printf("We found an adb device\n");
+	printf("\tVendor ID: 0x%04x\n", info->dev_vendor);
+	printf("\tProduct ID: 0x%04x\n", info->dev_product);
+	printf("\tSerial Number: %s\n", info->serial_number);
+
+	strncpy_s(device_serial, info->serial_number, sizeof(device_serial) - 1);
+
+	return 0;
+}
+
+int polyGenerateMD5Sum(const char *fileName, char *md5sum)
+{
+	unsigned char buf[64 * 1024];
+	unsigned char digest[MD5_DIGEST_SIZE];
+	md5_context md5;
+	FILE *fp;
+	size_t len;
+
+	TRACE_SCOPE("md5_file");
+
+	fopen_s(&fp, fileName, "rb");
+
+	if (fp == NULL)
+		return -1;
+
+	md5_init(&md5);
+	while ((len = fread(buf, 1, sizeof(buf), fp)) > 0)
+		md5_update(&md5, buf, len);
+
+	if (ferror(fp)) {
+		fclose(fp);
+		return -2;
+	}
+
+	fclose(fp);
+
+	md5_final(&md5, digest);
+	md5_to_hex(digest, md5sum);
+
+	return MD5_HEX_SIZE - 1;
+}
+
+int polySendControlInfo(Transport *transport, bool is_in_direction,
+	unsigned char request, unsigned short value, void *data, unsigned int len)
+{
+	struct setup_packet setup;
+	
+	memset(&setup, 0x00, sizeof(struct setup_packet));
+
+	setup.bRequest = request;
+	setup.wValue = value;
+	setup.wLength = len;
+
+	return transport->ControlIO(is_in_direction, &setup, data, len);
+}
+
+int64_t direct_io_threshold = IMAGE_READER_DIRECT_THRESHOLD;
+bool sparse_mode = false;
+int scan_threads = 4;
+int hash_threads = 2;
+int pipeline_depth = 4;
+bool flow_control = true;
+int stripe_count = 1;
+bool dedup_mode = true;
+bool digest_first_mode = true;
+//Files of up to this many bytes go in one IMG_INLINE request, 0 for none
+int64_t inline_threshold = PLCM_INLINE_MAX_TRANSFER - sizeof(plcm_img_inline);
+//Files of at least this size go LZ4 compressed with --compress, -1 for none
+#define COMPRESS_DEFAULT_THRESHOLD	(64 * 1024)
+int64_t compress_threshold = -1;
+//Compressed streams of --compress, kept across runs and devices
+const char *compress_cache_dir = "plcm_cache";
+uint64_t compress_cache_bytes = 1024ULL * 1024 * 1024;
+CompressCache *compress_cache = NULL;
+//Transfers of the devices logged to --record, or played back from --replay
+const char *record_path = NULL;
+tlog_payloads record_payloads = TLOG_BULK_NONE;
+const char *replay_path = NULL;
+//MD5 sums of --digest-cache=FILE, kept across runs, NULL for none
+DigestCache *digest_cache = NULL;
+//Files of at least this size go as chunk recipes with --chunks, -1 for none
+#define CHUNK_DEFAULT_THRESHOLD	(1024 * 1024)
+int64_t chunk_threshold = -1;
+cdc_params chunk_params = { CDC_DEFAULT_MIN_SIZE, CDC_DEFAULT_AVG_SIZE, CDC_DEFAULT_MAX_SIZE };
+const char *schedule_policy = "path";
+schedule_options batch_options = { SCHEDULE_DEFAULT_BATCH_THRESHOLD, SCHEDULE_DEFAULT_BATCH_SIZE };
+bool schedule_bench = false;
+//Release trees compared by --chunk-bench
+const char *chunk_bench_old = NULL;
+const char *chunk_bench_new = NULL;
+//Images and image size of --protocol-bench, 0 images for none
+unsigned long long protocol_bench_images = 0;
+long long protocol_bench_size = 4096;
+//Run time, largest image and faults per image of --soak, 0 s for none
+double soak_seconds = 0;
+long long soak_max_size = 4 * 1024 * 1024;
+double soak_fault_rate = 0.05;
+uint32_t soak_fault_kinds = FAULT_ALL_KINDS;
+bool fleet_mode = false;
+bool engine_mode = false;
+fleet_options fleet_opts = { FLEET_GROUP_HUB, 0, FLEET_DEFAULT_SETTLE_MS, FLEET_DEFAULT_MIN_GAIN,
+	FLEET_DEFAULT_STAGGER_MS };
+// Bulk bytes per second allowed to each device, 0 for no limit.
+double device_rate = 0;
+//File or directory of --pull on the device, and where it goes on the host
+const char *pull_path = NULL;
+const char *pull_host_path = NULL;
+
+//Handshake cost and throughput assumed by --schedule-bench, see --stats
+//for the figures of a real device
+schedule_cost_model bench_model = { 15.0, 30.0 * 1024 * 1024 / 1000 };
+
+//Room for capabilities blocks newer than ours
+#define PLCM_CAPS_READ_SIZE		64
+
+//Reads the capabilities block once after opening the device and caches it
+//on the transport. Devices that predate it stall the request; the fast
+//paths are then probed one by one as before.
+int polyReadCapabilities(Transport *transport)
+{
+	unsigned char block[PLCM_CAPS_READ_SIZE];
+	plcm_device_caps caps;
+
+	memset(block, 0, sizeof(block));
+
+	int ret = polySendControlInfo(transport,
+		true,
+		PLCM_USB_REQUEST_GET_INFORMATION,
+		PLCM_USB_REQUEST_VALUE_CAPABILITIES,
+		block,
+		sizeof(block));
+
+	if (ret < 0 || device_caps_parse(block, ret, &caps) < 0) {
+		printf("The device reports no capabilities\n");
+		return -1;
+	}
+
+	transport->SetCapabilities(caps);
+
+	printf("Device capabilities v%u: flags 0x%x, digests 0x%x, codecs 0x%x, window %u\n",
+		caps.version, caps.flags, caps.digests, caps.codecs, caps.window);
+	if (caps.max_bulk_transfer)
+		printf("\tMax bulk transfer: %u bytes\n", caps.max_bulk_transfer);
+	if (caps.free_bytes)
+		printf("\tFree storage: %llu bytes\n", (unsigned long long)caps.free_bytes);
+	if (!(caps.digests & PLCM_DIGEST_MD5))
+		fprintf(stderr, "The device does not report MD5 checking\n");
+
+	return 0;
+}
+
+//True if the device reported capabilities without |flag|, so there is no
+//point in trying the feature.
+bool polyDeviceLacks(Transport *transport, uint32_t flag)
+{
+	const plcm_device_caps &caps = transport->Capabilities();
+
+	return device_caps_known(caps) && !(caps.flags & flag);
+}
+
+//Bytes of the current image the device has room for, counted from its
+//first byte: the credits of the flow control
+int polyQueryCredits(Transport *transport, uint64_t *limit)
+{
+	int ret = polySendControlInfo(transport,
+		true,
+		PLCM_USB_REQUEST_GET_INFORMATION,
+		PLCM_USB_REQUEST_VALUE_CREDITS,
+		limit,
+		sizeof(*limit));
+
+	return ret == sizeof(*limit) ? 0 : -1;
+}
+
+//Credits are used when the device advertises them. Devices without a
+//capabilities block are asked once, older ones stall the request.
+bool polyUseCredits(Transport *transport)
+{
+	if (!flow_control)
+		return false;
+
+	if (device_caps_known(transport->Capabilities()))
+		return !polyDeviceLacks(transport, PLCM_CAP_CREDITS);
+
+	if (transport->Probed(PLCM_CAP_CREDITS) < 0) {
+		uint64_t limit;
+		bool supported = polyQueryCredits(transport, &limit) == 0;
+
+		transport->SetProbed(PLCM_CAP_CREDITS, supported);
+		printf("Flow control credits %ssupported by the device\n", supported ? "" : "not ");
+	}
+
+	return transport->Probed(PLCM_CAP_CREDITS) == 1;
+}
+
+//Devices with 64-bit sizes answer a GET_INFORMATION of WRITTEN_BYTES64,
+//older ones stall it. The answer is cached on the transport for the
+//session, and taken from the capabilities when the device reported them.
+bool polyProbeSize64(Transport *transport)
+{
+	if (device_caps_known(transport->Capabilities()))
+		return !polyDeviceLacks(transport, PLCM_CAP_SIZE64);
+
+	if (transport->Probed(PLCM_CAP_SIZE64) < 0) {
+		int64_t written_bytes = 0;
+
+		int ret = polySendControlInfo(transport,
+			true,
+			PLCM_USB_REQUEST_GET_INFORMATION,
+			PLCM_USB_REQUEST_VALUE_WRITTEN_BYTES64,
+			&written_bytes,
+			sizeof(written_bytes));
+
+		bool supported = ret == sizeof(written_bytes);
+
+		transport->SetProbed(PLCM_CAP_SIZE64, supported);
+		printf("64-bit image sizes %ssupported by the device\n", supported ? "" : "not ");
+	}
+
+	return transport->Probed(PLCM_CAP_SIZE64) == 1;
+}
+
+//What polyVerifyImage() needs once the data of an image has been sent
+struct image_send_state {
+	const char *src_name;
+	/// Session of the image, holding its sum
+	std::unique_ptr<PlcmSession> session;
+	/// What the session does after the data, not carried out yet
+	plcm_action next;
+	bool read_failed;
+	/// Not all the data got out; the image is lost, and the pipe may
+	/// still be in the middle of it
+	bool write_failed;
+};
+
+//64-bit sizes as a PlcmSession wants to know them: 1, 0, or -1 to probe
+int polyDeviceSize64(Transport *transport)
+{
+	if (device_caps_known(transport->Capabilities()))
+		return polyDeviceLacks(transport, PLCM_CAP_SIZE64) ? 0 : 1;
+
+	return transport->Probed(PLCM_CAP_SIZE64);
+}
+
+//Digest-first checking as a PlcmSession wants to know it, 0 with
+//--no-digest-first
+int polyDeviceDigestFirst(Transport *transport)
+{
+	if (!digest_first_mode)
+		return 0;
+
+	if (device_caps_known(transport->Capabilities()))
+		return polyDeviceLacks(transport, PLCM_CAP_DIGEST_FIRST) ? 0 : 1;
+
+	return transport->Probed(PLCM_CAP_DIGEST_FIRST);
+}
+
+//Keeps what the first image found out about digest-first checking for the
+//rest of the session
+void polyKeepDigestFirst(Transport *transport, const PlcmSession *session)
+{
+	if (!digest_first_mode || device_caps_known(transport->Capabilities()) ||
+		transport->Probed(PLCM_CAP_DIGEST_FIRST) >= 0 || session->DigestFirst() < 0)
+		return;
+
+	transport->SetProbed(PLCM_CAP_DIGEST_FIRST, session->DigestFirst() == 1);
+	printf("Digest-first checking %ssupported by the device\n",
+		session->DigestFirst() == 1 ? "" : "not ");
+}
+
+//Sends the metadata and the data of one image, leaving the verification to
+//polyVerifyImage(). The control requests are those of a PlcmSession kept
+//in |state|; only the data goes out here.
+//
+//|sparse_input| is the header of an Android sparse image, which is sent as
+//is, or NULL for a plain image. |md5_sum| is the digest of the image when
+//it has been computed ahead of time, NULL to hash the bytes as they are sent.
+//|format| is PLCM_IMG_FORMAT_RAW to let --sparse pick the format, or the
+//container format the device must unpack; -ENOTSUP is returned if it can't.
+//-1 with |state->write_failed| set means the data did not all get out; the
+//image must not be verified or committed.
+int polySendImageData(Transport *transport, ImageReader *reader, const char *srcName,
+	const char *destFileName, const sparse_header *sparse_input, const char *md5_sum,
+	int format, image_send_state *state)
+{
+	ssize_t read_len;
+	ssize_t write_len;
+
+	int ret;
+
+	TraceScope trace_file("send_file");
+
+	BufferPool *pool = transport->Buffers();
+
+	state->write_failed = false;
+
+	//Get the file size
+	int64_t ops = reader->Size();
+
+	printf("File size is %lld (%s)\n", ops, reader->Kind());
+
+	//If the filesize is zero. Do not transfer it.
+	if (ops == 0)
+		return -1;
+
+	//A name the device would cut short could land on another image
+	if (strlen(destFileName) >= PLCM_IMG_NAME_SIZE) {
+		fprintf(stderr, "Image name longer than %d bytes: %s\n", PLCM_IMG_NAME_SIZE - 1,
+			destFileName);
+		return -1;
+	}
+
+	trace_file.SetBytes(ops);
+
+	//Size of the image once written on the device
+	int64_t image_len = ops;
+	bool container = format != PLCM_IMG_FORMAT_RAW;
+
+	//Plain images are only encoded when they are a whole number of sparse blocks
+	if (!container && sparse_mode && (sparse_input != NULL ||
+		(ops % SPARSE_BLOCK_SIZE == 0 && pool->BlockSize() % SPARSE_BLOCK_SIZE == 0)))
+		format = PLCM_IMG_FORMAT_SPARSE;
+
+	TraceScope trace_metadata("img_metadata");
+
+	uint32_t format_cap = format == PLCM_IMG_FORMAT_CHUNKED ? PLCM_CAP_CHUNKS : PLCM_CAP_TAR;
+	bool format_lacking = format == PLCM_IMG_FORMAT_LZ4 ?
+		!(transport->Capabilities().codecs & PLCM_CODEC_LZ4) : polyDeviceLacks(transport, format_cap);
+
+	if (container && format_lacking) {
+		fprintf(stderr, "The device does not take format %d images\n", format);
+		return -ENOTSUP;
+	}
+
+	if (format == PLCM_IMG_FORMAT_SPARSE && polyDeviceLacks(transport, PLCM_CAP_SPARSE)) {
+		fprintf(stderr, "The device does not take sparse images, sending %s as is\n", srcName);
+		format = PLCM_IMG_FORMAT_RAW;
+	}
+
+	if ((sparse_mode && !polyDeviceLacks(transport, PLCM_CAP_SPARSE)) || container) {
+		unsigned int img_format = format;
+
+		write_len = polySendControlInfo(transport,
+			false,
+			PLCM_USB_REQUEST_SET_INFORMATION,
+			PLCM_USB_REQUEST_VALUE_IMG_FORMAT,
+			&img_format,
+			sizeof(img_format));
+
+		if (write_len < 0 && container) {
+			fprintf(stderr, "The device does not take format %d images\n", format);
+			return -ENOTSUP;
+		}
+
+		if (write_len < 0 && format == PLCM_IMG_FORMAT_SPARSE) {
+			fprintf(stderr, "The device does not take sparse images, sending %s as is\n", srcName);
+			format = PLCM_IMG_FORMAT_RAW;
+		}
+	}
+
+	if (format == PLCM_IMG_FORMAT_SPARSE && sparse_input != NULL)
+		image_len = (int64_t)sparse_input->blk_sz * sparse_input->total_blks;
+
+	if (image_len > PLCM_MAX_IMG_LENGTH32 && !polyProbeSize64(transport)) {
+		fprintf(stderr, "%s is %lld bytes, the device only takes images up to %lld bytes\n",
+			srcName, image_len, PLCM_MAX_IMG_LENGTH32);
+		return -1;
+	}
+
+	//Striped data comes framed, the device must know before it arrives.
+	//Host encoded sparse streams keep to the default pipe.
+	unsigned int stripes = 1;
+
+	if (transport->Stripes() > 1 && !(format == PLCM_IMG_FORMAT_SPARSE && sparse_input == NULL)) {
+		stripes = transport->Stripes();
+
+		write_len = polySendControlInfo(transport,
+			false,
+			PLCM_USB_REQUEST_SET_INFORMATION,
+			PLCM_USB_REQUEST_VALUE_STRIPES,
+			&stripes,
+			sizeof(stripes));
+
+		if (write_len < 0) {
+			fprintf(stderr, "The device does not take striped images, sending %s on one pipe\n", srcName);
+			stripes = 1;
+		}
+	}
+
+	//A sparse file sent as is only has the sum of the expanded image once
+	//its data is out; a known sum goes ahead of the data otherwise, so the
+	//device checks the image as it stores it.
+	bool passthrough = format == PLCM_IMG_FORMAT_SPARSE && sparse_input != NULL;
+
+	state->session.reset(new PlcmSession(polyProbeSize64(transport) ? 1 : 0,
+		polyDeviceDigestFirst(transport)));
+
+	PlcmSession *session = state->session.get();
+	plcm_action action = plcm_run_controls(transport, session,
+		session->Start(destFileName, image_len, passthrough ? NULL : md5_sum));
+
+	polyKeepDigestFirst(transport, session);
+
+	if (action.type != PLCM_ACTION_SEND_DATA) {
+		fprintf(stderr, "%s: %s\n", srcName, session->Error());
+		return -1;
+	}
+
+	trace_metadata.End();
+
+	int64_t total_len = 0;
+	bool read_failed = false;
+	bool write_failed = false;
+
+	//The MD5 sum is computed over the bytes as they are sent
+	md5_context md5;
+	md5_init(&md5);
+
+	//In sparse mode the digest covers the expanded image, not the wire bytes
+	bool encode = format == PLCM_IMG_FORMAT_SPARSE && sparse_input == NULL;
+	bool hash_inline = session->NeedsDigest();
+
+	SparseEncoder encoder(transport, image_len, hash_inline ? &md5 : NULL);
+	SparseDigest sparse_digest(&md5);
+
+	//The encoder writes its chunks itself, everything else can be paced by
+	//the device's credits
+	std::unique_ptr<StripedSender> striper;
+	std::unique_ptr<CreditSender> sender;
+	if (stripes > 1)
+		striper.reset(new StripedSender(transport, stripes));
+	else if (!encode && polyUseCredits(transport))
+		sender.reset(new CreditSender(transport, polyQueryCredits));
+
+	TraceScope trace_data("bulk_data");
+
+	while (1) {
+		//The reader fills transfer blocks of the transport in place
+		char *buf = NULL;
+
+		TraceScope trace_read("file_read");
+		read_len = reader->ReadBlock(&buf);
+		trace_read.SetBytes(read_len > 0 ? read_len : 0);
+		trace_read.End();
+
+		if (read_len <= 0) {
+			if (read_len < 0) {
+				fprintf(stderr, "Failed to read %s\n", srcName);
+				read_failed = true;
+			}
+			break;
+		}
+
+		total_len += read_len;
+
+		//Leave the rest of the bus to the other devices
+		if (transport->Limiter() != NULL)
+			transport->Limiter()->Acquire(read_len);
+
+		if (encode) {
+			ret = encoder.Encode(buf, read_len);
+			pool->Release(buf);
+
+			if (ret < 0) {
+				write_failed = true;
+				break;
+			}
+			continue;
+		}
+
+		if (hash_inline) {
+			TRACE_SCOPE("md5_update");
+			if (!passthrough)
+				md5_update(&md5, buf, read_len);
+			else if (sparse_digest.Update(buf, read_len) < 0) {
+				fprintf(stderr, "Malformed sparse image %s\n", srcName);
+				pool->Release(buf);
+				read_failed = true;
+				break;
+			}
+		}
+
+		if (striper) {
+			if (striper->Send(buf, read_len) < 0) {
+				fprintf(stderr, "Failed to write all the data. Sent: %llu\n",
+					(unsigned long long)striper->Sent());
+				write_failed = true;
+				break;
+			}
+			continue;
+		}
+
+		if (sender) {
+			//The sender gives the block back once it is on the wire
+			if (sender->Send(buf, read_len) < 0) {
+				fprintf(stderr, "Failed to write all the data. Sent: %llu\n",
+					(unsigned long long)sender->Sent());
+				write_failed = true;
+				break;
+			}
+			continue;
+		}
+
+		write_len = transport->Write(buf, read_len);
+		pool->Release(buf);
+
+		if (write_len < read_len) {
+			fprintf(stderr, "Failed to write all the data. Written length : %lld, all data : %lld\n",
+				(long long)write_len, (long long)read_len);
+			write_failed = true;
+			break;
+		}
+	}
+
+	if (encode && !read_failed && !write_failed && encoder.Finish() < 0)
+		write_failed = true;
+
+	if (striper) {
+		if (striper->Flush() < 0) {
+			fprintf(stderr, "Failed to write all the data of %s\n", srcName);
+			write_failed = true;
+		}
+
+		for (unsigned int i = 0; i < stripes; i++)
+			printf("Pipe %u: %llu bytes\n", i, (unsigned long long)striper->StripeBytes(i));
+	}
+
+	if (sender) {
+		if (sender->Flush() < 0) {
+			fprintf(stderr, "Failed to write all the data of %s\n", srcName);
+			write_failed = true;
+		}
+
+		if (sender->Stalls() > 0)
+			printf("Flow control: waited %.1f ms for credits %d times\n",
+				sender->StallUs() / 1000.0, sender->Stalls());
+	}
+
+	if (passthrough && !read_failed && !sparse_digest.Complete()) {
+		fprintf(stderr, "Sparse image %s is truncated\n", srcName);
+		read_failed = true;
+	}
+
+	trace_data.SetBytes(encode ? encoder.WireBytes() : total_len);
+	trace_data.End();
+
+	printf("total_len is %lld\n", total_len);
+
+	if (encode)
+		printf("Sparse: %lld bytes on the wire for %lld image bytes\n",
+			encoder.WireBytes(), image_len);
+
+	//The file shrank or grew since it was opened
+	if (!read_failed && !write_failed && total_len != ops) {
+		fprintf(stderr, "%s changed while being sent\n", srcName);
+		read_failed = true;
+	}
+
+	state->src_name = srcName;
+	state->read_failed = read_failed;
+	state->write_failed = write_failed;
+
+	if (hash_inline) {
+		unsigned char digest[MD5_DIGEST_SIZE];
+		char md5_hex[MD5_HEX_SIZE];
+
+		md5_final(&md5, digest);
+		md5_to_hex(digest, md5_hex);
+		session->SetDigest(md5_hex);
+	}
+
+	//A truncated or corrupt source must not pass the device check
+	if (read_failed) {
+		char md5_hex[MD5_HEX_SIZE];
+
+		memset(md5_hex, '0', MD5_HEX_SIZE - 1);
+		md5_hex[MD5_HEX_SIZE - 1] = '\0';
+		session->SetDigest(md5_hex);
+	}
+
+	//The session counts the bytes of the image as stored, which the wire
+	//bytes of a sparse stream are not
+	plcm_event event;
+
+	event.type = PLCM_EVENT_DATA;
+	event.result = write_failed ? -1 : image_len;
+	state->next = session->Step(event);
+
+	//Polling for data that never went out only delays the failure
+	if (write_failed)
+		return -1;
+
+	return 0;
+}
+
+//Waits for the device to store the whole image, then has it check the MD5 sum.
+//Images the device checked while storing them only need their STATUS.
+int polyVerifyImage(Transport *transport, const image_send_state *state)
+{
+	PlcmSession *session = state->session.get();
+
+	TraceScope trace_poll(session->CheckedInline() ? "status_poll" : "written_bytes_poll");
+
+	plcm_action action = plcm_run_controls(transport, session, state->next);
+
+	if (action.type != PLCM_ACTION_DONE || action.status != 0) {
+		fprintf(stderr, "%s: %s\n", state->src_name, session->Error());
+		return -1;
+	}
+
+	return state->read_failed ? -1 : 0;
+}
+
+//Images of a pipelined session whose MD5 sum is out and whose status has
+//not come back yet. The device verifies them on its own, so the next
+//image's metadata and data go out meanwhile.
+struct pipeline_entry {
+	uint32_t seq;
+	std::string src_name;
+	/// Files carried by the image, more than one for batches
+	size_t files;
+	bool read_failed;
+};
+
+struct image_pipeline {
+	/// False once the device has refused IMG_SEQ, or after a timeout
+	bool enabled;
+	/// Most images in flight at once
+	int depth;
+	uint32_t next_seq;
+	std::deque<pipeline_entry> in_flight;
+};
+
+//Payload of GET_INFORMATION SEQ_STATUS
+struct plcm_seq_status {
+	/// Image the status is for, 0 while none has finished
+	uint32_t seq;
+	int32_t status;
+};
+
+//|depth| is capped by the window the device reported.
+void polyPipelineInit(Transport *transport, image_pipeline *pipeline, int depth)
+{
+	const plcm_device_caps &caps = transport->Capabilities();
+
+	if (polyDeviceLacks(transport, PLCM_CAP_PIPELINE))
+		depth = 0;
+	else if (caps.window > 0 && (uint32_t)depth > caps.window)
+		depth = (int)caps.window;
+
+	pipeline->enabled = depth > 0;
+	pipeline->depth = depth;
+	pipeline->next_seq = 1;
+	pipeline->in_flight.clear();
+}
+
+//Tags the image whose metadata comes next. A device without pipelining
+//stalls the request, the session then goes on with the sequential flow.
+bool polyPipelineTag(Transport *transport, image_pipeline *pipeline)
+{
+	if (!pipeline->enabled)
+		return false;
+
+	uint32_t seq = pipeline->next_seq;
+
+	int ret = polySendControlInfo(transport,
+		false,
+		PLCM_USB_REQUEST_SET_INFORMATION,
+		PLCM_USB_REQUEST_VALUE_IMG_SEQ,
+		&seq,
+		sizeof(seq));
+
+	if (ret < 0) {
+		printf("Pipelined transfers not supported by the device\n");
+		pipeline->enabled = false;
+		return false;
+	}
+
+	return true;
+}
+
+//Sends the MD5 sum of the image tagged last and leaves its status for
+//polyPipelineReap().
+int polyPipelineCommit(Transport *transport, image_pipeline *pipeline,
+	const image_send_state *state, size_t files)
+{
+	TRACE_SCOPE("pipeline_commit");
+
+	const char *md5_sum = state->session->Digest();
+
+	//The device has the sum already and checks the image on its own
+	int write_len = state->session->CheckedInline() ? 0 : polySendControlInfo(transport,
+		false,
+		PLCM_USB_REQUEST_SET_INFORMATION,
+		PLCM_USB_REQUEST_VALUE_IMG_MD5_SUM,
+		(void *)md5_sum,
+		strlen(md5_sum) + 1);
+
+	if (write_len < 0) {
+		fprintf(stderr, "Failed to issue the md5sum control msg: %s\n", md5_sum);
+		return -1;
+	}
+
+	pipeline_entry entry;
+
+	entry.seq = pipeline->next_seq++;
+	entry.src_name = state->src_name;
+	entry.files = files;
+	entry.read_failed = state->read_failed;
+	pipeline->in_flight.push_back(entry);
+
+	return 0;
+}
+
+//Collects statuses until at most |keep| images are in flight. Statuses are
+//matched by sequence id, so the device may finish images in any order.
+//Returns the number of files verified by the collected statuses.
+int polyPipelineReap(Transport *transport, image_pipeline *pipeline, size_t keep)
+{
+	int verified = 0;
+	int waited_ms = 0;
+	int delay_ms = 1;
+
+	if (pipeline->in_flight.size() <= keep)
+		return 0;
+
+	TRACE_SCOPE("pipeline_wait");
+
+	while (pipeline->in_flight.size() > keep) {
+		plcm_seq_status record = { 0, 0 };
+
+		int ret = polySendControlInfo(transport,
+			true,
+			PLCM_USB_REQUEST_GET_INFORMATION,
+			PLCM_USB_REQUEST_VALUE_SEQ_STATUS,
+			&record,
+			sizeof(record));
+
+		if (ret < 0)
+			break;
+
+		auto it = pipeline->in_flight.begin();
+		while (record.seq != 0 && it != pipeline->in_flight.end() && it->seq != record.seq)
+			++it;
+
+		if (record.seq != 0 && it == pipeline->in_flight.end())
+			fprintf(stderr, "Status for unknown image %u\n", record.seq);
+
+		if (record.seq == 0 || it == pipeline->in_flight.end()) {
+			//Nothing finished. The budget restarts with every status, so
+			//each image gets at least what the sequential flow gives it.
+			if (waited_ms >= PLCM_POLL_TIMEOUT_MS)
+				break;
+
+			transport->Stats().RecordRetry();
+
+			{
+				TRACE_SCOPE("poll_sleep");
+				Sleep(delay_ms);
+			}
+
+			waited_ms += delay_ms;
+			delay_ms = (delay_ms * 2 > PLCM_POLL_MAX_DELAY_MS) ? PLCM_POLL_MAX_DELAY_MS : delay_ms * 2;
+			continue;
+		}
+
+		waited_ms = 0;
+		delay_ms = 1;
+
+		if (record.status != 0)
+			fprintf(stderr, "MD5 checking failed for %s. status: %d\n", it->src_name.c_str(), record.status);
+		else if (!it->read_failed)
+			verified += (int)it->files;
+
+		pipeline->in_flight.erase(it);
+	}
+
+	//The device stopped answering, whatever is left is lost
+	if (pipeline->in_flight.size() > keep) {
+		for (const pipeline_entry &entry : pipeline->in_flight)
+			fprintf(stderr, "No status for %s in %d ms\n", entry.src_name.c_str(), waited_ms);
+
+		pipeline->in_flight.clear();
+		pipeline->enabled = false;
+	}
+
+	return verified;
+}
+
+//Gives up pipelining for the session after an image whose data did not all
+//get out: the pipe may still be in the middle of it, so nothing more is
+//queued behind it. Collects the statuses in flight and returns the number
+//of files they verified.
+int polyPipelineStop(Transport *transport, image_pipeline *pipeline)
+{
+	int verified = polyPipelineReap(transport, pipeline, 0);
+
+	if (pipeline->enabled)
+		fprintf(stderr, "Image data lost, sending the rest one image at a time\n");
+
+	pipeline->enabled = false;
+	return verified;
+}
+
+//|sparse_input|, |md5_sum| and |format| are as for polySendImageData().
+int polySendImageStream(Transport *transport, ImageReader *reader, const char *srcName,
+	const char *destFileName, const sparse_header *sparse_input, const char *md5_sum, int format)
+{
+	image_send_state state;
+
+	int ret = polySendImageData(transport, reader, srcName, destFileName, sparse_input, md5_sum,
+		format, &state);
+
+	if (ret < 0)
+		return ret;
+
+	return polyVerifyImage(transport, &state);
+}
+
+
+//Swaps |*reader| for the LZ4 stream of |fileName| from the compression
+//cache, when the device decodes LZ4 and the stream is worth it. |md5_sum|
+//is the sum of the file, the cache key. Returns the format to send.
+//|*reader| is NULL if neither the stream nor the file can be opened.
+int polyUseCompressed(Transport *transport, const char *fileName, const char *md5_sum,
+	ImageReader **reader)
+{
+	int64_t size = (*reader)->Size();
+
+	if (compress_cache == NULL || size < compress_threshold ||
+		!(transport->Capabilities().codecs & PLCM_CODEC_LZ4))
+		return PLCM_IMG_FORMAT_RAW;
+
+	std::string path = compress_cache->Get(fileName, md5_sum);
+
+	if (path.empty()) {
+		fprintf(stderr, "Failed to compress %s, sending it as is\n", fileName);
+		return PLCM_IMG_FORMAT_RAW;
+	}
+
+	//Already compressed data only grows by the block headers
+	struct _stat64 st;
+
+	if (_stat64(path.c_str(), &st) != 0 || st.st_size > size - size / 16)
+		return PLCM_IMG_FORMAT_RAW;
+
+	//The file's reader gives its read-ahead blocks back first, the two
+	//together may want more than the pool has
+	delete *reader;
+	*reader = image_reader_open(path.c_str(), transport->Buffers(), direct_io_threshold);
+
+	if (*reader != NULL)
+		return PLCM_IMG_FORMAT_LZ4;
+
+	fprintf(stderr, "Failed to open %s, sending %s as is\n", path.c_str(), fileName);
+	*reader = image_reader_open(fileName, transport->Buffers(), direct_io_threshold);
+	return PLCM_IMG_FORMAT_RAW;
+}
+
+int polySendImageFile(Transport *transport, const char *fileName, const char *destFileName,
+	const char *md5_sum)
+{
+	ImageReader *reader;
+
+	if (transport == NULL)
+		return -EINVAL;
+
+	reader = image_reader_open(fileName, transport->Buffers(), direct_io_threshold);
+
+	if (reader == NULL) {
+		return -EINVAL;
+	}
+
+	sparse_header header;
+	bool is_sparse = sparse_mode && sparse_read_header(fileName, &header) == 0;
+	char file_md5[MD5_HEX_SIZE];
+	int format = PLCM_IMG_FORMAT_RAW;
+
+	//The compressed stream is keyed by the file's sum
+	if (!is_sparse && compress_cache != NULL && reader->Size() >= compress_threshold) {
+		if (md5_sum == NULL && polyGenerateMD5Sum(fileName, file_md5) > 0)
+			md5_sum = file_md5;
+		if (md5_sum != NULL)
+			format = polyUseCompressed(transport, fileName, md5_sum, &reader);
+		if (reader == NULL)
+			return -EINVAL;
+	}
+
+	int ret = polySendImageStream(transport, reader, fileName, destFileName,
+		is_sparse ? &header : NULL, md5_sum, format);
+
+	//Nothing was sent yet, go again as is
+	if (ret == -ENOTSUP && format == PLCM_IMG_FORMAT_LZ4) {
+		delete reader;
+		reader = image_reader_open(fileName, transport->Buffers(), direct_io_threshold);
+		if (reader == NULL)
+			return -EINVAL;
+
+		ret = polySendImageStream(transport, reader, fileName, destFileName, NULL, md5_sum,
+			PLCM_IMG_FORMAT_RAW);
+	}
+
+	delete reader;
+
+	return ret;
+}
+
+//Send every regular member of a .tar/.zip bundle under its path in the archive
+int polySendArchive(Transport *transport, Archive *archive, int *totalCount)
+{
+	int count = 0;
+
+	if (transport == NULL)
+		return 0;
+
+	printf("Sending %s archive %s\n", archive->Format(), archive->FileName());
+
+	image_pipeline pipeline;
+	polyPipelineInit(transport, &pipeline, pipeline_depth);
+
+	for (const archive_entry &entry : archive->Entries()) {
+		if (entry.is_dir)
+			continue;
+
+		printf("[Member]:\t%s\n", entry.name.c_str());
+		(*totalCount)++;
+
+		ImageReader *reader = archive->OpenEntry(entry, transport->Buffers());
+
+		if (reader == NULL) {
+			fprintf(stderr, "Failed to open %s in %s\n", entry.name.c_str(), archive->FileName());
+			continue;
+		}
+
+		if (pipeline.enabled)
+			count += polyPipelineReap(transport, &pipeline, pipeline.depth - 1);
+
+		if (!polyPipelineTag(transport, &pipeline)) {
+			if (!polySendImageStream(transport, reader, entry.name.c_str(), entry.name.c_str(), NULL, NULL,
+				PLCM_IMG_FORMAT_RAW))
+				count++;
+
+			delete reader;
+			continue;
+		}
+
+		image_send_state state;
+
+		if (!polySendImageData(transport, reader, entry.name.c_str(), entry.name.c_str(), NULL, NULL,
+			PLCM_IMG_FORMAT_RAW, &state))
+			polyPipelineCommit(transport, &pipeline, &state, 1);
+		else if (state.write_failed)
+			count += polyPipelineStop(transport, &pipeline);
+
+		delete reader;
+	}
+
+	count += polyPipelineReap(transport, &pipeline, 0);
+
+	return count;
+}
+
+//Largest file sent in one IMG_INLINE request, 0 if the device takes none.
+//Only a device reporting its capabilities can tell how much it takes.
+int64_t polyInlineLimit(Transport *transport)
+{
+	const plcm_device_caps &caps = transport->Capabilities();
+	int64_t limit = PLCM_INLINE_MAX_TRANSFER - sizeof(plcm_img_inline);
+
+	if (!(caps.flags & PLCM_CAP_INLINE))
+		return 0;
+
+	return std::min(std::min(limit, (int64_t)caps.max_inline), inline_threshold);
+}
+
+//Sends |entry| whole in one IMG_INLINE request, name and MD5 sum included,
+//instead of the length, name, data, WRITTEN_BYTES, MD5 and STATUS round
+//trips of an image. Returns 0 once the device stored and checked it, or -1
+//if it stalled or cut short the request or the file could not be read.
+int polySendInline(Transport *transport, const manifest_entry &entry)
+{
+	std::vector<char> request(sizeof(plcm_img_inline) + (size_t)entry.size);
+	plcm_img_inline header;
+	unsigned char digest[MD5_DIGEST_SIZE];
+	md5_context md5;
+	FILE *fp;
+
+	TRACE_SCOPE("send_inline");
+
+	memset(&header, 0, sizeof(header));
+	if (entry.name.size() >= sizeof(header.name))
+		return -1;
+	memcpy(header.name, entry.name.c_str(), entry.name.size() + 1);
+
+	fopen_s(&fp, entry.path.c_str(), "rb");
+	if (fp == NULL)
+		return -1;
+
+	size_t len = fread(&request[sizeof(header)], 1, (size_t)entry.size, fp);
+	bool grown = fgetc(fp) != EOF;
+
+	fclose(fp);
+
+	//Changed since the scan, let the image path deal with it
+	if (len != (size_t)entry.size || grown)
+		return -1;
+
+	md5_init(&md5);
+	md5_update(&md5, &request[sizeof(header)], len);
+	md5_final(&md5, digest);
+	md5_to_hex(digest, header.md5_sum);
+	header.length = (uint32_t)len;
+	memcpy(&request[0], &header, sizeof(header));
+
+	int ret = polySendControlInfo(transport,
+		false,
+		PLCM_USB_REQUEST_SET_INFORMATION,
+		PLCM_USB_REQUEST_VALUE_IMG_INLINE,
+		&request[0],
+		(unsigned int)request.size());
+
+	return ret == (int)request.size() ? 0 : -1;
+}
+
+//Has the device store the image |source| once more as |name|. Returns 0,
+//or -1 if the device stalled the request or the names don't fit.
+int polyLinkImage(Transport *transport, const char *source, const char *name,
+	const char *md5_sum)
+{
+	plcm_img_link link;
+	size_t source_len = strlen(source) + 1;
+	size_t name_len = strlen(name) + 1;
+
+	if (source_len > sizeof(link.source) || name_len > sizeof(link.name))
+		return -1;
+
+	memset(&link, 0, sizeof(link));
+	memcpy(link.md5_sum, md5_sum, MD5_HEX_SIZE);
+	memcpy(link.source, source, source_len);
+	memcpy(link.name, name, name_len);
+
+	int ret = polySendControlInfo(transport,
+		false,
+		PLCM_USB_REQUEST_SET_INFORMATION,
+		PLCM_USB_REQUEST_VALUE_IMG_LINK,
+		&link,
+		sizeof(link));
+
+	return ret == sizeof(link) ? 0 : -1;
+}
+
+//Stores the duplicates left out by dedup_plan() by linking them to the
+//content sent already. A device without a capabilities block is tried
+//with the first link; if it stalls it, links are not tried again. Every
+//duplicate that isn't linked is sent in full. Returns the number of files
+//stored.
+int polySendLinks(Transport *transport, const std::vector<manifest_entry> &manifest,
+	const std::vector<dedup_link> &links)
+{
+	int count = 0;
+
+	for (const dedup_link &link : links) {
+		const manifest_entry &entry = manifest[link.file];
+		const manifest_entry &source = manifest[link.source];
+		bool linked = false;
+
+		if (transport->Probed(PLCM_CAP_LINK) != 0) {
+			linked = polyLinkImage(transport, source.name.c_str(), entry.name.c_str(),
+				link.md5_sum) == 0;
+
+			if (!device_caps_known(transport->Capabilities()) &&
+				transport->Probed(PLCM_CAP_LINK) < 0) {
+				transport->SetProbed(PLCM_CAP_LINK, linked);
+				printf("Image links %ssupported by the device\n", linked ? "" : "not ");
+			}
+		}
+
+		if (linked) {
+			printf("[Link]:\t%s -> %s\n", entry.path.c_str(), source.name.c_str());
+			count++;
+			continue;
+		}
+
+		printf("[File]:\t%s\n", entry.path.c_str());
+		if (!polySendImageFile(transport, entry.path.c_str(), entry.name.c_str(), link.md5_sum))
+			count++;
+	}
+
+	return count;
+}
+
+//True if |entry| is worth splitting into chunks for a device that may
+//hold some of them from an earlier release
+bool polyChunkCandidate(Transport *transport, const manifest_entry &entry)
+{
+	return chunk_threshold >= 0 && entry.size >= chunk_threshold &&
+		transport->Probed(PLCM_CAP_CHUNKS) != 0 && !polyDeviceLacks(transport, PLCM_CAP_CHUNKS);
+}
+
+//Asks the device which of |chunks| its chunk store holds, at most
+//PLCM_CHUNK_QUERY_MAX at a time. A device without a capabilities block
+//that stalls the query is not asked again. Returns 0 or -1.
+int polyQueryChunks(Transport *transport, const std::vector<cdc_chunk> &chunks,
+	std::vector<bool> *held)
+{
+	unsigned char digests[PLCM_CHUNK_QUERY_MAX * MD5_DIGEST_SIZE];
+	unsigned char bitmap[PLCM_CHUNK_QUERY_MAX / 8];
+	bool probing = !device_caps_known(transport->Capabilities()) &&
+		transport->Probed(PLCM_CAP_CHUNKS) < 0;
+
+	held->assign(chunks.size(), false);
+
+	TRACE_SCOPE("chunk_query");
+
+	for (size_t first = 0; first < chunks.size(); first += PLCM_CHUNK_QUERY_MAX) {
+		size_t n = std::min<size_t>(PLCM_CHUNK_QUERY_MAX, chunks.size() - first);
+		int bitmap_len = (int)(n + 7) / 8;
+
+		for (size_t i = 0; i < n; i++)
+			memcpy(&digests[i * MD5_DIGEST_SIZE], chunks[first + i].digest, MD5_DIGEST_SIZE);
+
+		int ret = polySendControlInfo(transport,
+			false,
+			PLCM_USB_REQUEST_SET_INFORMATION,
+			PLCM_USB_REQUEST_VALUE_CHUNK_QUERY,
+			digests,
+			(unsigned int)(n * MD5_DIGEST_SIZE));
+
+		if (ret >= 0)
+			ret = polySendControlInfo(transport,
+				true,
+				PLCM_USB_REQUEST_GET_INFORMATION,
+				PLCM_USB_REQUEST_VALUE_CHUNK_QUERY,
+				bitmap,
+				bitmap_len);
+
+		if (ret < bitmap_len) {
+			if (probing) {
+				transport->SetProbed(PLCM_CAP_CHUNKS, false);
+				printf("Chunk store not supported by the device\n");
+			}
+			return -1;
+		}
+
+		for (size_t i = 0; i < n; i++)
+			(*held)[first + i] = (bitmap[i / 8] >> (i % 8)) & 1;
+	}
+
+	if (probing) {
+		transport->SetProbed(PLCM_CAP_CHUNKS, true);
+		printf("Chunk store supported by the device\n");
+	}
+
+	return 0;
+}
+
+//Splits |fileName| into content-defined chunks and asks the device which
+//of them it holds. Returns the reader of a chunked stream that carries
+//every other chunk once, or NULL when no chunk can be left out and the
+//file is better sent as is. |*have_md5| tells whether |md5_sum| got the
+//digest of the whole file, which chunking computes either way.
+ImageReader *polyOpenChunked(Transport *transport, const char *fileName, char *md5_sum,
+	bool *have_md5)
+{
+	std::vector<cdc_chunk> chunks;
+	std::vector<bool> held;
+
+	*have_md5 = cdc_chunk_file(fileName, chunk_params, &chunks, md5_sum) == 0;
+	if (!*have_md5 || polyQueryChunks(transport, chunks, &held) < 0)
+		return NULL;
+
+	//The device keeps each new chunk as it comes, later copies refer to it
+	std::vector<bool> send(chunks.size());
+	std::set<std::string> seen;
+	uint64_t total = 0;
+	uint64_t skipped = 0;
+
+	for (size_t i = 0; i < chunks.size(); i++) {
+		std::string digest((const char *)chunks[i].digest, MD5_DIGEST_SIZE);
+
+		send[i] = !held[i] && seen.insert(digest).second;
+		total += chunks[i].length;
+		if (!send[i])
+			skipped += chunks[i].length;
+	}
+
+	if (skipped == 0)
+		return NULL;
+
+	printf("%zu chunks, %llu of %llu bytes already on the device\n", chunks.size(),
+		(unsigned long long)skipped, (unsigned long long)total);
+
+	return cdc_open_reader(transport->Buffers(), fileName, chunks, send);
+}
+
+//Opens the reader of one planned transfer. Batches are built on the fly,
+//single files are checked for an Android sparse header.
+ImageReader *polyOpenTransfer(Transport *transport, const std::vector<manifest_entry> &manifest,
+	const transfer_item &item, sparse_header *header, bool *is_sparse)
+{
+	*is_sparse = false;
+
+	if (item.batch)
+		return schedule_open_batch(manifest, item, transport->Buffers());
+
+	const char *fileName = manifest[item.files[0]].path.c_str();
+
+	*is_sparse = sparse_mode && sparse_read_header(fileName, header) == 0;
+
+	return image_reader_open(fileName, transport->Buffers(), direct_io_threshold);
+}
+
+//Send every file under |base_dir|. The tree is scanned up front into a
+//manifest which the scheduler turns into transfers: small files go out
+//as tar batches and the transfers are sorted by the selected policy.
+//Each transfer is opened, so unbuffered readers start filling their first
+//blocks, while the device verifies the previous one, and the hash workers
+//compute the digests of the next few files meanwhile. Devices that take
+//pipelined transfers verify up to |pipeline_depth| images on their own
+//while the next ones are sent.
+int polySendDirectory(Transport *transport, const char *base_dir, int *totalCount)
+{
+	DirectoryScanner scanner(scan_threads);
+	int count = 0;
+
+	if (transport == NULL)
+		return 0;
+
+	if (scanner.Scan(base_dir) < 0)
+		return 0;
+
+	const std::vector<manifest_entry> &scanned = scanner.Manifest();
+
+	printf("Found %zu files, %lld bytes in %d directories\n", scanned.size(),
+		scanner.TotalBytes(), scanner.Directories());
+
+	*totalCount += (int)scanned.size();
+
+	//Identical files are sent once, the device links the other copies
+	std::vector<manifest_entry> unique;
+	std::vector<dedup_link> links;
+	int64_t saved = 0;
+	bool dedup = false;
+
+	if (dedup_mode && !polyDeviceLacks(transport, PLCM_CAP_LINK)) {
+		saved = dedup_plan(scanned, hash_threads, digest_cache, &unique, &links);
+		dedup = unique.size() < scanned.size();
+		if (dedup)
+			printf("%zu duplicate files, %lld bytes sent once\n", scanned.size() - unique.size(),
+				saved);
+	}
+
+	const std::vector<manifest_entry> &deduped = dedup ? unique : scanned;
+
+	//Better to stop now than with a full device halfway through
+	uint64_t free_bytes = transport->Capabilities().free_bytes;
+	int64_t total_bytes = scanner.TotalBytes() - saved;
+
+	if (free_bytes > 0 && (uint64_t)total_bytes > free_bytes) {
+		fprintf(stderr, "%lld bytes to send, the device only has %llu bytes free\n",
+			total_bytes, (unsigned long long)free_bytes);
+		return 0;
+	}
+
+	//Small files go whole in one control request each, the rest as images.
+	//Those the device turns down are sent as images right away.
+	int64_t inline_limit = polyInlineLimit(transport);
+	std::vector<manifest_entry> images;
+
+	if (inline_limit > 0) {
+		int inlined = 0;
+
+		for (const manifest_entry &entry : deduped) {
+			if (entry.size == 0 || entry.size > inline_limit) {
+				images.push_back(entry);
+				continue;
+			}
+
+			printf("[Inline]:\t%s\n", entry.path.c_str());
+			if (polySendInline(transport, entry) == 0) {
+				inlined++;
+			}
+			else {
+				fprintf(stderr, "Inline transfer of %s failed, sending it as an image\n",
+					entry.path.c_str());
+				if (!polySendImageFile(transport, entry.path.c_str(), entry.name.c_str(), NULL))
+					count++;
+			}
+		}
+
+		count += inlined;
+		printf("%d files of up to %lld bytes sent inline\n", inlined, inline_limit);
+	}
+
+	const std::vector<manifest_entry> &manifest = inline_limit > 0 ? images : deduped;
+
+	schedule_options options = batch_options;
+
+	if (polyDeviceLacks(transport, PLCM_CAP_TAR))
+		options.batch_threshold = 0;
+
+	std::unique_ptr<SchedulePolicy> policy(schedule_policy_create(schedule_policy));
+	std::vector<transfer_item> items = schedule_plan(manifest, *policy, options);
+
+	//Single files are hashed ahead in send order, batches while being built.
+	//Those hashed for the deduplication already, or hashed while being
+	//chunked, are left out.
+	std::vector<size_t> hash_order;
+	std::vector<size_t> hash_position(items.size());
+	std::vector<bool> hashed_ahead(items.size());
+	std::vector<bool> compress_skip(items.size());
+	std::vector<std::string> batch_names(items.size());
+	int batches = 0;
+
+	for (size_t k = 0; k < items.size(); k++) {
+		if (items[k].batch) {
+			char name[32];
+
+			snprintf(name, sizeof(name), "batch-%04d.tar", batches++);
+			batch_names[k] = name;
+			continue;
+		}
+
+		const manifest_entry &entry = manifest[items[k].files[0]];
+
+		if (!entry.md5.empty() || polyChunkCandidate(transport, entry))
+			continue;
+
+		hashed_ahead[k] = true;
+		hash_position[k] = hash_order.size();
+		hash_order.push_back(items[k].files[0]);
+	}
+
+	printf("%zu transfers, %d of them batches, in %s order\n", items.size(), batches, policy->Name());
+
+	std::unique_ptr<DigestPrefetcher> prefetcher;
+	if (hash_threads > 0)
+		prefetcher.reset(new DigestPrefetcher(manifest, hash_order, hash_threads, 2 * hash_threads,
+			digest_cache));
+
+	image_pipeline pipeline;
+	polyPipelineInit(transport, &pipeline, pipeline_depth);
+
+	bool batching = true;
+	bool pending = false;
+	size_t pending_files = 0;
+	image_send_state state;
+
+	for (size_t k = 0; k < items.size(); k++) {
+		const transfer_item &item = items[k];
+		ImageReader *reader = NULL;
+		sparse_header header;
+		bool is_sparse = false;
+
+		if (!item.batch || batching)
+			reader = polyOpenTransfer(transport, manifest, item, &header, &is_sparse);
+
+		//The next transfer is open, now let the device check the previous one
+		if (pending) {
+			if (!polyVerifyImage(transport, &state))
+				count += (int)pending_files;
+			pending = false;
+		}
+
+		if (item.batch && !batching) {
+			//The device can't unpack batches, send their files one by one.
+			//They go the sequential way, so let the pipeline drain first.
+			count += polyPipelineReap(transport, &pipeline, 0);
+			for (size_t i : item.files) {
+				const char *md5 = manifest[i].md5.empty() ? NULL : manifest[i].md5.c_str();
+
+				printf("[File]:\t%s\n", manifest[i].path.c_str());
+				if (!polySendImageFile(transport, manifest[i].path.c_str(), manifest[i].name.c_str(), md5))
+					count++;
+			}
+			continue;
+		}
+
+		if (reader == NULL) {
+			fprintf(stderr, "Failed to open %s\n",
+				item.batch ? batch_names[k].c_str() : manifest[item.files[0]].path.c_str());
+			continue;
+		}
+
+		const char *src_name;
+		const char *dest_name;
+		char md5_sum[MD5_HEX_SIZE];
+		bool have_md5 = false;
+		int format = item.batch ? PLCM_IMG_FORMAT_TAR : PLCM_IMG_FORMAT_RAW;
+
+		if (item.batch) {
+			src_name = batch_names[k].c_str();
+			dest_name = src_name;
+			printf("[Batch]:\t%s, %zu files\n", src_name, item.files.size());
+		}
+		else {
+			const manifest_entry &entry = manifest[item.files[0]];
+
+			src_name = entry.path.c_str();
+			dest_name = entry.name.c_str();
+			if (!entry.md5.empty()) {
+				memcpy(md5_sum, entry.md5.c_str(), MD5_HEX_SIZE);
+				have_md5 = true;
+			}
+			else if (hashed_ahead[k]) {
+				have_md5 = prefetcher && prefetcher->Get(hash_position[k], md5_sum) == 0;
+			}
+			printf("[File]:\t%s\n", src_name);
+
+			//Only the chunks the device lacks from earlier releases go out
+			if (!is_sparse && polyChunkCandidate(transport, entry)) {
+				bool chunk_md5;
+				ImageReader *chunked = polyOpenChunked(transport, src_name, md5_sum, &chunk_md5);
+
+				have_md5 = have_md5 || chunk_md5;
+				if (chunked != NULL) {
+					delete reader;
+					reader = chunked;
+					format = PLCM_IMG_FORMAT_CHUNKED;
+				}
+			}
+
+			//Otherwise compressed, from the cache after the first unit
+			if (!is_sparse && format == PLCM_IMG_FORMAT_RAW && !compress_skip[k] &&
+				compress_cache != NULL && entry.size >= compress_threshold) {
+				if (!have_md5)
+					have_md5 = polyGenerateMD5Sum(src_name, md5_sum) > 0;
+				if (have_md5)
+					format = polyUseCompressed(transport, src_name, md5_sum, &reader);
+			}
+
+			if (reader == NULL) {
+				fprintf(stderr, "Failed to open %s\n", src_name);
+				continue;
+			}
+		}
+
+		if (pipeline.enabled)
+			count += polyPipelineReap(transport, &pipeline, pipeline.depth - 1);
+
+		bool pipelined = polyPipelineTag(transport, &pipeline);
+
+		int ret = polySendImageData(transport, reader, src_name, dest_name,
+			is_sparse ? &header : NULL, have_md5 ? md5_sum : NULL, format, &state);
+
+		delete reader;
+
+		//Nothing was sent yet, go over the same file again as is
+		if (ret == -ENOTSUP && format == PLCM_IMG_FORMAT_CHUNKED) {
+			transport->SetProbed(PLCM_CAP_CHUNKS, false);
+			k--;
+			continue;
+		}
+
+		if (ret == -ENOTSUP && format == PLCM_IMG_FORMAT_LZ4) {
+			compress_skip[k] = true;
+			k--;
+			continue;
+		}
+
+		//Nothing was sent yet, go over the same batch again file by file
+		if (ret == -ENOTSUP && item.batch) {
+			fprintf(stderr, "The device does not take tar batches\n");
+			batching = false;
+			k--;
+			continue;
+		}
+
+		if (ret == 0 && pipelined) {
+			polyPipelineCommit(transport, &pipeline, &state, item.files.size());
+		}
+		else if (pipelined && state.write_failed) {
+			count += polyPipelineStop(transport, &pipeline);
+		}
+		else if (ret == 0) {
+			pending = true;
+			pending_files = item.files.size();
+		}
+	}
+
+	if (pending && !polyVerifyImage(transport, &state))
+		count += (int)pending_files;
+
+	count += polyPipelineReap(transport, &pipeline, 0);
+
+	//Duplicates under the name of their source were dropped from the plan
+	if (dedup)
+		count += polySendLinks(transport, scanned, links) +
+			(int)(scanned.size() - unique.size() - links.size());
+
+	return count;
+}
+
+//Fetches |device_path|, a file or a directory, from the device into
+//|host_path|, or under its own name in the current directory when NULL.
+//A directory comes as a tar stream. The data lands in a .part file that
+//only takes the final name once its MD5 sum matches the device's.
+int polyPullFile(Transport *transport, const char *device_path, const char *host_path)
+{
+	plcm_pull_info info;
+	char md5_sum[MD5_HEX_SIZE];
+	std::string target;
+
+	if (polyDeviceLacks(transport, PLCM_CAP_PULL)) {
+		fprintf(stderr, "The device does not send files\n");
+		return -ENOTSUP;
+	}
+
+	TRACE_SCOPE("pull_file");
+
+	int ret = polySendControlInfo(transport,
+		false,
+		PLCM_USB_REQUEST_SET_INFORMATION,
+		PLCM_USB_REQUEST_VALUE_PULL_PATH,
+		(void *)device_path,
+		(unsigned int)strlen(device_path) + 1);
+
+	if (ret < 0) {
+		fprintf(stderr, "The device refused to send %s\n", device_path);
+		return -1;
+	}
+
+	memset(&info, 0, sizeof(info));
+
+	ret = polySendControlInfo(transport,
+		true,
+		PLCM_USB_REQUEST_GET_INFORMATION,
+		PLCM_USB_REQUEST_VALUE_PULL_INFO,
+		&info,
+		sizeof(info));
+
+	if (ret != sizeof(info) || info.md5_sum[MD5_HEX_SIZE - 1] != '\0') {
+		fprintf(stderr, "Failed to get the size of %s\n", device_path);
+		return -1;
+	}
+
+	if (host_path != NULL) {
+		target = host_path;
+	}
+	else {
+		const char *name = strrchr(device_path, '/');
+
+		name = name != NULL ? name + 1 : device_path;
+		target = *name != '\0' ? name : "pull";
+		if (info.format == PLCM_IMG_FORMAT_TAR)
+			target += ".tar";
+	}
+
+	std::string part = target + ".part";
+	ImageWriter *writer = image_writer_open(part.c_str(), transport->Buffers(), IMAGE_WRITER_DEPTH);
+
+	if (writer == NULL) {
+		fprintf(stderr, "Failed to create %s\n", part.c_str());
+		return -1;
+	}
+
+	printf("Pulling %s, %llu bytes, into %s\n", device_path, (unsigned long long)info.length,
+		target.c_str());
+
+	uint64_t start_us = TransportStats::NowUs();
+	int64_t received = pull_stream(transport, writer, info.length, md5_sum);
+	double seconds = (TransportStats::NowUs() - start_us) / 1e6;
+
+	delete writer;
+
+	if (received != (int64_t)info.length || _stricmp(md5_sum, info.md5_sum) != 0) {
+		fprintf(stderr, "Pull of %s failed: %lld of %llu bytes, MD5 sum %s, expected %s\n",
+			device_path, (long long)received, (unsigned long long)info.length, md5_sum,
+			info.md5_sum);
+		remove(part.c_str());
+		return -1;
+	}
+
+	remove(target.c_str());
+	if (rename(part.c_str(), target.c_str()) != 0) {
+		fprintf(stderr, "Failed to rename %s to %s\n", part.c_str(), target.c_str());
+		return -1;
+	}
+
+	printf("%s: %llu bytes in %.2f s, %.1f MB/s, MD5 sum %s\n", target.c_str(),
+		(unsigned long long)received, seconds,
+		seconds > 0 ? received / (1024 * 1024) / seconds : 0, md5_sum);
+
+	return 0;
+}
 
-typedef int(*usb_file_transfer_func)(Transport *, const char *, const char *);
+//Time a --soak image keeps being sent again after a fault before the
+//fault counts as unrecovered, and the pause between tries
+#define SOAK_RECOVER_BUDGET_MS	30000
+#define SOAK_RETRY_DELAY_MS		100
 
-#define DEVICE_IMAGE_STORE_DIRECTORY	"/data"
+//A fault that hit during --soak, until an image is stored again
+struct soak_fault {
+	fault_kind kind;
+	uint64_t hit_us;
+	bool detected;
+};
 
-int on_adb_device_found(usb_ifc_info *info)
+//Sends images of random sizes up to |max_size| through the full host path
+//to a simulated device for |seconds|, arming one of the faults of |kinds|
+//before an image at |rate|. A failed image is sent again, as a station
+//would, so each fault yields the time until the host failed the image and
+//the time until it stored one again. No device is used.
+int polySoakTest(double seconds, int64_t max_size, double rate, uint32_t kinds)
 {
-	printf("We found an adb device\n");
-	printf("\tVendor ID: 0x%04x\n", info->dev_vendor);
-	printf("\tProduct ID: 0x%04x\n", info->dev_product);
-	printf("\tSerial Number: %s\n", info->serial_number);
+	plcm_sim_options checked = { true, 5, true, false, 0 };
+	fault_options options = { FAULT_DEFAULT_TIMEOUT_MS, FAULT_DEFAULT_RECONNECT_MS, 1 };
+	FaultInjectingTransport transport(new SimulatedTransport(checked), options);
+	std::mt19937 random(2);
+	std::uniform_real_distribution<double> unit(0.0, 1.0);
+	std::vector<fault_kind> armable;
+	std::vector<soak_fault> pending;
+	FaultReport report;
+	char name[PLCM_IMG_NAME_SIZE];
+	uint64_t images = 0;
+	uint64_t sends = 0;
+	uint64_t failed = 0;
+	uint64_t unprovoked = 0;
+	uint64_t bytes = 0;
+	int64_t size = 0;
+
+	for (int kind = 0; kind < FAULT_KINDS; kind++) {
+		if (kinds & (1U << kind))
+			armable.push_back((fault_kind)kind);
+	}
 
-	return 0;
+	if (max_size < 1024)
+		max_size = 1024;
+
+	uint64_t start_us = TransportStats::NowUs();
+	uint64_t end_us = start_us + (uint64_t)(seconds * 1e6);
+
+	//Faults still being recovered from get the time they need
+	while (TransportStats::NowUs() < end_us || !pending.empty()) {
+		//Sizes spread evenly over the orders of magnitude from 1 KB up.
+		//The first image runs the probes undisturbed.
+		if (size == 0) {
+			size = (int64_t)(1024 * pow((double)max_size / 1024, unit(random)));
+
+			if (images > 0 && !armable.empty() && unit(random) < rate)
+				transport.Arm(armable[random() % armable.size()]);
+		}
+
+		snprintf(name, sizeof(name), "soak-%llu", (unsigned long long)images);
+
+		PatternImageReader reader(transport.Buffers(), size);
+
+		int ret = polySendImageStream(&transport, &reader, name, name, NULL, NULL,
+			PLCM_IMG_FORMAT_RAW);
+		uint64_t now_us = TransportStats::NowUs();
+		fault_kind kind;
+		uint64_t hit_us;
+
+		sends++;
+
+		if (transport.TakeHit(&kind, &hit_us)) {
+			soak_fault fault = { kind, hit_us, false };
+
+			report.Hit(kind);
+			pending.push_back(fault);
+		}
+
+		if (ret == 0) {
+			for (const soak_fault &fault : pending) {
+				if (fault.detected)
+					report.Recovered(fault.kind, now_us - fault.hit_us);
+				else
+					report.Undetected(fault.kind);
+			}
+
+			pending.clear();
+			images++;
+			bytes += size;
+			size = 0;
+			continue;
+		}
+
+		failed++;
+
+		if (pending.empty()) {
+			fprintf(stderr, "soak: %s failed without a fault\n", name);
+			unprovoked++;
+			images++;
+			size = 0;
+			continue;
+		}
+
+		for (soak_fault &fault : pending) {
+			if (!fault.detected) {
+				fault.detected = true;
+				report.Detected(fault.kind, now_us - fault.hit_us);
+			}
+		}
+
+		//Past the budget the station would give up on the device
+		if (now_us - pending.front().hit_us > SOAK_RECOVER_BUDGET_MS * 1000ULL) {
+			for (const soak_fault &fault : pending)
+				report.Unrecovered(fault.kind);
+
+			pending.clear();
+			images++;
+			size = 0;
+			continue;
+		}
+
+		Sleep(SOAK_RETRY_DELAY_MS);
+	}
+
+	double total_s = (TransportStats::NowUs() - start_us) / 1e6;
+	double lost_s = report.LostUs() / 1e6;
+	double mb = bytes / (1024.0 * 1024.0);
+
+	printf("soak: %llu images, %.1f MB in %.1f s, %.2f MB/s, %.2f MB/s outside recoveries, "
+		"%llu of %llu sends failed, %llu without a fault\n",
+		(unsigned long long)images, mb, total_s, total_s > 0 ? mb / total_s : 0,
+		total_s > lost_s ? mb / (total_s - lost_s) : 0,
+		(unsigned long long)failed, (unsigned long long)sends, (unsigned long long)unprovoked);
+
+	report.Print(stdout);
+
+	printf("%.1f s of %.1f s spent recovering from faults, %llu undetected, %llu unrecovered\n",
+		lost_s, total_s, (unsigned long long)report.Undetected(),
+		(unsigned long long)report.Unrecovered());
+
+	return report.Undetected() > 0 || report.Unrecovered() > 0 || unprovoked > 0 ? -1 : 0;
 }
 
-int traverse_directory(const char *dirName,
-	usb_file_transfer_func callback,
-	Transport *transport,
-	int *totalCount)
+//Chunks the files under |old_dir| as if the device held them, then those
+//under |new_dir|, and reports how much of the new release would go out:
+//with content-defined chunks, with fixed size blocks of the average chunk
+//size, and with whole files only. Files nothing can be left out of go as
+//is, the others as recipes. No device is used.
+int polyChunkBenchmark(const char *old_dir, const char *new_dir)
 {
-	struct _finddata_t file_find;
-	int handle;
-	int done = 0;
-	char pattern[512];
-	int count;
+	DirectoryScanner old_scanner(scan_threads);
+	DirectoryScanner new_scanner(scan_threads);
 
-	snprintf(pattern, sizeof(pattern), "%s\\*.*", dirName);
+	if (old_scanner.Scan(old_dir) < 0 || new_scanner.Scan(new_dir) < 0) {
+		fprintf(stderr, "Failed to read %s or %s\n", old_dir, new_dir);
+		return -1;
+	}
+
+	cdc_params fixed = { chunk_params.avg_size, chunk_params.avg_size, chunk_params.avg_size };
+	const cdc_params *params[] = { &chunk_params, &fixed };
+	const char *names[] = { "content-defined chunks", "fixed size blocks" };
+
+	for (int p = 0; p < 2; p++) {
+		std::set<std::string> store;
+		std::set<std::string> old_files;
+		std::vector<cdc_chunk> chunks;
+		char md5_sum[MD5_HEX_SIZE];
+		uint64_t hashed = 0;
+		uint64_t total = 0;
+		uint64_t send = 0;
+		uint64_t file_send = 0;
+		uint64_t chunk_count = 0;
+		uint64_t start_us = TransportStats::NowUs();
+
+		for (const manifest_entry &entry : old_scanner.Manifest()) {
+			if (cdc_chunk_file(entry.path.c_str(), *params[p], &chunks, md5_sum) < 0)
+				continue;
 
-	count = 0;
+			for (const cdc_chunk &chunk : chunks)
+				store.insert(std::string((const char *)chunk.digest, MD5_DIGEST_SIZE));
+			old_files.insert(md5_sum);
+			hashed += entry.size;
+		}
 
-	if ((handle = _findfirst(pattern, &file_find)) != -1) {
-		while (!(done = _findnext(handle, &file_find))) {
-			if (strcmp(file_find.name, "..") == 0) {
+		for (const manifest_entry &entry : new_scanner.Manifest()) {
+			if (cdc_chunk_file(entry.path.c_str(), *params[p], &chunks, md5_sum) < 0)
 				continue;
-			}
 
-			snprintf(pattern, sizeof(pattern), "%s\\%s", dirName, file_find.name);
-			if (file_find.attrib == _A_SUBDIR) {
-				printf("[Dir]:\t%s\\%s\n", dirName, file_find.name);
-				count += traverse_directory(pattern, callback, transport, totalCount);
-			}
-			else {
-				printf("[File]:\t%s\\%s\n", dirName, file_find.name);
-				(*totalCount)++;
-				if (!callback(transport, pattern, file_find.name))
-					count++;
+			uint64_t missing = 0;
+
+			total += entry.size;
+			hashed += entry.size;
+			chunk_count += chunks.size();
+
+			for (const cdc_chunk &chunk : chunks) {
+				if (store.insert(std::string((const char *)chunk.digest, MD5_DIGEST_SIZE)).second)
+					missing += chunk.length;
 			}
+
+			if (missing < (uint64_t)entry.size)
+				send += missing + sizeof(plcm_recipe_header) + chunks.size() * sizeof(plcm_recipe_entry);
+			else
+				send += entry.size;
+
+			if (old_files.insert(md5_sum).second)
+				file_send += entry.size;
 		}
-		_findclose(handle);
+
+		double seconds = (TransportStats::NowUs() - start_us) / 1e6;
+
+		printf("%s: %llu of %llu bytes to send (%.1f%%), %llu chunks of %.0f bytes on average, "
+			"chunked at %.1f MB/s\n", names[p], (unsigned long long)send, (unsigned long long)total,
+			total > 0 ? 100.0 * send / total : 0, (unsigned long long)chunk_count,
+			chunk_count > 0 ? (double)total / chunk_count : 0,
+			seconds > 0 ? hashed / (1024 * 1024) / seconds : 0);
+
+		if (p == 0)
+			printf("whole files: %llu of %llu bytes to send (%.1f%%)\n",
+				(unsigned long long)file_send, (unsigned long long)total,
+				total > 0 ? 100.0 * file_send / total : 0);
 	}
 
-	return count;
+	return 0;
 }
 
-int polyGenerateMD5Sum(const char *fileName, char *md5sum)
+//Compares the schedule policies on the files under |base_dir| against
+//|bench_model|, with and without batching. No device is used.
+int polyScheduleBenchmark(const char *base_dir)
 {
-	int retValue = 0;
-	char cmd_buf[512];
-	char *tmp_results = "md5_result_tmp.txt";
-	FILE *md5_fp;
+	DirectoryScanner scanner(scan_threads);
+
+	if (scanner.Scan(base_dir) < 0)
+		return -1;
 
-	snprintf(cmd_buf, sizeof(cmd_buf), "C:\\bin\\md5sums -u %s > %s", fileName, tmp_results);
+	printf("%zu files, %lld bytes; model: %.1f ms per transfer, %.1f MB/s\n",
+		scanner.Manifest().size(), scanner.TotalBytes(), bench_model.handshake_ms,
+		bench_model.bytes_per_ms * 1000 / (1024 * 1024));
+	printf("%-10s %-9s %10s %12s %12s %12s\n", "policy", "batching", "transfers",
+		"makespan_s", "mean_file_s", "first_s");
 
-	system(cmd_buf);
+	for (int i = 0; schedule_policy_names[i] != NULL; i++) {
+		std::unique_ptr<SchedulePolicy> policy(schedule_policy_create(schedule_policy_names[i]));
 
-	fopen_s(&md5_fp, tmp_results, "r");
+		for (int batching = 0; batching < 2; batching++) {
+			schedule_options options = batch_options;
 
-	if (md5_fp == NULL)
-		return -1;
+			if (!batching)
+				options.batch_threshold = 0;
 
-	retValue = fread(md5sum, sizeof(char), 32, md5_fp);
-	if (retValue != 32) {
-		fclose(md5_fp);
-		return -2;
+			std::vector<transfer_item> items = schedule_plan(scanner.Manifest(), *policy, options);
+			schedule_estimate estimate = schedule_estimate_run(items, bench_model);
+
+			printf("%-10s %-9s %10d %12.2f %12.2f %12.2f\n", policy->Name(), batching ? "on" : "off",
+				estimate.transfers, estimate.makespan_ms / 1000, estimate.mean_file_ms / 1000,
+				estimate.first_verified_ms / 1000);
+		}
 	}
 
-	md5sum[retValue] = '\0';
+	return 0;
+}
+
+void polyWriteTransportStats(FILE *fp, Transport *transport)
+{
+	fprintf(fp, "{\"transport_stats\":");
+	transport->Stats().DumpJson(fp, transport->Name());
+	fprintf(fp, ",\n\"buffer_pool\":");
+	transport->Buffers()->DumpJson(fp);
+	fprintf(fp, ",\n\"device_caps\":");
+	device_caps_dump_json(fp, transport->Capabilities());
+	fprintf(fp, ",\n\"serial\":");
+	json_write_string(fp, transport->Serial());
+	fprintf(fp, ",\"location\":");
+	json_write_string(fp, transport->Location());
+	if (transport->Limiter() != NULL)
+		fprintf(fp, ",\"rate_limit\":%.0f,\"rate_limit_wait_us\":%llu",
+			transport->Limiter()->BytesPerSecond(),
+			(unsigned long long)transport->Limiter()->WaitUs());
+	fprintf(fp, "}");
+}
+
+//Writes the stats of one device as an object, of several as an array
+int polyDumpTransportStats(const std::vector<Transport *> &transports, const char *fileName)
+{
+	FILE *fp = stdout;
 
-	fclose(md5_fp);
+	if (strcmp(fileName, "-") != 0) {
+		fopen_s(&fp, fileName, "w");
+		if (fp == NULL) {
+			fprintf(stderr, "Failed to open the stats file %s\n", fileName);
+			return -1;
+		}
+	}
 
-	_unlink(tmp_results);
+	if (transports.size() == 1) {
+		polyWriteTransportStats(fp, transports[0]);
+	}
+	else {
+		fprintf(fp, "[");
+		for (size_t i = 0; i < transports.size(); i++) {
+			if (i > 0)
+				fprintf(fp, ",\n");
+			polyWriteTransportStats(fp, transports[i]);
+		}
+		fprintf(fp, "]");
+	}
+	fprintf(fp, "\n");
 
-	return retValue;
+	if (fp != stdout)
+		fclose(fp);
 
+	return 0;
 }
 
-char *buf;
-int buf_size = 16 * 1024;
+//Capabilities, pipes and buffers of a freshly opened device
+int polySetupDevice(Transport *transport, size_t block_size, int block_count, bool large_pages)
+{
+	polyReadCapabilities(transport);
+
+	//Extra pipes only help devices that put striped images back together
+	if (stripe_count > 1 && !polyDeviceLacks(transport, PLCM_CAP_STRIPES)) {
+		int wanted = stripe_count;
+		uint32_t max_stripes = transport->Capabilities().max_stripes;
 
-struct setup_packet {
-	unsigned char bRequestType;
-	unsigned char bRequest;
-	unsigned short wValue;
-	unsigned short wIndex;
-	unsigned short wLength;
-};
+		if (max_stripes > 0 && (uint32_t)wanted > max_stripes)
+			wanted = (int)max_stripes;
 
-#define PLCM_USB_REQUEST_SET_INFORMATION	0x01
-#define PLCM_USB_REQUEST_GET_INFORMATION	0x81
+		transport->OpenStripes(wanted - 1);
+		printf("Image data striped over %d bulk pipes\n", transport->Stripes());
+	}
 
-#define PLCM_USB_REQUEST_VALUE_IMG_LENGTH		0x0001
-#define PLCM_USB_REQUEST_VALUE_IMG_NAME			0x0002
-#define PLCM_USB_REQUEST_VALUE_IMG_MD5_SUM		0x0003
-#define PLCM_USB_REQUEST_VALUE_STATUS			0x0004
-#define PLCM_USB_REQUEST_VALUE_WRITTEN_BYTES	0x0005
+	//Blocks go to the pipe as they are, one transfer each
+	uint32_t max_bulk = transport->Capabilities().max_bulk_transfer;
 
-int polySendControlInfo(Transport *transport, bool is_in_direction,
-	unsigned char request, unsigned short value, void *data, unsigned int len)
+	if (max_bulk > 0 && block_size > max_bulk) {
+		printf("Transfer blocks reduced to %u bytes for the device\n", max_bulk);
+		block_size = max_bulk;
+	}
+
+	if (transport->ConfigureBuffers(block_size, block_count, large_pages) < 0) {
+		fprintf(stderr, "Failed to allocate %d transfer buffers of %zu bytes\n",
+			block_count, block_size);
+		return -1;
+	}
+
+	if (device_rate > 0)
+		transport->SetRateLimit(device_rate);
+
+	return 0;
+}
+
+//Sends the bundle or directory |base_dir| to |transport|
+int polySendUpdate(Transport *transport, const char *base_dir, int *totalCount)
 {
-	struct setup_packet setup;
-	
-	memset(&setup, 0x00, sizeof(struct setup_packet));
+	int file_count;
 
-	setup.bRequest = request;
-	setup.wValue = value;
-	setup.wLength = len;
+	//Release bundles are streamed member by member without extracting them
+	Archive *archive = Archive::Open(base_dir);
 
-	return transport->ControlIO(is_in_direction, &setup, data, len);
+	if (archive != NULL) {
+		TRACE_SCOPE("send_archive");
+		file_count = polySendArchive(transport, archive, totalCount);
+		delete archive;
+	}
+	else {
+		TRACE_SCOPE("send_directory");
+		file_count = polySendDirectory(transport, base_dir, totalCount);
+	}
+
+	return file_count;
 }
 
-int polySendImageFile(Transport *transport, const char *fileName, const char *destFileName)
+//One device of a fleet update, on its own thread
+int polyFleetJob(Transport *transport, int device_id, void *arg)
 {
-	FILE *fp;
+	const char *base_dir = (const char *)arg;
+	int total_file_count = 0;
 
-	int read_len;
-	int write_len;
+	trace_set_device(device_id, transport->Serial());
+	trace_set_thread_name("fleet device");
 
-	int ret;
+	int file_count = polySendUpdate(transport, base_dir, &total_file_count);
 
-	if (transport == NULL)
-		return -EINVAL;
+	printf("device %d (%s): total file count: %d, transferred count: %d\n",
+		device_id, transport->Serial(), total_file_count, file_count);
 
-	fopen_s(&fp, fileName, "rb");
+	return file_count < total_file_count ? -1 : file_count;
+}
 
-	if (fp == NULL) {
-		return -EINVAL;
-	}
+//Updates every device found, bandwidth permitting all at once
+int polyUpdateFleet(const std::vector<Transport *> &transports, const char *base_dir)
+{
+	FleetScheduler fleet(fleet_opts);
 
-	//Get the file size
-	fseek(fp, 0, SEEK_END);
+	for (Transport *transport : transports)
+		fleet.AddDevice(transport);
 
-	fpos_t ops;
+	int failed = fleet.Run(polyFleetJob, (void *)base_dir);
 
-	fgetpos(fp, &ops);
+	fleet.PrintReport(stdout);
 
-	printf("File size is %lld\n", ops);
+	return failed;
+}
 
-	//If the filesize is zero. Do not transfer it.
-	if (ops == 0) {
-		fclose(fp);
-		return -1;
-	}
+//One device of an --engine update, advanced by polyDeviceStep()
+struct device_update {
+	Transport *transport;
+	int device_id;
+	const std::vector<manifest_entry> *manifest;
+	/// MD5 sums of the manifest entries, "" where the file could not be read
+	const std::vector<std::string> *digests;
+
+	/// Next manifest entry; the one before is in progress while |reader| is open
+	size_t next;
+	ImageReader *reader;
+	std::unique_ptr<PlcmSession> session;
+	std::unique_ptr<PlcmAsyncDriver> driver;
+
+	int sent;
+	int failed;
+};
 
-	//Send the image filesize
-	char msg[64];
+//Advances the update of one device without blocking on its transfers
+bool polyDeviceStep(void *task, engine_wait *wait)
+{
+	device_update *dev = (device_update *)task;
+	Transport *transport = dev->transport;
 
-	unsigned int size = (unsigned int)ops;
-	memcpy(msg, &size, sizeof(size));
+	for (;;) {
+		if (dev->reader != NULL) {
+			if (dev->driver->Step(wait))
+				return true;
 
-	write_len = polySendControlInfo(transport,
-		false,
-		PLCM_USB_REQUEST_SET_INFORMATION,
-		PLCM_USB_REQUEST_VALUE_IMG_LENGTH,
-		msg,
-		sizeof(size));
+			if (dev->driver->Status() == 0) {
+				dev->sent++;
+			}
+			else {
+				fprintf(stderr, "device %d: %s: %s\n", dev->device_id,
+					(*dev->manifest)[dev->next - 1].path.c_str(), dev->session->Error());
+				dev->failed++;
+			}
 
-	if (write_len < 0) {
-		fprintf(stderr, "Failed to issue the control transer\n");
-		fclose(fp);
-		return -1;
-	}
+			if (dev->session->Size64() >= 0)
+				transport->SetProbed(PLCM_CAP_SIZE64, dev->session->Size64() == 1);
+			if (digest_first_mode && dev->session->DigestFirst() >= 0)
+				transport->SetProbed(PLCM_CAP_DIGEST_FIRST, dev->session->DigestFirst() == 1);
+
+			delete dev->reader;
+			dev->reader = NULL;
+		}
 
-	//Send the image name
-	int msg_count = snprintf(msg, sizeof(msg), "%s", destFileName);
-	msg[msg_count + 1] = '\0';
+		if (dev->next == dev->manifest->size()) {
+			printf("device %d (%s): transferred count: %d, failed: %d\n", dev->device_id,
+				transport->Serial(), dev->sent, dev->failed);
+			return false;
+		}
 
-	write_len = polySendControlInfo(transport,
-		false,
-		PLCM_USB_REQUEST_SET_INFORMATION,
-		PLCM_USB_REQUEST_VALUE_IMG_NAME,
-		msg,
-		msg_count + 1);
+		const manifest_entry &entry = (*dev->manifest)[dev->next];
+		const std::string &digest = (*dev->digests)[dev->next];
 
-	if (write_len < 0) {
-		fprintf(stderr, "Failed to issue the control transer, msg: %s\n", msg);
-		fclose(fp);
-		return -1;
+		dev->next++;
+
+		if (!digest.empty())
+			dev->reader = image_reader_open(entry.path.c_str(), transport->Buffers(), direct_io_threshold);
+
+		if (dev->reader == NULL) {
+			dev->failed++;
+			continue;
+		}
+
+		plcm_action action = dev->session->Start(entry.name.c_str(), entry.size, digest.c_str());
+
+		dev->driver->Start(transport, dev->session.get(), action, dev->reader);
+	}
+}
+
+//Updates every device from one event engine thread per ENGINE_MAX_TASKS
+//devices. The tree is scanned and hashed once for all of them.
+int polyUpdateEngine(const std::vector<Transport *> &transports, const char *base_dir)
+{
+	DirectoryScanner scanner(scan_threads);
+
+	if (scanner.Scan(base_dir) < 0) {
+		fprintf(stderr, "Failed to read %s\n", base_dir);
+		return (int)transports.size();
 	}
 
-	//Set the pos to start
-	fseek(fp, 0, SEEK_SET);
+	const std::vector<manifest_entry> &manifest = scanner.Manifest();
+	std::vector<std::string> digests(manifest.size());
 
-	int total_len = 0;
+	printf("Found %zu files, %lld bytes in %d directories\n", manifest.size(),
+		scanner.TotalBytes(), scanner.Directories());
 
-	while ((read_len = fread(buf, sizeof(char), buf_size, fp)) > 0) {
-		total_len += read_len;
+	{
+		TRACE_SCOPE("hash_tree");
+		std::vector<size_t> order(manifest.size());
 
-		write_len = transport->Write(buf, read_len);
-		if (write_len < read_len) {
-			fprintf(stderr, "Failed to write all the data. Written length : %d, all data : %d\n",
-				write_len, read_len);
-			break;
+		for (size_t i = 0; i < order.size(); i++)
+			order[i] = i;
+
+		DigestPrefetcher prefetcher(manifest, order, std::max(hash_threads, 1),
+			2 * std::max(hash_threads, 1), digest_cache);
+
+		for (size_t i = 0; i < manifest.size(); i++) {
+			char md5_sum[MD5_HEX_SIZE];
+
+			if (prefetcher.Get(i, md5_sum) == 0)
+				digests[i] = md5_sum;
+			else
+				fprintf(stderr, "Failed to read %s\n", manifest[i].path.c_str());
 		}
 	}
 
-	printf("total_len is %d\n", total_len);
-	fclose(fp);
+	std::vector<device_update> devices(transports.size());
+	std::vector<void *> tasks;
+
+	for (size_t i = 0; i < transports.size(); i++) {
+		device_update &dev = devices[i];
+		uint64_t free_bytes = transports[i]->Capabilities().free_bytes;
+
+		dev.transport = transports[i];
+		dev.device_id = (int)i + 1;
+		dev.manifest = &manifest;
+		dev.digests = &digests;
+		dev.next = 0;
+		dev.reader = NULL;
+		dev.session.reset(new PlcmSession(polyDeviceSize64(transports[i]),
+			polyDeviceDigestFirst(transports[i])));
+		dev.driver.reset(new PlcmAsyncDriver());
+		dev.sent = 0;
+		dev.failed = 0;
+
+		//Better to leave it out now than with a full device halfway through
+		if (free_bytes > 0 && (uint64_t)scanner.TotalBytes() > free_bytes) {
+			fprintf(stderr, "device %d: %lld bytes to send, only %llu bytes free\n", dev.device_id,
+				scanner.TotalBytes(), (unsigned long long)free_bytes);
+			dev.failed = (int)manifest.size();
+			continue;
+		}
 
-	int retries = 0;
+		tasks.push_back(&dev);
+	}
 
-	int written_bytes = 0;
+	int threads = engine_run_all(polyDeviceStep, tasks);
+	int failed = 0;
 
-	do {
-		Sleep(100);
+	printf("%zu devices on %d engine threads\n", tasks.size(), threads);
 
-		ret = polySendControlInfo(transport,
-			true,
-			PLCM_USB_REQUEST_GET_INFORMATION,
-			PLCM_USB_REQUEST_VALUE_WRITTEN_BYTES,
-			&written_bytes,
-			4);
+	for (const device_update &dev : devices) {
+		if (dev.failed > 0)
+			failed++;
+	}
 
-		if (ret < 0) {
-			return -1;
-		}
+	return failed;
+}
 
-		printf("Got written_bytes: %d\n", written_bytes);
+//Closes the recordings so their logs are complete, and has the replays
+//report how closely the host followed the recorded run
+void polyCloseLogs(std::vector<Transport *> &transports)
+{
+	if (record_path == NULL && replay_path == NULL)
+		return;
+
+	for (Transport *transport : transports)
+		transport->Close();
+}
+
+int main(int argc, char *argv[])
+{
+	printf("zhangjie\n");
+
+	char *base_dir = NULL;
+	char *stats_file = NULL;
+	size_t block_size = Transport::kDefaultBufferSize;
+	int block_count = Transport::kDefaultBufferCount;
+	bool large_pages = false;
+
+	for (int i = 1; i < argc; i++) {
+		if (strncmp(argv[i], "--trace=", 8) == 0)
+			trace_init(argv[i] + 8);
+		else if (strncmp(argv[i], "--stats=", 8) == 0)
+			stats_file = argv[i] + 8;
+		else if (strcmp(argv[i], "--profile") == 0)
+			trace_init(NULL);
+		else if (strncmp(argv[i], "--block-size=", 13) == 0)
+			block_size = strtoul(argv[i] + 13, NULL, 0);
+		else if (strncmp(argv[i], "--blocks=", 9) == 0)
+			block_count = atoi(argv[i] + 9);
+		else if (strcmp(argv[i], "--large-pages") == 0)
+			large_pages = true;
+		else if (strncmp(argv[i], "--direct-io=", 12) == 0)
+			direct_io_threshold = _strtoi64(argv[i] + 12, NULL, 0);
+		else if (strcmp(argv[i], "--no-direct-io") == 0)
+			direct_io_threshold = -1;
+		else if (strcmp(argv[i], "--sparse") == 0)
+			sparse_mode = true;
+		else if (strncmp(argv[i], "--scan-threads=", 15) == 0)
+			scan_threads = atoi(argv[i] + 15);
+		else if (strncmp(argv[i], "--hash-threads=", 15) == 0)
+			hash_threads = atoi(argv[i] + 15);
+		else if (strncmp(argv[i], "--stripes=", 10) == 0)
+			stripe_count = atoi(argv[i] + 10);
+		else if (strcmp(argv[i], "--no-flow-control") == 0)
+			flow_control = false;
+		else if (strcmp(argv[i], "--no-dedup") == 0)
+			dedup_mode = false;
+		else if (strcmp(argv[i], "--no-digest-first") == 0)
+			digest_first_mode = false;
+		else if (strcmp(argv[i], "--compress") == 0)
+			compress_threshold = COMPRESS_DEFAULT_THRESHOLD;
+		else if (strncmp(argv[i], "--compress=", 11) == 0)
+			compress_threshold = _strtoi64(argv[i] + 11, NULL, 0);
+		else if (strncmp(argv[i], "--compress-cache=", 17) == 0) {
+			char *comma = strchr(argv[i] + 17, ',');
+
+			compress_cache_dir = argv[i] + 17;
+			if (comma != NULL) {
+				*comma = '\0';
+				compress_cache_bytes = (uint64_t)_strtoi64(comma + 1, NULL, 0) * 1024 * 1024;
+			}
+		}
+		else if (strncmp(argv[i], "--record=", 9) == 0) {
+			char *comma = strchr(argv[i] + 9, ',');
+
+			record_path = argv[i] + 9;
+			if (comma != NULL) {
+				*comma = '\0';
+				if (strcmp(comma + 1, "hash") == 0)
+					record_payloads = TLOG_BULK_HASH;
+				else if (strcmp(comma + 1, "data") == 0)
+					record_payloads = TLOG_BULK_DATA;
+			}
+		}
+		else if (strncmp(argv[i], "--replay=", 9) == 0)
+			replay_path = argv[i] + 9;
+		else if (strncmp(argv[i], "--inline=", 9) == 0)
+			inline_threshold = _strtoi64(argv[i] + 9, NULL, 0);
+		else if (strncmp(argv[i], "--digest-cache=", 15) == 0)
+			digest_cache = new DigestCache(argv[i] + 15);
+		else if (strcmp(argv[i], "--chunks") == 0)
+			chunk_threshold = CHUNK_DEFAULT_THRESHOLD;
+		else if (strncmp(argv[i], "--chunks=", 9) == 0)
+			chunk_threshold = _strtoi64(argv[i] + 9, NULL, 0);
+		else if (strncmp(argv[i], "--chunk-bench=", 14) == 0) {
+			char *comma = strchr(argv[i] + 14, ',');
+
+			if (comma == NULL) {
+				fprintf(stderr, "--chunk-bench needs OLD_DIRECTORY,NEW_DIRECTORY\n");
+				return -1;
+			}
+			*comma = '\0';
+			chunk_bench_old = argv[i] + 14;
+			chunk_bench_new = comma + 1;
+		}
+		else if (strncmp(argv[i], "--pipeline=", 11) == 0)
+			pipeline_depth = atoi(argv[i] + 11);
+		else if (strncmp(argv[i], "--schedule=", 11) == 0)
+			schedule_policy = argv[i] + 11;
+		else if (strncmp(argv[i], "--batch-threshold=", 18) == 0)
+			batch_options.batch_threshold = _strtoi64(argv[i] + 18, NULL, 0);
+		else if (strncmp(argv[i], "--batch-size=", 13) == 0)
+			batch_options.batch_size = _strtoi64(argv[i] + 13, NULL, 0);
+		else if (strcmp(argv[i], "--schedule-bench") == 0)
+			schedule_bench = true;
+		else if (strncmp(argv[i], "--protocol-bench=", 17) == 0)
+			sscanf_s(argv[i] + 17, "%llu,%lld", &protocol_bench_images, &protocol_bench_size);
+		else if (strncmp(argv[i], "--soak=", 7) == 0)
+			sscanf_s(argv[i] + 7, "%lf,%lld,%lf", &soak_seconds, &soak_max_size, &soak_fault_rate);
+		else if (strncmp(argv[i], "--soak-faults=", 14) == 0) {
+			if (fault_kinds_parse(argv[i] + 14, &soak_fault_kinds) < 0) {
+				fprintf(stderr, "Unknown fault in %s\n", argv[i] + 14);
+				return -1;
+			}
+		}
+		else if (strcmp(argv[i], "--fleet") == 0)
+			fleet_mode = true;
+		else if (strcmp(argv[i], "--engine") == 0)
+			fleet_mode = engine_mode = true;
+		else if (strncmp(argv[i], "--group-by=", 11) == 0) {
+			if (fleet_grouping_parse(argv[i] + 11, &fleet_opts.grouping) < 0) {
+				fprintf(stderr, "Unknown device grouping: %s\n", argv[i] + 11);
+				return -1;
+			}
+		}
+		else if (strncmp(argv[i], "--group-limit=", 14) == 0)
+			fleet_opts.group_limit = atoi(argv[i] + 14);
+		else if (strncmp(argv[i], "--device-rate=", 14) == 0)
+			device_rate = atof(argv[i] + 14) * 1024 * 1024;
+		else if (strncmp(argv[i], "--pull=", 7) == 0) {
+			char *comma = strchr(argv[i] + 7, ',');
+
+			if (comma != NULL) {
+				*comma = '\0';
+				pull_host_path = comma + 1;
+			}
+			pull_path = argv[i] + 7;
+		}
+		else if (strncmp(argv[i], "--bench-model=", 14) == 0) {
+			double mb_per_s = 0;
 
-	} while (written_bytes < total_len && (retries++) < 10);
+			if (sscanf_s(argv[i] + 14, "%lf,%lf", &bench_model.handshake_ms, &mb_per_s) == 2)
+				bench_model.bytes_per_ms = mb_per_s * 1024 * 1024 / 1000;
+		}
+		else
+			base_dir = argv[i];
+	}
 
-	if (written_bytes != total_len && retries >= 10) {
-		fprintf(stderr, "Failed to transfer all the data in %d times retries\n", 10);
+	//A block on the wire and one being read. Senders keep fewer than half
+	//of the blocks in flight between reads, readers wait for one only with
+	//none of their own in flight, so the two never wait on each other.
+	if (block_count < 2) {
+		fprintf(stderr, "--blocks needs at least 2 blocks\n");
 		return -1;
 	}
 
-	char md5_sum[40];
+	if (compress_threshold >= 0)
+		compress_cache = new CompressCache(compress_cache_dir, compress_cache_bytes);
 
-	ret = polyGenerateMD5Sum(fileName, md5_sum);
-	if (ret < 0) {
-		fprintf(stderr, "Failed to generate the MD5 Sum\n");
+	std::unique_ptr<SchedulePolicy> policy(schedule_policy_create(schedule_policy));
+
+	if (!policy) {
+		fprintf(stderr, "Unknown schedule policy: %s\n", schedule_policy);
 		return -1;
 	}
 
-	//Send the MD5 sum for verification
-	write_len = polySendControlInfo(transport,
-		false,
-		PLCM_USB_REQUEST_SET_INFORMATION,
-		PLCM_USB_REQUEST_VALUE_IMG_MD5_SUM,
-		md5_sum,
-		strnlen(md5_sum, sizeof(md5_sum)) + 1);
+	//Planning only, no device needed
+	if (schedule_bench) {
+		if (base_dir == NULL) {
+			fprintf(stderr, "--schedule-bench needs a DIRECTORY\n");
+			return -1;
+		}
 
-	if (write_len < 0) {
-		fprintf(stderr, "Failed to issue the md5sum control msg: %s\n", md5_sum);
-		return -1;
+		return polyScheduleBenchmark(base_dir) < 0 ? -1 : 0;
 	}
 
-	int status;
+	if (chunk_bench_old != NULL)
+		return polyChunkBenchmark(chunk_bench_old, chunk_bench_new) < 0 ? -1 : 0;
 
-	ret = polySendControlInfo(transport,
-		true,
-		PLCM_USB_REQUEST_GET_INFORMATION,
-		PLCM_USB_REQUEST_VALUE_STATUS,
-		&status,
-		4);
+	//Protocol core against a simulated device, no device needed either
+	if (protocol_bench_images > 0)
+		return plcm_protocol_bench(protocol_bench_images, protocol_bench_size) < 0 ? -1 : 0;
 
-	if (ret < 0) {
-		fprintf(stderr, "Failed to read out the status\n");
-		return -1;
+	//Host error handling against a simulated device that misbehaves
+	if (soak_seconds > 0)
+		return polySoakTest(soak_seconds, soak_max_size, soak_fault_rate, soak_fault_kinds) < 0 ? -1 : 0;
+
+	Transport *transport = NULL;
+	std::vector<Transport *> transports;
+
+	//A recorded run stands in for the device, so the host side can be
+	//profiled against it without hardware
+	if (replay_path != NULL) {
+		ReplayTransport *replay = new ReplayTransport(replay_path);
+
+		if (!replay->IsValid()) {
+			fprintf(stderr, "Failed to read the recording %s\n", replay_path);
+			delete replay;
+			return -1;
+		}
+
+		transports.push_back(replay);
+		if (!fleet_mode)
+			transport = replay;
+	}
+	else if (fleet_mode)
+		transports = usb_open_all(on_adb_device_found);
+	else if ((transport = usb_open(on_adb_device_found)) != NULL)
+		transports.push_back(transport);
+
+	for (size_t i = 0; record_path != NULL && i < transports.size(); i++) {
+		std::string log = record_path;
+
+		if (transports.size() > 1)
+			log += "." + std::to_string(i);
+
+		RecordingTransport *recording = new RecordingTransport(transports[i], log.c_str(),
+			record_payloads);
+
+		if (!recording->IsValid()) {
+			fprintf(stderr, "Failed to create the recording %s\n", log.c_str());
+			return -1;
+		}
+
+		if (transport == transports[i])
+			transport = recording;
+		transports[i] = recording;
 	}
 
-	if (status != 0) {
-		fprintf(stderr, "MD5 checking failed. status: %d\n", status);
+	if (fleet_mode && transports.empty()) {
+		fprintf(stderr, "No device found\n");
 		return -1;
 	}
 
-	return 0;
-}
+	for (size_t i = 0; i < transports.size(); i++) {
+		if (!fleet_mode)
+			trace_set_device(1, device_serial);
 
-int main(int argc, char *argv[])
-{
-	printf("zhangjie\n");
+		if (polySetupDevice(transports[i], block_size, block_count, large_pages) < 0)
+			return -1;
+	}
 
-	buf = (char *)malloc(buf_size);
+	//Logs and backups come the other way, from the one device opened
+	if (pull_path != NULL) {
+		int ret = -1;
 
-	if (buf == NULL)
-		return -1;
+		if (fleet_mode || transport == NULL)
+			fprintf(stderr, "--pull needs exactly one device\n");
+		else
+			ret = polyPullFile(transport, pull_path, pull_host_path);
+
+		polyCloseLogs(transports);
+		trace_shutdown();
+
+		if (stats_file != NULL && !transports.empty())
+			polyDumpTransportStats(transports, stats_file);
 
-	Transport *transport = usb_open(on_adb_device_found);
+		return ret < 0 ? -1 : 0;
+	}
 
 #if 0
 	//transport->Write(hello, strlen(hello));
+	char *buf = (char *)transport->Buffers()->Acquire();
 	transport->Write(buf, 1024);
+	transport->Buffers()->Release(buf);
 #else
 	//polySendImageFile(transport, "d:\\polycom-cx5100cx5500-dev-1.3.0-0.zip", "/root/b.zip");
 	//polySendImageFile(transport, "d:\\polycom-cx5100cx5500-dev-1.3.0-0.tar", "/root/aaab.tar");
@@ -315,24 +2470,46 @@ int main(int argc, char *argv[])
 #endif
 
 #if 1
-	char *base_dir = "c:\\aaa2";
-
-	if (argc < 2) {
+	if (base_dir == NULL) {
+		base_dir = "c:\\aaa2";
 		fprintf(stderr, "Invaild argument!\n");
-		fprintf(stderr, "Usage: usb_win_update.exe [DIRECTORY]\n");
+		fprintf(stderr, "Usage: usb_win_update.exe [--trace=FILE.json] [--profile] [--stats=FILE.json|-]\n"
+			"\t[--block-size=BYTES] [--blocks=N] [--large-pages]\n"
+			"\t[--direct-io=MIN_FILE_SIZE] [--no-direct-io] [--sparse]\n"
+			"\t[--scan-threads=N] [--hash-threads=N] [--pipeline=DEPTH] [--no-flow-control]\n"
+			"\t[--stripes=N] [--device-rate=MB_PER_S] [--no-dedup] [--chunks[=MIN_FILE_SIZE]]\n"
+			"\t[--digest-cache=FILE] [--no-digest-first] [--inline=MAX_FILE_SIZE]\n"
+			"\t[--compress[=MIN_FILE_SIZE] [--compress-cache=DIRECTORY[,MAX_MB]]]\n"
+			"\t[--record=FILE.tlog[,hash|data]] [--replay=FILE.tlog]\n"
+			"\t[--fleet [--group-by=hub|controller|none] [--group-limit=N]] [--engine]\n"
+			"\t[--schedule=path|largest|shortest] [--batch-threshold=BYTES] [--batch-size=BYTES]\n"
+			"\t[--schedule-bench [--bench-model=HANDSHAKE_MS,MB_PER_S]]\n"
+			"\t[--chunk-bench=OLD_DIRECTORY,NEW_DIRECTORY]\n"
+			"\t[--protocol-bench=IMAGES[,BYTES]] [--pull=DEVICE_PATH[,HOST_PATH]]\n"
+			"\t[--soak=SECONDS[,MAX_BYTES[,FAULTS_PER_IMAGE]]\n"
+			"\t [--soak-faults=all|timeout,short-write,stall,disconnect,bad-status]]\n"
+			"\t[DIRECTORY|BUNDLE.tar|BUNDLE.zip]\n");
 		fprintf(stderr, "Use the default directory: %s\n", base_dir);
 	}
-	else {
-		base_dir = argv[1];
-	}
 
-	int total_file_count = 0;
+	if (fleet_mode) {
+		int failed = engine_mode ? polyUpdateEngine(transports, base_dir) :
+			polyUpdateFleet(transports, base_dir);
+
+		printf("%zu devices updated, %d failed\n", transports.size() - failed, failed);
+	}
+	else {
+		int total_file_count = 0;
 
-	int file_count = traverse_directory(base_dir, polySendImageFile, transport, &total_file_count);
+		int file_count = polySendUpdate(transport, base_dir, &total_file_count);
 
-	printf("total file count: %d, transferred count: %d\n", total_file_count, file_count);
+		printf("total file count: %d, transferred count: %d\n", total_file_count, file_count);
+	}
 #else
 
+	char *buf = (char *)transport->Buffers()->Acquire();
+	int buf_size = (int)transport->Buffers()->BlockSize();
+
 	//int count = snprintf(buf, 1024, "%s", "zhangjie");
 	//buf[count + 1] = '\0';
 	memset(buf, 0xFF, buf_size);
@@ -346,6 +2523,8 @@ int main(int argc, char *argv[])
 	transport->Write(buf, count);
 
 	//transport->Write(buf, 0);
+
+	transport->Buffers()->Release(buf);
 #endif
 
 #if 0
@@ -381,7 +2560,9 @@ int main(int argc, char *argv[])
 	if (ret < 0)
 		return -1;
 
+	char *buf = (char *)transport->Buffers()->Acquire();
 	transport->Write(buf, number_bytes);
+	transport->Buffers()->Release(buf);
 
 	for (int i = 0; i < 4; i++) {
 		Sleep(1000);
@@ -419,7 +2600,22 @@ int main(int argc, char *argv[])
 
 #endif
 
-	free(buf);
+	polyCloseLogs(transports);
+
+	if (compress_cache != NULL)
+		printf("Compression cache: %llu hits, %llu misses\n",
+			(unsigned long long)compress_cache->Hits(), (unsigned long long)compress_cache->Misses());
+
+	if (digest_cache != NULL) {
+		printf("%zu MD5 sums taken from the digest cache\n", digest_cache->Hits());
+		if (digest_cache->Save() < 0)
+			fprintf(stderr, "Failed to save the digest cache\n");
+	}
+
+	trace_shutdown();
+
+	if (stats_file != NULL && !transports.empty())
+		polyDumpTransportStats(transports, stats_file);
 
     return 0;
 }